@@ -16,6 +16,7 @@
 #include "arch/probe.h"
 
 /* flags we export */
+int ceph_arch_intel_avx2 = 0;
 int ceph_arch_intel_pclmul = 0;
 int ceph_arch_intel_sse42 = 0;
 int ceph_arch_intel_sse41 = 0;
@@ -43,14 +44,34 @@ static void do_cpuid(unsigned int *eax, unsigned int *ebx, unsigned int *ecx,
                 : "eax", "ebx", "ecx", "edx");
 }
 
+/* leaves with sub-leaves, e.g. 7 for the extended features */
+static void do_cpuid_count(unsigned int leaf, unsigned int subleaf,
+			   unsigned int *eax, unsigned int *ebx,
+			   unsigned int *ecx, unsigned int *edx)
+{
+	asm("cpuid"
+	    : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx)
+	    : "a" (leaf), "c" (subleaf));
+}
+
+/* the OS saves the ymm registers on context switch */
+static int ymm_enabled(void)
+{
+	unsigned int eax, edx;
+	asm("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+	return (eax & 6) == 6;
+}
+
 /* http://en.wikipedia.org/wiki/CPUID#EAX.3D1:_Processor_Info_and_Feature_Bits */
 
+#define CPUID_OSXSAVE	(1 << 27)
 #define CPUID_PCLMUL	(1 << 1)
 #define CPUID_SSE42	(1 << 20)
 #define CPUID_SSE41	(1 << 19)
 #define CPUID_SSSE3	(1 << 9)
 #define CPUID_SSE3	(1)
 #define CPUID_SSE2	(1 << 26)
+#define CPUID7_AVX2	(1 << 5)	/* leaf 7, ebx */
 
 int ceph_arch_intel_probe(void)
 {
@@ -75,6 +96,15 @@ int ceph_arch_intel_probe(void)
 	if ((edx & CPUID_SSE2) != 0) {
 	        ceph_arch_intel_sse2 = 1;
 	}
+	if ((ecx & CPUID_OSXSAVE) != 0 && ymm_enabled()) {
+		unsigned int max_leaf;
+		do_cpuid_count(0, 0, &max_leaf, &ebx, &ecx, &edx);
+		if (max_leaf >= 7) {
+			do_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx);
+			if ((ebx & CPUID7_AVX2) != 0)
+				ceph_arch_intel_avx2 = 1;
+		}
+	}
 
 	return 0;
 }
@@ -48,6 +48,7 @@ using namespace std;
 #include "include/assert.h"
 
 #include "erasure-code/ErasureCodePlugin.h"
+#include "compressor/Compressor.h"
 
 #define dout_subsys ceph_subsys_osd
 
@@ -116,6 +117,8 @@ int main(int argc, const char **argv)
   // We want to enable leveldb's log, while allowing users to override this
   // option, therefore we will pass it as a default argument to global_init().
   def_args.push_back("--leveldb-log=");
+  // clients look up few pgs per map; only the osd gains from the table
+  def_args.push_back("--osd-map-mapping-table=true");
 
   global_init(&def_args, args, CEPH_ENTITY_TYPE_OSD, CODE_ENVIRONMENT_DAEMON, 0);
   ceph_heap_profiler_init();
@@ -416,24 +419,37 @@ int main(int argc, const char **argv)
 	 << TEXT_NORMAL << dendl;
   }
 
-  Messenger *ms_public = Messenger::create(g_ceph_context, g_conf->ms_type,
+  // the public and cluster networks may use different messenger
+  // backends, e.g. to move the many client connections to async first
+  string public_msgr_type = g_conf->ms_public_type.empty() ?
+    g_conf->ms_type : g_conf->ms_public_type;
+  string cluster_msgr_type = g_conf->ms_cluster_type.empty() ?
+    g_conf->ms_type : g_conf->ms_cluster_type;
+
+  Messenger *ms_public = Messenger::create(g_ceph_context, public_msgr_type,
 					   entity_name_t::OSD(whoami), "client",
 					   getpid());
-  Messenger *ms_cluster = Messenger::create(g_ceph_context, g_conf->ms_type,
+  Messenger *ms_cluster = Messenger::create(g_ceph_context, cluster_msgr_type,
 					    entity_name_t::OSD(whoami), "cluster",
 					    getpid(), CEPH_FEATURES_ALL);
-  Messenger *ms_hbclient = Messenger::create(g_ceph_context, g_conf->ms_type,
+  Messenger *ms_hbclient = Messenger::create(g_ceph_context, cluster_msgr_type,
 					     entity_name_t::OSD(whoami), "hbclient",
 					     getpid());
-  Messenger *ms_hb_back_server = Messenger::create(g_ceph_context, g_conf->ms_type,
+  Messenger *ms_hb_back_server = Messenger::create(g_ceph_context, cluster_msgr_type,
 						   entity_name_t::OSD(whoami), "hb_back_server",
 						   getpid());
-  Messenger *ms_hb_front_server = Messenger::create(g_ceph_context, g_conf->ms_type,
+  Messenger *ms_hb_front_server = Messenger::create(g_ceph_context, public_msgr_type,
 						    entity_name_t::OSD(whoami), "hb_front_server",
 						    getpid());
   Messenger *ms_objecter = Messenger::create(g_ceph_context, g_conf->ms_type,
 					     entity_name_t::OSD(whoami), "ms_objecter",
 					     getpid());
+  if (!ms_public || !ms_cluster || !ms_hbclient || !ms_hb_back_server ||
+      !ms_hb_front_server || !ms_objecter) {
+    derr << "unable to create messengers; check ms_type, ms_public_type"
+	 << " and ms_cluster_type" << dendl;
+    exit(1);
+  }
   ms_cluster->set_cluster_protocol(CEPH_OSD_PROTOCOL);
   ms_hbclient->set_cluster_protocol(CEPH_OSD_PROTOCOL);
   ms_hb_back_server->set_cluster_protocol(CEPH_OSD_PROTOCOL);
@@ -502,6 +518,20 @@ int main(int argc, const char **argv)
 
   ms_objecter->set_default_policy(Messenger::Policy::lossy_client(0, CEPH_FEATURE_OSDREPLYMUX));
 
+  if (!g_conf->ms_compress_type.empty()) {
+    ceph::shared_ptr<Compressor> compressor(
+      Compressor::create(g_conf->ms_compress_type));
+    if (!compressor) {
+      derr << "unknown ms_compress_type '" << g_conf->ms_compress_type
+	   << "'" << dendl;
+      exit(1);
+    }
+    // heartbeats are too small to be worth it
+    ms_public->set_compressor(compressor);
+    ms_cluster->set_compressor(compressor);
+    ms_objecter->set_compressor(compressor);
+  }
+
   r = ms_public->bind(g_conf->public_addr);
   if (r < 0)
     exit(1);
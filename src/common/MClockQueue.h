@@ -0,0 +1,376 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef MCLOCK_QUEUE_H
+#define MCLOCK_QUEUE_H
+
+#include "common/OpQueue.h"
+#include "common/Clock.h"
+#include "include/assert.h"
+
+#include <map>
+#include <list>
+#include <limits>
+#include <algorithm>
+#include <utility>
+
+/// QoS of one mClock class, in ops per second; 0 means none
+struct mclock_info_t {
+  double reservation;  ///< served at least this often, ahead of weights
+  double weight;       ///< share of what is left over
+  double limit;        ///< never served more often than this
+
+  mclock_info_t(double r = 0, double w = 1, double l = 0)
+    : reservation(r), weight(w), limit(l) {}
+};
+
+/**
+ * Op queue scheduling classes by mClock tags
+ *
+ * Every request gets a reservation, a proportional and a limit tag,
+ * each spaced 1/rate after the previous request of its class (and
+ * never before it arrived).  A class that becomes active again starts
+ * its proportional tags at the smallest one of the backlogged classes,
+ * so it shares with them by weight from then on.  dequeue() first
+ * serves the smallest reservation tag that is due; if none is, it
+ * serves the smallest proportional tag among classes under their
+ * limit, and moves that class's reservation tags back so the extra
+ * service is not counted against its reservation.  When every class
+ * is over its limit, get_wait() says how long to wait.
+ *
+ * Strict items bypass the tags and go first, as in PrioritizedQueue.
+ * Costs are ignored: the rates are in ops.
+ */
+template <typename T, typename K>
+class MClockQueue : public OpQueue <T, K> {
+public:
+  typedef std::function<mclock_info_t (const K&)> InfoFunc;
+  typedef std::function<double ()> ClockFunc;
+
+private:
+  struct Request {
+    double r_tag, p_tag, l_tag;
+    T item;
+    Request(double r, double p, double l, T i)
+      : r_tag(r), p_tag(p), l_tag(l), item(i) {}
+  };
+
+  struct Class {
+    mclock_info_t info;
+    double prev_r, prev_p, prev_l;  ///< tags of the last request queued
+    std::list<Request> requests;
+    explicit Class(const mclock_info_t& i)
+      : info(i), prev_r(0), prev_p(0), prev_l(0) {}
+
+    /// true once a new request would be tagged "now" anyway
+    bool is_idle(double now) const {
+      return requests.empty() &&
+	(info.reservation <= 0 || prev_r + 1.0 / info.reservation <= now) &&
+	prev_p + 1.0 / info.weight <= now &&
+	(info.limit <= 0 || prev_l + 1.0 / info.limit <= now);
+    }
+  };
+
+  typedef std::map<K, Class> Classes;
+  Classes classes;
+  unsigned size;
+
+  typedef std::map<unsigned, std::list<std::pair<K, T> > > StrictQueues;
+  StrictQueues high_queue;
+
+  InfoFunc get_info;
+  ClockFunc clock;
+
+  static double real_clock() {
+    return (double)ceph_clock_now(NULL);
+  }
+
+  mclock_info_t fetch_info(const K& cl) {
+    mclock_info_t info = get_info(cl);
+    if (info.weight <= 0)
+      info.weight = 1;
+    return info;
+  }
+
+  Class& get_class(const K& cl) {
+    typename Classes::iterator p = classes.find(cl);
+    if (p == classes.end())
+      p = classes.insert(std::make_pair(cl, Class(fetch_info(cl)))).first;
+    return p->second;
+  }
+
+  /// smallest proportional tag at the head of a backlogged class
+  double min_active_p_tag() const {
+    double m = std::numeric_limits<double>::max();
+    for (typename Classes::const_iterator i = classes.begin();
+	 i != classes.end();
+	 ++i)
+      if (!i->second.requests.empty())
+	m = std::min(m, i->second.requests.front().p_tag);
+    return m;
+  }
+
+  static void filter_list(std::list<Request> *l, std::function<bool (T)> f,
+			  std::list<T> *out) {
+    for (typename std::list<Request>::iterator i = l->begin();
+	 i != l->end();
+      ) {
+      if (f(i->item)) {
+	if (out)
+	  out->push_back(i->item);
+	l->erase(i++);
+      } else {
+	++i;
+      }
+    }
+  }
+
+  T pop(typename Classes::iterator c, bool by_weight) {
+    Class& k = c->second;
+    T ret = k.requests.front().item;
+    k.requests.pop_front();
+    --size;
+    if (by_weight && k.info.reservation > 0) {
+      // the reservation was not used for this one
+      double d = 1.0 / k.info.reservation;
+      for (typename std::list<Request>::iterator i = k.requests.begin();
+	   i != k.requests.end();
+	   ++i)
+	i->r_tag -= d;
+      k.prev_r -= d;
+    }
+    return ret;
+  }
+
+public:
+  MClockQueue(InfoFunc i, ClockFunc c = ClockFunc())
+    : size(0), get_info(i), clock(c ? c : ClockFunc(real_clock)) {}
+
+  unsigned length() const {
+    unsigned total = size;
+    for (typename StrictQueues::const_iterator i = high_queue.begin();
+	 i != high_queue.end();
+	 ++i)
+      total += i->second.size();
+    return total;
+  }
+
+  void remove_by_filter(std::function<bool (T)> f,
+			std::list<T> *removed = 0) {
+    size = 0;
+    for (typename Classes::iterator i = classes.begin();
+	 i != classes.end();
+	 ++i) {
+      filter_list(&i->second.requests, f, removed);
+      size += i->second.requests.size();
+    }
+    for (typename StrictQueues::iterator i = high_queue.begin();
+	 i != high_queue.end();
+      ) {
+      for (typename std::list<std::pair<K, T> >::iterator j =
+	     i->second.begin();
+	   j != i->second.end();
+	) {
+	if (f(j->second)) {
+	  if (removed)
+	    removed->push_back(j->second);
+	  i->second.erase(j++);
+	} else {
+	  ++j;
+	}
+      }
+      if (i->second.empty())
+	high_queue.erase(i++);
+      else
+	++i;
+    }
+  }
+
+  void remove_by_class(K k, std::list<T> *out = 0) {
+    typename Classes::iterator p = classes.find(k);
+    if (p != classes.end()) {
+      size -= p->second.requests.size();
+      if (out) {
+	for (typename std::list<Request>::iterator i =
+	       p->second.requests.begin();
+	     i != p->second.requests.end();
+	     ++i)
+	  out->push_back(i->item);
+      }
+      classes.erase(p);
+    }
+    for (typename StrictQueues::iterator i = high_queue.begin();
+	 i != high_queue.end();
+      ) {
+      for (typename std::list<std::pair<K, T> >::iterator j =
+	     i->second.begin();
+	   j != i->second.end();
+	) {
+	if (j->first == k) {
+	  if (out)
+	    out->push_back(j->second);
+	  i->second.erase(j++);
+	} else {
+	  ++j;
+	}
+      }
+      if (i->second.empty())
+	high_queue.erase(i++);
+      else
+	++i;
+    }
+  }
+
+  void enqueue_strict(K cl, unsigned priority, T item) {
+    high_queue[priority].push_back(std::make_pair(cl, item));
+  }
+
+  void enqueue_strict_front(K cl, unsigned priority, T item) {
+    high_queue[priority].push_front(std::make_pair(cl, item));
+  }
+
+  void enqueue(K cl, unsigned priority, unsigned cost, T item) {
+    double now = clock();
+    Class& k = get_class(cl);
+    double r = std::numeric_limits<double>::max();
+    if (k.info.reservation > 0)
+      r = k.prev_r = std::max(now, k.prev_r + 1.0 / k.info.reservation);
+    // the backlogged classes' p tags have run ahead of now; starting
+    // there would let the newcomer win every weight-based dequeue
+    double p_start = now;
+    if (k.requests.empty()) {
+      double min_p = min_active_p_tag();
+      if (min_p != std::numeric_limits<double>::max())
+	p_start = min_p;
+    }
+    double p = k.prev_p = std::max(p_start, k.prev_p + 1.0 / k.info.weight);
+    double l = 0;
+    if (k.info.limit > 0)
+      l = k.prev_l = std::max(now, k.prev_l + 1.0 / k.info.limit);
+    k.requests.push_back(Request(r, p, l, item));
+    ++size;
+  }
+
+  void enqueue_front(K cl, unsigned priority, unsigned cost, T item) {
+    // a requeue: it goes ahead of its class without new tags
+    double now = clock();
+    Class& k = get_class(cl);
+    if (k.requests.empty()) {
+      double r = k.info.reservation > 0 ? now :
+	std::numeric_limits<double>::max();
+      k.requests.push_front(Request(r, now, 0, item));
+    } else {
+      Request f = k.requests.front();
+      k.requests.push_front(Request(f.r_tag, f.p_tag, f.l_tag, item));
+    }
+    ++size;
+  }
+
+  bool empty() const {
+    return size == 0 && high_queue.empty();
+  }
+
+  void update_class_info() {
+    // requests already queued keep their tags; new ones are spaced by
+    // the new rates
+    for (typename Classes::iterator i = classes.begin();
+	 i != classes.end();
+	 ++i)
+      i->second.info = fetch_info(i->first);
+  }
+
+  double get_wait() {
+    if (!high_queue.empty())
+      return 0;
+    double now = clock();
+    double first = std::numeric_limits<double>::max();
+    for (typename Classes::iterator i = classes.begin();
+	 i != classes.end();
+	 ++i) {
+      if (i->second.requests.empty())
+	continue;
+      const Request& r = i->second.requests.front();
+      if (r.r_tag <= now || r.l_tag <= now)
+	return 0;
+      first = std::min(first, r.l_tag);
+    }
+    return first == std::numeric_limits<double>::max() ? 0 : first - now;
+  }
+
+  T dequeue() {
+    assert(!empty());
+
+    if (!high_queue.empty()) {
+      T ret = high_queue.rbegin()->second.front().second;
+      high_queue.rbegin()->second.pop_front();
+      if (high_queue.rbegin()->second.empty())
+	high_queue.erase(high_queue.rbegin()->first);
+      return ret;
+    }
+
+    double now = clock();
+    typename Classes::iterator by_r = classes.end();
+    typename Classes::iterator by_p = classes.end();
+    typename Classes::iterator by_l = classes.end();
+    for (typename Classes::iterator i = classes.begin();
+	 i != classes.end();
+      ) {
+      if (i->second.requests.empty()) {
+	// forget classes whose tags no longer matter
+	if (i->second.is_idle(now))
+	  classes.erase(i++);
+	else
+	  ++i;
+	continue;
+      }
+      const Request& r = i->second.requests.front();
+      if (r.r_tag <= now &&
+	  (by_r == classes.end() ||
+	   r.r_tag < by_r->second.requests.front().r_tag))
+	by_r = i;
+      if (r.l_tag <= now &&
+	  (by_p == classes.end() ||
+	   r.p_tag < by_p->second.requests.front().p_tag))
+	by_p = i;
+      if (by_l == classes.end() ||
+	  r.l_tag < by_l->second.requests.front().l_tag)
+	by_l = i;
+      ++i;
+    }
+
+    if (by_r != classes.end())
+      return pop(by_r, false);
+    if (by_p != classes.end())
+      return pop(by_p, true);
+    // everyone is over the limit; callers should have waited
+    // get_wait(), but do not stall if they did not
+    assert(by_l != classes.end());
+    return pop(by_l, true);
+  }
+
+  void dump(Formatter *f) const {
+    f->dump_int("size", size);
+    f->dump_int("num_classes", classes.size());
+    f->open_array_section("high_queues");
+    for (typename StrictQueues::const_iterator p = high_queue.begin();
+	 p != high_queue.end();
+	 ++p) {
+      f->open_object_section("subqueue");
+      f->dump_int("priority", p->first);
+      f->dump_int("size", p->second.size());
+      f->close_section();
+    }
+    f->close_section();
+  }
+};
+
+#endif
@@ -0,0 +1,96 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef CEPH_COMMON_MPSCQUEUE_H
+#define CEPH_COMMON_MPSCQUEUE_H
+
+#include <atomic>
+#include <list>
+
+/**
+ * multi-producer, single-consumer queue
+ *
+ * Producers push with a CAS on the head of a singly linked stack and
+ * never take a lock.  The consumer detaches the whole stack with one
+ * exchange and reverses it, so items come out in push order.  Because
+ * the consumer never pops single nodes there is no ABA problem.
+ */
+template <typename T>
+class MPSCQueue {
+  struct Node {
+    T item;
+    Node *next;
+    explicit Node(const T& i) : item(i), next(NULL) {}
+  };
+
+  std::atomic<Node*> head;
+
+  MPSCQueue(const MPSCQueue&);
+  MPSCQueue& operator=(const MPSCQueue&);
+
+public:
+  MPSCQueue() : head(NULL) {}
+  ~MPSCQueue() {
+    Node *n = head.exchange(NULL);
+    while (n) {
+      Node *next = n->next;
+      delete n;
+      n = next;
+    }
+  }
+
+  /**
+   * add an item; safe from any number of threads
+   *
+   * @param retries if non-NULL, set to the number of lost CAS races
+   * @return true if the queue was empty, i.e. the consumer may need
+   * to be woken up
+   */
+  bool push(const T& item, unsigned *retries = NULL) {
+    Node *n = new Node(item);
+    Node *h = head.load(std::memory_order_relaxed);
+    unsigned r = 0;
+    n->next = h;
+    while (!head.compare_exchange_weak(h, n, std::memory_order_release,
+				       std::memory_order_relaxed)) {
+      n->next = h;
+      ++r;
+    }
+    if (retries)
+      *retries = r;
+    return h == NULL;
+  }
+
+  /// take everything pushed so far, oldest first; consumer only
+  void drain(std::list<T> *out) {
+    Node *n = head.exchange(NULL, std::memory_order_acquire);
+    Node *rev = NULL;
+    while (n) {
+      Node *next = n->next;
+      n->next = rev;
+      rev = n;
+      n = next;
+    }
+    while (rev) {
+      Node *next = rev->next;
+      out->push_back(rev->item);
+      delete rev;
+      rev = next;
+    }
+  }
+
+  bool empty() const {
+    return head.load(std::memory_order_acquire) == NULL;
+  }
+};
+
+#endif
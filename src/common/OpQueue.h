@@ -0,0 +1,59 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef OP_QUEUE_H
+#define OP_QUEUE_H
+
+#include "common/Formatter.h"
+
+#include <list>
+#include <functional>
+
+/**
+ * Interface of the queues an op work queue can schedule with
+ *
+ * Items are enqueued under a class K (e.g. the client) that the
+ * implementation is fair between.  Strict items are dequeued before
+ * all others, highest priority first.
+ */
+template <typename T, typename K>
+class OpQueue {
+public:
+  virtual unsigned length() const = 0;
+  /// remove items for which f is true, appending them to *removed
+  virtual void remove_by_filter(
+    std::function<bool (T)> f, std::list<T> *removed = 0) = 0;
+  virtual void remove_by_class(K k, std::list<T> *out = 0) = 0;
+  virtual void enqueue_strict(K cl, unsigned priority, T item) = 0;
+  virtual void enqueue_strict_front(K cl, unsigned priority, T item) = 0;
+  virtual void enqueue(K cl, unsigned priority, unsigned cost, T item) = 0;
+  virtual void enqueue_front(K cl, unsigned priority, unsigned cost,
+			     T item) = 0;
+  virtual bool empty() const = 0;
+  /// look up the settings of every known class again, e.g. after they changed
+  virtual void update_class_info() {}
+  /**
+   * seconds until dequeue() may be called
+   *
+   * Queues that enforce rate limits can hold back every queued item
+   * for a while; the others are always ready.  Only meaningful when
+   * !empty().
+   */
+  virtual double get_wait() {
+    return 0;
+  }
+  virtual T dequeue() = 0;
+  virtual void dump(ceph::Formatter *f) const = 0;
+  virtual ~OpQueue() {}
+};
+
+#endif
@@ -145,6 +145,8 @@ OPTION(heartbeat_inject_failure, OPT_INT, 0)    // force an unhealthy heartbeat
 OPTION(perf, OPT_BOOL, true)       // enable internal perf counters
 
 OPTION(ms_type, OPT_STR, "simple")   // messenger backend
+OPTION(ms_public_type, OPT_STR, "")   // messenger backend for the osd public network; defaults to ms_type
+OPTION(ms_cluster_type, OPT_STR, "")  // messenger backend for the osd cluster network; defaults to ms_type
 OPTION(ms_tcp_nodelay, OPT_BOOL, true)
 OPTION(ms_tcp_rcvbuf, OPT_INT, 0)
 OPTION(ms_tcp_prefetch_max_size, OPT_INT, 4096) // max prefetch size, we limit this to avoid extra memcpy
@@ -152,6 +154,8 @@ OPTION(ms_initial_backoff, OPT_DOUBLE, .2)
 OPTION(ms_max_backoff, OPT_DOUBLE, 15.0)
 OPTION(ms_crc_data, OPT_BOOL, true)
 OPTION(ms_crc_header, OPT_BOOL, true)
+OPTION(ms_compress_type, OPT_STR, "")    // compress messages to peers that support it (e.g. snappy); osd only
+OPTION(ms_compress_min_size, OPT_U64, 4096) // smallest message segment worth compressing
 OPTION(ms_die_on_bad_msg, OPT_BOOL, false)
 OPTION(ms_die_on_unhandled_msg, OPT_BOOL, false)
 OPTION(ms_die_on_old_message, OPT_BOOL, false)     // assert if we get a dup incoming message and shouldn't have (may be triggered by pre-541cd3c64be0dfa04e8a2df39422e0eb9541a428 code)
@@ -175,7 +179,13 @@ OPTION(ms_inject_internal_delays, OPT_DOUBLE, 0)   // seconds
 OPTION(ms_dump_on_send, OPT_BOOL, false)           // hexdump msg to log on send
 OPTION(ms_dump_corrupt_message_level, OPT_INT, 1)  // debug level to hexdump undecodeable messages at
 OPTION(ms_async_op_threads, OPT_INT, 2)
+OPTION(ms_async_rx_buffer_pool_size, OPT_INT, 0)   // aligned rx data buffers each worker keeps for reuse
+OPTION(ms_async_rx_buffer_pool_min, OPT_INT, 64 << 10)  // smallest rx data buffer worth pooling
 OPTION(ms_async_set_affinity, OPT_BOOL, true)
+OPTION(ms_async_peer_affinity, OPT_BOOL, false)  // place all connections to/from one host on the same worker
+OPTION(ms_async_send_batch_bytes, OPT_U64, 65536)  // coalesce queued messages into one sendmsg up to this size
+OPTION(ms_async_zerocopy_min_size, OPT_U64, 0)    // send buffers at least this big with MSG_ZEROCOPY (0 = never)
+OPTION(ms_async_local_socket_dir, OPT_STR, "")     // unix sockets for same-host peers live here (empty = always tcp)
 // example: ms_async_affinity_cores = 0,1
 // The number of coreset is expected to equal to ms_async_op_threads, otherwise
 // extra op threads will loop ms_async_affinity_cores again.
@@ -599,6 +609,8 @@ OPTION(osd_tier_default_cache_min_read_recency_for_promote, OPT_INT, 1) // numbe
 OPTION(osd_tier_default_cache_min_write_recency_for_promote, OPT_INT, 1) // number of recent HitSets the object must appear in to be promoted (on write)
 
 OPTION(osd_map_dedup, OPT_BOOL, true)
+OPTION(osd_map_mapping_table, OPT_BOOL, false) // precompute pg placement for each new map epoch; ceph-osd turns it on
+OPTION(osd_map_mapping_threads, OPT_INT, 2)  // threads computing it
 OPTION(osd_map_max_advance, OPT_INT, 150) // make this < cache_size!
 OPTION(osd_map_cache_size, OPT_INT, 200)
 OPTION(osd_map_message_max, OPT_INT, 100)  // max maps per MOSDMap message
@@ -609,6 +621,21 @@ OPTION(osd_op_threads, OPT_INT, 2)    // 0 == no threading
 OPTION(osd_peering_wq_batch_size, OPT_U64, 20)
 OPTION(osd_op_pq_max_tokens_per_priority, OPT_U64, 4194304)
 OPTION(osd_op_pq_min_cost, OPT_U64, 65536)
+OPTION(osd_op_queue, OPT_STR, "prio") // prio or mclock
+// mclock rates are in ops/sec for the whole osd; 0 res or lim means none
+OPTION(osd_op_queue_mclock_client_res, OPT_DOUBLE, 0)
+OPTION(osd_op_queue_mclock_client_wgt, OPT_DOUBLE, 1)
+OPTION(osd_op_queue_mclock_client_lim, OPT_DOUBLE, 0)
+OPTION(osd_op_queue_mclock_peer_res, OPT_DOUBLE, 0)
+OPTION(osd_op_queue_mclock_peer_wgt, OPT_DOUBLE, 1)
+OPTION(osd_op_queue_mclock_peer_lim, OPT_DOUBLE, 0)
+OPTION(osd_op_queue_mclock_recov_res, OPT_DOUBLE, 0)
+OPTION(osd_op_queue_mclock_recov_wgt, OPT_DOUBLE, 1)
+OPTION(osd_op_queue_mclock_recov_lim, OPT_DOUBLE, 0)
+OPTION(osd_op_queue_mclock_scrub_res, OPT_DOUBLE, 0)
+OPTION(osd_op_queue_mclock_scrub_wgt, OPT_DOUBLE, 1)
+OPTION(osd_op_queue_mclock_scrub_lim, OPT_DOUBLE, 0)
+OPTION(osd_op_queue_mclock_pool_client_qos, OPT_STR, "") // "pool:res:wgt:lim ..." per-client qos overrides
 OPTION(osd_disk_threads, OPT_INT, 1)
 OPTION(osd_disk_thread_ioprio_class, OPT_STR, "") // rt realtime be best effort idle
 OPTION(osd_disk_thread_ioprio_priority, OPT_INT, -1) // 0-7
@@ -616,6 +643,7 @@ OPTION(osd_recovery_threads, OPT_INT, 1)
 OPTION(osd_recover_clone_overlap, OPT_BOOL, true)   // preserve clone_overlap during recovery/migration
 OPTION(osd_op_num_threads_per_shard, OPT_INT, 2)
 OPTION(osd_op_num_shards, OPT_INT, 5)
+OPTION(osd_op_shard_steal_min_queue, OPT_INT, 8) // idle shard threads take ops from shards with this many queued; 0 disables
 
 // Only use clone_overlap for recovery if there are fewer than
 // osd_recover_clone_overlap_limit entries in the overlap set
@@ -750,6 +778,8 @@ OPTION(kinetic_use_ssl, OPT_BOOL, false) // whether to secure kinetic traffic wi
 
 // rocksdb options that will be used for keyvaluestore(if backend is rocksdb)
 OPTION(keyvaluestore_rocksdb_options, OPT_STR, "")
+// prefixes given their own column family at mkfs: "prefix[:opt=val;...] ..."
+OPTION(keyvaluestore_rocksdb_cf_options, OPT_STR, "")
 // rocksdb options that will be used for omap(if omap_backend is rocksdb)
 OPTION(filestore_rocksdb_options, OPT_STR, "")
 // rocksdb options that will be used in monstore
@@ -801,15 +831,22 @@ OPTION(osd_bench_duration, OPT_U32, 30) // duration of 'osd bench', capped at 30
 OPTION(memstore_device_bytes, OPT_U64, 1024*1024*1024)
 OPTION(memstore_page_set, OPT_BOOL, true)
 OPTION(memstore_page_size, OPT_U64, 64 << 10)
+OPTION(memstore_checkpoint_interval, OPT_INT, 0)  // seconds between background checkpoints; 0 = only at umount
+OPTION(memstore_checkpoint_threads, OPT_INT, 4)   // collections saved/loaded in parallel
 
 OPTION(newstore_max_dir_size, OPT_U32, 1000000)
-OPTION(newstore_onode_map_size, OPT_U32, 1024)   // onodes per collection
+OPTION(newstore_onode_cache_size, OPT_U64, 128*1024*1024)  // bytes of onode metadata cached, across all collections
+OPTION(newstore_onode_cache_shards, OPT_U32, 16)  // independently locked onode cache shards
 OPTION(newstore_backend, OPT_STR, "rocksdb")
 OPTION(newstore_backend_options, OPT_STR, "")
+OPTION(newstore_backend_cf_options, OPT_STR, "L")  // keep short-lived wal keys apart from omap/onodes
 OPTION(newstore_fail_eio, OPT_BOOL, true)
 OPTION(newstore_sync_io, OPT_BOOL, false)  // perform initial io synchronously
 OPTION(newstore_sync_transaction, OPT_BOOL, false)  // perform kv txn synchronously
 OPTION(newstore_sync_submit_transaction, OPT_BOOL, false)
+OPTION(newstore_kv_batch_max_us, OPT_INT, 250)  // max time to wait for more txcs to commit together (0 to never wait)
+OPTION(newstore_kv_batch_max_txcs, OPT_INT, 64)  // stop waiting once this many txcs are queued
+OPTION(newstore_kv_batch_max_bytes, OPT_U64, 4*1024*1024)  // or they have written this many bytes
 OPTION(newstore_sync_wal_apply, OPT_BOOL, true)     // perform initial wal work synchronously (possibly in combination with aio so we only *queue* ios)
 OPTION(newstore_fsync_threads, OPT_INT, 16)  // num threads calling fsync
 OPTION(newstore_fsync_thread_timeout, OPT_INT, 30) // thread timeout value
@@ -831,6 +868,16 @@ OPTION(newstore_db_path, OPT_STR, "")
 OPTION(newstore_aio, OPT_BOOL, true)
 OPTION(newstore_aio_poll_ms, OPT_INT, 250)  // milliseconds
 OPTION(newstore_aio_max_queue_depth, OPT_INT, 4096)
+OPTION(newstore_block_path, OPT_STR, "")  // raw device or file for object data (instead of fragments/)
+OPTION(newstore_block_size, OPT_U64, 10ull*1024*1024*1024)  // size of block file to create if it does not exist
+OPTION(newstore_min_alloc_size, OPT_U32, 4096)  // allocation unit on the block device
+OPTION(newstore_block_max_slack, OPT_U64, 4*1024*1024)  // when an object outgrows its extent, reserve up to its size (at most this much) beyond it
+OPTION(newstore_debug_freelist, OPT_BOOL, false)  // verify freelist after every update
+OPTION(newstore_csum_block_size, OPT_U32, 4096)  // crc32c each block of this size on the block device (0 for none)
+OPTION(newstore_compression, OPT_STR, "")  // compressor for new object data (e.g., snappy), or empty for none
+OPTION(newstore_compression_pools, OPT_STR, "")  // only compress objects in these pool ids (empty for all)
+OPTION(newstore_compression_min_blob_size, OPT_U32, 16384)  // do not compress smaller writes
+OPTION(newstore_compression_max_ratio, OPT_DOUBLE, .875)  // store raw unless compressed size is below this fraction
 
 OPTION(filestore_omap_backend, OPT_STR, "leveldb")
 
@@ -906,6 +953,11 @@ OPTION(filestore_queue_committing_max_bytes, OPT_INT, 100 << 20) //  "
 OPTION(filestore_op_threads, OPT_INT, 2)
 OPTION(filestore_op_thread_timeout, OPT_INT, 60)
 OPTION(filestore_op_thread_suicide_timeout, OPT_INT, 180)
+// submit page-aligned data writes with O_DIRECT aio and complete ops
+// once they are reaped, instead of blocking the op threads in pwrite
+OPTION(filestore_aio_apply, OPT_BOOL, false)
+OPTION(filestore_aio_apply_min_size, OPT_U32, 65536)  // smaller writes stay buffered
+OPTION(filestore_aio_apply_queue_depth, OPT_INT, 128)
 OPTION(filestore_commit_timeout, OPT_FLOAT, 600)
 OPTION(filestore_fiemap_threshold, OPT_INT, 4096)
 OPTION(filestore_merge_threshold, OPT_INT, 10)
@@ -922,6 +974,7 @@ OPTION(filestore_debug_verify_split, OPT_BOOL, false)
 OPTION(journal_dio, OPT_BOOL, true)
 OPTION(journal_aio, OPT_BOOL, true)
 OPTION(journal_force_aio, OPT_BOOL, false)
+OPTION(journal_stripe_paths, OPT_STR, "")  // more journals to stripe entries over, with osd_journal
 
 OPTION(keyvaluestore_queue_max_ops, OPT_INT, 50)
 OPTION(keyvaluestore_queue_max_bytes, OPT_INT, 100 << 20)
@@ -941,6 +994,7 @@ OPTION(journal_block_align, OPT_BOOL, true)
 OPTION(journal_write_header_frequency, OPT_U64, 0)
 OPTION(journal_max_write_bytes, OPT_INT, 10 << 20)
 OPTION(journal_max_write_entries, OPT_INT, 100)
+OPTION(journal_batch_adaptive, OPT_BOOL, false)  // size aio batches from arrival rate and device latency
 OPTION(journal_queue_max_ops, OPT_INT, 300)
 OPTION(journal_queue_max_bytes, OPT_INT, 32 << 20)
 OPTION(journal_align_min_size, OPT_INT, 64 << 10)  // align data payloads >= this.
@@ -186,6 +186,18 @@ bool CrushWrapper::subtree_contains(int root, int item) const
   return false;
 }
 
+bool CrushWrapper::is_mapper_reentrant() const
+{
+  if (crush->choose_local_fallback_tries > 0)
+    return false;
+  for (int i = 0; i < crush->max_buckets; i++) {
+    const crush_bucket *b = crush->buckets[i];
+    if (b && b->alg == CRUSH_BUCKET_UNIFORM)
+      return false;
+  }
+  return true;
+}
+
 bool CrushWrapper::_maybe_remove_last_instance(CephContext *cct, int item, bool unlink_only)
 {
   // last instance?
@@ -1023,12 +1023,23 @@ public:
     return result;
   }
 
+  /**
+   * true if mapping never updates the buckets' cached permutations
+   *
+   * That is the case without uniform buckets and local fallback
+   * retries; do_rule() calls then need not be serialized.
+   */
+  bool is_mapper_reentrant() const;
+
   void do_rule(int rule, int x, vector<int>& out, int maxout,
-	       const vector<__u32>& weight) const {
-    Mutex::Locker l(mapper_lock);
+	       const vector<__u32>& weight, bool need_lock = true) const {
+    if (need_lock)
+      mapper_lock.Lock();
     int rawout[maxout];
     int scratch[maxout * 3];
     int numrep = crush_do_rule(crush, rule, x, rawout, maxout, &weight[0], weight.size(), scratch);
+    if (need_lock)
+      mapper_lock.Unlock();
     if (numrep < 0)
       numrep = 0;
     out.resize(numrep);
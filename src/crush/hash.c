@@ -140,6 +140,144 @@ __u32 crush_hash32_5(int type, __u32 a, __u32 b, __u32 c, __u32 d, __u32 e)
 	}
 }
 
+#ifndef __KERNEL__
+
+#include <string.h>
+#include "arch/probe.h"
+#include "arch/intel.h"
+#include "arch/arm.h"
+
+/*
+ * rjenkins1_3 on CRUSH_HASH_BATCH values of b at once, with the gcc
+ * vector extensions.  It is the same sequence of 32-bit operations as
+ * crush_hash32_rjenkins1_3(), lane by lane, so the results are
+ * identical.  The compiler turns it into sse2 or neon code, or avx2 in
+ * the copy built for that target.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__aarch64__))
+# define CRUSH_HAVE_HASH_VECTOR 1
+
+# define CRUSH_HASH_BATCH 8
+typedef __u32 crush_hash_vec_t
+	__attribute__((vector_size(CRUSH_HASH_BATCH * sizeof(__u32))));
+
+# define crush_hash_vec_rjenkins1_3(a, pb, c, out) do {			\
+		crush_hash_vec_t va, vb, vc, vx, vy, vhash;		\
+		crush_hash_vec_t zero = {0};				\
+		va = zero + (a);					\
+		memcpy(&vb, (pb), sizeof(vb));				\
+		vc = zero + (c);					\
+		vhash = va ^ vb ^ vc ^ crush_hash_seed;			\
+		vx = zero + 231232;					\
+		vy = zero + 1232;					\
+		crush_hashmix(va, vb, vhash);				\
+		crush_hashmix(vc, vx, vhash);				\
+		crush_hashmix(vy, va, vhash);				\
+		crush_hashmix(vb, vx, vhash);				\
+		crush_hashmix(vy, vc, vhash);				\
+		memcpy((out), &vhash, sizeof(vhash));			\
+	} while (0)
+
+static void crush_hash32_rjenkins1_3_vec(__u32 a, const __u32 *b, __u32 c,
+					 __u32 *out, unsigned int n)
+{
+	unsigned int i;
+	for (i = 0; i + CRUSH_HASH_BATCH <= n; i += CRUSH_HASH_BATCH)
+		crush_hash_vec_rjenkins1_3(a, b + i, c, out + i);
+	for (; i < n; i++)
+		out[i] = crush_hash32_rjenkins1_3(a, b[i], c);
+}
+
+# if defined(__x86_64__) && \
+	(__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9) || \
+	 defined(__clang__))
+#  define CRUSH_HAVE_HASH_AVX2 1
+__attribute__((target("avx2")))
+static void crush_hash32_rjenkins1_3_avx2(__u32 a, const __u32 *b, __u32 c,
+					  __u32 *out, unsigned int n)
+{
+	unsigned int i;
+	for (i = 0; i + CRUSH_HASH_BATCH <= n; i += CRUSH_HASH_BATCH)
+		crush_hash_vec_rjenkins1_3(a, b + i, c, out + i);
+	for (; i < n; i++)
+		out[i] = crush_hash32_rjenkins1_3(a, b[i], c);
+}
+# endif
+#endif
+
+static void crush_hash32_rjenkins1_3_scalar(__u32 a, const __u32 *b, __u32 c,
+					    __u32 *out, unsigned int n)
+{
+	unsigned int i;
+	for (i = 0; i < n; i++)
+		out[i] = crush_hash32_rjenkins1_3(a, b[i], c);
+}
+
+typedef void (*crush_hash32_3_batch_t)(__u32 a, const __u32 *b, __u32 c,
+				       __u32 *out, unsigned int n);
+
+static crush_hash32_3_batch_t crush_hash_batch_func;
+static const char *crush_hash_batch_name;
+
+/* choose the best implementation for this cpu */
+static void crush_hash_batch_choose(int enable)
+{
+	crush_hash32_3_batch_t f = crush_hash32_rjenkins1_3_scalar;
+	const char *name = "scalar";
+
+	ceph_arch_probe();
+	if (enable) {
+#if defined(CRUSH_HAVE_HASH_AVX2)
+		if (ceph_arch_intel_avx2) {
+			f = crush_hash32_rjenkins1_3_avx2;
+			name = "avx2";
+		} else
+#endif
+#if defined(CRUSH_HAVE_HASH_VECTOR) && defined(__x86_64__)
+		if (ceph_arch_intel_sse2) {
+			f = crush_hash32_rjenkins1_3_vec;
+			name = "sse2";
+		}
+#elif defined(CRUSH_HAVE_HASH_VECTOR) && defined(__aarch64__)
+		if (ceph_arch_neon) {
+			f = crush_hash32_rjenkins1_3_vec;
+			name = "neon";
+		}
+#endif
+	}
+	/* racing callers all pick the same one */
+	crush_hash_batch_name = name;
+	crush_hash_batch_func = f;
+}
+
+void crush_hash32_3_batch(int type, __u32 a, const __u32 *b, __u32 c,
+			  __u32 *out, unsigned int n)
+{
+	switch (type) {
+	case CRUSH_HASH_RJENKINS1:
+		if (!crush_hash_batch_func)
+			crush_hash_batch_choose(1);
+		crush_hash_batch_func(a, b, c, out, n);
+		break;
+	default:
+		memset(out, 0, n * sizeof(*out));
+	}
+}
+
+const char *crush_hash_batch_impl(void)
+{
+	if (!crush_hash_batch_func)
+		crush_hash_batch_choose(1);
+	return crush_hash_batch_name;
+}
+
+void crush_hash_batch_enable(int enable)
+{
+	crush_hash_batch_choose(enable);
+}
+
+#endif /* !__KERNEL__ */
+
 const char *crush_hash_name(int type)
 {
 	switch (type) {
@@ -20,4 +20,17 @@ extern __u32 crush_hash32_4(int type, __u32 a, __u32 b, __u32 c, __u32 d);
 extern __u32 crush_hash32_5(int type, __u32 a, __u32 b, __u32 c, __u32 d,
 			    __u32 e);
 
+#ifndef __KERNEL__
+/*
+ * out[i] = crush_hash32_3(type, a, b[i], c) for i < n, several b at a
+ * time where the cpu allows (see crush_hash_batch_impl()).
+ */
+extern void crush_hash32_3_batch(int type, __u32 a, const __u32 *b, __u32 c,
+				 __u32 *out, unsigned int n);
+/* name of the vector code crush_hash32_3_batch() uses, or "scalar" */
+extern const char *crush_hash_batch_impl(void);
+/* 0 makes crush_hash32_3_batch() use the scalar code (for testing) */
+extern void crush_hash_batch_enable(int enable);
+#endif
+
 #endif
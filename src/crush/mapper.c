@@ -294,40 +294,87 @@ static __u64 crush_ln(unsigned int xin)
  *
  */
 
+static __s64 straw2_draw(unsigned int u, unsigned int w)
+{
+	__s64 ln;
+
+	u &= 0xffff;
+
+	/*
+	 * for some reason slightly less than 0x10000 produces
+	 * a slightly more accurate distribution... probably a
+	 * rounding effect.
+	 *
+	 * the natural log lookup table maps [0,0xffff]
+	 * (corresponding to real numbers [1/0x10000, 1] to
+	 * [0, 0xffffffffffff] (corresponding to real numbers
+	 * [-11.090355,0]).
+	 */
+	ln = crush_ln(u) - 0x1000000000000ll;
+
+	/*
+	 * divide by 16.16 fixed-point weight.  note
+	 * that the ln value is negative, so a larger
+	 * weight means a larger (less negative) value
+	 * for draw.
+	 */
+	return div64_s64(ln, w);
+}
+
+#ifndef __KERNEL__
+/*
+ * hash the items a batch at a time with crush_hash32_3_batch(), which
+ * uses simd where it can.  the draws are still computed one by one
+ * (there is no vector 64-bit divide) in the same order, so the result
+ * is the same as the scalar loop below.
+ */
+#define STRAW2_HASH_BATCH 32
+
+static int bucket_straw2_choose(struct crush_bucket_straw2 *bucket,
+				int x, int r)
+{
+	unsigned int i, j, n, high = 0;
+	unsigned int w;
+	__u32 hashes[STRAW2_HASH_BATCH];
+	__s64 draw, high_draw = 0;
+
+	for (i = 0; i < bucket->h.size; i += n) {
+		n = bucket->h.size - i;
+		if (n > STRAW2_HASH_BATCH)
+			n = STRAW2_HASH_BATCH;
+		crush_hash32_3_batch(bucket->h.hash, x,
+				     (const __u32 *)bucket->h.items + i, r,
+				     hashes, n);
+		for (j = 0; j < n; j++) {
+			w = bucket->item_weights[i + j];
+			if (w)
+				draw = straw2_draw(hashes[j], w);
+			else
+				draw = S64_MIN;
+
+			if (i + j == 0 || draw > high_draw) {
+				high = i + j;
+				high_draw = draw;
+			}
+		}
+	}
+	return bucket->h.items[high];
+}
+#else
 static int bucket_straw2_choose(struct crush_bucket_straw2 *bucket,
 				int x, int r)
 {
 	unsigned int i, high = 0;
 	unsigned int u;
 	unsigned int w;
-	__s64 ln, draw, high_draw = 0;
+	__s64 draw, high_draw = 0;
 
 	for (i = 0; i < bucket->h.size; i++) {
 		w = bucket->item_weights[i];
 		if (w) {
 			u = crush_hash32_3(bucket->h.hash, x,
 					   bucket->h.items[i], r);
-			u &= 0xffff;
-
-			/*
-			 * for some reason slightly less than 0x10000 produces
-			 * a slightly more accurate distribution... probably a
-			 * rounding effect.
-			 *
-			 * the natural log lookup table maps [0,0xffff]
-			 * (corresponding to real numbers [1/0x10000, 1] to
-			 * [0, 0xffffffffffff] (corresponding to real numbers
-			 * [-11.090355,0]).
-			 */
-			ln = crush_ln(u) - 0x1000000000000ll;
-
-			/*
-			 * divide by 16.16 fixed-point weight.  note
-			 * that the ln value is negative, so a larger
-			 * weight means a larger (less negative) value
-			 * for draw.
-			 */
-			draw = div64_s64(ln, w);
+			draw = straw2_draw(u, w);
 		} else {
 			draw = S64_MIN;
 		}
@@ -339,6 +386,7 @@ static int bucket_straw2_choose(struct crush_bucket_straw2 *bucket,
 	}
 	return bucket->h.items[high];
 }
+#endif
 
 
 static int crush_bucket_choose(struct crush_bucket *in, int x, int r)
@@ -70,6 +70,11 @@
 #define CEPH_FEATURE_OSD_HITSET_GMT (1ULL<<54)
 #define CEPH_FEATURE_HAMMER_0_94_4 (1ULL<<55)
 #define CEPH_FEATURE_NEW_OSDOP_ENCODING   (1ULL<<56) /* New, v7 encoding */
+/*
+ * can inflate compressed message segments; advertised by a messenger
+ * only once it has a compressor, so it is not part of CEPH_FEATURES_ALL
+ */
+#define CEPH_FEATURE_MSG_COMPRESS (1ULL<<57)
 
 #define CEPH_FEATURE_RESERVED2 (1ULL<<61)  /* slow down, we are almost out... */
 #define CEPH_FEATURE_RESERVED  (1ULL<<62)  /* DO NOT USE THIS ... last bit! */
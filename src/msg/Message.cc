@@ -14,6 +14,7 @@ using namespace std;
 #include "global/global_context.h"
 
 #include "Message.h"
+#include "compressor/Compressor.h"
 
 #include "messages/MPGStats.h"
 
@@ -189,6 +190,7 @@ void Message::encode(uint64_t features, int crcflags)
     calc_front_crc();
 
   // update envelope
+  header.reserved = (unsigned)header.reserved & ~CEPH_MSG_COMPRESS_MASK;
   header.front_len = get_payload().length();
   header.middle_len = get_middle().length();
   header.data_len = get_data().length();
@@ -242,6 +244,89 @@ void Message::encode(uint64_t features, int crcflags)
   }
 }
 
+static bool compress_segment(Compressor *c, uint64_t min_size,
+			     bufferlist& in, bufferlist& out)
+{
+  if (in.length() < min_size)
+    return false;
+  bufferlist z;
+  if (c->compress(in, z) < 0 || z.length() >= in.length())
+    return false;
+  out.claim_append(z);
+  return true;
+}
+
+void compress_message(CephContext *cct, Compressor *c, Message *m,
+		      bufferlist& out)
+{
+  ceph_msg_header& header = m->get_header();
+  uint64_t min_size = cct->_conf->ms_compress_min_size;
+  unsigned flags = 0;
+
+  bufferlist front, middle, data;
+  if (compress_segment(c, min_size, m->get_payload(), front))
+    flags |= CEPH_MSG_COMPRESS_FRONT;
+  else
+    front = m->get_payload();
+  if (compress_segment(c, min_size, m->get_middle(), middle))
+    flags |= CEPH_MSG_COMPRESS_MIDDLE;
+  else
+    middle = m->get_middle();
+  if (compress_segment(c, min_size, m->get_data(), data))
+    flags |= CEPH_MSG_COMPRESS_DATA;
+  else
+    data = m->get_data();
+
+  if (flags) {
+    ldout(cct, 20) << __func__ << " " << *m << " "
+		   << header.front_len << "+" << header.middle_len << "+"
+		   << header.data_len << " -> " << front.length() << "+"
+		   << middle.length() << "+" << data.length() << dendl;
+    header.reserved = (unsigned)header.reserved | flags;
+    header.front_len = front.length();
+    header.middle_len = middle.length();
+    header.data_len = data.length();
+  }
+  out.claim_append(front);
+  out.claim_append(middle);
+  out.claim_append(data);
+}
+
+int decompress_message(CephContext *cct, Compressor *c,
+		       ceph_msg_header& header, bufferlist& front,
+		       bufferlist& middle, bufferlist& data)
+{
+  unsigned flags = (unsigned)header.reserved & CEPH_MSG_COMPRESS_MASK;
+  if (!flags)
+    return 0;
+  if (!c) {
+    ldout(cct, 0) << __func__ << " got compressed message but no compressor"
+		  << dendl;
+    return -EINVAL;
+  }
+
+  bufferlist f, mi, d;
+  if (((flags & CEPH_MSG_COMPRESS_FRONT) && c->decompress(front, f) < 0) ||
+      ((flags & CEPH_MSG_COMPRESS_MIDDLE) && c->decompress(middle, mi) < 0) ||
+      ((flags & CEPH_MSG_COMPRESS_DATA) && c->decompress(data, d) < 0)) {
+    ldout(cct, 0) << __func__ << " failed to decompress message type "
+		  << header.type << " flags " << flags << dendl;
+    return -EINVAL;
+  }
+  if (flags & CEPH_MSG_COMPRESS_FRONT)
+    front.swap(f);
+  if (flags & CEPH_MSG_COMPRESS_MIDDLE)
+    middle.swap(mi);
+  if (flags & CEPH_MSG_COMPRESS_DATA)
+    data.swap(d);
+
+  header.reserved = (unsigned)header.reserved & ~CEPH_MSG_COMPRESS_MASK;
+  header.front_len = front.length();
+  header.middle_len = middle.length();
+  header.data_len = data.length();
+  return 0;
+}
+
 void Message::dump(Formatter *f) const
 {
   stringstream ss;
@@ -464,6 +464,40 @@ extern Message *decode_message(CephContext *cct, int crcflags,
 			       ceph_msg_header &header,
 			       ceph_msg_footer& footer, bufferlist& front,
 			       bufferlist& middle, bufferlist& data);
+
+/*
+ * header.reserved bits marking segments that were compressed on the
+ * wire (only used with CEPH_FEATURE_MSG_COMPRESS peers)
+ */
+#define CEPH_MSG_COMPRESS_FRONT   0x1
+#define CEPH_MSG_COMPRESS_MIDDLE  0x2
+#define CEPH_MSG_COMPRESS_DATA    0x4
+#define CEPH_MSG_COMPRESS_MASK    0x7
+
+class Compressor;
+
+/**
+ * Build the on-wire segments of an encoded message, compressing each
+ * one that is at least ms_compress_min_size bytes and actually
+ * shrinks.  The header lengths and compression flags of @a m are
+ * updated to describe what is sent; the footer crcs keep covering the
+ * uncompressed segments.  The header crc must be recalculated
+ * afterwards.  Message::encode() resets the header for a resend.
+ *
+ * @param out receives front + middle + data as they go on the wire
+ */
+extern void compress_message(CephContext *cct, Compressor *c, Message *m,
+			     bufferlist& out);
+/**
+ * Inflate the segments flagged in @a header and restore its lengths
+ * and flags.  On failure nothing is modified.
+ *
+ * @return 0 on success, -EINVAL if a segment cannot be decompressed
+ */
+extern int decompress_message(CephContext *cct, Compressor *c,
+			      ceph_msg_header& header, bufferlist& front,
+			      bufferlist& middle, bufferlist& data);
+
 inline ostream& operator<<(ostream& out, Message& m) {
   m.print(out);
   if (m.get_header().version)
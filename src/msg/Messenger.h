@@ -27,6 +27,7 @@ using namespace std;
 #include "include/Context.h"
 #include "include/types.h"
 #include "include/ceph_features.h"
+#include "include/memory.h"
 #include "auth/Crypto.h"
 
 #include <errno.h>
@@ -35,6 +36,7 @@ using namespace std;
 #define SOCKET_PRIORITY_MIN_DELAY 6
 
 class Timer;
+class Compressor;
 
 
 class Messenger {
@@ -50,6 +52,8 @@ protected:
   bool started;
   uint32_t magic;
   int socket_priority;
+  /// on-the-wire compressor, if compression is enabled
+  ceph::shared_ptr<Compressor> compressor;
 
 public:
   /**
@@ -348,6 +352,26 @@ public:
   int get_socket_priority() {
     return socket_priority;
   }
+  /**
+   * Set the Compressor used to compress messages on the wire. Once set,
+   * the Messenger advertises CEPH_FEATURE_MSG_COMPRESS and compresses
+   * messages to peers that advertise it too.
+   * This is an init-time function and cannot be called after calling
+   * start() or bind().
+   *
+   * @param c The Compressor to use; it must be safe to call from
+   * multiple threads.
+   * @return 0 on success, -EOPNOTSUPP if this Messenger cannot compress.
+   */
+  virtual int set_compressor(ceph::shared_ptr<Compressor> c) {
+    return -EOPNOTSUPP;
+  }
+  /**
+   * Get the Compressor set with set_compressor(), or NULL.
+   */
+  Compressor *get_compressor() {
+    return compressor.get();
+  }
   /**
    * Add a new Dispatcher to the front of the list. If you add
    * a Dispatcher which is already included, it will get a duplicate
@@ -47,15 +47,28 @@ public:
     Mutex::Locker l(policy_lock);
     map<int, Policy>::iterator iter =
       policy_map.find(t);
-    if (iter != policy_map.end())
-      return iter->second;
-    else
-      return default_policy;
+    Policy p = iter != policy_map.end() ? iter->second : default_policy;
+    if (compressor)
+      p.features_supported |= CEPH_FEATURE_MSG_COMPRESS;
+    return p;
   }
 
   virtual Policy get_default_policy() {
     Mutex::Locker l(policy_lock);
-    return default_policy;
+    Policy p = default_policy;
+    if (compressor)
+      p.features_supported |= CEPH_FEATURE_MSG_COMPRESS;
+    return p;
+  }
+
+  /**
+   * Set the on-the-wire Compressor. CEPH_FEATURE_MSG_COMPRESS is added
+   * to the supported features of every Policy handed out afterwards.
+   */
+  virtual int set_compressor(ceph::shared_ptr<Compressor> c) {
+    Mutex::Locker l(policy_lock);
+    compressor = c;
+    return 0;
   }
 
   /**
@@ -17,6 +17,10 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#endif
 
 #include "include/Context.h"
 #include "common/errno.h"
@@ -25,6 +29,10 @@
 
 #include "include/sock_compat.h"
 
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define HAVE_MSG_ZEROCOPY
+#endif
+
 // Constant to limit starting sequence number to 2^31.  Nothing special about it, just a big number.  PLR
 #define SEQ_MASK  0x7fffffff 
 
@@ -150,7 +158,8 @@ class C_clean_handler : public EventCallback {
   }
 };
 
-static void alloc_aligned_buffer(bufferlist& data, unsigned len, unsigned off)
+static void alloc_aligned_buffer(bufferlist& data, unsigned len, unsigned off,
+                                 RxBufferPool *pool, PerfCounters *logger)
 {
   // create a buffer to read into that matches the data alignment
   unsigned left = len;
@@ -164,7 +173,10 @@ static void alloc_aligned_buffer(bufferlist& data, unsigned len, unsigned off)
   }
   unsigned middle = left & CEPH_PAGE_MASK;
   if (middle > 0) {
-    bufferptr bp = buffer::create_page_aligned(middle);
+    bool reused;
+    bufferptr bp = pool->get(middle, &reused);
+    if (reused)
+      logger->inc(l_msgr_rx_buffer_reused);
     data.push_back(bp);
     left -= middle;
   }
@@ -174,8 +186,9 @@ static void alloc_aligned_buffer(bufferlist& data, unsigned len, unsigned off)
   }
 }
 
-AsyncConnection::AsyncConnection(CephContext *cct, AsyncMessenger *m, EventCenter *c, PerfCounters *p)
-  : Connection(cct, m), async_msgr(m), logger(p), global_seq(0), connect_seq(0), peer_global_seq(0),
+AsyncConnection::AsyncConnection(CephContext *cct, AsyncMessenger *m, EventCenter *c,
+                                 PerfCounters *p, RxBufferPool *rp)
+  : Connection(cct, m), async_msgr(m), logger(p), rx_pool(rp), global_seq(0), connect_seq(0), peer_global_seq(0),
     out_seq(0), ack_left(0), in_seq(0), state(STATE_NONE), state_after_send(0), sd(-1), port(-1),
     write_lock("AsyncConnection::write_lock"), can_write(NOWRITE),
     open_write(false), keepalive(false), lock("AsyncConnection::lock"), recv_buf(NULL),
@@ -201,6 +214,11 @@ AsyncConnection::~AsyncConnection()
 {
   assert(out_q.empty());
   assert(sent.empty());
+  // messages sent after the connection was stopped
+  list<OutgoingMessage> q;
+  send_q.drain(&q);
+  for (list<OutgoingMessage>::iterator p = q.begin(); p != q.end(); ++p)
+    p->m->put();
   delete authorizer;
   if (recv_buf)
     delete[] recv_buf;
@@ -231,16 +249,25 @@ int AsyncConnection::read_bulk(int fd, char *buf, int len)
 
 // return the length of msg needed to be sent,
 // < 0 means error occured
-int AsyncConnection::do_sendmsg(struct msghdr &msg, int len, bool more)
+int AsyncConnection::do_sendmsg(struct msghdr &msg, int len, bool more, bool zerocopy)
 {
   while (len > 0) {
-    int r = ::sendmsg(sd, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+    int flags = MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+#ifdef HAVE_MSG_ZEROCOPY
+    if (zerocopy)
+      flags |= MSG_ZEROCOPY;
+#endif
+    int r = ::sendmsg(sd, &msg, flags);
 
     if (r == 0) {
       ldout(async_msgr->cct, 10) << __func__ << " sendmsg got r==0!" << dendl;
     } else if (r < 0) {
       if (errno == EINTR) {
         continue;
+      } else if (errno == ENOBUFS && zerocopy) {
+        // no optmem left to pin more pages; just copy
+        zerocopy = false;
+        continue;
       } else if (errno == EAGAIN) {
         break;
       } else {
@@ -249,6 +276,9 @@ int AsyncConnection::do_sendmsg(struct msghdr &msg, int len, bool more)
       }
     }
 
+    if (zerocopy && r > 0)
+      ++zc.next_id;
+
     len -= r;
     if (len == 0) break;
 
@@ -292,6 +322,11 @@ int AsyncConnection::_try_send(bufferlist &send_bl, bool send)
     }
   }
 
+  if (zc.enabled && !zc.pending.empty())
+    _reap_zerocopy();
+  uint32_t zc_first = zc.next_id;
+  uint64_t zc_min = async_msgr->cct->_conf->ms_async_zerocopy_min_size;
+
   uint64_t sent_bytes = 0;
   list<bufferptr>::const_iterator pb = outcoming_bl.buffers().begin();
   uint64_t left_pbrs = outcoming_bl.buffers().size();
@@ -303,16 +338,20 @@ int AsyncConnection::_try_send(bufferlist &send_bl, bool send)
     msg.msg_iovlen = 0;
     msg.msg_iov = msgvec;
     int msglen = 0;
+    // pinning pages only pays off for large data segments
+    bool zerocopy = false;
     while (size > 0) {
       msgvec[msg.msg_iovlen].iov_base = (void*)(pb->c_str());
       msgvec[msg.msg_iovlen].iov_len = pb->length();
       msg.msg_iovlen++;
       msglen += pb->length();
+      if (zc.enabled && pb->length() >= zc_min)
+        zerocopy = true;
       ++pb;
       size--;
     }
 
-    int r = do_sendmsg(msg, msglen, false);
+    int r = do_sendmsg(msg, msglen, false, zerocopy);
     if (r < 0)
       return r;
 
@@ -333,6 +372,15 @@ int AsyncConnection::_try_send(bufferlist &send_bl, bool send)
     if (sent_bytes < outcoming_bl.length())
       outcoming_bl.splice(sent_bytes, outcoming_bl.length()-sent_bytes, &bl);
     bl.swap(outcoming_bl);
+    if (zc.next_id != zc_first) {
+      // the kernel may still read these pages; hold them until it says so
+      zc.pending.push_back(ZeroCopyState::Sent());
+      ZeroCopyState::Sent &sent = zc.pending.back();
+      sent.lo = zc_first;
+      sent.hi = zc.next_id - 1;
+      sent.acked = 0;
+      sent.bl.swap(bl);
+    }
   }
 
   ldout(async_msgr->cct, 20) << __func__ << " sent bytes " << sent_bytes
@@ -351,6 +399,64 @@ int AsyncConnection::_try_send(bufferlist &send_bl, bool send)
   return outcoming_bl.length();
 }
 
+void AsyncConnection::init_zerocopy()
+{
+  Mutex::Locker l(write_lock);
+  zc.reset();
+#ifdef HAVE_MSG_ZEROCOPY
+  if (async_msgr->cct->_conf->ms_async_zerocopy_min_size &&
+      !net.is_local_socket(sd)) {
+    int on = 1;
+    if (::setsockopt(sd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0)
+      zc.enabled = true;
+    else
+      ldout(async_msgr->cct, 1) << __func__ << " SO_ZEROCOPY failed: "
+                                << cpp_strerror(errno) << dendl;
+  }
+#endif
+}
+
+// release the buffers of zerocopy sends the kernel has completed
+void AsyncConnection::_reap_zerocopy()
+{
+  assert(write_lock.is_locked());
+#ifdef HAVE_MSG_ZEROCOPY
+  while (sd >= 0) {
+    char control[128];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (::recvmsg(sd, &msg, MSG_ERRQUEUE) < 0)
+      break;
+
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+      if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+          !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+        continue;
+      struct sock_extended_err *ee = (struct sock_extended_err*)CMSG_DATA(cm);
+      if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+        continue;
+      uint32_t lo = ee->ee_info, hi = ee->ee_data;
+      ldout(async_msgr->cct, 20) << __func__ << " completed " << lo << "-" << hi << dendl;
+      // ranges usually complete in order, but nothing guarantees it
+      for (list<ZeroCopyState::Sent>::iterator p = zc.pending.begin();
+           p != zc.pending.end(); ++p) {
+        for (uint32_t id = p->lo; ; ++id) {
+          if ((uint32_t)(id - lo) <= (uint32_t)(hi - lo))
+            ++p->acked;
+          if (id == p->hi)
+            break;
+        }
+      }
+    }
+  }
+#endif
+  while (!zc.pending.empty() &&
+         zc.pending.front().acked == zc.pending.front().hi - zc.pending.front().lo + 1)
+    zc.pending.pop_front();
+}
+
 // Because this func will be called multi times to populate
 // the needed buffer, so the passed in bufferptr must be the same.
 // Normally, only "read_message" will pass existing bufferptr in
@@ -438,6 +544,11 @@ void AsyncConnection::process()
   int r = 0;
   int prev_state = state;
   Mutex::Locker l(lock);
+  if (zc.enabled) {
+    // completions on the error queue raise EPOLLERR, which lands here
+    Mutex::Locker wl(write_lock);
+    _reap_zerocopy();
+  }
   do {
     ldout(async_msgr->cct, 20) << __func__ << " state is " << get_state_name(state)
                                << ", prev state is " << get_state_name(prev_state) << dendl;
@@ -697,7 +808,11 @@ void AsyncConnection::process()
           int data_off = le32_to_cpu(current_header.data_off);
           if (data_len) {
             // get a buffer
-            map<ceph_tid_t,pair<bufferlist,int> >::iterator p = rx_buffers.find(current_header.tid);
+            // compressed data is inflated into a new buffer, so a
+            // registered rx buffer cannot be filled in place
+            map<ceph_tid_t,pair<bufferlist,int> >::iterator p = rx_buffers.end();
+            if (!((unsigned)current_header.reserved & CEPH_MSG_COMPRESS_DATA))
+              p = rx_buffers.find(current_header.tid);
             if (p != rx_buffers.end()) {
               ldout(async_msgr->cct,10) << __func__ << " seleting rx buffer v " << p->second.second
                                   << " at offset " << data_off
@@ -709,7 +824,7 @@ void AsyncConnection::process()
               data_blp = data_buf.begin();
             } else {
               ldout(async_msgr->cct,20) << __func__ << " allocating new rx buffer at offset " << data_off << dendl;
-              alloc_aligned_buffer(data_buf, data_len, data_off);
+              alloc_aligned_buffer(data_buf, data_len, data_off, rx_pool, logger);
               data_blp = data_buf.begin();
             }
           }
@@ -782,6 +897,16 @@ void AsyncConnection::process()
 
           ldout(async_msgr->cct, 20) << __func__ << " got " << front.length() << " + " << middle.length()
                               << " + " << data.length() << " byte message" << dendl;
+          if ((unsigned)current_header.reserved & CEPH_MSG_COMPRESS_MASK) {
+            uint64_t wire_size = current_header.front_len + current_header.middle_len + current_header.data_len;
+            if (decompress_message(async_msgr->cct, async_msgr->get_compressor(), current_header, front, middle, data) < 0)
+              goto fail;
+            // the throttle was taken for the wire size; account the inflated one
+            uint64_t inflated = current_header.front_len + current_header.middle_len + current_header.data_len;
+            if (policy.throttler_bytes && inflated > wire_size)
+              policy.throttler_bytes->take(inflated - wire_size);
+          }
+
           Message *message = decode_message(async_msgr->cct, async_msgr->crcflags, current_header, footer, front, middle, data);
           if (!message) {
             ldout(async_msgr->cct, 1) << __func__ << " decode message failed " << dendl;
@@ -969,7 +1094,17 @@ int AsyncConnection::_process_connection()
           ::close(sd);
         }
 
-        sd = net.connect(get_peer_addr());
+        sd = -1;
+        {
+          string path = async_msgr->get_local_socket_path(get_peer_addr());
+          if (!path.empty()) {
+            sd = net.connect_local(path);
+            ldout(async_msgr->cct, 10) << __func__ << " same-host socket " << path
+                                       << (sd < 0 ? " unavailable, using tcp" : "") << dendl;
+          }
+        }
+        if (sd < 0)
+          sd = net.connect(get_peer_addr());
         if (sd < 0) {
           goto fail;
         }
@@ -977,6 +1112,7 @@ int AsyncConnection::_process_connection()
         if (r < 0) {
           goto fail;
         }
+        init_zerocopy();
 
         center->create_file_event(sd, EVENT_READABLE, read_handler);
         state = STATE_CONNECTING_WAIT_BANNER;
@@ -1274,6 +1410,7 @@ int AsyncConnection::_process_connection()
         // write event may already notify and we need to force scheduler again
         write_lock.Lock();
         can_write = CANWRITE;
+        _drain_send_queue();
         if (is_queued())
           center->dispatch_event_external(write_handler);
         write_lock.Unlock();
@@ -1288,22 +1425,37 @@ int AsyncConnection::_process_connection()
         if (net.set_nonblock(sd) < 0)
           goto fail;
 
-        net.set_socket_options(sd);
+        bool local_socket = net.is_local_socket(sd);
+        if (!local_socket)
+          net.set_socket_options(sd);
+        init_zerocopy();
 
         bl.append(CEPH_BANNER, strlen(CEPH_BANNER));
 
         ::encode(async_msgr->get_myaddr(), bl);
         port = async_msgr->get_myaddr().get_port();
         // and peer's socket addr (they might not know their ip)
-        socklen_t len = sizeof(socket_addr.ss_addr());
-        r = ::getpeername(sd, (sockaddr*)&socket_addr.ss_addr(), &len);
-        if (r < 0) {
-          ldout(async_msgr->cct, 0) << __func__ << " failed to getpeername "
-                              << cpp_strerror(errno) << dendl;
-          goto fail;
+        entity_addr_t addr_for_peer;
+        if (local_socket) {
+          // a unix socket has no ip; a same-host peer can reach us at
+          // ours, so that is what it learns.  its own address comes
+          // from its banner.
+          socket_addr = entity_addr_t();
+          addr_for_peer = async_msgr->get_myaddr();
+          addr_for_peer.set_port(0);
+          addr_for_peer.set_nonce(0);
+        } else {
+          socklen_t len = sizeof(socket_addr.ss_addr());
+          r = ::getpeername(sd, (sockaddr*)&socket_addr.ss_addr(), &len);
+          if (r < 0) {
+            ldout(async_msgr->cct, 0) << __func__ << " failed to getpeername "
+                                << cpp_strerror(errno) << dendl;
+            goto fail;
+          }
+          addr_for_peer = socket_addr;
         }
-        ::encode(socket_addr, bl);
-        ldout(async_msgr->cct, 1) << __func__ << " sd=" << sd << " " << socket_addr << dendl;
+        ::encode(addr_for_peer, bl);
+        ldout(async_msgr->cct, 1) << __func__ << " sd=" << sd << " " << addr_for_peer << dendl;
 
         r = try_send(bl);
         if (r == 0) {
@@ -1347,7 +1499,7 @@ int AsyncConnection::_process_connection()
         }
 
         ldout(async_msgr->cct, 10) << __func__ << " accept peer addr is " << peer_addr << dendl;
-        if (peer_addr.is_blank_ip()) {
+        if (peer_addr.is_blank_ip() && !socket_addr.is_blank_ip()) {
           // peer apparently doesn't know what ip they have; figure it out for them.
           int port = peer_addr.get_port();
           peer_addr.addr = socket_addr.addr;
@@ -1769,6 +1921,7 @@ int AsyncConnection::handle_connect_msg(ceph_msg_connect &connect, bufferlist &a
     existing->requeue_sent();
 
     swap(existing->sd, sd);
+    swap(existing->zc, zc);
     existing->can_write = NOWRITE;
     existing->open_write = false;
     existing->replacing = true;
@@ -1956,35 +2109,71 @@ int AsyncConnection::send_message(Message *m)
   if (can_fast_prepare)
     prepare_send_message(f, m, bl);
 
-  Mutex::Locker l(write_lock);
-  // "features" changes will change the payload encoding
-  if (can_fast_prepare && (can_write == NOWRITE || get_features() != f)) {
-    // ensure the correctness of message encoding
-    bl.clear();
-    m->get_payload().clear();
-    ldout(async_msgr->cct, 5) << __func__ << " clear encoded buffer, can_write=" << can_write << " previous "
-                              << f << " != " << get_features() << dendl;
-  }
-  if (!is_queued() && can_write == CANWRITE) {
-    if (!can_fast_prepare)
-      prepare_send_message(get_features(), m, bl);
-    if (write_message(m, bl) < 0) {
-      ldout(async_msgr->cct, 1) << __func__ << " send msg failed" << dendl;
-      // we want to handle fault within internal thread
-      center->dispatch_event_external(write_handler);
+  // Write inline only if nobody else holds write_lock and nothing is
+  // ahead of us.  Otherwise hand the message to the event thread through
+  // send_q instead of waiting for write_lock, which it may hold across
+  // socket I/O.
+  if (write_lock.TryLock()) {
+    if (send_q.empty() && !is_queued() && can_write == CANWRITE) {
+      // "features" changes will change the payload encoding
+      if (can_fast_prepare && get_features() != f) {
+        bl.clear();
+        m->get_payload().clear();
+        ldout(async_msgr->cct, 5) << __func__ << " clear encoded buffer, previous "
+                                  << f << " != " << get_features() << dendl;
+      }
+      if (!bl.length())
+        prepare_send_message(get_features(), m, bl);
+      if (write_message(m, bl) < 0) {
+        ldout(async_msgr->cct, 1) << __func__ << " send msg failed" << dendl;
+        // we want to handle fault within internal thread
+        center->dispatch_event_external(write_handler);
+      }
+      write_lock.Unlock();
+      return 0;
     }
-  } else if (can_write == CLOSED) {
-    ldout(async_msgr->cct, 10) << __func__ << " connection closed."
-                               << " Drop message " << m << dendl;
-    m->put();
-  } else {
-    out_q[m->get_priority()].push_back(make_pair(bl, m));
-    ldout(async_msgr->cct, 15) << __func__ << " inline write is denied, reschedule m=" << m << dendl;
-    center->dispatch_event_external(write_handler);
+    write_lock.Unlock();
   }
+
+  utime_t start = ceph_clock_now(async_msgr->cct);
+  unsigned retries;
+  bool was_empty = send_q.push(OutgoingMessage(f, bl, m), &retries);
+  logger->tinc(l_msgr_send_enqueue_lat, ceph_clock_now(async_msgr->cct) - start);
+  if (retries)
+    logger->inc(l_msgr_send_enqueue_retries, retries);
+  ldout(async_msgr->cct, 15) << __func__ << " inline write is denied, reschedule m=" << m << dendl;
+  // one wakeup per batch: the event thread drains everything queued
+  if (was_empty)
+    center->dispatch_event_external(write_handler);
   return 0;
 }
 
+// move what send_message() queued into out_q
+void AsyncConnection::_drain_send_queue()
+{
+  assert(write_lock.is_locked());
+  list<OutgoingMessage> q;
+  send_q.drain(&q);
+  for (list<OutgoingMessage>::iterator p = q.begin(); p != q.end(); ++p) {
+    Message *m = p->m;
+    if (can_write == CLOSED) {
+      ldout(async_msgr->cct, 10) << __func__ << " connection closed."
+                                 << " Drop message " << m << dendl;
+      m->put();
+      continue;
+    }
+    // "features" changes will change the payload encoding
+    if (p->bl.length() && (can_write == NOWRITE || get_features() != p->features)) {
+      // ensure the correctness of message encoding
+      p->bl.clear();
+      m->get_payload().clear();
+      ldout(async_msgr->cct, 5) << __func__ << " clear encoded buffer, can_write=" << can_write << " previous "
+                                << p->features << " != " << get_features() << dendl;
+    }
+    out_q[m->get_priority()].push_back(make_pair(p->bl, m));
+  }
+}
+
 void AsyncConnection::requeue_sent()
 {
   assert(write_lock.is_locked());
@@ -2029,6 +2218,7 @@ void AsyncConnection::discard_out_queue()
 {
   ldout(async_msgr->cct, 10) << __func__ << " started" << dendl;
   assert(write_lock.is_locked());
+  _drain_send_queue();
 
   for (list<Message*>::iterator p = sent.begin(); p != sent.end(); ++p) {
     ldout(async_msgr->cct, 20) << __func__ << " discard " << *p << dendl;
@@ -2077,12 +2267,14 @@ void AsyncConnection::fault()
   }
 
   write_lock.Lock();
+  _drain_send_queue();
   if (sd >= 0) {
     shutdown_socket();
     center->delete_file_event(sd, EVENT_READABLE|EVENT_WRITABLE);
     ::close(sd);
     sd = -1;
   }
+  zc.reset();
   can_write = NOWRITE;
   open_write = false;
 
@@ -2184,6 +2376,7 @@ void AsyncConnection::_stop()
     ::close(sd);
   }
   sd = -1;
+  zc.reset();
   for (set<uint64_t>::iterator it = register_time_events.begin();
        it != register_time_events.end(); ++it)
     center->delete_time_event(*it);
@@ -2206,12 +2399,20 @@ void AsyncConnection::prepare_send_message(uint64_t features, Message *m, buffer
   // encode and copy out of *m
   m->encode(features, msgr->crcflags);
 
+  // compress here rather than in write_message so that fast-prepared
+  // messages pay for it in the sender's thread, not the event loop
+  Compressor *c = async_msgr->get_compressor();
+  if (c && (features & CEPH_FEATURE_MSG_COMPRESS)) {
+    compress_message(async_msgr->cct, c, m, bl);
+    return;
+  }
+
   bl.append(m->get_payload());
   bl.append(m->get_middle());
   bl.append(m->get_data());
 }
 
-int AsyncConnection::write_message(Message *m, bufferlist& bl)
+int AsyncConnection::write_message(Message *m, bufferlist& bl, bool more)
 {
   assert(can_write == CANWRITE);
   m->set_seq(out_seq.inc());
@@ -2292,10 +2493,14 @@ int AsyncConnection::write_message(Message *m, bufferlist& bl)
   logger->inc(l_msgr_send_bytes, complete_bl.length());
   ldout(async_msgr->cct, 20) << __func__ << " sending " << m->get_seq()
                              << " " << m << dendl;
-  int rc = _try_send(complete_bl);
+  // with "more", only queue it so the caller can batch the next message
+  // into the same sendmsg
+  int rc = _try_send(complete_bl, !more);
   if (rc < 0) {
     ldout(async_msgr->cct, 1) << __func__ << " error sending " << m << ", "
                               << cpp_strerror(errno) << dendl;
+  } else if (more) {
+    ldout(async_msgr->cct, 10) << __func__ << " sending " << m << " batched." << dendl;
   } else if (rc == 0) {
     ldout(async_msgr->cct, 10) << __func__ << " sending " << m << " done." << dendl;
   } else {
@@ -2371,12 +2576,14 @@ void AsyncConnection::handle_write()
   int r = 0;
 
   write_lock.Lock();
+  _drain_send_queue();
   if (can_write == CANWRITE) {
     if (keepalive) {
       _send_keepalive_or_ack();
       keepalive = false;
     }
 
+    uint64_t batch_bytes = async_msgr->cct->_conf->ms_async_send_batch_bytes;
     while (1) {
       bufferlist data;
       Message *m = _get_next_outgoing(&data);
@@ -2387,7 +2594,11 @@ void AsyncConnection::handle_write()
       if (!data.length())
         prepare_send_message(get_features(), m, data);
 
-      r = write_message(m, data);
+      // coalesce queued messages into one sendmsg until the batch is full;
+      // whatever is left is flushed below
+      bool more = !out_q.empty() &&
+        outcoming_bl.length() + data.length() < batch_bytes;
+      r = write_message(m, data, more);
       if (r < 0) {
         ldout(async_msgr->cct, 1) << __func__ << " send msg failed" << dendl;
         write_lock.Unlock();
@@ -25,6 +25,7 @@ using namespace std;
 
 #include "auth/AuthSessionHandler.h"
 #include "common/Mutex.h"
+#include "common/MPSCQueue.h"
 #include "common/perf_counters.h"
 #include "include/buffer.h"
 #include "msg/Connection.h"
@@ -34,6 +35,7 @@ using namespace std;
 #include "net_handler.h"
 
 class AsyncMessenger;
+class RxBufferPool;
 
 /*
  * AsyncConnection maintains a logic session between two endpoints. In other
@@ -45,7 +47,7 @@ class AsyncMessenger;
 class AsyncConnection : public Connection {
 
   int read_bulk(int fd, char *buf, int len);
-  int do_sendmsg(struct msghdr &msg, int len, bool more);
+  int do_sendmsg(struct msghdr &msg, int len, bool more, bool zerocopy=false);
   int try_send(bufferlist &bl, bool send=true) {
     Mutex::Locker l(write_lock);
     return _try_send(bl, send);
@@ -69,7 +71,10 @@ class AsyncConnection : public Connection {
   int randomize_out_seq();
   void handle_ack(uint64_t seq);
   void _send_keepalive_or_ack(bool ack=false, utime_t *t=NULL);
-  int write_message(Message *m, bufferlist& bl);
+  int write_message(Message *m, bufferlist& bl, bool more=false);
+  void _drain_send_queue();
+  void init_zerocopy();
+  void _reap_zerocopy();
   int _reply_accept(char tag, ceph_msg_connect &connect, ceph_msg_connect_reply &reply,
                     bufferlist authorizer_reply) {
     bufferlist reply_bl;
@@ -114,7 +119,8 @@ class AsyncConnection : public Connection {
   }
 
  public:
-  AsyncConnection(CephContext *cct, AsyncMessenger *m, EventCenter *c, PerfCounters *p);
+  AsyncConnection(CephContext *cct, AsyncMessenger *m, EventCenter *c,
+                  PerfCounters *p, RxBufferPool *rp);
   ~AsyncConnection();
 
   ostream& _conn_prefix(std::ostream *_dout);
@@ -217,6 +223,7 @@ class AsyncConnection : public Connection {
 
   AsyncMessenger *async_msgr;
   PerfCounters *logger;
+  RxBufferPool *rx_pool;
   int global_seq;
   __u32 connect_seq, peer_global_seq;
   atomic_t out_seq;
@@ -235,11 +242,44 @@ class AsyncConnection : public Connection {
   } can_write;
   bool open_write;
   map<int, list<pair<bufferlist, Message*> > > out_q;  // priority queue for outbound msgs
+  /// a message send_message() queued without taking write_lock
+  struct OutgoingMessage {
+    uint64_t features;  ///< what bl was encoded with, if anything
+    bufferlist bl;
+    Message *m;
+    OutgoingMessage(uint64_t f, const bufferlist& b, Message *m)
+      : features(f), bl(b), m(m) {}
+  };
+  /// handed to out_q, in order, by the event thread under write_lock
+  MPSCQueue<OutgoingMessage> send_q;
   list<Message*> sent; // the first bufferlist need to inject seq
   list<Message*> local_messages;    // local deliver
   bufferlist outcoming_bl;
   bool keepalive;
 
+  /**
+   * MSG_ZEROCOPY bookkeeping.  The kernel numbers each zerocopy
+   * sendmsg on a socket and later reports ranges of those numbers on
+   * the socket error queue once it no longer references the pages, so
+   * the state belongs to the socket and moves with sd.
+   */
+  struct ZeroCopyState {
+    struct Sent {
+      uint32_t lo, hi;  ///< kernel ids of the sendmsg calls that sent bl
+      uint32_t acked;   ///< how many of them have completed
+      bufferlist bl;
+    };
+    bool enabled;
+    uint32_t next_id;
+    list<Sent> pending;
+    ZeroCopyState() : enabled(false), next_id(0) {}
+    void reset() {
+      enabled = false;
+      next_id = 0;
+      pending.clear();
+    }
+  } zc;
+
   Mutex lock;
   utime_t backoff;         // backoff time
   EventCallbackRef read_handler;
@@ -17,6 +17,7 @@
 #include "acconfig.h"
 
 #include <errno.h>
+#include <ifaddrs.h>
 #include <iostream>
 #include <fstream>
 
@@ -29,6 +30,7 @@
 #include "common/errno.h"
 #include "auth/Crypto.h"
 #include "include/Spinlock.h"
+#include "include/ceph_hash.h"
 
 #define dout_subsys ceph_subsys_ms
 #undef dout_prefix
@@ -55,8 +57,8 @@ class C_processor_accept : public EventCallback {
 
  public:
   C_processor_accept(Processor *p): pro(p) {}
-  void do_request(int id) {
-    pro->accept();
+  void do_request(int fd) {
+    pro->accept(fd);
   }
 };
 
@@ -202,11 +204,27 @@ int Processor::bind(const entity_addr_t &bind_addr, const set<int>& avoid_ports)
   msgr->set_myaddr(addr);
 
   msgr->init_local_connection();
+  bind_local();
 
   ldout(msgr->cct,1) << __func__ << " bind my_inst.addr is " << msgr->get_myaddr() << dendl;
   return 0;
 }
 
+void Processor::bind_local()
+{
+  if (msgr->cct->_conf->ms_async_local_socket_dir.empty())
+    return;
+  // the port and nonce identify us whatever ip peers know us by
+  string path = msgr->local_socket_path(msgr->get_myaddr().get_port(), nonce);
+  // not fatal: peers just keep using tcp
+  int sd = net.listen_local(path);
+  if (sd < 0)
+    return;
+  local_sd = sd;
+  local_path = path;
+  ldout(msgr->cct, 1) << __func__ << " same-host socket " << local_path << dendl;
+}
+
 int Processor::rebind(const set<int>& avoid_ports)
 {
   ldout(msgr->cct, 1) << __func__ << " rebind avoid " << avoid_ports << dendl;
@@ -235,23 +253,29 @@ int Processor::start(Worker *w)
     w->center.create_file_event(listen_sd, EVENT_READABLE,
                                 EventCallbackRef(new C_processor_accept(this)));
   }
+  if (local_sd >= 0)
+    w->center.create_file_event(local_sd, EVENT_READABLE,
+                                EventCallbackRef(new C_processor_accept(this)));
 
   return 0;
 }
 
-void Processor::accept()
+void Processor::accept(int fd)
 {
-  ldout(msgr->cct, 10) << __func__ << " listen_sd=" << listen_sd << dendl;
+  ldout(msgr->cct, 10) << __func__ << " listen_sd=" << fd << dendl;
   int errors = 0;
   while (errors < 4) {
     entity_addr_t addr;
     socklen_t slen = sizeof(addr.ss_addr());
-    int sd = ::accept(listen_sd, (sockaddr*)&addr.ss_addr(), &slen);
+    int sd = ::accept(fd, (sockaddr*)&addr.ss_addr(), &slen);
     if (sd >= 0) {
       errors = 0;
       ldout(msgr->cct, 10) << __func__ << " accepted incoming on sd " << sd << dendl;
+      // a same-host peer shares our ip
+      if (fd == local_sd)
+        addr = msgr->get_myaddr();
 
-      msgr->add_accept(sd);
+      msgr->add_accept(sd, addr);
       continue;
     } else {
       if (errno == EINTR) {
@@ -277,6 +301,50 @@ void Processor::stop()
     ::close(listen_sd);
     listen_sd = -1;
   }
+  if (local_sd >= 0) {
+    if (worker)
+      worker->center.delete_file_event(local_sd, EVENT_READABLE);
+    ::close(local_sd);
+    ::unlink(local_path.c_str());
+    local_sd = -1;
+    local_path.clear();
+  }
+}
+
+/*******************
+ * RxBufferPool
+ */
+
+bufferptr RxBufferPool::get(unsigned len, bool *reused)
+{
+  const unsigned size = ROUND_UP_TO(len, CEPH_PAGE_SIZE);
+  const unsigned max = cct->_conf->ms_async_rx_buffer_pool_size;
+  *reused = false;
+  if (max == 0 || len < (unsigned)cct->_conf->ms_async_rx_buffer_pool_min)
+    return buffer::create_page_aligned(len);
+
+  // an idle buffer is one nobody else references any more
+  int idle = -1;
+  for (unsigned i = 0; i < bufs.size(); ++i) {
+    if (bufs[i].raw_nref() != 1)
+      continue;
+    if (bufs[i].raw_length() == size) {
+      *reused = true;
+      // the old contents' crcs are still cached on the raw buffer
+      bufferlist bl;
+      bl.append(bufs[i]);
+      bl.invalidate_crc();
+      return bufferptr(bufs[i], 0, len);
+    }
+    idle = i;
+  }
+
+  bufferptr bp = buffer::create_page_aligned(size);
+  if (bufs.size() < max)
+    bufs.push_back(bp);
+  else if (idle >= 0)
+    bufs[idle] = bp;  // evict an idle buffer of another size
+  return bufferptr(bp, 0, len);
 }
 
 void Worker::stop()
@@ -361,6 +429,32 @@ void WorkerPool::start()
   }
 }
 
+/*
+ * With ms_async_peer_affinity, every connection with a given host lands
+ * on the same worker, so its messages are read, fast dispatched and
+ * replied to on one (pinned) core, and a reconnect or connection race
+ * does not hop between event loops.
+ */
+Worker *WorkerPool::get_worker(const entity_addr_t& peer)
+{
+  if (!cct->_conf->ms_async_peer_affinity)
+    return get_worker();
+  unsigned h;
+  switch (peer.get_family()) {
+  case AF_INET:
+    h = ceph_str_hash_rjenkins((const char*)&peer.addr4.sin_addr,
+			       sizeof(peer.addr4.sin_addr));
+    break;
+  case AF_INET6:
+    h = ceph_str_hash_rjenkins((const char*)&peer.addr6.sin6_addr,
+			       sizeof(peer.addr6.sin6_addr));
+    break;
+  default:
+    return get_worker();
+  }
+  return workers[h % workers.size()];
+}
+
 void WorkerPool::barrier()
 {
   ldout(cct, 10) << __func__ << " started." << dendl;
@@ -393,9 +487,20 @@ AsyncMessenger::AsyncMessenger(CephContext *cct, entity_name_t name,
     cluster_protocol(0), stopped(true)
 {
   ceph_spin_init(&global_seq_lock);
+  if (!cct->_conf->ms_async_local_socket_dir.empty()) {
+    struct ifaddrs *ifa;
+    if (getifaddrs(&ifa) == 0) {
+      for (struct ifaddrs *p = ifa; p; p = p->ifa_next) {
+        entity_addr_t a;
+        if (p->ifa_addr && a.set_sockaddr(p->ifa_addr))
+          host_addrs.push_back(a);
+      }
+      freeifaddrs(ifa);
+    }
+  }
   cct->lookup_or_create_singleton_object<WorkerPool>(pool, WorkerPool::name);
   Worker *w = pool->get_worker();
-  local_connection = new AsyncConnection(cct, this, &w->center, w->get_perf_counter());
+  local_connection = new AsyncConnection(cct, this, &w->center, w->get_perf_counter(), &w->rx_pool);
   local_features = features;
   init_local_connection();
 }
@@ -518,11 +623,11 @@ void AsyncMessenger::wait()
   started = false;
 }
 
-AsyncConnectionRef AsyncMessenger::add_accept(int sd)
+AsyncConnectionRef AsyncMessenger::add_accept(int sd, const entity_addr_t& peer)
 {
   lock.Lock();
-  Worker *w = pool->get_worker();
-  AsyncConnectionRef conn = new AsyncConnection(cct, this, &w->center, w->get_perf_counter());
+  Worker *w = pool->get_worker(peer);
+  AsyncConnectionRef conn = new AsyncConnection(cct, this, &w->center, w->get_perf_counter(), &w->rx_pool);
   conn->accept(sd);
   accepting_conns.insert(conn);
   lock.Unlock();
@@ -538,8 +643,8 @@ AsyncConnectionRef AsyncMessenger::create_connect(const entity_addr_t& addr, int
       << ", creating connection and registering" << dendl;
 
   // create connection
-  Worker *w = pool->get_worker();
-  AsyncConnectionRef conn = new AsyncConnection(cct, this, &w->center, w->get_perf_counter());
+  Worker *w = pool->get_worker(addr);
+  AsyncConnectionRef conn = new AsyncConnection(cct, this, &w->center, w->get_perf_counter(), &w->rx_pool);
   conn->connect(addr, type);
   assert(!conns.count(addr));
   conns[addr] = conn;
@@ -726,6 +831,25 @@ int AsyncMessenger::get_proto_version(int peer_type, bool connect)
   return 0;
 }
 
+string AsyncMessenger::local_socket_path(int port, uint32_t nonce)
+{
+  ostringstream ss;
+  ss << cct->_conf->ms_async_local_socket_dir << "/ms." << port << "." << nonce;
+  return ss.str();
+}
+
+string AsyncMessenger::get_local_socket_path(const entity_addr_t& addr)
+{
+  if (cct->_conf->ms_async_local_socket_dir.empty())
+    return string();
+  for (vector<entity_addr_t>::iterator p = host_addrs.begin();
+       p != host_addrs.end(); ++p) {
+    if (p->is_same_host(addr))
+      return local_socket_path(addr.get_port(), addr.get_nonce());
+  }
+  return string();
+}
+
 void AsyncMessenger::learned_addr(const entity_addr_t &peer_addr_for_me)
 {
   // be careful here: multiple threads may block here, and readers of
@@ -49,9 +49,30 @@ enum {
   l_msgr_send_bytes,
   l_msgr_created_connections,
   l_msgr_active_connections,
+  l_msgr_rx_buffer_reused,
+  l_msgr_send_enqueue_lat,
+  l_msgr_send_enqueue_retries,
   l_msgr_last,
 };
 
+/**
+ * page-aligned receive buffers for message data, owned by one worker
+ *
+ * A buffer handed to a message goes back into service once we hold the
+ * only reference to it again, i.e. once the message and whatever the
+ * store did with its data are gone.  Only the worker thread touches the
+ * pool, so it needs no lock.
+ */
+class RxBufferPool {
+  CephContext *cct;
+  vector<bufferptr> bufs;
+
+ public:
+  explicit RxBufferPool(CephContext *c) : cct(c) {}
+  /// get a page-aligned buffer of at least len bytes (len > 0)
+  bufferptr get(unsigned len, bool *reused);
+};
+
 
 class Worker : public Thread {
   static const uint64_t InitEventNumber = 5000;
@@ -64,8 +85,10 @@ class Worker : public Thread {
 
  public:
   EventCenter center;
+  RxBufferPool rx_pool;
   Worker(CephContext *c, WorkerPool *p, int i)
-    : cct(c), pool(p), done(false), id(i), perf_logger(NULL), center(c) {
+    : cct(c), pool(p), done(false), id(i), perf_logger(NULL), center(c),
+      rx_pool(c) {
     center.init(InitEventNumber);
     char name[128];
     sprintf(name, "AsyncMessenger::Worker-%d", id);
@@ -78,6 +101,9 @@ class Worker : public Thread {
     plb.add_u64_counter(l_msgr_send_bytes, "msgr_send_bytes", "Network received bytes");
     plb.add_u64_counter(l_msgr_created_connections, "msgr_active_connections", "Active connection number");
     plb.add_u64_counter(l_msgr_active_connections, "msgr_created_connections", "Created connection number");
+    plb.add_u64_counter(l_msgr_rx_buffer_reused, "msgr_rx_buffer_reused", "Pooled rx data buffers reused");
+    plb.add_time_avg(l_msgr_send_enqueue_lat, "msgr_send_enqueue_lat", "Time to queue a message for the event thread");
+    plb.add_u64_counter(l_msgr_send_enqueue_retries, "msgr_send_enqueue_retries", "Contended send queue pushes");
 
     perf_logger = plb.create_perf_counters();
     cct->get_perfcounters_collection()->add(perf_logger);
@@ -102,16 +128,21 @@ class Processor {
   NetHandler net;
   Worker *worker;
   int listen_sd;
+  int local_sd;       ///< same-host unix socket, if enabled
+  string local_path;
   uint64_t nonce;
 
+  void bind_local();
+
  public:
-  Processor(AsyncMessenger *r, CephContext *c, uint64_t n): msgr(r), net(c), worker(NULL), listen_sd(-1), nonce(n) {}
+  Processor(AsyncMessenger *r, CephContext *c, uint64_t n)
+    : msgr(r), net(c), worker(NULL), listen_sd(-1), local_sd(-1), nonce(n) {}
 
   void stop();
   int bind(const entity_addr_t &bind_addr, const set<int>& avoid_ports);
   int rebind(const set<int>& avoid_port);
   int start(Worker *w);
-  void accept();
+  void accept(int fd);
 };
 
 class WorkerPool {
@@ -145,6 +176,8 @@ class WorkerPool {
   Worker *get_worker() {
     return workers[(seq++)%workers.size()];
   }
+  /// pick a worker for a connection with the given peer
+  Worker *get_worker(const entity_addr_t& peer);
   int get_cpuid(int id) {
     if (coreids.empty())
       return -1;
@@ -251,7 +284,8 @@ public:
   Connection *create_anon_connection() {
     Mutex::Locker l(lock);
     Worker *w = pool->get_worker();
-    return new AsyncConnection(cct, this, &w->center, w->get_perf_counter());
+    return new AsyncConnection(cct, this, &w->center, w->get_perf_counter(),
+                               &w->rx_pool);
   }
 
   /**
@@ -402,6 +436,9 @@ private:
 
 public:
 
+  /// addresses of this host's interfaces, for the same-host transport
+  vector<entity_addr_t> host_addrs;
+
   /// con used for sending messages to ourselves
   ConnectionRef local_connection;
   uint64_t local_features;
@@ -439,7 +476,18 @@ public:
   }
 
   void learned_addr(const entity_addr_t &peer_addr_for_me);
-  AsyncConnectionRef add_accept(int sd);
+  AsyncConnectionRef add_accept(int sd, const entity_addr_t& peer);
+
+  /**
+   * Same-host transport: with ms_async_local_socket_dir set, a bound
+   * messenger also listens on a unix domain socket named after its port
+   * and nonce, and connections to an address of this host try that
+   * socket before falling back to tcp.
+   *
+   * @return the socket path for addr, or "" if disabled or addr is remote
+   */
+  string get_local_socket_path(const entity_addr_t& addr);
+  string local_socket_path(int port, uint32_t nonce);
 
   /**
    * This wraps ms_deliver_get_authorizer. We use it for AsyncConnection.
@@ -15,6 +15,7 @@
  */
 
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
@@ -142,5 +143,70 @@ int NetHandler::nonblock_connect(const entity_addr_t &addr)
   return generic_connect(addr, true);
 }
 
+static int fill_sockaddr_un(const string &path, struct sockaddr_un *sa)
+{
+  memset(sa, 0, sizeof(*sa));
+  if (path.length() >= sizeof(sa->sun_path))
+    return -ENAMETOOLONG;
+  sa->sun_family = AF_UNIX;
+  strcpy(sa->sun_path, path.c_str());
+  return 0;
+}
+
+int NetHandler::connect_local(const string &path)
+{
+  struct sockaddr_un sa;
+  int r = fill_sockaddr_un(path, &sa);
+  if (r < 0)
+    return r;
+  int s = create_socket(AF_UNIX);
+  if (s < 0)
+    return s;
+  if (::connect(s, (sockaddr*)&sa, sizeof(sa)) < 0) {
+    r = -errno;
+    ldout(cct, 10) << __func__ << " connect " << path << ": " << cpp_strerror(r) << dendl;
+    close(s);
+    return r;
+  }
+  return s;
+}
+
+int NetHandler::listen_local(const string &path)
+{
+  struct sockaddr_un sa;
+  int r = fill_sockaddr_un(path, &sa);
+  if (r < 0)
+    return r;
+  int s = create_socket(AF_UNIX);
+  if (s < 0)
+    return s;
+  // a previous instance bound to the same port and nonce is gone
+  ::unlink(path.c_str());
+  if (::bind(s, (sockaddr*)&sa, sizeof(sa)) < 0 ||
+      ::listen(s, 128) < 0) {
+    r = -errno;
+    lderr(cct) << __func__ << " unable to listen on " << path << ": "
+               << cpp_strerror(r) << dendl;
+    close(s);
+    return r;
+  }
+  r = set_nonblock(s);
+  if (r < 0) {
+    close(s);
+    ::unlink(path.c_str());
+    return r;
+  }
+  return s;
+}
+
+bool NetHandler::is_local_socket(int sd)
+{
+  struct sockaddr_storage ss;
+  socklen_t len = sizeof(ss);
+  if (::getsockname(sd, (sockaddr*)&ss, &len) < 0)
+    return false;
+  return ss.ss_family == AF_UNIX;
+}
+
 
 }
@@ -31,6 +31,12 @@ namespace ceph {
     void set_socket_options(int sd);
     int connect(const entity_addr_t &addr);
     int nonblock_connect(const entity_addr_t &addr);
+    /// blocking connect to a unix domain socket; the fd or -errno
+    int connect_local(const string &path);
+    /// listen on a unix domain socket, replacing a stale one at path
+    int listen_local(const string &path);
+    /// true for unix domain sockets, which take no tcp options
+    bool is_local_socket(int sd);
   };
 }
 
@@ -1786,6 +1786,18 @@ void Pipe::writer()
 	// encode and copy out of *m
 	m->encode(features, msgr->crcflags);
 
+	bufferlist blist;
+	Compressor *c = msgr->get_compressor();
+	if (c && (features & CEPH_FEATURE_MSG_COMPRESS)) {
+	  compress_message(msgr->cct, c, m, blist);
+	  if (msgr->crcflags & MSG_CRC_HEADER)
+	    m->calc_header_crc();
+	} else {
+	  blist = m->get_payload();
+	  blist.append(m->get_middle());
+	  blist.append(m->get_data());
+	}
+
 	// prepare everything
 	const ceph_msg_header& header = m->get_header();
 	const ceph_msg_footer& footer = m->get_footer();
@@ -1807,14 +1819,13 @@ void Pipe::writer()
 	  }
 	}
 
-	bufferlist blist = m->get_payload();
-	blist.append(m->get_middle());
-	blist.append(m->get_data());
+	// let the kernel coalesce this with the next queued message
+	bool more = !out_q.empty();
 
         pipe_lock.Unlock();
 
         ldout(msgr->cct,20) << "writer sending " << m->get_seq() << " " << m << dendl;
-	int rc = write_message(header, footer, blist);
+	int rc = write_message(header, footer, blist, more);
 
 	pipe_lock.Lock();
 	if (rc < 0) {
@@ -1995,7 +2006,11 @@ int Pipe::read_message(Message **pm, AuthSessionHandler* auth_handler)
 
       // get a buffer
       connection_state->lock.Lock();
-      map<ceph_tid_t,pair<bufferlist,int> >::iterator p = connection_state->rx_buffers.find(header.tid);
+      // compressed data is inflated into a new buffer, so a registered
+      // rx buffer cannot be filled in place
+      map<ceph_tid_t,pair<bufferlist,int> >::iterator p = connection_state->rx_buffers.end();
+      if (!((unsigned)header.reserved & CEPH_MSG_COMPRESS_DATA))
+	p = connection_state->rx_buffers.find(header.tid);
       if (p != connection_state->rx_buffers.end()) {
 	if (rxbuf.length() == 0 || p->second.second != rxbuf_version) {
 	  ldout(msgr->cct,10) << "reader seleting rx buffer v " << p->second.second
@@ -2060,6 +2075,22 @@ int Pipe::read_message(Message **pm, AuthSessionHandler* auth_handler)
 
   ldout(msgr->cct,20) << "reader got " << front.length() << " + " << middle.length() << " + " << data.length()
 	   << " byte message" << dendl;
+  if ((unsigned)header.reserved & CEPH_MSG_COMPRESS_MASK) {
+    if (decompress_message(msgr->cct, msgr->get_compressor(), header,
+			   front, middle, data) < 0) {
+      ret = -EINVAL;
+      goto out_dethrottle;
+    }
+    // the throttles were taken for the wire size; account the inflated one
+    uint64_t inflated = header.front_len + header.middle_len + header.data_len;
+    if (inflated > message_size) {
+      if (policy.throttler_bytes)
+	policy.throttler_bytes->take(inflated - message_size);
+      msgr->dispatch_throttler.take(inflated - message_size);
+      message_size = inflated;
+    }
+  }
+
   message = decode_message(msgr->cct, msgr->crcflags, header, footer, front, middle, data);
   if (!message) {
     ret = -EINVAL;
@@ -2226,7 +2257,8 @@ int Pipe::write_keepalive2(char tag, const utime_t& t)
 }
 
 
-int Pipe::write_message(const ceph_msg_header& header, const ceph_msg_footer& footer, bufferlist& blist)
+int Pipe::write_message(const ceph_msg_header& header, const ceph_msg_footer& footer, bufferlist& blist,
+			bool more)
 {
   int ret;
 
@@ -2339,7 +2371,7 @@ int Pipe::write_message(const ceph_msg_header& header, const ceph_msg_footer& fo
   }
 
   // send
-  if (do_sendmsg(&msg, msglen))
+  if (do_sendmsg(&msg, msglen, more))
     goto fail;
 
   ret = 0;
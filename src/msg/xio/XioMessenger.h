@@ -95,6 +95,9 @@ public:
   virtual double get_dispatch_queue_max_age(utime_t now)
     { return 0; } /* XXX bogus? */
 
+  virtual int set_compressor(ceph::shared_ptr<Compressor> c)
+    { return -EOPNOTSUPP; } /* segments travel as xio iovecs */
+
   virtual void set_cluster_protocol(int p)
     { }
 
@@ -785,6 +785,23 @@ int DBObjectMap::scan(Header header,
 		      set<string> *out_keys,
 		      map<string, bufferlist> *out_values)
 {
+  if (!header->parent) {
+    // nothing to merge from a parent: one batched point lookup will do
+    map<string, bufferlist> got;
+    int r = db->get(user_prefix(header), in_keys, &got);
+    if (r < 0)
+      return r;
+    for (map<string, bufferlist>::iterator p = got.begin();
+	 p != got.end();
+	 ++p) {
+      if (out_keys)
+	out_keys->insert(out_keys->end(), p->first);
+    }
+    if (out_values)
+      out_values->insert(got.begin(), got.end());
+    return 0;
+  }
+
   ObjectMapIterator db_iter = _get_iterator(header);
   for (set<string>::const_iterator key_iter = in_keys.begin();
        key_iter != in_keys.end();
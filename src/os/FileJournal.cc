@@ -530,6 +530,18 @@ int FileJournal::open(uint64_t fs_op_seq)
   while (1) {
     bufferlist bl;
     off64_t old_pos = read_pos;
+    if (seq_gaps) {
+      // the entry for next_seq may well be in another journal
+      uint64_t s;
+      if (!peek_entry_seq(&s)) {
+	dout(10) << "open reached end of journal." << dendl;
+	break;
+      }
+      if (s >= next_seq) {
+	dout(10) << "open reached seq " << s << dendl;
+	break;
+      }
+    }
     if (!read_entry(bl, seq)) {
       dout(10) << "open reached end of journal." << dendl;
       break;
@@ -1037,19 +1049,83 @@ int FileJournal::prepare_single_write(bufferlist& bl, off64_t& queue_pos, uint64
   return 0;
 }
 
+/**
+ * split segments that hold whole aligned blocks
+ *
+ * rebuild_aligned() keeps a segment only if it is both memory aligned
+ * and a whole number of blocks long; otherwise the entire segment is
+ * copied.  A large payload that is aligned in memory and lands on a
+ * block boundary on disk (see pre_pad) usually only fails the second
+ * test because of its tail, so carve it into an unaligned head, the
+ * aligned middle, and the tail.  Only the head and tail get copied.
+ */
+void FileJournal::split_aligned(off64_t pos, bufferlist& bl)
+{
+  const unsigned align = CEPH_MINIMUM_BLOCK_SIZE;
+  bool need = false;
+  unsigned off = pos & (align - 1);
+  for (std::list<buffer::ptr>::const_iterator p = bl.buffers().begin();
+       p != bl.buffers().end();
+       ++p) {
+    unsigned len = p->length();
+    unsigned head = (align - off) & (align - 1);
+    if (!p->is_n_align_sized(align) && len >= head + align &&
+	((unsigned long)(p->c_str() + head) & (align - 1)) == 0) {
+      need = true;
+      break;
+    }
+    off = (off + len) & (align - 1);
+  }
+  if (!need)
+    return;
+
+  bufferlist out;
+  off = pos & (align - 1);
+  for (std::list<buffer::ptr>::const_iterator p = bl.buffers().begin();
+       p != bl.buffers().end();
+       ++p) {
+    unsigned len = p->length();
+    unsigned head = (align - off) & (align - 1);
+    if (!p->is_n_align_sized(align) && len >= head + align &&
+	((unsigned long)(p->c_str() + head) & (align - 1)) == 0) {
+      unsigned mid = (len - head) & ~(align - 1);
+      if (head)
+	out.push_back(buffer::ptr(*p, 0, head));
+      out.push_back(buffer::ptr(*p, head, mid));
+      if (head + mid < len)
+	out.push_back(buffer::ptr(*p, head + mid, len - head - mid));
+    } else {
+      out.push_back(*p);
+    }
+    off = (off + len) & (align - 1);
+  }
+  bl.swap(out);
+}
+
 void FileJournal::align_bl(off64_t pos, bufferlist& bl)
 {
   // make sure list segments are page aligned
-  if (directio && (!bl.is_aligned(block_size) ||
-		   !bl.is_n_align_sized(CEPH_MINIMUM_BLOCK_SIZE))) {
+  if (!directio)
+    return;
+  unsigned copied = 0;
+  if (!bl.is_aligned(block_size) ||
+      !bl.is_n_align_sized(CEPH_MINIMUM_BLOCK_SIZE)) {
+    split_aligned(pos, bl);
+    unsigned before = bl.get_memcopy_count();
     bl.rebuild_aligned(CEPH_MINIMUM_BLOCK_SIZE);
-    dout(10) << __func__ << " total memcopy: " << bl.get_memcopy_count() << dendl;
+    copied = bl.get_memcopy_count() - before;
+    dout(10) << __func__ << " memcopy " << copied << " of " << bl.length()
+	     << dendl;
     if ((bl.length() & (CEPH_MINIMUM_BLOCK_SIZE - 1)) != 0 ||
 	(pos & (CEPH_MINIMUM_BLOCK_SIZE - 1)) != 0)
       dout(0) << "rebuild_page_aligned failed, " << bl << dendl;
     assert((bl.length() & (CEPH_MINIMUM_BLOCK_SIZE - 1)) == 0);
     assert((pos & (CEPH_MINIMUM_BLOCK_SIZE - 1)) == 0);
   }
+  if (logger) {
+    logger->inc(l_os_j_copy_bytes, copied);
+    logger->inc(l_os_j_nocopy_bytes, bl.length() - copied);
+  }
 }
 
 int FileJournal::write_bl(off64_t& pos, bufferlist& bl)
@@ -1271,9 +1347,18 @@ void FileJournal::write_thread_entry()
       // but should be fine given that we will have plenty of aios in
       // flight if we hit this limit to ensure we keep the device
       // saturated.
+      //
+      // with journal_batch_adaptive, the threshold is instead what we
+      // expect to arrive during one aio (see update_batch_target), so
+      // batches grow with load and device latency and we never wait
+      // when the device is idle.
       while (aio_num > 0) {
 	int exp = MIN(aio_num * 2, 24);
 	long unsigned min_new = 1ull << exp;
+	if (g_conf->journal_batch_adaptive) {
+	  update_batch_target();
+	  min_new = batch_target;
+	}
 	long unsigned cur = throttle_bytes.get_current();
 	dout(20) << "write_thread_entry aio throttle: aio num " << aio_num << " bytes " << aio_bytes
 		 << " ... exp " << exp << " min_new " << min_new
@@ -1318,6 +1403,7 @@ void FileJournal::write_thread_entry()
     if (logger) {
       logger->inc(l_os_j_wr);
       logger->inc(l_os_j_wr_bytes, bl.length());
+      logger->inc(l_os_j_wr_ops, orig_ops);
     }
 
 #ifdef HAVE_LIBAIO
@@ -1446,6 +1532,7 @@ int FileJournal::write_aio_bl(off64_t& pos, bufferlist& bl, uint64_t seq)
     aio_queue.push_back(aio_info(tbl, pos, bl.length() > 0 ? 0 : seq));
     aio_info& aio = aio_queue.back();
     aio.iov = iov;
+    aio.start = ceph_clock_now(g_ceph_context);
 
     io_prep_pwritev(&aio.iocb, fd, aio.iov, n, pos);
 
@@ -1473,6 +1560,8 @@ int FileJournal::write_aio_bl(off64_t& pos, bufferlist& bl, uint64_t seq)
     } while (true);
     pos += aio.len;
   }
+  if (logger)
+    logger->set(l_os_j_aio_depth, aio_num);
   write_finish_cond.Signal();
   return 0;
 }
@@ -1508,6 +1597,7 @@ void FileJournal::write_finish_thread_entry()
     
     {
       Mutex::Locker locker(aio_lock);
+      utime_t now = ceph_clock_now(g_ceph_context);
       for (int i=0; i<r; i++) {
 	aio_info *ai = (aio_info *)event[i].obj;
 	if (event[i].res != ai->len) {
@@ -1518,6 +1608,11 @@ void FileJournal::write_finish_thread_entry()
 	dout(10) << "write_finish_thread_entry aio " << ai->off
 		 << "~" << ai->len << " done" << dendl;
 	ai->done = true;
+	double lat = now - ai->start;
+	if (aio_lat_avg > 0)
+	  aio_lat_avg = (aio_lat_avg * 7 + lat) / 8;
+	else
+	  aio_lat_avg = lat;
       }
       check_aio_completion();
     }
@@ -1573,6 +1668,48 @@ void FileJournal::check_aio_completion()
   if (signal) {
     // maybe write queue was waiting for aio count to drop?
     aio_cond.Signal();
+    if (logger)
+      logger->set(l_os_j_aio_depth, aio_num);
+  }
+}
+
+/**
+ * recompute batch_target from the arrival rate and aio latency
+ *
+ * Holding back a new aio for about one device latency costs no more
+ * than the aios already in flight do, and lets the next write carry
+ * everything that arrived meanwhile.
+ */
+void FileJournal::update_batch_target()
+{
+  assert(aio_lock.is_locked());
+  utime_t now = ceph_clock_now(g_ceph_context);
+  double dt = now - arrival_stamp;
+  if (arrival_stamp.is_zero() || dt > 1.0) {
+    // first sample, or we have been idle; start over
+    arrival_stamp = now;
+    arrival_sampled = arrival_bytes.read();
+    arrival_rate = 0;
+  } else if (dt >= .001) {
+    uint64_t total = arrival_bytes.read();
+    double rate = (double)(total - arrival_sampled) / dt;
+    arrival_rate = arrival_rate > 0 ? (arrival_rate * 7 + rate) / 8 : rate;
+    arrival_sampled = total;
+    arrival_stamp = now;
+  }
+
+  uint64_t target = arrival_rate * aio_lat_avg;
+  uint64_t max = g_conf->journal_max_write_bytes;
+  if (max && target > max)
+    target = max;
+  if (target < CEPH_MINIMUM_BLOCK_SIZE)
+    target = CEPH_MINIMUM_BLOCK_SIZE;
+  if (target != batch_target) {
+    dout(20) << __func__ << " rate " << arrival_rate << " B/s lat " << aio_lat_avg
+	     << " -> target " << target << dendl;
+    batch_target = target;
+    if (logger)
+      logger->set(l_os_j_batch_target, batch_target);
   }
 }
 #endif
@@ -1588,6 +1725,7 @@ void FileJournal::submit_entry(uint64_t seq, bufferlist& e, int alignment,
 
   throttle_ops.take(1);
   throttle_bytes.take(e.length());
+  arrival_bytes.add(e.length());
   if (osd_op)
     osd_op->mark_event("commit_queued_for_journal_write");
   if (logger) {
@@ -1770,6 +1908,43 @@ void FileJournal::put_throttle(uint64_t ops, uint64_t bytes)
 int FileJournal::make_writeable()
 {
   dout(10) << __func__ << dendl;
+
+  // Find entries we were not asked to replay before the fd goes
+  // O_DIRECT.  They have ascending seqs past the last one we read;
+  // step over torn or corrupt ones, and stop at the first entry left
+  // over from the previous lap of the ring.
+  vector<off64_t> unread;
+  uint64_t replayed_seq = journalq.empty() ? 0 : journalq.back().first;
+  if (seq_gaps && read_pos > 0) {
+    uint64_t last_seq = replayed_seq;
+    off64_t pos = read_pos;
+    uint64_t skipped = 0, scanned = 0;
+    while (skipped < g_conf->journal_max_corrupt_search &&
+	   scanned < (uint64_t)(header.max_size - get_top())) {
+      off64_t next_pos;
+      uint64_t seq = 0;
+      read_entry_result result = do_read_entry(pos, &next_pos, NULL, &seq,
+					       NULL);
+      uint64_t len = next_pos >= pos ? next_pos - pos :
+	next_pos - get_top() + header.max_size - pos;
+      scanned += len;
+      if (result == SUCCESS) {
+	if (seq <= last_seq)
+	  break;
+	dout(10) << __func__ << " entry seq " << seq << " at " << pos
+		 << " was not replayed" << dendl;
+	unread.push_back(pos);
+	last_seq = seq;
+	skipped = 0;
+      } else {
+	skipped += len;
+      }
+      pos = next_pos;
+      if (pos >= header.max_size)
+	pos = pos + get_top() - header.max_size;
+    }
+  }
+
   int r = _open(true);
   if (r < 0)
     return r;
@@ -1780,11 +1955,55 @@ int FileJournal::make_writeable()
     write_pos = get_top();
   read_pos = 0;
 
+  if (!unread.empty()) {
+    r = _invalidate_unread(unread, replayed_seq);
+    if (r < 0)
+      return r;
+  }
+
   must_write_header = true;
   start_writer();
   return 0;
 }
 
+/**
+ * make sure entries left behind a replay gap are never replayed
+ *
+ * They follow a seq that never made it to disk, so they were never
+ * acked and must not be mistaken for the new entries we are about to
+ * write in their place.  Lower committed_up_to in the header to the
+ * last seq we replayed first: it still covers the unread entries, and a
+ * torn new entry below it would otherwise look like corruption.
+ */
+int FileJournal::_invalidate_unread(const vector<off64_t>& pos,
+				    uint64_t replayed_seq)
+{
+  dout(1) << __func__ << " " << pos.size() << " entries, committed_up_to "
+	  << header.committed_up_to << " -> " << replayed_seq << dendl;
+  {
+    Mutex::Locker l(finisher_lock);
+    journaled_seq = replayed_seq;  // prepare_header() copies it
+  }
+  write_header_sync();
+
+  bufferptr z = buffer::create_page_aligned(header.alignment);
+  z.zero();
+  for (vector<off64_t>::const_iterator p = pos.begin(); p != pos.end(); ++p) {
+    int r = safe_pwrite(fd, z.c_str(), z.length(), *p);
+    if (r < 0) {
+      derr << __func__ << " pwrite at " << *p << " got " << cpp_strerror(r)
+	   << dendl;
+      return r;
+    }
+  }
+  if (::fsync(fd) < 0) {
+    int r = -errno;
+    derr << __func__ << " fsync got " << cpp_strerror(r) << dendl;
+    return r;
+  }
+  return 0;
+}
+
 void FileJournal::wrap_read_bl(
   off64_t pos,
   int64_t olen,
@@ -1877,6 +2096,19 @@ bool FileJournal::read_entry(
   return false;
 }
 
+bool FileJournal::peek_entry_seq(uint64_t *seq) const
+{
+  if (read_pos <= 0)
+    return false;
+  bufferlist hbl;
+  wrap_read_bl(read_pos, sizeof(entry_header_t), &hbl, NULL);
+  entry_header_t *h = reinterpret_cast<entry_header_t *>(hbl.c_str());
+  if (!h->check_magic(read_pos, header.get_fsid64()))
+    return false;
+  *seq = h->seq;
+  return true;
+}
+
 FileJournal::read_entry_result FileJournal::do_read_entry(
   off64_t init_pos,
   off64_t *next_pos,
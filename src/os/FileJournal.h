@@ -24,6 +24,7 @@ using std::deque;
 #include "common/Mutex.h"
 #include "common/Thread.h"
 #include "common/Throttle.h"
+#include "include/atomic.h"
 
 #ifdef HAVE_LIBAIO
 # include <libaio.h>
@@ -224,6 +225,7 @@ private:
   off64_t max_size;
   size_t block_size;
   bool directio, aio, force_aio;
+  bool seq_gaps;          ///< entries may skip seqs (one stripe of several)
   bool must_write_header;
   off64_t write_pos;      // byte where the next entry to be written will go
   off64_t read_pos;       //
@@ -239,6 +241,7 @@ private:
     bool done;
     uint64_t off, len;    ///< these are for debug only
     uint64_t seq;         ///< seq number to complete on aio completion, if non-zero
+    utime_t start;        ///< submit time, for device latency estimate
 
     aio_info(bufferlist& b, uint64_t o, uint64_t s)
       : iov(NULL), done(false), off(o), len(b.length()), seq(s) {
@@ -255,8 +258,19 @@ private:
   io_context_t aio_ctx;
   list<aio_info> aio_queue;
   int aio_num, aio_bytes;
+
+  /// adaptive batching: hold back a new aio while others are in
+  /// flight until roughly one device latency worth of arrivals queued
+  double aio_lat_avg;         ///< decaying average aio latency (sec)
+  double arrival_rate;        ///< decaying average submit rate (bytes/sec)
+  uint64_t arrival_sampled;   ///< arrival_bytes at arrival_stamp
+  utime_t arrival_stamp;
+  uint64_t batch_target;      ///< bytes to accumulate before a new aio
   /// End protected by aio_lock
+
+  void update_batch_target();
 #endif
+  atomic64_t arrival_bytes;   ///< total bytes ever passed to submit_entry
 
   uint64_t last_committed_seq;
   uint64_t journaled_since_start;
@@ -295,6 +309,7 @@ private:
   Cond commit_cond;
 
   int _open(bool wr, bool create=false);
+  int _invalidate_unread(const vector<off64_t>& pos, uint64_t replayed_seq);
   int _open_block_device();
   void _close(int fd) const;
   void _check_disk_write_cache() const;
@@ -320,6 +335,7 @@ private:
   int write_aio_bl(off64_t& pos, bufferlist& bl, uint64_t seq);
 
 
+  void split_aligned(off64_t pos, bufferlist& bl);
   void align_bl(off64_t pos, bufferlist& bl);
   int write_bl(off64_t& pos, bufferlist& bl);
 
@@ -370,6 +386,7 @@ private:
     zero_buf(NULL),
     max_size(0), block_size(0),
     directio(dio), aio(ai), force_aio(faio),
+    seq_gaps(false),
     must_write_header(false),
     write_pos(0), read_pos(0),
     discard(false),
@@ -377,6 +394,8 @@ private:
     aio_lock("FileJournal::aio_lock"),
     aio_ctx(0),
     aio_num(0), aio_bytes(0),
+    aio_lat_avg(0), arrival_rate(0), arrival_sampled(0),
+    batch_target(0),
 #endif
     last_committed_seq(0), 
     journaled_since_start(0),
@@ -426,6 +445,19 @@ private:
   }
   int make_writeable();
 
+  /**
+   * allow sequence gaps between entries
+   *
+   * Set (before open) when this journal holds only every Nth entry.
+   * open() then stops at the first entry at or past fs_op_seq + 1
+   * instead of insisting on it, and make_writeable() invalidates any
+   * entries that were left unread so they can never be replayed.
+   */
+  void set_allow_seq_gaps(bool b) { seq_gaps = b; }
+
+  /// seq of the entry read_entry() would return next, without reading it
+  bool peek_entry_seq(uint64_t *seq) const;
+
   // writes
   void commit_start(uint64_t seq);
   void committed_thru(uint64_t seq);
@@ -54,6 +54,7 @@
 #include "common/BackTrace.h"
 #include "include/types.h"
 #include "FileJournal.h"
+#include "StripedJournal.h"
 
 #include "osd/osd_types.h"
 #include "include/color.h"
@@ -66,6 +67,7 @@
 #include "common/safe_io.h"
 #include "common/perf_counters.h"
 #include "common/sync_filesystem.h"
+#include "include/str_list.h"
 #include "common/fd.h"
 #include "HashIndex.h"
 #include "DBObjectMap.h"
@@ -536,6 +538,15 @@ FileStore::FileStore(const std::string &base, const std::string &jdev, osflagbit
   op_tp(g_ceph_context, "FileStore::op_tp", g_conf->filestore_op_threads, "filestore_op_threads"),
   op_wq(this, g_conf->filestore_op_thread_timeout,
 	g_conf->filestore_op_thread_suicide_timeout, &op_tp),
+  m_filestore_aio_apply(false),
+#ifdef HAVE_LIBAIO
+  apply_aio_lock("FileStore::apply_aio_lock"),
+  apply_aio_ctx(0),
+  apply_aio_num(0),
+  apply_aio_depth(0),
+  apply_aio_stop(true),
+  apply_aio_thread(this),
+#endif
   logger(NULL),
   read_error_lock("FileStore::read_error_lock"),
   m_filestore_commit_timeout(g_conf->filestore_commit_timeout),
@@ -606,6 +617,13 @@ FileStore::FileStore(const std::string &base, const std::string &jdev, osflagbit
   plb.add_time_avg(l_os_commit_lat, "commitcycle_latency", "Average latency of commit");
   plb.add_u64_counter(l_os_j_full, "journal_full", "Journal writes while full");
   plb.add_time_avg(l_os_queue_lat, "queue_transaction_latency_avg", "Store operation queue latency");
+  plb.add_u64_counter(l_os_aio_apply_ops, "aio_apply_ops", "Data writes applied via aio");
+  plb.add_u64_counter(l_os_aio_apply_bytes, "aio_apply_bytes", "Data applied via aio");
+  plb.add_u64_avg(l_os_j_wr_ops, "journal_wr_ops", "Journal entries per write IO");
+  plb.add_u64(l_os_j_aio_depth, "journal_aio_depth", "Journal aios in flight");
+  plb.add_u64(l_os_j_batch_target, "journal_batch_target", "Adaptive journal batch size target");
+  plb.add_u64_counter(l_os_j_copy_bytes, "journal_copy_bytes", "Journal data copied to align");
+  plb.add_u64_counter(l_os_j_nocopy_bytes, "journal_nocopy_bytes", "Journal data written without copy");
 
   logger = plb.create_perf_counters();
 
@@ -687,9 +705,19 @@ int FileStore::statfs(struct statfs *buf)
 void FileStore::new_journal()
 {
   if (journalpath.length()) {
-    dout(10) << "open_journal at " << journalpath << dendl;
-    journal = new FileJournal(fsid, &finisher, &sync_cond, journalpath.c_str(),
-			      m_journal_dio, m_journal_aio, m_journal_force_aio);
+    vector<string> stripes;
+    get_str_vec(g_conf->journal_stripe_paths, stripes);
+    if (stripes.empty()) {
+      dout(10) << "open_journal at " << journalpath << dendl;
+      journal = new FileJournal(fsid, &finisher, &sync_cond, journalpath.c_str(),
+				m_journal_dio, m_journal_aio, m_journal_force_aio);
+    } else {
+      stripes.insert(stripes.begin(), journalpath);
+      dout(10) << "open_journal striped over " << stripes << dendl;
+      journal = new StripedJournal(fsid, &finisher, &sync_cond, stripes,
+				   m_journal_dio, m_journal_aio,
+				   m_journal_force_aio);
+    }
     if (journal)
       journal->logger = logger;
   }
@@ -1631,6 +1659,19 @@ int FileStore::mount()
 
   journal_start();
 
+  m_filestore_aio_apply = g_conf->filestore_aio_apply;
+  if (m_filestore_aio_apply) {
+#ifdef HAVE_LIBAIO
+    if (_apply_aio_start() < 0) {
+      derr << "mount: unable to set up aio apply; disabling" << dendl;
+      m_filestore_aio_apply = false;
+    }
+#else
+    derr << "mount: libaio not compiled in; disabling aio apply" << dendl;
+    m_filestore_aio_apply = false;
+#endif
+  }
+
   op_tp.start();
   op_finisher.start();
   ondisk_finisher.start();
@@ -1717,7 +1758,15 @@ int FileStore::umount()
   lock.Unlock();
   sync_thread.join();
   wbthrottle.stop();
+#ifdef HAVE_LIBAIO
+  if (m_filestore_aio_apply)
+    _apply_aio_drain();
+#endif
   op_tp.stop();
+#ifdef HAVE_LIBAIO
+  if (m_filestore_aio_apply)
+    _apply_aio_stop();
+#endif
 
   journal_stop();
   if (!(generic_flags & SKIP_JOURNAL_REPLAY))
@@ -1866,10 +1915,29 @@ void FileStore::_do_op(OpSequencer *osr, ThreadPool::TPHandle &handle)
   }
 
   osr->apply_lock.Lock();
+  if (osr->apply_aio_busy) {
+    // the op ahead of us is waiting on its aio batch; _apply_aio_finish
+    // will requeue the sequencer once it completes.
+    dout(10) << "_do_op " << *osr << " aio busy, deferring" << dendl;
+    osr->apply_deferred++;
+    osr->apply_skip_finish = true;
+    return;
+  }
   Op *o = osr->peek_queue();
   apply_manager.op_apply_start(o->op);
   dout(5) << "_do_op " << o << " seq " << o->op << " " << *osr << "/" << osr->parent << " start" << dendl;
-  int r = _do_transactions(o->tls, o->op, &handle);
+  int r = _do_transactions(o->tls, o->op, &handle,
+			   m_filestore_aio_apply ? &o->batch : NULL);
+#ifdef HAVE_LIBAIO
+  if (!o->batch.empty()) {
+    dout(10) << "_do_op " << o << " seq " << o->op << " r = " << r
+	     << ", submitting " << o->batch.aios.size() << " aios" << dendl;
+    osr->apply_aio_busy = true;
+    osr->apply_skip_finish = true;
+    _apply_aio_submit(osr, o);  // o may complete at any point after this
+    return;
+  }
+#endif
   apply_manager.op_apply_finish(o->op);
   dout(10) << "_do_op " << o << " seq " << o->op << " r = " << r
 	   << ", finisher " << o->onreadable << " " << o->onreadable_sync << dendl;
@@ -1877,6 +1945,13 @@ void FileStore::_do_op(OpSequencer *osr, ThreadPool::TPHandle &handle)
 
 void FileStore::_finish_op(OpSequencer *osr)
 {
+  if (osr->apply_skip_finish) {
+    // op is still in flight (or we did not touch it); see _do_op
+    osr->apply_skip_finish = false;
+    osr->apply_lock.Unlock();
+    return;
+  }
+
   list<Context*> to_queue;
   Op *o = osr->dequeue(&to_queue);
   
@@ -1904,6 +1979,260 @@ void FileStore::_finish_op(OpSequencer *osr)
 }
 
 
+#ifdef HAVE_LIBAIO
+int FileStore::_apply_aio_start()
+{
+  apply_aio_ctx = 0;
+  apply_aio_depth = MAX(g_conf->filestore_aio_apply_queue_depth, 1);
+  int r = io_setup(apply_aio_depth, &apply_aio_ctx);
+  if (r < 0) {
+    derr << __func__ << " io_setup got " << cpp_strerror(r) << dendl;
+    return r;
+  }
+  apply_aio_stop = false;
+  apply_aio_thread.create();
+  dout(1) << __func__ << " queue depth " << apply_aio_depth << dendl;
+  return 0;
+}
+
+/**
+ * wait for in-flight aio batches and the passes they requeue
+ *
+ * A completing batch requeues the deferred passes over its sequencer,
+ * and those may submit more batches, so op_tp must not be stopped
+ * until both are idle.
+ */
+void FileStore::_apply_aio_drain()
+{
+  dout(10) << __func__ << dendl;
+  apply_aio_lock.Lock();
+  while (true) {
+    while (apply_aio_num > 0)
+      apply_aio_cond.Wait(apply_aio_lock);
+    apply_aio_lock.Unlock();
+    op_wq.drain();
+    apply_aio_lock.Lock();
+    if (apply_aio_num == 0)
+      break;
+  }
+  apply_aio_lock.Unlock();
+}
+
+void FileStore::_apply_aio_stop()
+{
+  dout(10) << __func__ << dendl;
+  apply_aio_lock.Lock();
+  assert(apply_aio_num == 0);  // see _apply_aio_drain
+  apply_aio_stop = true;
+  apply_aio_cond.SignalAll();
+  apply_aio_lock.Unlock();
+  apply_aio_thread.join();
+  io_destroy(apply_aio_ctx);
+  apply_aio_ctx = 0;
+}
+
+bool FileStore::_apply_aio_eligible(uint64_t offset, size_t len,
+				    const bufferlist& bl)
+{
+  if (m_filestore_sloppy_crc)
+    return false;   // crc tracking wants to see the data in order
+  if (len != bl.length() ||
+      len < g_conf->filestore_aio_apply_min_size)
+    return false;
+  // O_DIRECT wants block aligned io
+  return (offset & ~CEPH_PAGE_MASK) == 0 && (len & ~CEPH_PAGE_MASK) == 0;
+}
+
+int FileStore::_apply_aio_prepare(coll_t cid, const ghobject_t& oid,
+				  uint64_t offset, const bufferlist& bl,
+				  ApplyBatch *batch)
+{
+  Index index;
+  int r = get_index(cid, &index);
+  if (r < 0)
+    return r;
+
+  int fd;
+  {
+    assert(NULL != index.index);
+    RWLock::RLocker l((index.index)->access_lock);
+    IndexedPath path;
+    r = lfn_find(oid, index, &path);
+    if (r < 0)
+      return r;
+    fd = ::open(path->path(), O_WRONLY | O_DIRECT);
+    if (fd < 0) {
+      r = -errno;
+      dout(10) << __func__ << " open O_DIRECT " << path->path() << " got "
+	       << cpp_strerror(r) << dendl;
+      return r;
+    }
+  }
+
+  bufferlist abl(bl);   // shares the data; only copies what is unaligned
+  if (abl.buffers().size() > IOV_MAX)
+    abl.rebuild();
+  if (!abl.is_page_aligned())
+    abl.rebuild_page_aligned();
+
+  batch->aios.push_back(ApplyBatch::aio_t(fd, oid, offset, abl));
+  ApplyBatch::aio_t& aio = batch->aios.back();
+  aio.bl.prepare_iov(&aio.iov);
+  dout(20) << __func__ << " " << cid << "/" << oid << " " << offset << "~"
+	   << aio.len << " in " << aio.iov.size() << " iovs" << dendl;
+  return aio.len;
+}
+
+/**
+ * write out a batch that has not been submitted yet, synchronously
+ */
+int FileStore::_apply_aio_flush(ApplyBatch *batch)
+{
+  dout(10) << __func__ << " " << batch->aios.size() << " writes" << dendl;
+  int r = 0;
+  while (!batch->aios.empty()) {
+    ApplyBatch::aio_t& aio = batch->aios.front();
+    uint64_t off = aio.off;
+    for (std::list<bufferptr>::const_iterator p = aio.bl.buffers().begin();
+	 r >= 0 && p != aio.bl.buffers().end();
+	 ++p) {
+      r = safe_pwrite(aio.fd, p->c_str(), p->length(), off);
+      off += p->length();
+    }
+    if (r < 0)
+      derr << __func__ << " " << aio.oid << " " << aio.off << "~" << aio.len
+	   << " got " << cpp_strerror(r) << dendl;
+    VOID_TEMP_FAILURE_RETRY(::close(aio.fd));
+    batch->aios.pop_front();
+  }
+  return r;
+}
+
+void FileStore::_apply_aio_submit(OpSequencer *osr, Op *o)
+{
+  assert(osr->apply_lock.is_locked());
+  ApplyBatch& b = o->batch;
+  b.osr = osr;
+  b.num_pending = b.aios.size();
+
+  vector<iocb*> piocb;
+  uint64_t bytes = 0;
+  for (list<ApplyBatch::aio_t>::iterator p = b.aios.begin();
+       p != b.aios.end();
+       ++p) {
+    io_prep_pwritev(&p->iocb, p->fd, &p->iov[0], p->iov.size(), p->off);
+    p->iocb.data = o;
+    piocb.push_back(&p->iocb);
+    bytes += p->len;
+  }
+  logger->inc(l_os_aio_apply_ops, piocb.size());
+  logger->inc(l_os_aio_apply_bytes, bytes);
+
+  // never put more iocbs in flight than the context has slots for;
+  // a batch larger than that goes in chunks as slots free up.  once
+  // the last iocb is in, o belongs to the reaper.
+  unsigned done = 0;
+  while (done < piocb.size()) {
+    unsigned n = MIN(piocb.size() - done, apply_aio_depth);
+    {
+      Mutex::Locker l(apply_aio_lock);
+      while (apply_aio_num + n > apply_aio_depth)
+	apply_aio_cond.Wait(apply_aio_lock);
+      apply_aio_num += n;
+      apply_aio_cond.SignalAll();
+    }
+    unsigned end = done + n;
+    while (done < end) {
+      int r = io_submit(apply_aio_ctx, end - done, &piocb[done]);
+      if (r == 0 || r == -EAGAIN) {
+	// the kernel is short of resources; wait for a completion
+	dout(10) << __func__ << " io_submit got EAGAIN, waiting" << dendl;
+	Mutex::Locker l(apply_aio_lock);
+	apply_aio_cond.WaitInterval(g_ceph_context, apply_aio_lock,
+				    utime_t(0, 1000000));
+	continue;
+      }
+      if (r < 0) {
+	derr << __func__ << " io_submit got " << cpp_strerror(r) << dendl;
+	assert(0 == "io_submit got unexpected error");
+      }
+      done += r;
+    }
+  }
+}
+
+void FileStore::apply_aio_thread_entry()
+{
+  dout(10) << __func__ << " start" << dendl;
+  while (true) {
+    {
+      Mutex::Locker l(apply_aio_lock);
+      if (apply_aio_num == 0) {
+	if (apply_aio_stop)
+	  break;
+	apply_aio_cond.Wait(apply_aio_lock);
+	continue;
+      }
+    }
+
+    io_event event[16];
+    int r = io_getevents(apply_aio_ctx, 1, 16, event, NULL);
+    if (r < 0) {
+      if (r == -EINTR) {
+	dout(0) << __func__ << " io_getevents got " << cpp_strerror(r) << dendl;
+	continue;
+      }
+      derr << __func__ << " io_getevents got " << cpp_strerror(r) << dendl;
+      assert(0 == "got unexpected error from io_getevents");
+    }
+
+    for (int i = 0; i < r; ++i) {
+      ApplyBatch::aio_t *aio = (ApplyBatch::aio_t *)event[i].obj;
+      Op *o = (Op *)event[i].data;
+      if ((int64_t)event[i].res != (int64_t)aio->len) {
+	derr << __func__ << " aio to " << aio->oid << " " << aio->off << "~"
+	     << aio->len << " wrote " << (int64_t)event[i].res << dendl;
+	assert(!m_filestore_fail_eio || (int64_t)event[i].res != -EIO);
+	assert(0 == "unexpected aio error");
+      }
+      dout(20) << __func__ << " aio " << aio->oid << " " << aio->off << "~"
+	       << aio->len << " done" << dendl;
+      VOID_TEMP_FAILURE_RETRY(::close(aio->fd));
+      if (--o->batch.num_pending == 0)
+	_apply_aio_finish(o);
+    }
+
+    Mutex::Locker l(apply_aio_lock);
+    apply_aio_num -= r;
+    apply_aio_cond.SignalAll();  // for _apply_aio_submit and _apply_aio_drain
+  }
+  dout(10) << __func__ << " finish" << dendl;
+}
+
+void FileStore::_apply_aio_finish(Op *o)
+{
+  OpSequencer *osr = o->batch.osr;
+  dout(10) << __func__ << " " << o << " seq " << o->op << " " << *osr
+	   << dendl;
+
+  osr->apply_lock.Lock();
+  assert(osr->apply_aio_busy);
+  assert(osr->peek_queue() == o);
+  apply_manager.op_apply_finish(o->op);
+  osr->apply_aio_busy = false;
+  unsigned requeue = osr->apply_deferred;
+  osr->apply_deferred = 0;
+
+  _finish_op(osr);  // unlocks apply_lock and deletes o
+
+  // each deferred pass still has an op behind it on osr, so the
+  // sequencer cannot have gone away.
+  while (requeue--)
+    op_wq.queue(osr);
+}
+#endif
+
+
 struct C_JournaledAhead : public Context {
   FileStore *fs;
   FileStore::OpSequencer *osr;
@@ -2064,7 +2393,8 @@ void FileStore::_journaled_ahead(OpSequencer *osr, Op *o, Context *ondisk)
 int FileStore::_do_transactions(
   list<Transaction*> &tls,
   uint64_t op_seq,
-  ThreadPool::TPHandle *handle)
+  ThreadPool::TPHandle *handle,
+  ApplyBatch *batch)
 {
   int r = 0;
   int trans_num = 0;
@@ -2072,7 +2402,7 @@ int FileStore::_do_transactions(
   for (list<Transaction*>::iterator p = tls.begin();
        p != tls.end();
        ++p, trans_num++) {
-    r = _do_transaction(**p, op_seq, trans_num, handle);
+    r = _do_transaction(**p, op_seq, trans_num, handle, batch);
     if (r < 0)
       break;
     if (handle)
@@ -2345,7 +2675,8 @@ int FileStore::_check_replay_guard(int fd, const SequencerPosition& spos)
 
 unsigned FileStore::_do_transaction(
   Transaction& t, uint64_t op_seq, int trans_num,
-  ThreadPool::TPHandle *handle)
+  ThreadPool::TPHandle *handle,
+  ApplyBatch *batch)
 {
   dout(10) << "_do_transaction on " << &t << dendl;
 
@@ -2365,6 +2696,36 @@ unsigned FileStore::_do_transaction(
 
     _inject_failure();
 
+#ifdef HAVE_LIBAIO
+    if (batch && !batch->empty()) {
+      switch (op->op) {
+      case Transaction::OP_NOP:
+      case Transaction::OP_TOUCH:
+      case Transaction::OP_WRITE:      // flushes overlapping writes itself
+      case Transaction::OP_SETATTR:
+      case Transaction::OP_SETATTRS:
+      case Transaction::OP_RMATTR:
+      case Transaction::OP_RMATTRS:
+      case Transaction::OP_OMAP_CLEAR:
+      case Transaction::OP_OMAP_SETKEYS:
+      case Transaction::OP_OMAP_RMKEYS:
+      case Transaction::OP_OMAP_RMKEYRANGE:
+      case Transaction::OP_OMAP_SETHEADER:
+      case Transaction::OP_SETALLOCHINT:
+	break;
+      default:
+	// anything else may read, move or remove file data, so it must
+	// not race with writes we have yet to submit.
+	r = _apply_aio_flush(batch);
+	if (r < 0) {
+	  derr << " error " << cpp_strerror(r) << " flushing aio apply batch"
+	       << dendl;
+	  assert(0 == "unexpected error");
+	}
+      }
+    }
+#endif
+
     switch (op->op) {
     case Transaction::OP_NOP:
       break;
@@ -2392,7 +2753,7 @@ unsigned FileStore::_do_transaction(
         i.decode_bl(bl);
         tracepoint(objectstore, write_enter, osr_name, off, len);
         if (_check_replay_guard(cid, oid, spos) > 0)
-          r = _write(cid, oid, off, len, bl, fadvise_flags);
+          r = _write(cid, oid, off, len, bl, fadvise_flags, batch);
         tracepoint(objectstore, write_exit, r);
       }
       break;
@@ -3154,7 +3515,8 @@ int FileStore::_touch(coll_t cid, const ghobject_t& oid)
 
 int FileStore::_write(coll_t cid, const ghobject_t& oid,
                      uint64_t offset, size_t len,
-                     const bufferlist& bl, uint32_t fadvise_flags)
+                     const bufferlist& bl, uint32_t fadvise_flags,
+		     ApplyBatch *batch)
 {
   dout(15) << "write " << cid << "/" << oid << " " << offset << "~" << len << dendl;
   int r;
@@ -3169,6 +3531,36 @@ int FileStore::_write(coll_t cid, const ghobject_t& oid,
 	    << cpp_strerror(r) << dendl;
     goto out;
   }
+
+#ifdef HAVE_LIBAIO
+  if (batch) {
+    if (_apply_aio_eligible(offset, len, bl)) {
+      // aios in one io_submit may complete in any order
+      if (batch->overlaps(oid, offset, len)) {
+	r = _apply_aio_flush(batch);
+	if (r < 0) {
+	  lfn_close(fd);
+	  goto out;
+	}
+      }
+      r = _apply_aio_prepare(cid, oid, offset, bl, batch);
+      if (r >= 0) {
+	// no dirty pages for the wbthrottle to flush; the commit syncfs
+	// covers the metadata.
+	lfn_close(fd);
+	goto out;
+      }
+      // e.g. the fs does not do O_DIRECT; fall back to a buffered write
+    }
+    if (batch->has_object(oid)) {
+      r = _apply_aio_flush(batch);
+      if (r < 0) {
+	lfn_close(fd);
+	goto out;
+      }
+    }
+  }
+#endif
     
   // seek
   actual = ::lseek64(**fd, offset, SEEK_SET);
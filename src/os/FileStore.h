@@ -42,6 +42,10 @@ using namespace std;
 #include "FDCache.h"
 #include "WBThrottle.h"
 
+#ifdef HAVE_LIBAIO
+# include <libaio.h>
+#endif
+
 #include "include/uuid.h"
 
 
@@ -184,6 +188,72 @@ private:
   } sync_thread;
 
   // -- op workqueue --
+  class OpSequencer;
+
+  /**
+   * data writes an Op defers to aio (filestore_aio_apply)
+   *
+   * Page-aligned writes are prepared against an O_DIRECT fd while the
+   * Op's transactions are applied, and are submitted together once
+   * the last transaction is done.  The Op completes when the last of
+   * them is reaped.  Ops that need the data on disk first (clone,
+   * truncate, an overlapping buffered write, ...) flush the batch
+   * synchronously before proceeding.
+   */
+  struct ApplyBatch {
+#ifdef HAVE_LIBAIO
+    struct aio_t {
+      struct iocb iocb;
+      int fd;
+      ghobject_t oid;
+      uint64_t off, len;
+      bufferlist bl;
+      vector<iovec> iov;
+
+      aio_t(int f, const ghobject_t& o, uint64_t of, bufferlist& b)
+	: fd(f), oid(o), off(of), len(b.length()) {
+	bl.claim(b);
+	memset((void*)&iocb, 0, sizeof(iocb));
+      }
+    };
+    list<aio_t> aios;
+    unsigned num_pending;    ///< submitted aios not yet reaped
+#endif
+    OpSequencer *osr;
+
+    ApplyBatch()
+      :
+#ifdef HAVE_LIBAIO
+        num_pending(0),
+#endif
+        osr(NULL) {}
+
+    bool empty() const {
+#ifdef HAVE_LIBAIO
+      return aios.empty();
+#else
+      return true;
+#endif
+    }
+    bool has_object(const ghobject_t& oid) const {
+#ifdef HAVE_LIBAIO
+      for (list<aio_t>::const_iterator p = aios.begin(); p != aios.end(); ++p)
+	if (p->oid == oid)
+	  return true;
+#endif
+      return false;
+    }
+    /// true if a queued write to oid overlaps off~len
+    bool overlaps(const ghobject_t& oid, uint64_t off, uint64_t len) const {
+#ifdef HAVE_LIBAIO
+      for (list<aio_t>::const_iterator p = aios.begin(); p != aios.end(); ++p)
+	if (p->oid == oid && p->off < off + len && off < p->off + p->len)
+	  return true;
+#endif
+      return false;
+    }
+  };
+
   struct Op {
     utime_t start;
     uint64_t op;
@@ -191,6 +261,7 @@ private:
     Context *onreadable, *onreadable_sync;
     uint64_t ops, bytes;
     TrackedOpRef osd_op;
+    ApplyBatch batch;
   };
   class OpSequencer : public Sequencer_impl {
     Mutex qlock; // to protect q, for benefit of flush (peek/dequeue also protected by lock)
@@ -201,6 +272,11 @@ private:
   public:
     Sequencer *parent;
     Mutex apply_lock;  // for apply mutual exclusion
+
+    // protected by apply_lock
+    bool apply_aio_busy;      ///< front op is waiting for its aio batch
+    unsigned apply_deferred;  ///< op_wq passes skipped while busy
+    bool apply_skip_finish;   ///< _finish_op must not dequeue this pass
     
     /// get_max_uncompleted
     bool _get_max_uncompleted(
@@ -318,7 +394,10 @@ private:
     OpSequencer()
       : qlock("FileStore::OpSequencer::qlock", false, false),
 	parent(0),
-	apply_lock("FileStore::OpSequencer::apply_lock", false, false) {}
+	apply_lock("FileStore::OpSequencer::apply_lock", false, false),
+	apply_aio_busy(false),
+	apply_deferred(0),
+	apply_skip_finish(false) {}
     ~OpSequencer() {
       assert(q.empty());
     }
@@ -383,6 +462,38 @@ private:
   void _journaled_ahead(OpSequencer *osr, Op *o, Context *ondisk);
   friend struct C_JournaledAhead;
 
+  // -- aio apply --
+  bool m_filestore_aio_apply;
+#ifdef HAVE_LIBAIO
+  Mutex apply_aio_lock;
+  Cond apply_aio_cond;
+  io_context_t apply_aio_ctx;
+  unsigned apply_aio_num;    ///< aios in flight; protected by apply_aio_lock
+  unsigned apply_aio_depth;  ///< slots in apply_aio_ctx
+  bool apply_aio_stop;
+
+  void apply_aio_thread_entry();
+  struct ApplyAioThread : public Thread {
+    FileStore *fs;
+    ApplyAioThread(FileStore *f) : fs(f) {}
+    void *entry() {
+      fs->apply_aio_thread_entry();
+      return 0;
+    }
+  } apply_aio_thread;
+
+  int _apply_aio_start();
+  void _apply_aio_drain();
+  void _apply_aio_stop();
+  bool _apply_aio_eligible(uint64_t offset, size_t len, const bufferlist& bl);
+  int _apply_aio_prepare(coll_t cid, const ghobject_t& oid,
+			 uint64_t offset, const bufferlist& bl,
+			 ApplyBatch *batch);
+  int _apply_aio_flush(ApplyBatch *batch);
+  void _apply_aio_submit(OpSequencer *osr, Op *o);
+  void _apply_aio_finish(Op *o);
+#endif
+
   void new_journal();
 
   PerfCounters *logger;
@@ -470,13 +581,15 @@ public:
 
   int _do_transactions(
     list<Transaction*> &tls, uint64_t op_seq,
-    ThreadPool::TPHandle *handle);
+    ThreadPool::TPHandle *handle,
+    ApplyBatch *batch = NULL);
   int do_transactions(list<Transaction*> &tls, uint64_t op_seq) {
     return _do_transactions(tls, op_seq, 0);
   }
   unsigned _do_transaction(
     Transaction& t, uint64_t op_seq, int trans_num,
-    ThreadPool::TPHandle *handle);
+    ThreadPool::TPHandle *handle,
+    ApplyBatch *batch = NULL);
 
   int queue_transactions(Sequencer *osr, list<Transaction*>& tls,
 			 TrackedOpRef op = TrackedOpRef(),
@@ -553,7 +666,8 @@ public:
 
   int _touch(coll_t cid, const ghobject_t& oid);
   int _write(coll_t cid, const ghobject_t& oid, uint64_t offset, size_t len,
-	      const bufferlist& bl, uint32_t fadvise_flags = 0);
+	      const bufferlist& bl, uint32_t fadvise_flags = 0,
+	      ApplyBatch *batch = NULL);
   int _zero(coll_t cid, const ghobject_t& oid, uint64_t offset, size_t len);
   int _truncate(coll_t cid, const ghobject_t& oid, uint64_t size);
   int _clone(coll_t cid, const ghobject_t& oldoid, const ghobject_t& newoid,
@@ -60,6 +60,18 @@ public:
       const string &prefix ///< [in] Prefix by which to remove keys
       ) = 0;
 
+    /**
+     * Removes keys in [start, end) under prefix
+     *
+     * Like rmkeys_by_prefix, only keys already committed to the store are
+     * removed; keys set earlier in this transaction are left in place.
+     */
+    virtual void rm_range_keys(
+      const string &prefix, ///< [in] Prefix by which to remove keys
+      const string &start,  ///< [in] First key to remove
+      const string &end     ///< [in] Stop before this key
+      ) = 0;
+
     virtual ~TransactionImpl() {}
   };
   typedef ceph::shared_ptr< TransactionImpl > Transaction;
@@ -71,6 +83,18 @@ public:
   /// test whether we can successfully initialize; may have side effects (e.g., create)
   static int test_init(const string& type, const string& dir);
   virtual int init(string option_str="") = 0;
+  /**
+   * give some prefixes a key space of their own
+   *
+   * Keys under each listed prefix are kept apart from the rest (a
+   * column family in rocksdb) so they can be tuned separately.  Must
+   * be called before open; backends without the notion ignore it.
+   *
+   * @param spec whitespace separated "prefix[:opt=val;opt=val...]"
+   */
+  virtual int set_column_families(const string &spec) {
+    return 0;
+  }
   virtual int open(ostream &out) = 0;
   virtual int create_and_open(ostream &out) = 0;
 
@@ -102,6 +126,27 @@ public:
     return r;
   }
 
+  /**
+   * Retrieve keys under several prefixes in one call
+   *
+   * Backends read all of them against a single view of the store and
+   * may sort and batch the lookups; missing keys are simply absent
+   * from the output.
+   */
+  virtual int get_batch(
+    const std::map<string, std::set<string> > &keys, ///< [in] prefix -> keys
+    std::map<string, std::map<string, bufferlist> > *out ///< [out] prefix -> found
+    ) {
+    for (std::map<string, std::set<string> >::const_iterator p = keys.begin();
+	 p != keys.end();
+	 ++p) {
+      int r = get(p->first, p->second, &(*out)[p->first]);
+      if (r < 0)
+	return r;
+    }
+    return 0;
+  }
+
   class WholeSpaceIteratorImpl {
   public:
     virtual int seek_to_first() = 0;
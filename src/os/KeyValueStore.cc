@@ -699,6 +699,13 @@ int KeyValueStore::mkfs()
       goto close_fsid_fd;
     }
 
+    if (superblock.backend == "rocksdb" &&
+	store->set_column_families(g_conf->keyvaluestore_rocksdb_cf_options) < 0) {
+      derr << __func__ << " bad keyvaluestore_rocksdb_cf_options" << dendl;
+      ret = -EINVAL;
+      delete store;
+      goto close_fsid_fd;
+    }
     ostringstream err;
     if (store->create_and_open(err)) {
       derr << __func__  << " failed to create/open backend type "
@@ -188,6 +188,19 @@ void LevelDBStore::LevelDBTransactionImpl::rmkeys_by_prefix(const string &prefix
   }
 }
 
+void LevelDBStore::LevelDBTransactionImpl::rm_range_keys(const string &prefix,
+							  const string &start,
+							  const string &end)
+{
+  // no range tombstones in leveldb
+  KeyValueDB::Iterator it = db->get_iterator(prefix);
+  for (it->lower_bound(start);
+       it->valid() && it->key() < end;
+       it->next()) {
+    bat.Delete(combine_strings(prefix, it->key()));
+  }
+}
+
 int LevelDBStore::get(
     const string &prefix,
     const std::set<string> &keys,
@@ -210,6 +223,36 @@ int LevelDBStore::get(
   return 0;
 }
 
+int LevelDBStore::get_batch(
+    const std::map<string, std::set<string> > &keys,
+    std::map<string, std::map<string, bufferlist> > *out)
+{
+  utime_t start = ceph_clock_now(g_ceph_context);
+  // leveldb has no MultiGet; one snapshot iterator moving forward
+  // through the sorted keys reuses the blocks it already has loaded
+  KeyValueDB::WholeSpaceIterator it = get_snapshot_iterator();
+  for (std::map<string, std::set<string> >::const_iterator p = keys.begin();
+       p != keys.end();
+       ++p) {
+    std::map<string, bufferlist> &o = (*out)[p->first];
+    for (std::set<string>::const_iterator i = p->second.begin();
+	 i != p->second.end();
+	 ++i) {
+      it->lower_bound(p->first, *i);
+      if (!it->valid())
+	break;
+      pair<string,string> raw = it->raw_key();
+      if (raw.first == p->first && raw.second == *i)
+	o.insert(make_pair(*i, it->value()));
+    }
+  }
+  int r = it->status();
+  utime_t lat = ceph_clock_now(g_ceph_context) - start;
+  logger->inc(l_leveldb_gets);
+  logger->tinc(l_leveldb_get_latency, lat);
+  return r;
+}
+
 string LevelDBStore::combine_strings(const string &prefix, const string &value)
 {
   string out = prefix;
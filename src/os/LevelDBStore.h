@@ -189,6 +189,11 @@ public:
     void rmkeys_by_prefix(
       const string &prefix
       );
+    void rm_range_keys(
+      const string &prefix,
+      const string &start,
+      const string &end
+      );
   };
 
   KeyValueDB::Transaction get_transaction() {
@@ -203,6 +208,10 @@ public:
     const std::set<string> &key,
     std::map<string, bufferlist> *out
     );
+  int get_batch(
+    const std::map<string, std::set<string> > &keys,
+    std::map<string, std::map<string, bufferlist> > *out
+    );
 
   class LevelDBWholeSpaceIteratorImpl :
     public KeyValueDB::WholeSpaceIteratorImpl {
@@ -21,8 +21,11 @@
 #include <sys/param.h>
 #endif
 
+#include <thread>
+
 #include "include/types.h"
 #include "include/stringify.h"
+#include "include/unordered_set.h"
 #include "include/unordered_map.h"
 #include "include/memory.h"
 #include "common/errno.h"
@@ -47,59 +50,224 @@ int MemStore::peek_journal_fsid(uuid_d *fsid)
   return 0;
 }
 
+// run f(0..n-1) on up to 'threads' threads
+template <typename F>
+static void parallel_for(size_t n, int threads, F f)
+{
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    for (size_t i = next++; i < n; i = next++)
+      f(i);
+  };
+  vector<std::thread> workers;
+  for (int i = 1; i < threads && (size_t)i < n; ++i)
+    workers.push_back(std::thread(worker));
+  worker();
+  for (auto& t : workers)
+    t.join();
+}
+
+// write a file under a temporary name, sync it and rename it into
+// place, so that an interrupted checkpoint leaves the previous copy
+// intact.  the rename is only durable once the directory is synced.
+static int write_file_atomic(const string& fn, bufferlist& bl)
+{
+  string tmp = fn + ".tmp";
+  int fd = TEMP_FAILURE_RETRY(::open(tmp.c_str(),
+				     O_WRONLY|O_CREAT|O_TRUNC, 0644));
+  if (fd < 0)
+    return -errno;
+  int r = bl.write_fd(fd);
+  if (r == 0 && ::fsync(fd) < 0)
+    r = -errno;
+  VOID_TEMP_FAILURE_RETRY(::close(fd));
+  if (r < 0)
+    return r;
+  if (::rename(tmp.c_str(), fn.c_str()) < 0)
+    return -errno;
+  return 0;
+}
+
+static int fsync_dir(const string& dir)
+{
+  int fd = TEMP_FAILURE_RETRY(::open(dir.c_str(), O_RDONLY));
+  if (fd < 0)
+    return -errno;
+  int r = 0;
+  if (::fsync(fd) < 0)
+    r = -errno;
+  VOID_TEMP_FAILURE_RETRY(::close(fd));
+  return r;
+}
+
 int MemStore::mount()
 {
   int r = _load();
   if (r < 0)
     return r;
   finisher.start();
+  if (cct->_conf->memstore_checkpoint_interval > 0) {
+    checkpoint_stop = false;
+    checkpoint_thread.create();
+  }
   return 0;
 }
 
 int MemStore::umount()
 {
+  if (checkpoint_thread.is_started()) {
+    checkpoint_stop_lock.Lock();
+    checkpoint_stop = true;
+    checkpoint_cond.Signal();
+    checkpoint_stop_lock.Unlock();
+    checkpoint_thread.join();
+  }
   finisher.stop();
+  dump_all();
   return _save();
 }
 
+void MemStore::checkpoint_entry()
+{
+  Mutex::Locker l(checkpoint_stop_lock);
+  while (!checkpoint_stop) {
+    checkpoint_cond.WaitInterval(
+      cct, checkpoint_stop_lock,
+      utime_t(cct->_conf->memstore_checkpoint_interval, 0));
+    if (checkpoint_stop)
+      break;
+    checkpoint_stop_lock.Unlock();
+    int r = _save();
+    if (r < 0)
+      derr << __func__ << " checkpoint failed: " << cpp_strerror(r) << dendl;
+    checkpoint_stop_lock.Lock();
+  }
+}
+
+/*
+ * Checkpoint the store.  Only collections modified since the last
+ * checkpoint are rewritten; the manifest is rewritten only if the set
+ * of collections changed.  Transactions are blocked only while the
+ * dirty collections are encoded, not while the files are written.
+ */
 int MemStore::_save()
 {
   dout(10) << __func__ << dendl;
-  Mutex::Locker l(apply_lock); // block any writer
-  dump_all();
+  Mutex::Locker sl(save_lock);  // one checkpoint at a time
+  utime_t start = ceph_clock_now(cct);
+
   set<coll_t> collections;
-  for (ceph::unordered_map<coll_t,CollectionRef>::iterator p = coll_map.begin();
-       p != coll_map.end();
-       ++p) {
-    dout(20) << __func__ << " coll " << p->first << " " << p->second << dendl;
-    collections.insert(p->first);
+  vector<pair<coll_t,CollectionRef> > dirty;
+  vector<bufferlist> encoded;
+  bool full;
+  {
+    RWLock::WLocker cl(checkpoint_lock); // block any transaction
+    Mutex::Locker l(apply_lock); // block any writer
+
+    full = objects_shared;
+    for (ceph::unordered_map<coll_t,CollectionRef>::iterator p =
+	   coll_map.begin();
+	 p != coll_map.end();
+	 ++p) {
+      assert(p->second);
+      collections.insert(p->first);
+      if (p->second->dirty.exchange(false) || full)
+	dirty.push_back(*p);
+    }
+
+    // the encoded collections are our snapshot: they copy page data
+    // and only share buffers that are never modified in place
+    encoded.resize(dirty.size());
+    parallel_for(dirty.size(), cct->_conf->memstore_checkpoint_threads,
+		 [&](size_t i) {
+      dirty[i].second->encode(encoded[i]);
+    });
+
+    if (full && !_objects_shared())
+      objects_shared = false;
+  }
+  utime_t encoded_at = ceph_clock_now(cct);
+
+  std::atomic<int> err(0);
+  parallel_for(dirty.size(), cct->_conf->memstore_checkpoint_threads,
+	       [&](size_t i) {
+    dout(20) << __func__ << " coll " << dirty[i].first << dendl;
+    int r = write_file_atomic(path + "/" + stringify(dirty[i].first),
+			      encoded[i]);
+    if (r < 0) {
+      dirty[i].second->dirty = true; // retry next time
+      err = r;
+    }
+  });
+  if (err < 0)
+    return err;
+
+  if (sharded) {
+   string fn = path + "/sharded";
     bufferlist bl;
-    assert(p->second);
-    p->second->encode(bl);
-    string fn = path + "/" + stringify(p->first);
     int r = bl.write_file(fn.c_str());
     if (r < 0)
       return r;
   }
+  // the manifest must not name a collection whose file is not there
+  if (!dirty.empty() || sharded) {
+    int r = fsync_dir(path);
+    if (r < 0) {
+      for (size_t i = 0; i < dirty.size(); ++i)
+	dirty[i].second->dirty = true;
+      return r;
+    }
+  }
 
-  string fn = path + "/collections";
-  bufferlist bl;
-  ::encode(collections, bl);
-  int r = bl.write_file(fn.c_str());
-  if (r < 0)
-    return r;
-
-  if (sharded) {
-   string fn = path + "/sharded";
+  if (collections != saved_collections) {
+    string fn = path + "/collections";
     bufferlist bl;
-    int r = bl.write_file(fn.c_str());
+    ::encode(collections, bl);
+    int r = write_file_atomic(fn, bl);
+    if (r < 0)
+      return r;
+    for (set<coll_t>::iterator p = saved_collections.begin();
+	 p != saved_collections.end();
+	 ++p) {
+      if (collections.count(*p))
+	continue;
+      string fn = path + "/" + stringify(*p);
+      dout(20) << __func__ << " removing " << fn << dendl;
+      ::unlink(fn.c_str());
+    }
+    r = fsync_dir(path);
     if (r < 0)
       return r;
+    saved_collections.swap(collections);
   }
 
+  dout(10) << __func__ << " wrote " << dirty.size() << "/"
+	   << collections.size() << " collections"
+	   << (full ? " (full)" : "") << " in "
+	   << (ceph_clock_now(cct) - start) << ", blocking for "
+	   << (encoded_at - start) << dendl;
   return 0;
 }
 
+/// true if some object is still linked into more than one collection
+bool MemStore::_objects_shared()
+{
+  ceph::unordered_set<Object*> seen;
+  for (ceph::unordered_map<coll_t,CollectionRef>::iterator p =
+	 coll_map.begin();
+       p != coll_map.end();
+       ++p) {
+    for (ceph::unordered_map<ghobject_t,ObjectRef>::iterator q =
+	   p->second->object_hash.begin();
+	 q != p->second->object_hash.end();
+	 ++q) {
+      if (!seen.insert(q->second.get()).second)
+	return true;
+    }
+  }
+  return false;
+}
+
 void MemStore::dump_all()
 {
   Formatter *f = Formatter::create("json-pretty");
@@ -163,20 +331,35 @@ int MemStore::_load()
   bufferlist::iterator p = bl.begin();
   ::decode(collections, p);
 
-  for (set<coll_t>::iterator q = collections.begin();
-       q != collections.end();
-       ++q) {
-    string fn = path + "/" + stringify(*q);
+  // read and decode collections in parallel
+  vector<coll_t> cids(collections.begin(), collections.end());
+  vector<CollectionRef> colls(cids.size());
+  std::atomic<int> error(0);
+  parallel_for(cids.size(), cct->_conf->memstore_checkpoint_threads,
+	       [&](size_t i) {
+    string fn = path + "/" + stringify(cids[i]);
+    string err;
     bufferlist cbl;
     int r = cbl.read_file(fn.c_str(), &err);
-    if (r < 0)
-      return r;
+    if (r < 0) {
+      derr << __func__ << " " << fn << ": " << err << dendl;
+      error = r;
+      return;
+    }
     CollectionRef c(new Collection(cct));
     bufferlist::iterator p = cbl.begin();
     c->decode(p);
-    coll_map[*q] = c;
-    used_bytes += c->used_bytes();
+    c->dirty = false;
+    colls[i] = c;
+  });
+  if (error < 0)
+    return error;
+
+  for (size_t i = 0; i < cids.size(); ++i) {
+    coll_map[cids[i]] = colls[i];
+    used_bytes += colls[i]->used_bytes();
   }
+  saved_collections.swap(collections);
 
   fn = path + "/sharded";
   struct stat st;
@@ -262,6 +445,13 @@ MemStore::CollectionRef MemStore::get_collection(coll_t cid)
   return cp->second;
 }
 
+void MemStore::_mark_dirty(coll_t cid)
+{
+  CollectionRef c = get_collection(cid);
+  if (c)
+    c->dirty = true;
+}
+
 
 // ---------------
 // read operations
@@ -599,6 +789,8 @@ int MemStore::queue_transactions(Sequencer *osr,
     lock = std::unique_lock<std::mutex>((*seq)->mutex);
   }
 
+  RWLock::RLocker cl(checkpoint_lock);
+
   for (list<Transaction*>::iterator p = tls.begin(); p != tls.end(); ++p) {
     // poke the TPHandle heartbeat just to exercise that code path
     if (handle)
@@ -908,6 +1100,15 @@ void MemStore::_do_transaction(Transaction& t)
       assert(0);
     }
 
+    if (op->op != Transaction::OP_NOP) {
+      // note what the next checkpoint needs to write
+      _mark_dirty(i.get_cid(op->cid));
+      if (op->op == Transaction::OP_COLL_ADD ||
+	  op->op == Transaction::OP_COLL_MOVE_RENAME ||
+	  op->op == Transaction::OP_SPLIT_COLLECTION2)
+	_mark_dirty(i.get_cid(op->dest_cid));
+    }
+
     if (r < 0) {
       bool ok = false;
 
@@ -1273,6 +1474,7 @@ int MemStore::_collection_add(coll_t cid, coll_t ocid, const ghobject_t& oid)
   ObjectRef o = oc->object_hash[oid];
   c->object_map[oid] = o;
   c->object_hash[oid] = o;
+  objects_shared = true;
   return 0;
 }
 
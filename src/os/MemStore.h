@@ -16,15 +16,18 @@
 #ifndef CEPH_MEMSTORE_H
 #define CEPH_MEMSTORE_H
 
+#include <atomic>
 #include <mutex>
 #include <boost/intrusive_ptr.hpp>
 
 #include "include/unordered_map.h"
 #include "include/memory.h"
 #include "include/Spinlock.h"
+#include "common/Cond.h"
 #include "common/Finisher.h"
 #include "common/RefCountedObj.h"
 #include "common/RWLock.h"
+#include "common/Thread.h"
 #include "ObjectStore.h"
 #include "PageSet.h"
 #include "include/assert.h"
@@ -163,6 +166,7 @@ public:
     map<ghobject_t, ObjectRef,ghobject_t::BitwiseComparator> object_map;        ///< for iteration
     map<string,bufferptr> xattr;
     RWLock lock;   ///< for object_{map,hash}
+    std::atomic<bool> dirty;  ///< modified since the last checkpoint
 
     typedef boost::intrusive_ptr<Collection> Ref;
     friend void intrusive_ptr_add_ref(Collection *c) { c->get(); }
@@ -239,7 +243,7 @@ public:
 
     Collection(CephContext *cct)
       : cct(cct), use_page_set(cct->_conf->memstore_page_set),
-        lock("MemStore::Collection::lock") {}
+        lock("MemStore::Collection::lock"), dirty(true) {}
   };
   typedef Collection::Ref CollectionRef;
 
@@ -294,7 +298,30 @@ private:
   RWLock coll_lock;    ///< rwlock to protect coll_map
   Mutex apply_lock;    ///< serialize all updates
 
+  /// transactions hold this for read; a checkpoint holds it for write
+  RWLock checkpoint_lock;
+  set<coll_t> saved_collections;  ///< as of the last manifest we wrote
+  /// set once an object is linked into a second collection; a write via
+  /// one collection then dirties both, so checkpoints must be full until
+  /// one finds no object linked twice
+  std::atomic<bool> objects_shared;
+  Mutex save_lock;  ///< serializes checkpoints
+
+  Mutex checkpoint_stop_lock;
+  Cond checkpoint_cond;
+  bool checkpoint_stop;
+  struct CheckpointThread : public Thread {
+    MemStore *store;
+    CheckpointThread(MemStore *s) : store(s) {}
+    void *entry() {
+      store->checkpoint_entry();
+      return 0;
+    }
+  } checkpoint_thread;
+  void checkpoint_entry();
+
   CollectionRef get_collection(coll_t cid);
+  void _mark_dirty(coll_t cid);
 
   Finisher finisher;
 
@@ -333,6 +360,7 @@ private:
   int _split_collection(coll_t cid, uint32_t bits, uint32_t rem, coll_t dest);
 
   int _save();
+  bool _objects_shared();
   int _load();
 
   void dump(Formatter *f);
@@ -344,6 +372,12 @@ public:
       cct(cct),
       coll_lock("MemStore::coll_lock"),
       apply_lock("MemStore::apply_lock"),
+      checkpoint_lock("MemStore::checkpoint_lock"),
+      objects_shared(false),
+      save_lock("MemStore::save_lock"),
+      checkpoint_stop_lock("MemStore::checkpoint_stop_lock"),
+      checkpoint_stop(false),
+      checkpoint_thread(this),
       finisher(cct),
       used_bytes(0),
       sharded(false) {}
@@ -47,6 +47,13 @@ namespace ceph {
 
 enum {
   l_os_first = 84000,
+  l_os_aio_apply_ops,
+  l_os_aio_apply_bytes,
+  l_os_j_wr_ops,
+  l_os_j_aio_depth,
+  l_os_j_batch_target,
+  l_os_j_copy_bytes,
+  l_os_j_nocopy_bytes,
   l_os_jq_max_ops,
   l_os_jq_ops,
   l_os_j_ops,
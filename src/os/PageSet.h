@@ -19,17 +19,15 @@
 #include <atomic>
 #include <cassert>
 #include <mutex>
+#include <thread>
 #include <vector>
-#include <boost/intrusive/avl_set.hpp>
 #include <boost/intrusive_ptr.hpp>
 
 #include "include/encoding.h"
-#include "include/Spinlock.h"
 
 
 struct Page {
   char *const data;
-  boost::intrusive::avl_set_member_hook<> hook;
   uint64_t offset;
 
   // avoid RefCountedObject because it has a virtual destructor
@@ -41,18 +39,6 @@ struct Page {
   friend void intrusive_ptr_add_ref(Page *p) { p->get(); }
   friend void intrusive_ptr_release(Page *p) { p->put(); }
 
-  // key-value comparison functor for avl
-  struct Less {
-    bool operator()(uint64_t offset, const Page &page) const {
-      return offset < page.offset;
-    }
-    bool operator()(const Page &page, uint64_t offset) const {
-      return page.offset < offset;
-    }
-    bool operator()(const Page &lhs, const Page &rhs) const {
-      return lhs.offset < rhs.offset;
-    }
-  };
   void encode(bufferlist &bl, size_t page_size) const {
     bl.append(buffer::copy(data, page_size));
     ::encode(offset, bl);
@@ -81,34 +67,131 @@ struct Page {
   }
 };
 
+/*
+ * PageSet is a radix tree of pages indexed by offset / page_size.
+ *
+ * Readers (get_range) take no lock: they walk the tree with acquire
+ * loads and take a ref on each page they find, so reads of a hot
+ * object do not serialize against each other.  Writers (alloc_range,
+ * free_pages_after) are serialized by a mutex.  New pages and nodes
+ * are filled in before they are published with a release store.
+ *
+ * Interior nodes live as long as the PageSet.  Removed pages may still
+ * be in the hands of a reader that has not taken its ref yet, so the
+ * writer drops the tree's ref only after waiting for every reader that
+ * started before the removal (a two-epoch grace period, as in RCU).
+ */
 class PageSet {
  public:
   // alloc_range() and get_range() return page refs in a vector
   typedef std::vector<Page::Ref> page_vector;
 
  private:
-  // store pages in a boost intrusive avl_set
-  typedef Page::Less page_cmp;
-  typedef boost::intrusive::member_hook<Page,
-          boost::intrusive::avl_set_member_hook<>,
-          &Page::hook> member_option;
-  typedef boost::intrusive::avl_set<Page,
-          boost::intrusive::compare<page_cmp>, member_option> page_set;
+  static const unsigned node_bits = 6;
+  static const unsigned node_slots = 1 << node_bits;
 
-  typedef typename page_set::iterator iterator;
+  struct Node {
+    const unsigned shift; // index bits resolved below this node
+    // child Node* for interior nodes, Page* when shift == 0
+    std::atomic<void*> slots[node_slots];
 
-  page_set pages;
+    explicit Node(unsigned shift) : shift(shift) {
+      for (auto &slot : slots)
+        slot.store(nullptr, std::memory_order_relaxed);
+    }
+  };
+
+  std::atomic<Node*> root;
+  std::atomic<size_t> npages;
   uint64_t page_size;
+  unsigned page_shift;
+
+  typedef std::mutex lock_type;
+  lock_type mutex; // serializes writers
+
+  // readers register in the counter for the current epoch
+  mutable std::atomic<unsigned> epoch;
+  mutable std::atomic<int> readers[2];
+
+  unsigned read_begin() const {
+    while (true) {
+      unsigned e = epoch.load();
+      ++readers[e & 1];
+      if (epoch.load() == e)
+        return e;
+      --readers[e & 1]; // raced with synchronize(), retry in the new epoch
+    }
+  }
+  void read_end(unsigned e) const {
+    --readers[e & 1];
+  }
+  // wait for readers that may have seen pages we just unlinked
+  void synchronize() {
+    unsigned e = epoch.fetch_add(1);
+    while (readers[e & 1].load() != 0)
+      std::this_thread::yield();
+  }
 
-  typedef Spinlock lock_type;
-  lock_type mutex;
+  static bool covers(const Node *node, uint64_t index) {
+    const unsigned bits = node->shift + node_bits;
+    return bits >= 64 || (index >> bits) == 0;
+  }
 
-  void free_pages(iterator cur, iterator end) {
-    while (cur != end) {
-      Page *page = &*cur;
-      cur = pages.erase(cur);
-      page->put();
+  // find or create the slot for a page index; writer only
+  std::atomic<void*>& leaf_slot(uint64_t index) {
+    Node *node = root.load(std::memory_order_relaxed);
+    while (!covers(node, index)) {
+      // grow the tree upward; the old root becomes our first child
+      Node *parent = new Node(node->shift + node_bits);
+      parent->slots[0].store(node, std::memory_order_relaxed);
+      root.store(parent, std::memory_order_release);
+      node = parent;
+    }
+    while (node->shift) {
+      auto &slot = node->slots[(index >> node->shift) & (node_slots - 1)];
+      Node *child = static_cast<Node*>(slot.load(std::memory_order_relaxed));
+      if (!child) {
+        child = new Node(node->shift - node_bits);
+        slot.store(child, std::memory_order_release);
+      }
+      node = child;
     }
+    return node->slots[index & (node_slots - 1)];
+  }
+
+  // visit the populated leaf slots with index in [first,last], in order
+  template <typename F>
+  static void walk(Node *node, uint64_t base, uint64_t first, uint64_t last,
+                   F &&f) {
+    const uint64_t lo = first > base ? (first - base) >> node->shift : 0;
+    if (last < base || lo >= node_slots)
+      return;
+    const uint64_t hi = std::min<uint64_t>(node_slots - 1,
+                                           (last - base) >> node->shift);
+    for (uint64_t i = lo; i <= hi; i++) {
+      auto &slot = node->slots[i];
+      void *p = slot.load(std::memory_order_acquire);
+      if (!p)
+        continue;
+      const uint64_t index = base + (i << node->shift);
+      if (node->shift == 0)
+        f(slot, static_cast<Page*>(p));
+      else
+        walk(static_cast<Node*>(p), index, first, last, f);
+    }
+  }
+
+  static void free_node(Node *node) {
+    for (auto &slot : node->slots) {
+      void *p = slot.load(std::memory_order_relaxed);
+      if (!p)
+        continue;
+      if (node->shift == 0)
+        static_cast<Page*>(p)->put();
+      else
+        free_node(static_cast<Node*>(p));
+    }
+    delete node;
   }
 
   int count_pages(uint64_t offset, uint64_t len) const {
@@ -125,41 +208,56 @@ class PageSet {
     return count;
   }
 
+  // index of the last page touched by [offset,length), length > 0
+  uint64_t last_index(uint64_t offset, uint64_t length) const {
+    uint64_t end = offset + length;
+    if (end < offset)
+      end = 0; // wrapped; clamp to the end of the address space
+    return (end - 1) >> page_shift;
+  }
+
  public:
-  PageSet(size_t page_size) : page_size(page_size) {}
+  PageSet(size_t page_size)
+    : root(new Node(0)), npages(0), page_size(page_size), page_shift(0),
+      epoch(0) {
+    assert(page_size && (page_size & (page_size - 1)) == 0);
+    while ((1ull << page_shift) < page_size)
+      page_shift++;
+    readers[0] = readers[1] = 0;
+  }
   PageSet(PageSet &&rhs)
-    : pages(std::move(rhs.pages)), page_size(rhs.page_size) {}
+    : root(rhs.root.exchange(new Node(0))), npages(rhs.npages.exchange(0)),
+      page_size(rhs.page_size), page_shift(rhs.page_shift), epoch(0) {
+    readers[0] = readers[1] = 0;
+  }
   ~PageSet() {
-    free_pages(pages.begin(), pages.end());
+    free_node(root.load());
   }
 
   // disable copy
   PageSet(const PageSet&) = delete;
   const PageSet& operator=(const PageSet&) = delete;
 
-  bool empty() const { return pages.empty(); }
-  size_t size() const { return pages.size(); }
+  bool empty() const { return npages == 0; }
+  size_t size() const { return npages; }
   size_t get_page_size() const { return page_size; }
 
   // allocate all pages that intersect the range [offset,length)
   void alloc_range(uint64_t offset, uint64_t length, page_vector &range) {
-    // loop in reverse so we can provide hints to avl_set::insert_check()
-    //	and get O(1) insertions after the first
-    uint64_t position = offset + length - 1;
-
     range.resize(count_pages(offset, length));
-    auto out = range.rbegin();
+    if (range.empty())
+      return;
+    auto out = range.begin();
 
     std::lock_guard<lock_type> lock(mutex);
-    iterator cur = pages.end();
-    while (length) {
-      const uint64_t page_offset = position & ~(page_size-1);
-
-      typename page_set::insert_commit_data commit;
-      auto insert = pages.insert_check(cur, page_offset, page_cmp(), commit);
-      if (insert.second) {
-        auto page = Page::create(page_size, page_offset);
-        cur = pages.insert_commit(*page, commit);
+    const uint64_t last = last_index(offset, length);
+    for (uint64_t index = offset >> page_shift; ; index++) {
+      auto &slot = leaf_slot(index);
+      Page *page = static_cast<Page*>(slot.load(std::memory_order_relaxed));
+      if (!page) {
+        // the temporary Ref's get/put cancel out, leaving the
+        // initial ref from create() for the tree
+        page = Page::create(page_size, index << page_shift).get();
 
         // assume that the caller will write to the range [offset,length),
         //  so we only need to zero memory outside of this range
@@ -171,55 +269,78 @@ class PageSet {
         // zero front of page between page_offset and offset
         if (offset > page->offset)
           std::fill(page->data, page->data + offset - page->offset, 0);
-      } else { // exists
-        cur = insert.first;
+
+        slot.store(page, std::memory_order_release);
+        ++npages;
       }
       // add a reference to output vector
-      out->reset(&*cur);
+      out->reset(page);
       ++out;
-
-      auto c = std::min(length, (position & (page_size-1)) + 1);
-      position -= c;
-      length -= c;
+      if (index == last)
+        break;
     }
     // make sure we sized the vector correctly
-    assert(out == range.rend());
+    assert(out == range.end());
   }
 
   // return all allocated pages that intersect the range [offset,length)
-  void get_range(uint64_t offset, uint64_t length, page_vector &range) {
-    auto cur = pages.lower_bound(offset & ~(page_size-1), page_cmp());
-    while (cur != pages.end() && cur->offset < offset + length)
-      range.push_back(&*cur++);
+  void get_range(uint64_t offset, uint64_t length, page_vector &range) const {
+    if (!length)
+      return;
+    const unsigned e = read_begin();
+    walk(root.load(std::memory_order_acquire), 0, offset >> page_shift,
+         last_index(offset, length),
+         [&range](std::atomic<void*>&, Page *page) {
+           range.push_back(page);
+         });
+    read_end(e);
   }
 
   void free_pages_after(uint64_t offset) {
+    std::vector<Page*> freed;
     std::lock_guard<lock_type> lock(mutex);
-    auto cur = pages.lower_bound(offset & ~(page_size-1), page_cmp());
-    if (cur == pages.end())
+    // pages that start at or after offset
+    const uint64_t first = (offset >> page_shift) +
+      ((offset & (page_size - 1)) ? 1 : 0);
+    walk(root.load(std::memory_order_relaxed), 0, first, UINT64_MAX,
+         [&freed](std::atomic<void*> &slot, Page *page) {
+           slot.store(nullptr, std::memory_order_release);
+           freed.push_back(page);
+         });
+    if (freed.empty())
       return;
-    if (cur->offset < offset)
-      cur++;
-    free_pages(cur, pages.end());
+    npages -= freed.size();
+    synchronize();
+    for (auto page : freed)
+      page->put();
   }
 
   void encode(bufferlist &bl) const {
+    page_vector all;
+    get_range(0, UINT64_MAX, all);
     ::encode(page_size, bl);
-    unsigned count = pages.size();
+    unsigned count = all.size();
     ::encode(count, bl);
-    for (auto p = pages.rbegin(); p != pages.rend(); ++p)
-      p->encode(bl, page_size);
+    for (auto p = all.rbegin(); p != all.rend(); ++p)
+      (*p)->encode(bl, page_size);
   }
   void decode(bufferlist::iterator &p) {
     assert(empty());
     ::decode(page_size, p);
+    assert(page_size && (page_size & (page_size - 1)) == 0);
+    page_shift = 0;
+    while ((1ull << page_shift) < page_size)
+      page_shift++;
     unsigned count;
     ::decode(count, p);
-    auto cur = pages.end();
+    std::lock_guard<lock_type> lock(mutex);
     for (unsigned i = 0; i < count; i++) {
-      auto page = Page::create(page_size);
+      Page *page = Page::create(page_size).get(); // keeps the initial ref
       page->decode(p, page_size);
-      cur = pages.insert_before(cur, *page);
+      auto &slot = leaf_slot(page->offset >> page_shift);
+      assert(slot.load(std::memory_order_relaxed) == nullptr);
+      slot.store(page, std::memory_order_release);
+      ++npages;
     }
   }
 };
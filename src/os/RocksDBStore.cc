@@ -5,7 +5,9 @@
 #include <map>
 #include <string>
 #include <memory>
+#include <algorithm>
 #include <errno.h>
+#include <sys/stat.h>
 
 #include "rocksdb/db.h"
 #include "rocksdb/table.h"
@@ -18,6 +20,7 @@
 using std::string;
 #include "common/perf_counters.h"
 #include "include/str_map.h"
+#include "include/str_list.h"
 #include "KeyValueDB.h"
 #include "RocksDBStore.h"
 
@@ -94,6 +97,74 @@ int RocksDBStore::ParseOptionsFromString(const string opt_str, rocksdb::Options
   return 0;
 }
 
+int RocksDBStore::ParseCFOptionsFromString(const string opt_str,
+					   rocksdb::ColumnFamilyOptions &opt)
+{
+  map<string, string> str_map;
+  int r = get_str_map(opt_str, ",;", &str_map);
+  if (r < 0)
+    return r;
+  rocksdb::BlockBasedTableOptions table_opt;
+  bool have_table_opt = false;
+  map<string, string>::iterator it;
+  for (it = str_map.begin(); it != str_map.end(); ++it) {
+    string this_opt = it->first + "=" + it->second;
+    rocksdb::Status status =
+      rocksdb::GetColumnFamilyOptionsFromString(opt, this_opt, &opt);
+    if (status.ok())
+      continue;
+    // table options rocksdb cannot parse from a flat string
+    std::string err;
+    if (it->first == "bloom_bits") {
+      int bits = strict_strtol(it->second.c_str(), 10, &err);
+      if (!err.empty())
+	return -EINVAL;
+      table_opt.filter_policy.reset(rocksdb::NewBloomFilterPolicy(bits));
+      have_table_opt = true;
+    } else if (it->first == "block_cache_size") {
+      int64_t size = strict_sistrtoll(it->second.c_str(), &err);
+      if (!err.empty())
+	return -EINVAL;
+      table_opt.block_cache = rocksdb::NewLRUCache(size);
+      have_table_opt = true;
+    } else {
+      derr << status.ToString() << dendl;
+      return -EINVAL;
+    }
+  }
+  if (have_table_opt)
+    opt.table_factory.reset(rocksdb::NewBlockBasedTableFactory(table_opt));
+  return 0;
+}
+
+int RocksDBStore::set_column_families(const string &spec)
+{
+  assert(!db);
+  list<string> entries;
+  get_str_list(spec, " \t", entries);
+  map<string, string> specs;
+  for (list<string>::iterator p = entries.begin(); p != entries.end(); ++p) {
+    size_t colon = p->find(':');
+    string prefix = p->substr(0, colon);
+    string opts = colon == string::npos ? string() : p->substr(colon + 1);
+    if (prefix.empty() || prefix == rocksdb::kDefaultColumnFamilyName) {
+      derr << __func__ << " bad column family '" << *p << "'" << dendl;
+      return -EINVAL;
+    }
+    // catch typos now rather than at open
+    rocksdb::ColumnFamilyOptions cf_opt;
+    int r = ParseCFOptionsFromString(opts, cf_opt);
+    if (r < 0) {
+      derr << __func__ << " bad options for prefix " << prefix << ": " << opts
+	   << dendl;
+      return r;
+    }
+    specs[prefix] = opts;
+  }
+  cf_specs.swap(specs);
+  return 0;
+}
+
 int RocksDBStore::init(string _options_str)
 {
   options_str = _options_str;
@@ -117,11 +188,85 @@ int RocksDBStore::do_open(ostream &out, bool create_if_missing)
   }
   opt.create_if_missing = create_if_missing;
 
-  status = rocksdb::DB::Open(opt, path, &db);
+  // every existing column family must be opened.  configured ones are
+  // only created along with the store: keys already written under a
+  // prefix stay where they are.
+  vector<string> existing;
+  status = rocksdb::DB::ListColumnFamilies(rocksdb::DBOptions(opt), path,
+					   &existing);
+  bool is_new = false;
+  if (!status.ok()) {
+    // only a store that does not exist yet is new; an i/o error or
+    // corruption must not get it opened with the wrong families
+    struct stat st;
+    string current = path + "/CURRENT";
+    if (::stat(current.c_str(), &st) < 0 && errno == ENOENT) {
+      is_new = true;
+    } else {
+      derr << __func__ << " unable to list column families: "
+	   << status.ToString() << dendl;
+      return -EIO;
+    }
+  }
+  vector<rocksdb::ColumnFamilyDescriptor> cfs;
+  if (is_new) {
+    for (map<string, string>::iterator p = cf_specs.begin();
+	 p != cf_specs.end();
+	 ++p)
+      cfs.push_back(rocksdb::ColumnFamilyDescriptor(p->first, opt));
+  } else {
+    for (vector<string>::iterator p = existing.begin();
+	 p != existing.end();
+	 ++p) {
+      if (*p != rocksdb::kDefaultColumnFamilyName)
+	cfs.push_back(rocksdb::ColumnFamilyDescriptor(*p, opt));
+    }
+    for (map<string, string>::iterator p = cf_specs.begin();
+	 p != cf_specs.end();
+	 ++p) {
+      if (std::find(existing.begin(), existing.end(), p->first) ==
+	  existing.end())
+	derr << __func__ << " store has no column family for prefix "
+	     << p->first << ", keeping its keys in the default one" << dendl;
+    }
+  }
+  for (vector<rocksdb::ColumnFamilyDescriptor>::iterator p = cfs.begin();
+       p != cfs.end();
+       ++p) {
+    map<string, string>::iterator q = cf_specs.find(p->name);
+    if (q != cf_specs.end()) {
+      r = ParseCFOptionsFromString(q->second, p->options);
+      if (r < 0)
+	return r;
+    }
+  }
+
+  if (cfs.empty()) {
+    status = rocksdb::DB::Open(opt, path, &db);
+  } else {
+    cfs.insert(cfs.begin(), rocksdb::ColumnFamilyDescriptor(
+		 rocksdb::kDefaultColumnFamilyName, opt));
+    opt.create_missing_column_families = is_new;
+    vector<rocksdb::ColumnFamilyHandle*> handles;
+    status = rocksdb::DB::Open(rocksdb::DBOptions(opt), path, cfs, &handles,
+			       &db);
+    if (status.ok()) {
+      // the db keeps its own handle on the default family
+      delete handles[0];
+      for (unsigned i = 1; i < handles.size(); ++i)
+	cf_handles[cfs[i].name] = handles[i];
+    }
+  }
   if (!status.ok()) {
     derr << status.ToString() << dendl;
     return -EINVAL;
   }
+  for (map<string, rocksdb::ColumnFamilyHandle*>::iterator p =
+	 cf_handles.begin();
+       p != cf_handles.end();
+       ++p)
+    lgeneric_dout(cct, 1) << __func__ << " prefix " << p->first
+			  << " has its own column family" << dendl;
 
   PerfCountersBuilder plb(g_ceph_context, "rocksdb", l_rocksdb_first, l_rocksdb_last);
   plb.add_u64_counter(l_rocksdb_gets, "rocksdb_get", "Gets");
@@ -159,6 +304,13 @@ RocksDBStore::~RocksDBStore()
   close();
   delete logger;
 
+  for (map<string, rocksdb::ColumnFamilyHandle*>::iterator p =
+	 cf_handles.begin();
+       p != cf_handles.end();
+       ++p)
+    delete p->second;
+  cf_handles.clear();
+
   // Ensure db is destroyed before dependent db_cache and filterpolicy
   delete db;
 }
@@ -242,47 +394,121 @@ void RocksDBStore::RocksDBTransactionImpl::set(
   string key = combine_strings(prefix, k);
   //bufferlist::c_str() is non-constant, so we need to make a copy
   bufferlist val = to_set_bl;
-  bat->Delete(rocksdb::Slice(key));
-  bat->Put(rocksdb::Slice(key),
+  rocksdb::ColumnFamilyHandle *cf = db->get_cf_handle(prefix);
+  bat->Delete(cf, rocksdb::Slice(key));
+  bat->Put(cf, rocksdb::Slice(key),
 	  rocksdb::Slice(val.c_str(), val.length()));
 }
 
 void RocksDBStore::RocksDBTransactionImpl::rmkey(const string &prefix,
 					         const string &k)
 {
-  bat->Delete(combine_strings(prefix, k));
+  bat->Delete(db->get_cf_handle(prefix), combine_strings(prefix, k));
 }
 
 void RocksDBStore::RocksDBTransactionImpl::rmkeys_by_prefix(const string &prefix)
 {
+  rocksdb::ColumnFamilyHandle *cf = db->get_cf_handle(prefix);
   KeyValueDB::Iterator it = db->get_iterator(prefix);
   for (it->seek_to_first();
        it->valid();
        it->next()) {
-    bat->Delete(combine_strings(prefix, it->key()));
+    bat->Delete(cf, combine_strings(prefix, it->key()));
+  }
+}
+
+void RocksDBStore::RocksDBTransactionImpl::rm_range_keys(const string &prefix,
+							  const string &start,
+							  const string &end)
+{
+  // the in-tree rocksdb has no WriteBatch::DeleteRange; walk the
+  // committed keys like leveldb does so both backends agree
+  rocksdb::ColumnFamilyHandle *cf = db->get_cf_handle(prefix);
+  KeyValueDB::Iterator it = db->get_iterator(prefix);
+  for (it->lower_bound(start);
+       it->valid() && it->key() < end;
+       it->next()) {
+    bat->Delete(cf, combine_strings(prefix, it->key()));
   }
 }
 
+int RocksDBStore::_multi_get(
+    const vector<rocksdb::ColumnFamilyHandle*> &cfs,
+    const vector<string> &raw,
+    const vector<pair<std::map<string, bufferlist>*, const string*> > &dst)
+{
+  if (raw.empty())
+    return 0;
+  // MultiGet reads every key from one implicit snapshot and can share
+  // block and filter lookups between keys that land in the same file
+  vector<rocksdb::Slice> slices(raw.begin(), raw.end());
+  vector<string> values;
+  vector<rocksdb::Status> status =
+    db->MultiGet(rocksdb::ReadOptions(), cfs, slices, &values);
+  for (unsigned i = 0; i < raw.size(); ++i) {
+    if (status[i].IsNotFound())
+      continue;
+    if (!status[i].ok()) {
+      derr << __func__ << " " << status[i].ToString() << dendl;
+      return -EIO;
+    }
+    bufferlist& bl = (*dst[i].first)[*dst[i].second];
+    bl.append(values[i]);
+  }
+  return 0;
+}
+
 int RocksDBStore::get(
     const string &prefix,
     const std::set<string> &keys,
     std::map<string, bufferlist> *out)
 {
   utime_t start = ceph_clock_now(g_ceph_context);
-  KeyValueDB::Iterator it = get_iterator(prefix);
+  vector<string> raw;
+  vector<pair<std::map<string, bufferlist>*, const string*> > dst;
+  raw.reserve(keys.size());
+  dst.reserve(keys.size());
   for (std::set<string>::const_iterator i = keys.begin();
        i != keys.end();
        ++i) {
-    it->lower_bound(*i);
-    if (it->valid() && it->key() == *i) {
-      out->insert(make_pair(*i, it->value()));
-    } else if (!it->valid())
-      break;
+    raw.push_back(combine_strings(prefix, *i));
+    dst.push_back(make_pair(out, &*i));
   }
+  vector<rocksdb::ColumnFamilyHandle*> cfs(raw.size(), get_cf_handle(prefix));
+  int r = _multi_get(cfs, raw, dst);
   utime_t lat = ceph_clock_now(g_ceph_context) - start;
   logger->inc(l_rocksdb_gets);
   logger->tinc(l_rocksdb_get_latency, lat);
-  return 0;
+  return r;
+}
+
+int RocksDBStore::get_batch(
+    const std::map<string, std::set<string> > &keys,
+    std::map<string, std::map<string, bufferlist> > *out)
+{
+  utime_t start = ceph_clock_now(g_ceph_context);
+  vector<rocksdb::ColumnFamilyHandle*> cfs;
+  vector<string> raw;
+  vector<pair<std::map<string, bufferlist>*, const string*> > dst;
+  // map and set order already is the on-disk order of the combined keys
+  for (std::map<string, std::set<string> >::const_iterator p = keys.begin();
+       p != keys.end();
+       ++p) {
+    std::map<string, bufferlist> *o = &(*out)[p->first];
+    rocksdb::ColumnFamilyHandle *cf = get_cf_handle(p->first);
+    for (std::set<string>::const_iterator i = p->second.begin();
+	 i != p->second.end();
+	 ++i) {
+      cfs.push_back(cf);
+      raw.push_back(combine_strings(p->first, *i));
+      dst.push_back(make_pair(o, &*i));
+    }
+  }
+  int r = _multi_get(cfs, raw, dst);
+  utime_t lat = ceph_clock_now(g_ceph_context) - start;
+  logger->inc(l_rocksdb_gets);
+  logger->tinc(l_rocksdb_get_latency, lat);
+  return r;
 }
 
 string RocksDBStore::combine_strings(const string &prefix, const string &value)
@@ -318,6 +544,11 @@ void RocksDBStore::compact()
 {
   logger->inc(l_rocksdb_compact);
   db->CompactRange(NULL, NULL);
+  for (map<string, rocksdb::ColumnFamilyHandle*>::iterator p =
+	 cf_handles.begin();
+       p != cf_handles.end();
+       ++p)
+    db->CompactRange(p->second, NULL, NULL);
 }
 
 
@@ -393,6 +624,12 @@ void RocksDBStore::compact_range(const string& start, const string& end)
     rocksdb::Slice cstart(start);
     rocksdb::Slice cend(end);
     db->CompactRange(&cstart, &cend);
+    // cheap for families that hold nothing in the range
+    for (map<string, rocksdb::ColumnFamilyHandle*>::iterator p =
+	   cf_handles.begin();
+	 p != cf_handles.end();
+	 ++p)
+      db->CompactRange(p->second, &cstart, &cend);
 }
 RocksDBStore::RocksDBWholeSpaceIteratorImpl::~RocksDBWholeSpaceIteratorImpl()
 {
@@ -489,11 +726,162 @@ string RocksDBStore::past_prefix(const string &prefix)
 }
 
 
+rocksdb::ColumnFamilyHandle *RocksDBStore::get_cf_handle(const string &prefix)
+{
+  if (!cf_handles.empty()) {
+    map<string, rocksdb::ColumnFamilyHandle*>::iterator p =
+      cf_handles.find(prefix);
+    if (p != cf_handles.end())
+      return p->second;
+  }
+  return db->DefaultColumnFamily();
+}
+
+/**
+ * Merge the per column family iterators back into one keyspace.
+ *
+ * Each prefix lives in exactly one family, so children never hold the
+ * same key and the merge only has to pick the smallest (or, going
+ * backwards, largest) current key.
+ */
+class RocksDBMergingIterator : public rocksdb::Iterator {
+  vector<rocksdb::Iterator*> children;
+  rocksdb::Iterator *cur;
+  bool forward;
+
+  void find_smallest() {
+    cur = NULL;
+    for (vector<rocksdb::Iterator*>::iterator p = children.begin();
+	 p != children.end();
+	 ++p) {
+      if ((*p)->Valid() && (!cur || (*p)->key().compare(cur->key()) < 0))
+	cur = *p;
+    }
+  }
+  void find_largest() {
+    cur = NULL;
+    for (vector<rocksdb::Iterator*>::iterator p = children.begin();
+	 p != children.end();
+	 ++p) {
+      if ((*p)->Valid() && (!cur || (*p)->key().compare(cur->key()) > 0))
+	cur = *p;
+    }
+  }
+
+public:
+  explicit RocksDBMergingIterator(const vector<rocksdb::Iterator*> &c)
+    : children(c), cur(NULL), forward(true) {}
+  ~RocksDBMergingIterator() {
+    for (vector<rocksdb::Iterator*>::iterator p = children.begin();
+	 p != children.end();
+	 ++p)
+      delete *p;
+  }
+
+  bool Valid() const {
+    return cur != NULL;
+  }
+  void SeekToFirst() {
+    for (vector<rocksdb::Iterator*>::iterator p = children.begin();
+	 p != children.end();
+	 ++p)
+      (*p)->SeekToFirst();
+    forward = true;
+    find_smallest();
+  }
+  void SeekToLast() {
+    for (vector<rocksdb::Iterator*>::iterator p = children.begin();
+	 p != children.end();
+	 ++p)
+      (*p)->SeekToLast();
+    forward = false;
+    find_largest();
+  }
+  void Seek(const rocksdb::Slice &target) {
+    for (vector<rocksdb::Iterator*>::iterator p = children.begin();
+	 p != children.end();
+	 ++p)
+      (*p)->Seek(target);
+    forward = true;
+    find_smallest();
+  }
+  void Next() {
+    assert(cur);
+    if (!forward) {
+      // the other children sit before cur; move them past it
+      string k = cur->key().ToString();
+      for (vector<rocksdb::Iterator*>::iterator p = children.begin();
+	   p != children.end();
+	   ++p) {
+	if (*p != cur)
+	  (*p)->Seek(k);
+      }
+      forward = true;
+    }
+    cur->Next();
+    find_smallest();
+  }
+  void Prev() {
+    assert(cur);
+    if (forward) {
+      // the other children sit after cur; move them before it
+      string k = cur->key().ToString();
+      for (vector<rocksdb::Iterator*>::iterator p = children.begin();
+	   p != children.end();
+	   ++p) {
+	if (*p == cur)
+	  continue;
+	(*p)->Seek(k);
+	if ((*p)->Valid())
+	  (*p)->Prev();
+	else
+	  (*p)->SeekToLast();
+      }
+      forward = false;
+    }
+    cur->Prev();
+    find_largest();
+  }
+  rocksdb::Slice key() const {
+    return cur->key();
+  }
+  rocksdb::Slice value() const {
+    return cur->value();
+  }
+  rocksdb::Status status() const {
+    for (vector<rocksdb::Iterator*>::const_iterator p = children.begin();
+	 p != children.end();
+	 ++p) {
+      if (!(*p)->status().ok())
+	return (*p)->status();
+    }
+    return rocksdb::Status::OK();
+  }
+};
+
+rocksdb::Iterator *RocksDBStore::new_iterator(const rocksdb::ReadOptions &options)
+{
+  if (cf_handles.empty())
+    return db->NewIterator(options);
+  vector<rocksdb::ColumnFamilyHandle*> handles;
+  handles.push_back(db->DefaultColumnFamily());
+  for (map<string, rocksdb::ColumnFamilyHandle*>::iterator p =
+	 cf_handles.begin();
+       p != cf_handles.end();
+       ++p)
+    handles.push_back(p->second);
+  vector<rocksdb::Iterator*> iters;
+  rocksdb::Status status = db->NewIterators(options, handles, &iters);
+  if (!status.ok())
+    return rocksdb::NewErrorIterator(status);
+  return new RocksDBMergingIterator(iters);
+}
+
 RocksDBStore::WholeSpaceIterator RocksDBStore::_get_iterator()
 {
   return std::shared_ptr<KeyValueDB::WholeSpaceIteratorImpl>(
     new RocksDBWholeSpaceIteratorImpl(
-      db->NewIterator(rocksdb::ReadOptions())
+      new_iterator(rocksdb::ReadOptions())
     )
   );
 }
@@ -508,7 +896,7 @@ RocksDBStore::WholeSpaceIterator RocksDBStore::_get_snapshot_iterator()
 
   return std::shared_ptr<KeyValueDB::WholeSpaceIteratorImpl>(
     new RocksDBSnapshotIteratorImpl(db, snapshot,
-      db->NewIterator(options))
+      new_iterator(options))
   );
 }
 
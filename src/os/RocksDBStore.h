@@ -43,7 +43,10 @@ namespace rocksdb{
   class Slice;
   class WriteBatch;
   class Iterator;
+  class ColumnFamilyHandle;
   struct Options;
+  struct ColumnFamilyOptions;
+  struct ReadOptions;
 }
 /**
  * Uses RocksDB to implement the KeyValueDB interface
@@ -54,8 +57,15 @@ class RocksDBStore : public KeyValueDB {
   string path;
   rocksdb::DB *db;
   string options_str;
+  map<string, string> cf_specs;  ///< prefix -> column family options
+  map<string, rocksdb::ColumnFamilyHandle*> cf_handles;  ///< prefix -> open cf
   int do_open(ostream &out, bool create_if_missing);
 
+  /// column family holding keys with this prefix
+  rocksdb::ColumnFamilyHandle *get_cf_handle(const string &prefix);
+  /// iterator over every column family, merged in key order
+  rocksdb::Iterator *new_iterator(const rocksdb::ReadOptions &options);
+
   // manage async compactions
   Mutex compact_queue_lock;
   Cond compact_queue_cond;
@@ -85,6 +95,9 @@ public:
 
   int tryInterpret(const string key, const string val, rocksdb::Options &opt);
   int ParseOptionsFromString(const string opt_str, rocksdb::Options &opt);
+  int ParseCFOptionsFromString(const string opt_str,
+			       rocksdb::ColumnFamilyOptions &opt);
+  int set_column_families(const string &spec);
   static int _test_init(const string& dir);
   int init(string options_str);
   /// compact rocksdb for all keys with a given prefix
@@ -146,6 +159,11 @@ public:
     void rmkeys_by_prefix(
       const string &prefix
       );
+    void rm_range_keys(
+      const string &prefix,
+      const string &start,
+      const string &end
+      );
   };
 
   KeyValueDB::Transaction get_transaction() {
@@ -153,6 +171,12 @@ public:
       new RocksDBTransactionImpl(this));
   }
 
+  /// MultiGet the combined keys in raw from cfs; hits go to (*dst[i].first)[*dst[i].second]
+  int _multi_get(
+    const vector<rocksdb::ColumnFamilyHandle*> &cfs,
+    const vector<string> &raw,
+    const vector<pair<std::map<string, bufferlist>*, const string*> > &dst);
+
   int submit_transaction(KeyValueDB::Transaction t);
   int submit_transaction_sync(KeyValueDB::Transaction t);
   int get(
@@ -160,6 +184,10 @@ public:
     const std::set<string> &key,
     std::map<string, bufferlist> *out
     );
+  int get_batch(
+    const std::map<string, std::set<string> > &keys,
+    std::map<string, std::map<string, bufferlist> > *out
+    );
 
   class RocksDBWholeSpaceIteratorImpl :
     public KeyValueDB::WholeSpaceIteratorImpl {
@@ -0,0 +1,219 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2015 Red Hat
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include "StripedJournal.h"
+#include "FileJournal.h"
+
+#include "common/debug.h"
+#include "common/errno.h"
+
+#define dout_subsys ceph_subsys_journal
+#undef dout_prefix
+#define dout_prefix *_dout << "journal(striped) "
+
+struct StripedJournal::C_StripeCommitted : public Context {
+  StripedJournal *journal;
+  uint64_t seq;
+  C_StripeCommitted(StripedJournal *j, uint64_t s) : journal(j), seq(s) {}
+  void finish(int r) {
+    journal->stripe_committed(seq);
+  }
+};
+
+StripedJournal::StripedJournal(uuid_d fsid, Finisher *fin, Cond *sync_cond,
+			       const vector<string>& paths,
+			       bool dio, bool ai, bool faio)
+  : Journal(fsid, fin, sync_cond),
+    lock("StripedJournal::lock")
+{
+  assert(!paths.empty());
+  for (vector<string>::const_iterator p = paths.begin(); p != paths.end(); ++p) {
+    FileJournal *j = new FileJournal(fsid, fin, sync_cond, p->c_str(),
+				     dio, ai, faio);
+    j->set_allow_seq_gaps(paths.size() > 1);
+    stripes.push_back(j);
+  }
+}
+
+StripedJournal::~StripedJournal()
+{
+  assert(pending.empty());
+  for (vector<FileJournal*>::iterator p = stripes.begin(); p != stripes.end(); ++p)
+    delete *p;
+}
+
+int StripedJournal::check()
+{
+  for (unsigned i = 0; i < stripes.size(); ++i) {
+    int r = stripes[i]->check();
+    if (r < 0) {
+      dout(2) << __func__ << " stripe " << i << " got " << cpp_strerror(r)
+	      << dendl;
+      return r;
+    }
+  }
+  return 0;
+}
+
+int StripedJournal::create()
+{
+  for (unsigned i = 0; i < stripes.size(); ++i) {
+    int r = stripes[i]->create();
+    if (r < 0) {
+      derr << __func__ << " stripe " << i << " got " << cpp_strerror(r)
+	   << dendl;
+      return r;
+    }
+  }
+  return 0;
+}
+
+int StripedJournal::open(uint64_t fs_op_seq)
+{
+  dout(2) << __func__ << " " << stripes.size() << " stripes, fs_op_seq "
+	  << fs_op_seq << dendl;
+  for (unsigned i = 0; i < stripes.size(); ++i) {
+    stripes[i]->logger = logger;
+    stripes[i]->set_wait_on_full(wait_on_full);
+    int r = stripes[i]->open(fs_op_seq);
+    if (r < 0) {
+      derr << __func__ << " stripe " << i << " got " << cpp_strerror(r)
+	   << dendl;
+      while (i-- > 0)
+	stripes[i]->close();
+      return r;
+    }
+  }
+  return 0;
+}
+
+void StripedJournal::close()
+{
+  for (vector<FileJournal*>::iterator p = stripes.begin(); p != stripes.end(); ++p)
+    (*p)->close();
+  Mutex::Locker l(lock);
+  assert(pending.empty());
+  committed.clear();
+}
+
+void StripedJournal::flush()
+{
+  for (vector<FileJournal*>::iterator p = stripes.begin(); p != stripes.end(); ++p)
+    (*p)->flush();
+}
+
+void StripedJournal::throttle()
+{
+  // we do not know which stripe the next seq lands on yet
+  for (vector<FileJournal*>::iterator p = stripes.begin(); p != stripes.end(); ++p)
+    (*p)->throttle();
+}
+
+bool StripedJournal::is_writeable()
+{
+  for (vector<FileJournal*>::iterator p = stripes.begin(); p != stripes.end(); ++p)
+    if (!(*p)->is_writeable())
+      return false;
+  return true;
+}
+
+int StripedJournal::make_writeable()
+{
+  for (unsigned i = 0; i < stripes.size(); ++i) {
+    int r = stripes[i]->make_writeable();
+    if (r < 0) {
+      derr << __func__ << " stripe " << i << " got " << cpp_strerror(r)
+	   << dendl;
+      return r;
+    }
+  }
+  return 0;
+}
+
+void StripedJournal::submit_entry(uint64_t seq, bufferlist& e, int alignment,
+				  Context *oncommit, TrackedOpRef osd_op)
+{
+  dout(10) << __func__ << " seq " << seq << " to stripe "
+	   << seq % stripes.size() << dendl;
+  {
+    Mutex::Locker l(lock);
+    assert(pending.empty() || pending.rbegin()->first < seq);
+    pending[seq] = oncommit;
+  }
+  get_stripe(seq)->submit_entry(seq, e, alignment,
+				new C_StripeCommitted(this, seq), osd_op);
+}
+
+void StripedJournal::stripe_committed(uint64_t seq)
+{
+  list<Context*> ls;
+  {
+    Mutex::Locker l(lock);
+    dout(20) << __func__ << " seq " << seq << dendl;
+    committed.insert(seq);
+    while (!pending.empty() &&
+	   !committed.empty() &&
+	   *committed.begin() == pending.begin()->first) {
+      if (pending.begin()->second)
+	ls.push_back(pending.begin()->second);
+      committed.erase(committed.begin());
+      pending.erase(pending.begin());
+    }
+  }
+  // we are already in the finisher; keep the callbacks in seq order
+  finish_contexts(g_ceph_context, ls, 0);
+}
+
+void StripedJournal::commit_start(uint64_t seq)
+{
+  for (vector<FileJournal*>::iterator p = stripes.begin(); p != stripes.end(); ++p)
+    (*p)->commit_start(seq);
+}
+
+void StripedJournal::committed_thru(uint64_t seq)
+{
+  for (vector<FileJournal*>::iterator p = stripes.begin(); p != stripes.end(); ++p)
+    (*p)->committed_thru(seq);
+}
+
+bool StripedJournal::read_entry(bufferlist &bl, uint64_t &seq)
+{
+  uint64_t want = seq;
+  FileJournal *j = get_stripe(want);
+  uint64_t next;
+  if (!j->peek_entry_seq(&next)) {
+    dout(2) << __func__ << " stripe " << want % stripes.size()
+	    << " has no more entries" << dendl;
+    return false;
+  }
+  if (next != want) {
+    // lost in flight; nothing past it was acked
+    dout(1) << __func__ << " stripe " << want % stripes.size()
+	    << " has seq " << next << " but not " << want
+	    << ", stopping replay" << dendl;
+    return false;
+  }
+  if (!j->read_entry(bl, seq))
+    return false;
+  assert(seq == want);
+  return true;
+}
+
+bool StripedJournal::should_commit_now()
+{
+  for (vector<FileJournal*>::iterator p = stripes.begin(); p != stripes.end(); ++p)
+    if ((*p)->should_commit_now())
+      return true;
+  return false;
+}
@@ -0,0 +1,81 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2015 Red Hat
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef CEPH_STRIPEDJOURNAL_H
+#define CEPH_STRIPEDJOURNAL_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "Journal.h"
+#include "common/Mutex.h"
+
+class FileJournal;
+
+/**
+ * a journal striped over several FileJournals
+ *
+ * Entry seq goes to stripe seq % N, so each stripe has its own write
+ * thread and aio queue and the devices are written in parallel.
+ * Commits may complete out of order across stripes; we hold back the
+ * oncommit callbacks so that they still fire in seq order.
+ *
+ * On replay we read seq n from stripe n % N and stop at the first seq
+ * that is missing.  Anything the stripes hold beyond that point was
+ * never acked and is invalidated when the journal is made writeable.
+ */
+class StripedJournal : public Journal {
+  std::vector<FileJournal*> stripes;
+
+  Mutex lock;
+  std::map<uint64_t, Context*> pending;  ///< oncommit by seq, in order
+  std::set<uint64_t> committed;          ///< stripe commits not yet released
+
+  struct C_StripeCommitted;
+  void stripe_committed(uint64_t seq);
+
+  FileJournal *get_stripe(uint64_t seq) {
+    return stripes[seq % stripes.size()];
+  }
+
+public:
+  StripedJournal(uuid_d fsid, Finisher *fin, Cond *sync_cond,
+		 const std::vector<std::string>& paths,
+		 bool dio, bool ai, bool faio);
+  ~StripedJournal();
+
+  int check();
+  int create();
+  int open(uint64_t fs_op_seq);
+  void close();
+
+  void flush();
+  void throttle();
+
+  bool is_writeable();
+  int make_writeable();
+  void submit_entry(uint64_t seq, bufferlist& e, int alignment,
+		    Context *oncommit,
+		    TrackedOpRef osd_op = TrackedOpRef());
+  void commit_start(uint64_t seq);
+  void committed_thru(uint64_t seq);
+
+  bool read_entry(bufferlist &bl, uint64_t &seq);
+
+  bool should_commit_now();
+};
+
+#endif
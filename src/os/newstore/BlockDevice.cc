@@ -0,0 +1,223 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2015 Red Hat
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+
+#include "BlockDevice.h"
+#include "include/compat.h"
+#include "common/blkdev.h"
+#include "common/errno.h"
+#include "common/debug.h"
+#include "common/safe_io.h"
+
+#define dout_subsys ceph_subsys_newstore
+#undef dout_prefix
+#define dout_prefix *_dout << "bdev(" << path << ") "
+
+BlockDevice::BlockDevice(CephContext *c)
+  : cct(c),
+    fd_direct(-1),
+    fd_buffered(-1),
+    size(0),
+    block_size(CEPH_PAGE_SIZE)
+{
+}
+
+BlockDevice::~BlockDevice()
+{
+  assert(fd_direct < 0);
+  assert(fd_buffered < 0);
+}
+
+int BlockDevice::create(const std::string& path, uint64_t size)
+{
+  int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+  if (fd < 0) {
+    int r = -errno;
+    if (r == -EEXIST)
+      return 0;  // existing file or device; use it as-is
+    return r;
+  }
+  int r = ::ftruncate(fd, size);
+  if (r < 0) {
+    r = -errno;
+  } else {
+#ifdef HAVE_POSIX_FALLOCATE
+    // best effort; a sparse file works too, just less predictably
+    ::posix_fallocate(fd, 0, size);
+#endif
+    r = 0;
+  }
+  VOID_TEMP_FAILURE_RETRY(::close(fd));
+  return r;
+}
+
+int BlockDevice::open(const std::string& p)
+{
+  path = p;
+  dout(1) << __func__ << dendl;
+
+  fd_direct = ::open(path.c_str(), O_RDWR | O_DIRECT);
+  if (fd_direct < 0) {
+    int r = -errno;
+    derr << __func__ << " open O_DIRECT got: " << cpp_strerror(r) << dendl;
+    return r;
+  }
+  fd_buffered = ::open(path.c_str(), O_RDWR);
+  if (fd_buffered < 0) {
+    int r = -errno;
+    derr << __func__ << " open got: " << cpp_strerror(r) << dendl;
+    VOID_TEMP_FAILURE_RETRY(::close(fd_direct));
+    fd_direct = -1;
+    return r;
+  }
+
+  struct stat st;
+  int r = ::fstat(fd_direct, &st);
+  if (r < 0) {
+    r = -errno;
+    derr << __func__ << " fstat got " << cpp_strerror(r) << dendl;
+    goto out_fail;
+  }
+  if (S_ISBLK(st.st_mode)) {
+    int64_t s;
+    r = get_block_device_size(fd_direct, &s);
+    if (r < 0) {
+      derr << __func__ << " failed to get device size: " << cpp_strerror(r)
+	   << dendl;
+      goto out_fail;
+    }
+    size = s;
+  } else {
+    size = st.st_size;
+  }
+  if (st.st_blksize > (blksize_t)block_size)
+    block_size = st.st_blksize;
+
+  // only use whole blocks
+  size &= ~(block_size - 1);
+
+  dout(1) << __func__ << " size " << size << " (" << prettybyte_t(size) << ")"
+	  << " block_size " << block_size << dendl;
+  return 0;
+
+ out_fail:
+  close();
+  return r;
+}
+
+void BlockDevice::close()
+{
+  dout(1) << __func__ << dendl;
+  if (fd_direct >= 0) {
+    VOID_TEMP_FAILURE_RETRY(::close(fd_direct));
+    fd_direct = -1;
+  }
+  if (fd_buffered >= 0) {
+    VOID_TEMP_FAILURE_RETRY(::close(fd_buffered));
+    fd_buffered = -1;
+  }
+}
+
+/*
+ * Read through the O_DIRECT handle, whole blocks at a time.  Data is
+ * written both by aio on that handle and by buffered writes; a direct
+ * read first writes back dirty cached pages in its range, so it sees
+ * both, while the page cache could still hold pages from before a
+ * direct write.
+ */
+int BlockDevice::read(uint64_t off, uint64_t len, bufferlist *pbl)
+{
+  dout(20) << __func__ << " " << off << "~" << len << dendl;
+  assert(off + len <= size);
+  uint64_t b_off = off & ~(block_size - 1);
+  uint64_t b_len = ROUND_UP_TO(off + len, block_size) - b_off;
+  bufferptr p = buffer::create_page_aligned(b_len);
+  int r = safe_pread_exact(fd_direct, p.c_str(), b_len, b_off);
+  if (r < 0) {
+    derr << __func__ << " " << off << "~" << len << " got "
+	 << cpp_strerror(r) << dendl;
+    return r;
+  }
+  pbl->append(p, off - b_off, len);
+  return len;
+}
+
+int BlockDevice::write(uint64_t off, const bufferlist& bl)
+{
+  uint64_t len = bl.length();
+  dout(20) << __func__ << " " << off << "~" << len << dendl;
+  assert(off + len <= size);
+
+  vector<iovec> iov;
+  bl.prepare_iov(&iov);
+  unsigned idx = 0;
+  while (len > 0) {
+    unsigned cnt = MIN(iov.size() - idx, (unsigned)IOV_MAX);
+    ssize_t r = ::pwritev(fd_buffered, &iov[idx], cnt, off);
+    if (r < 0) {
+      r = -errno;
+      derr << __func__ << " pwritev got " << cpp_strerror(r) << dendl;
+      return r;
+    }
+    off += r;
+    len -= r;
+    // advance past what was written; a short write may split an iovec
+    while (r > 0 && idx < iov.size()) {
+      if ((size_t)r >= iov[idx].iov_len) {
+	r -= iov[idx].iov_len;
+	++idx;
+      } else {
+	iov[idx].iov_base = (char*)iov[idx].iov_base + r;
+	iov[idx].iov_len -= r;
+	r = 0;
+      }
+    }
+  }
+  return 0;
+}
+
+int BlockDevice::zero(uint64_t off, uint64_t len)
+{
+  dout(20) << __func__ << " " << off << "~" << len << dendl;
+  bufferptr z(MIN(len, (uint64_t)1024 * 1024));
+  z.zero();
+  while (len > 0) {
+    uint64_t l = MIN(len, (uint64_t)z.length());
+    bufferlist bl;
+    bl.append(z, 0, l);
+    int r = write(off, bl);
+    if (r < 0)
+      return r;
+    off += l;
+    len -= l;
+  }
+  return 0;
+}
+
+int BlockDevice::flush()
+{
+  dout(10) << __func__ << dendl;
+  int r = ::fdatasync(fd_buffered);
+  if (r < 0) {
+    r = -errno;
+    derr << __func__ << " fdatasync got: " << cpp_strerror(r) << dendl;
+  }
+  return r;
+}
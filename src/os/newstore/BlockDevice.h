@@ -0,0 +1,68 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2015 Red Hat
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef CEPH_OS_NEWSTORE_BLOCKDEVICE_H
+#define CEPH_OS_NEWSTORE_BLOCKDEVICE_H
+
+#include <string>
+
+#include "include/types.h"
+
+class CephContext;
+
+/**
+ * raw block device (or preallocated file) backing object data
+ *
+ * We keep two handles open: an O_DIRECT one that is used for reads
+ * and page-aligned aio, and a buffered one for other writes.  The
+ * buffered handle must be flushed before unaligned writes can be
+ * considered stable.
+ */
+class BlockDevice {
+  CephContext *cct;
+  std::string path;
+  int fd_direct, fd_buffered;
+  uint64_t size;
+  uint64_t block_size;
+
+public:
+  BlockDevice(CephContext *c);
+  ~BlockDevice();
+
+  /// create a regular file of the given size if path does not exist
+  static int create(const std::string& path, uint64_t size);
+
+  int open(const std::string& path);
+  void close();
+
+  uint64_t get_size() const {
+    return size;
+  }
+  uint64_t get_block_size() const {
+    return block_size;
+  }
+  int get_fd_direct() const {
+    return fd_direct;
+  }
+  int get_fd_buffered() const {
+    return fd_buffered;
+  }
+
+  int read(uint64_t off, uint64_t len, bufferlist *pbl);
+  int write(uint64_t off, const bufferlist& bl);
+  int zero(uint64_t off, uint64_t len);
+  int flush();
+};
+
+#endif
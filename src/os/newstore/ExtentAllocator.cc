@@ -0,0 +1,129 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2015 Red Hat
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include "ExtentAllocator.h"
+#include "include/assert.h"
+#include "include/intarith.h"
+#include "common/debug.h"
+
+#define dout_subsys ceph_subsys_newstore
+#undef dout_prefix
+#define dout_prefix *_dout << "extentalloc(" << this << ") "
+
+ExtentAllocator::ExtentAllocator(uint64_t mas)
+  : lock("ExtentAllocator::lock"),
+    min_alloc_size(mas),
+    num_free(0)
+{
+  assert((min_alloc_size & (min_alloc_size - 1)) == 0);
+}
+
+void ExtentAllocator::_insert_free(uint64_t off, uint64_t len)
+{
+  assert(len > 0);
+  std::map<uint64_t,uint64_t>::iterator p = free.lower_bound(off);
+  if (p != free.end()) {
+    assert(p->first >= off + len);  // no overlap
+    if (p->first == off + len) {
+      len += p->second;
+      free.erase(p++);
+    }
+  }
+  if (p != free.begin()) {
+    --p;
+    assert(p->first + p->second <= off);  // no overlap
+    if (p->first + p->second == off) {
+      p->second += len;
+      return;
+    }
+  }
+  free[off] = len;
+}
+
+void ExtentAllocator::init_add_free(uint64_t off, uint64_t len)
+{
+  Mutex::Locker l(lock);
+  dout(10) << __func__ << " " << off << "~" << len << dendl;
+  _insert_free(off, len);
+  num_free += len;
+}
+
+int ExtentAllocator::allocate(uint64_t want, uint64_t hint,
+			      uint64_t *offset, uint64_t *length)
+{
+  Mutex::Locker l(lock);
+  want = ROUND_UP_TO(want, min_alloc_size);
+
+  // first fit, starting at hint and wrapping around to the beginning
+  std::map<uint64_t,uint64_t>::iterator p = free.lower_bound(hint);
+  if (p != free.begin()) {
+    std::map<uint64_t,uint64_t>::iterator q = p;
+    --q;
+    if (q->first + q->second > hint)
+      p = q;
+  }
+  std::map<uint64_t,uint64_t>::iterator start = p;
+  bool wrapped = false;
+  while (true) {
+    if (p == free.end()) {
+      if (wrapped || free.empty())
+	break;
+      p = free.begin();
+      wrapped = true;
+    }
+    if (wrapped && p == start)
+      break;
+    if (p->second >= want)
+      break;
+    ++p;
+  }
+  if (p == free.end() || p->second < want) {
+    dout(1) << __func__ << " no extent of " << want << " bytes, "
+	    << num_free << " bytes free in " << free.size() << " extents"
+	    << dendl;
+    return -ENOSPC;
+  }
+
+  *offset = p->first;
+  *length = want;
+  if (p->second > want)
+    free[p->first + want] = p->second - want;
+  free.erase(p);
+  num_free -= want;
+  dout(10) << __func__ << " want " << want << " hint " << hint
+	   << " = " << *offset << "~" << *length << dendl;
+  return 0;
+}
+
+void ExtentAllocator::release(uint64_t off, uint64_t len)
+{
+  Mutex::Locker l(lock);
+  dout(10) << __func__ << " " << off << "~" << len << dendl;
+  _insert_free(off, len);
+  num_free += len;
+}
+
+uint64_t ExtentAllocator::get_free()
+{
+  Mutex::Locker l(lock);
+  return num_free;
+}
+
+void ExtentAllocator::shutdown()
+{
+  Mutex::Locker l(lock);
+  dout(10) << __func__ << dendl;
+  free.clear();
+  num_free = 0;
+}
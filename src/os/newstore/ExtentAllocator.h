@@ -0,0 +1,67 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2015 Red Hat
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef CEPH_OS_NEWSTORE_EXTENTALLOCATOR_H
+#define CEPH_OS_NEWSTORE_EXTENTALLOCATOR_H
+
+#include <map>
+
+#include "include/int_types.h"
+#include "common/Mutex.h"
+
+/**
+ * in-memory first-fit allocator over free device extents
+ *
+ * This is the view of free space used to hand out new extents.  It
+ * runs ahead of the committed freelist (see FreelistManager): space
+ * is removed here as soon as it is allocated, but released space is
+ * only added back once nothing can still reference it.
+ */
+class ExtentAllocator {
+  Mutex lock;
+  uint64_t min_alloc_size;
+  std::map<uint64_t,uint64_t> free;  ///< offset -> length
+  uint64_t num_free;                 ///< total free bytes
+
+  void _insert_free(uint64_t off, uint64_t len);
+
+public:
+  ExtentAllocator(uint64_t min_alloc_size);
+
+  uint64_t get_min_alloc_size() const {
+    return min_alloc_size;
+  }
+
+  /// seed free space at mount time
+  void init_add_free(uint64_t off, uint64_t len);
+
+  /**
+   * allocate a contiguous extent
+   *
+   * @param want bytes wanted (rounded up to min_alloc_size)
+   * @param hint preferred device offset to start searching from
+   * @param offset [out] start of allocated extent
+   * @param length [out] length of allocated extent
+   * @return 0 on success, -ENOSPC if no extent is large enough
+   */
+  int allocate(uint64_t want, uint64_t hint,
+	       uint64_t *offset, uint64_t *length);
+
+  void release(uint64_t off, uint64_t len);
+
+  uint64_t get_free();
+  void shutdown();
+};
+
+#endif
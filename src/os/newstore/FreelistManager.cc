@@ -0,0 +1,189 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2015 Red Hat
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include "FreelistManager.h"
+#include "include/assert.h"
+#include "include/encoding.h"
+#include "common/debug.h"
+
+#define dout_subsys ceph_subsys_newstore
+#undef dout_prefix
+#define dout_prefix *_dout << "freelist "
+
+static void make_offset_key(uint64_t off, std::string *out)
+{
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)off);
+  *out = buf;
+}
+
+static int decode_offset_key(const std::string& key, uint64_t *off)
+{
+  unsigned long long v;
+  if (sscanf(key.c_str(), "%llx", &v) < 1)
+    return -EINVAL;
+  *off = v;
+  return 0;
+}
+
+int FreelistManager::init(KeyValueDB *kvdb, const std::string& p)
+{
+  dout(1) << __func__ << " prefix " << p << dendl;
+  Mutex::Locker l(lock);
+  prefix = p;
+
+  KeyValueDB::Iterator it = kvdb->get_iterator(prefix);
+  it->lower_bound(std::string());
+  total_free = 0;
+  while (it->valid()) {
+    uint64_t offset, length;
+    if (decode_offset_key(it->key(), &offset) < 0) {
+      derr << __func__ << " bad key " << it->key() << dendl;
+      return -EIO;
+    }
+    bufferlist bl = it->value();
+    bufferlist::iterator bp = bl.begin();
+    try {
+      ::decode(length, bp);
+    } catch (buffer::error& e) {
+      derr << __func__ << " failed to decode extent at " << it->key() << dendl;
+      return -EIO;
+    }
+    kv_free[offset] = length;
+    total_free += length;
+    dout(20) << __func__ << "  " << offset << "~" << length << dendl;
+    it->next();
+  }
+  dout(10) << __func__ << " loaded " << kv_free.size() << " extents, "
+	   << total_free << " bytes free" << dendl;
+  _audit();
+  return 0;
+}
+
+void FreelistManager::shutdown()
+{
+  dout(1) << __func__ << dendl;
+  Mutex::Locker l(lock);
+  kv_free.clear();
+  total_free = 0;
+}
+
+void FreelistManager::_audit()
+{
+  assert(lock.is_locked());
+  uint64_t sum = 0;
+  uint64_t end = 0;
+  for (std::map<uint64_t,uint64_t>::iterator p = kv_free.begin();
+       p != kv_free.end();
+       ++p) {
+    // extents must not overlap and must be merged if adjacent
+    assert(p == kv_free.begin() || p->first > end);
+    sum += p->second;
+    end = p->first + p->second;
+  }
+  assert(sum == total_free);
+}
+
+void FreelistManager::_set(uint64_t off, uint64_t len,
+			   KeyValueDB::Transaction txn)
+{
+  std::string key;
+  make_offset_key(off, &key);
+  bufferlist bl;
+  ::encode(len, bl);
+  txn->set(prefix, key, bl);
+  kv_free[off] = len;
+}
+
+void FreelistManager::_rm(uint64_t off, KeyValueDB::Transaction txn)
+{
+  std::string key;
+  make_offset_key(off, &key);
+  txn->rmkey(prefix, key);
+  kv_free.erase(off);
+}
+
+void FreelistManager::create(uint64_t size, KeyValueDB::Transaction txn)
+{
+  dout(1) << __func__ << " " << size << " bytes" << dendl;
+  Mutex::Locker l(lock);
+  assert(kv_free.empty());
+  _set(0, size, txn);
+  total_free = size;
+}
+
+int FreelistManager::allocate(uint64_t offset, uint64_t length,
+			      KeyValueDB::Transaction txn)
+{
+  dout(10) << __func__ << " " << offset << "~" << length << dendl;
+  Mutex::Locker l(lock);
+  std::map<uint64_t,uint64_t>::iterator p = kv_free.upper_bound(offset);
+  if (p == kv_free.begin()) {
+    derr << __func__ << " " << offset << "~" << length << " not free" << dendl;
+    return -EINVAL;
+  }
+  --p;
+  uint64_t free_off = p->first;
+  uint64_t free_len = p->second;
+  if (free_off + free_len < offset + length) {
+    derr << __func__ << " " << offset << "~" << length << " not free, "
+	 << "overlaps " << free_off << "~" << free_len << dendl;
+    return -EINVAL;
+  }
+  _rm(free_off, txn);
+  if (free_off < offset)
+    _set(free_off, offset - free_off, txn);
+  if (free_off + free_len > offset + length)
+    _set(offset + length, free_off + free_len - offset - length, txn);
+  total_free -= length;
+  if (g_conf->newstore_debug_freelist)
+    _audit();
+  return 0;
+}
+
+int FreelistManager::release(uint64_t offset, uint64_t length,
+			     KeyValueDB::Transaction txn)
+{
+  dout(10) << __func__ << " " << offset << "~" << length << dendl;
+  Mutex::Locker l(lock);
+  std::map<uint64_t,uint64_t>::iterator next = kv_free.lower_bound(offset);
+  std::map<uint64_t,uint64_t>::iterator prev = next;
+  bool have_prev = false;
+  if (prev != kv_free.begin()) {
+    --prev;
+    have_prev = true;
+  }
+  if ((next != kv_free.end() && next->first < offset + length) ||
+      (have_prev && prev->first + prev->second > offset)) {
+    derr << __func__ << " " << offset << "~" << length
+	 << " overlaps existing free extent" << dendl;
+    return -EINVAL;
+  }
+
+  uint64_t new_off = offset;
+  uint64_t new_len = length;
+  if (next != kv_free.end() && next->first == offset + length) {
+    new_len += next->second;
+    _rm(next->first, txn);
+  }
+  if (have_prev && prev->first + prev->second == offset) {
+    new_off = prev->first;
+    new_len += prev->second;
+  }
+  _set(new_off, new_len, txn);
+  total_free += length;
+  if (g_conf->newstore_debug_freelist)
+    _audit();
+  return 0;
+}
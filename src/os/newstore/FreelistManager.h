@@ -0,0 +1,67 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2015 Red Hat
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef CEPH_OS_NEWSTORE_FREELISTMANAGER_H
+#define CEPH_OS_NEWSTORE_FREELISTMANAGER_H
+
+#include <string>
+#include <map>
+
+#include "common/Mutex.h"
+#include "os/KeyValueDB.h"
+
+/**
+ * persistent list of free extents on the block device
+ *
+ * Each free extent is stored as a key (device offset) and value
+ * (length) under our prefix.  Adjacent extents are merged.  The
+ * in-memory map mirrors exactly what has been queued to the kv store,
+ * so callers must apply updates in the same order in which the
+ * transactions carrying them are submitted.
+ */
+class FreelistManager {
+  std::string prefix;
+  Mutex lock;
+  uint64_t total_free;
+  std::map<uint64_t,uint64_t> kv_free;  ///< mirrors our kv values
+
+  void _audit();
+  void _set(uint64_t off, uint64_t len, KeyValueDB::Transaction txn);
+  void _rm(uint64_t off, KeyValueDB::Transaction txn);
+
+public:
+  FreelistManager()
+    : lock("FreelistManager::lock"),
+      total_free(0) {
+  }
+
+  int init(KeyValueDB *kvdb, const std::string& prefix);
+  void shutdown();
+
+  /// mark an entire (new) device free; only for mkfs
+  void create(uint64_t size, KeyValueDB::Transaction txn);
+
+  uint64_t get_total_free() {
+    Mutex::Locker l(lock);
+    return total_free;
+  }
+  const std::map<uint64_t,uint64_t>& get_freelist() {
+    return kv_free;
+  }
+
+  int allocate(uint64_t offset, uint64_t length, KeyValueDB::Transaction txn);
+  int release(uint64_t offset, uint64_t length, KeyValueDB::Transaction txn);
+};
+
+#endif
@@ -22,8 +22,12 @@
 #include "NewStore.h"
 #include "include/compat.h"
 #include "include/stringify.h"
+#include "include/str_list.h"
+#include "include/intarith.h"
+#include "include/crc32c.h"
 #include "common/errno.h"
 #include "common/safe_io.h"
+#include "common/strtol.h"
 
 #define dout_subsys ceph_subsys_newstore
 
@@ -50,6 +54,7 @@ const string PREFIX_OBJ = "O";  // object name -> onode
 const string PREFIX_OVERLAY = "V"; // u64 + offset -> value
 const string PREFIX_OMAP = "M"; // u64 + keyname -> value
 const string PREFIX_WAL = "L";  // write ahead log
+const string PREFIX_ALLOC = "B";   // block device offset -> free extent length
 
 
 /*
@@ -338,154 +343,224 @@ void get_wal_key(uint64_t seq, string *out)
 
 // Onode
 
-NewStore::Onode::Onode(const ghobject_t& o, const string& k)
+NewStore::Onode::Onode(Collection *c, const ghobject_t& o, const string& k)
   : nref(0),
     oid(o),
     key(k),
+    coll(c),
+    cache_bytes(0),
     dirty(false),
     exists(true),
     flush_lock("NewStore::Onode::flush_lock") {
 }
 
-// OnodeHashLRU
+// OnodeCache
 
 #undef dout_prefix
-#define dout_prefix *_dout << "newstore.lru(" << this << ") "
+#define dout_prefix *_dout << "newstore.onode_cache(" << this << ") "
 
-void NewStore::OnodeHashLRU::_touch(OnodeRef o)
+void NewStore::OnodeCache::init(unsigned num_shards, uint64_t max_bytes,
+				PerfCounters *l)
 {
-  lru_list_t::iterator p = lru.iterator_to(*o);
-  lru.erase(p);
-  lru.push_front(*o);
+  assert(shards.empty());
+  if (num_shards == 0)
+    num_shards = 1;
+  for (unsigned i = 0; i < num_shards; ++i)
+    shards.push_back(new Shard);
+  max_shard_bytes = max_bytes / num_shards;
+  logger = l;
+  dout(10) << __func__ << " " << num_shards << " shards, " << max_bytes
+	   << " bytes" << dendl;
 }
 
-void NewStore::OnodeHashLRU::add(const ghobject_t& oid, OnodeRef o)
+void NewStore::OnodeCache::shutdown()
 {
-  Mutex::Locker l(lock);
-  dout(30) << __func__ << " " << oid << " " << o << dendl;
-  assert(onode_map.count(oid) == 0);
-  onode_map[oid] = o;
-  lru.push_back(*o);
+  dout(10) << __func__ << dendl;
+  for (vector<Shard*>::iterator p = shards.begin(); p != shards.end(); ++p) {
+    Shard *s = *p;
+    s->lock.Lock();
+    while (!s->lru.empty())
+      _remove(s, &s->lru.front());
+    assert(s->onode_map.empty());
+    s->lock.Unlock();
+    delete s;
+  }
+  shards.clear();
 }
 
-NewStore::OnodeRef NewStore::OnodeHashLRU::lookup(const ghobject_t& oid)
+void NewStore::OnodeCache::_set_bytes(Onode *o, uint32_t bytes)
 {
-  Mutex::Locker l(lock);
-  dout(30) << __func__ << dendl;
-  ceph::unordered_map<ghobject_t,OnodeRef>::iterator p = onode_map.find(oid);
-  if (p == onode_map.end()) {
-    dout(30) << __func__ << " " << oid << " miss" << dendl;
-    return OnodeRef();
-  }
-  dout(30) << __func__ << " " << oid << " hit " << p->second << dendl;
-  _touch(p->second);
-  return p->second;
+  Shard *s = _get_shard(o->oid);
+  assert(s->lock.is_locked());
+  s->bytes -= o->cache_bytes;
+  s->bytes += bytes;
+  if (bytes > o->cache_bytes)
+    logger->inc(l_newstore_onode_bytes, bytes - o->cache_bytes);
+  else
+    logger->dec(l_newstore_onode_bytes, o->cache_bytes - bytes);
+  o->cache_bytes = bytes;
 }
 
-void NewStore::OnodeHashLRU::clear()
+void NewStore::OnodeCache::_remove(Shard *s, Onode *o)
 {
-  Mutex::Locker l(lock);
-  dout(10) << __func__ << dendl;
-  lru.clear();
-  onode_map.clear();
+  dout(30) << __func__ << " " << o->oid << dendl;
+  s->lru.erase(s->lru.iterator_to(*o));
+  s->bytes -= o->cache_bytes;
+  logger->dec(l_newstore_onode_bytes, o->cache_bytes);
+  logger->dec(l_newstore_onode_count);
+  o->cache_bytes = 0;
+  s->onode_map.erase(o->oid);  // may drop the last ref
+}
+
+void NewStore::OnodeCache::_trim(Shard *s)
+{
+  lru_list_t::iterator p = s->lru.end();
+  while (s->bytes > max_shard_bytes && p != s->lru.begin()) {
+    --p;
+    Onode *o = &*p;
+    if (o->nref.read() > 1) {
+      dout(30) << __func__ << " " << o->oid << " in use" << dendl;
+      continue;
+    }
+    ++p;  // _remove invalidates o's position
+    _remove(s, o);
+    logger->inc(l_newstore_onode_evict);
+  }
 }
 
-void NewStore::OnodeHashLRU::remove(const ghobject_t& oid)
+NewStore::OnodeRef NewStore::OnodeCache::lookup(Collection *c,
+						const ghobject_t& oid)
 {
-  Mutex::Locker l(lock);
-  ceph::unordered_map<ghobject_t,OnodeRef>::iterator p = onode_map.find(oid);
-  if (p == onode_map.end()) {
+  Shard *s = _get_shard(oid);
+  Mutex::Locker l(s->lock);
+  ceph::unordered_map<ghobject_t,OnodeRef>::iterator p =
+    s->onode_map.find(oid);
+  if (p == s->onode_map.end()) {
     dout(30) << __func__ << " " << oid << " miss" << dendl;
-    return;
+    logger->inc(l_newstore_onode_miss);
+    return OnodeRef();
   }
   dout(30) << __func__ << " " << oid << " hit " << p->second << dendl;
-  lru_list_t::iterator pi = lru.iterator_to(*p->second);
-  lru.erase(pi);
-  onode_map.erase(p);
+  logger->inc(l_newstore_onode_hit);
+  Onode *o = p->second.get();
+  s->lru.erase(s->lru.iterator_to(*o));
+  s->lru.push_front(*o);
+  o->coll = c;
+  return p->second;
 }
 
-void NewStore::OnodeHashLRU::rename(const ghobject_t& old_oid,
-				    const ghobject_t& new_oid)
+bool NewStore::OnodeCache::contains(const ghobject_t& oid)
 {
-  Mutex::Locker l(lock);
-  dout(30) << __func__ << " " << old_oid << " -> " << new_oid << dendl;
-  ceph::unordered_map<ghobject_t,OnodeRef>::iterator po, pn;
-  po = onode_map.find(old_oid);
-  pn = onode_map.find(new_oid);
+  Shard *s = _get_shard(oid);
+  Mutex::Locker l(s->lock);
+  return s->onode_map.count(oid);
+}
 
-  assert(po != onode_map.end());
-  if (pn != onode_map.end()) {
-    lru_list_t::iterator p = lru.iterator_to(*pn->second);
-    lru.erase(p);
-    onode_map.erase(pn);
-  }
-  onode_map.insert(make_pair(new_oid, po->second));
-  _touch(po->second);
-  onode_map.erase(po);
+NewStore::OnodeRef NewStore::OnodeCache::add(OnodeRef o, uint32_t encoded_len)
+{
+  Shard *s = _get_shard(o->oid);
+  Mutex::Locker l(s->lock);
+  ceph::unordered_map<ghobject_t,OnodeRef>::iterator p =
+    s->onode_map.find(o->oid);
+  if (p != s->onode_map.end()) {
+    dout(30) << __func__ << " " << o->oid << " raced with " << p->second
+	     << dendl;
+    return p->second;
+  }
+  dout(30) << __func__ << " " << o->oid << " " << o << dendl;
+  s->onode_map[o->oid] = o;
+  s->lru.push_front(*o);
+  logger->inc(l_newstore_onode_count);
+  _set_bytes(o.get(), sizeof(Onode) + o->key.length() + encoded_len);
+  _trim(s);
+  return o;
 }
 
-bool NewStore::OnodeHashLRU::get_next(
-  const ghobject_t& after,
-  pair<ghobject_t,OnodeRef> *next)
+void NewStore::OnodeCache::update(OnodeRef o, uint32_t encoded_len)
 {
-  Mutex::Locker l(lock);
-  dout(20) << __func__ << " after " << after << dendl;
+  Shard *s = _get_shard(o->oid);
+  Mutex::Locker l(s->lock);
+  if (!o->lru_item.is_linked())
+    return;  // evicted or replaced
+  _set_bytes(o.get(), sizeof(Onode) + o->key.length() + encoded_len);
+  _trim(s);
+}
 
-  if (after == ghobject_t()) {
-    if (lru.empty()) {
-      return false;
+void NewStore::OnodeCache::rename(OnodeRef o,
+				  const ghobject_t& old_oid,
+				  const ghobject_t& new_oid)
+{
+  dout(30) << __func__ << " " << old_oid << " -> " << new_oid << dendl;
+  uint32_t bytes;
+  {
+    Shard *s = _get_shard(old_oid);
+    Mutex::Locker l(s->lock);
+    ceph::unordered_map<ghobject_t,OnodeRef>::iterator p =
+      s->onode_map.find(old_oid);
+    assert(p != s->onode_map.end());
+    assert(p->second == o);
+    bytes = o->cache_bytes;
+    _remove(s, o.get());
+  }
+  {
+    Shard *s = _get_shard(new_oid);
+    Mutex::Locker l(s->lock);
+    ceph::unordered_map<ghobject_t,OnodeRef>::iterator p =
+      s->onode_map.find(new_oid);
+    if (p != s->onode_map.end())
+      _remove(s, p->second.get());
+    s->onode_map[new_oid] = o;
+    s->lru.push_front(*o);
+    logger->inc(l_newstore_onode_count);
+    // o->oid is not updated until we return
+    s->bytes += bytes;
+    logger->inc(l_newstore_onode_bytes, bytes);
+    o->cache_bytes = bytes;
+  }
+}
+
+void NewStore::OnodeCache::get_collection(Collection *c, list<OnodeRef> *ls)
+{
+  for (vector<Shard*>::iterator p = shards.begin(); p != shards.end(); ++p) {
+    Mutex::Locker l((*p)->lock);
+    for (lru_list_t::iterator q = (*p)->lru.begin();
+	 q != (*p)->lru.end();
+	 ++q) {
+      if (q->coll == c)
+	ls->push_back(&*q);
     }
-    ceph::unordered_map<ghobject_t,OnodeRef>::iterator p = onode_map.begin();
-    assert(p != onode_map.end());
-    next->first = p->first;
-    next->second = p->second;
-    return true;
   }
+}
 
-  ceph::unordered_map<ghobject_t,OnodeRef>::iterator p = onode_map.find(after);
-  assert(p != onode_map.end()); // for now
-  lru_list_t::iterator pi = lru.iterator_to(*p->second);
-  ++pi;
-  if (pi == lru.end()) {
-    return false;
-  }
-  next->first = pi->oid;
-  next->second = onode_map[pi->oid];
-  return true;
+void NewStore::OnodeCache::set_collection(OnodeRef o, Collection *c)
+{
+  Shard *s = _get_shard(o->oid);
+  Mutex::Locker l(s->lock);
+  o->coll = c;
 }
 
-int NewStore::OnodeHashLRU::trim(int max)
+void NewStore::OnodeCache::clear_collection(Collection *c)
 {
-  Mutex::Locker l(lock);
-  dout(20) << __func__ << " max " << max
-	   << " size " << onode_map.size() << dendl;
-  int trimmed = 0;
-  int num = onode_map.size() - max;
-  lru_list_t::iterator p = lru.end();
-  if (num)
-    --p;
-  while (num > 0) {
-    Onode *o = &*p;
-    int refs = o->nref.read();
-    if (refs > 1) {
-      dout(20) << __func__ << "  " << o->oid << " has " << refs
-	       << " refs; stopping with " << num << " left to trim" << dendl;
-      break;
-    }
-    dout(30) << __func__ << "  trim " << o->oid << dendl;
-    if (p != lru.begin()) {
-      lru.erase(p--);
-    } else {
-      lru.erase(p);
-      assert(num == 1);
+  dout(10) << __func__ << " " << c << dendl;
+  for (vector<Shard*>::iterator p = shards.begin(); p != shards.end(); ++p) {
+    Shard *s = *p;
+    Mutex::Locker l(s->lock);
+    lru_list_t::iterator q = s->lru.begin();
+    while (q != s->lru.end()) {
+      Onode *o = &*q;
+      ++q;
+      if (o->coll != c)
+	continue;
+      if (o->nref.read() == 1) {
+	_remove(s, o);
+      } else {
+	// still referenced; c is about to go away, so don't let a later
+	// collection allocated at the same address claim it
+	dout(30) << __func__ << " " << o->oid << " in use" << dendl;
+	o->coll = NULL;
+      }
     }
-    o->get();  // paranoia
-    onode_map.erase(o->oid);
-    o->put();
-    --num;
-    ++trimmed;
   }
-  return trimmed;
 }
 
 // =======================================================
@@ -499,8 +574,11 @@ NewStore::Collection::Collection(NewStore *ns, coll_t c)
   : store(ns),
     cid(c),
     lock("NewStore::Collection::lock"),
-    onode_map()
+    compression(ns->_choose_compression(c)),
+    compressor(NULL)
 {
+  if (!compression.empty())
+    compressor = ns->_get_compressor(compression);
 }
 
 NewStore::OnodeRef NewStore::Collection::get_onode(
@@ -518,7 +596,7 @@ NewStore::OnodeRef NewStore::Collection::get_onode(
     }
   }
 
-  OnodeRef o = onode_map.lookup(oid);
+  OnodeRef o = store->onode_cache.lookup(this, oid);
   if (o)
     return o;
 
@@ -537,18 +615,60 @@ NewStore::OnodeRef NewStore::Collection::get_onode(
       return OnodeRef();
 
     // new
-    on = new Onode(oid, key);
+    on = new Onode(this, oid, key);
     on->dirty = true;
   } else {
     // loaded
     assert(r >=0);
-    on = new Onode(oid, key);
+    on = new Onode(this, oid, key);
     bufferlist::iterator p = v.begin();
     ::decode(on->onode, p);
   }
   o.reset(on);
-  onode_map.add(oid, o);
-  return o;
+  return store->onode_cache.add(o, v.length());
+}
+
+/*
+ * Load the onodes of several objects into the cache with one batched
+ * kv read, so that the get_onode() calls that follow hit the cache.
+ */
+void NewStore::Collection::prefetch_onodes(const vector<ghobject_t>& oids)
+{
+  RWLock::RLocker l(lock);
+  map<string,ghobject_t> keys;
+  for (vector<ghobject_t>::const_iterator p = oids.begin();
+       p != oids.end();
+       ++p) {
+    if (store->onode_cache.contains(*p))
+      continue;
+    string key;
+    get_object_key(*p, &key);
+    keys[key] = *p;
+  }
+  if (keys.size() < 2)
+    return;  // get_onode() does a point get just as well
+
+  map<string,set<string> > want;
+  set<string>& ks = want[PREFIX_OBJ];
+  for (map<string,ghobject_t>::iterator p = keys.begin(); p != keys.end(); ++p)
+    ks.insert(ks.end(), p->first);
+  map<string,map<string,bufferlist> > got;
+  int r = store->db->get_batch(want, &got);
+  if (r < 0) {
+    dout(10) << __func__ << " get_batch got " << cpp_strerror(r) << dendl;
+    return;  // get_onode() will try again one at a time
+  }
+  map<string,bufferlist>& found = got[PREFIX_OBJ];
+  for (map<string,bufferlist>::iterator p = found.begin();
+       p != found.end();
+       ++p) {
+    Onode *on = new Onode(this, keys[p->first], p->first);
+    bufferlist::iterator bp = p->second.begin();
+    ::decode(on->onode, bp);
+    store->onode_cache.add(OnodeRef(on), p->second.length());
+  }
+  dout(20) << __func__ << " loaded " << found.size() << "/" << keys.size()
+	   << " onodes" << dendl;
 }
 
 
@@ -570,6 +690,10 @@ NewStore::NewStore(CephContext *cct, const string& path)
     frag_fd(-1),
     fset_fd(-1),
     mounted(false),
+    bdev(NULL),
+    alloc(NULL),
+    csum_order(0),
+    compressor_lock("NewStore::compressor_lock"),
     coll_lock("NewStore::coll_lock"),
     fid_lock("NewStore::fid_lock"),
     nid_lock("NewStore::nid_lock"),
@@ -607,7 +731,9 @@ NewStore::NewStore(CephContext *cct, const string& path)
     kv_sync_thread(this),
     kv_lock("NewStore::kv_lock"),
     kv_stop(false),
+    kv_queue_bytes(0),
     logger(NULL),
+    onode_cache(cct),
     reap_lock("NewStore::reap_lock")
 {
   _init_logger();
@@ -624,12 +750,48 @@ NewStore::~NewStore()
 
 void NewStore::_init_logger()
 {
-  // XXX
+  PerfCountersBuilder b(cct, "newstore", l_newstore_first, l_newstore_last);
+  b.add_u64_counter(l_newstore_onode_hit, "onode_hit",
+		    "Onode cache hits");
+  b.add_u64_counter(l_newstore_onode_miss, "onode_miss",
+		    "Onode cache misses");
+  b.add_u64_counter(l_newstore_onode_evict, "onode_evict",
+		    "Onodes evicted from cache");
+  b.add_u64(l_newstore_onode_count, "onode_count", "Onodes in cache");
+  b.add_u64(l_newstore_onode_bytes, "onode_bytes",
+	    "Estimated memory used by cached onodes");
+  b.add_u64_counter(l_newstore_kv_commit, "kv_commit",
+		    "Synchronous kv commits");
+  b.add_u64_avg(l_newstore_kv_batch, "kv_batch",
+		"Transactions per kv commit");
+  b.add_time_avg(l_newstore_kv_batch_wait_lat, "kv_batch_wait_lat",
+		 "Time spent waiting for a kv commit batch to fill");
+  b.add_time_avg(l_newstore_kv_commit_lat, "kv_commit_lat",
+		 "Kv commit latency");
+  static const char *batch_hist[] = {
+    "kv_batch_1", "kv_batch_2_3", "kv_batch_4_7",
+    "kv_batch_8_15", "kv_batch_16_31", "kv_batch_32_plus"
+  };
+  static const char *lat_hist[] = {
+    "kv_commit_lat_lt_1ms", "kv_commit_lat_1_2ms", "kv_commit_lat_2_4ms",
+    "kv_commit_lat_4_8ms", "kv_commit_lat_8_16ms", "kv_commit_lat_16ms_plus"
+  };
+  for (int i = 0; i <= l_newstore_kv_batch_hist_last -
+	 l_newstore_kv_batch_hist_first; ++i) {
+    b.add_u64_counter(l_newstore_kv_batch_hist_first + i, batch_hist[i],
+		      "Kv commits with this many transactions");
+    b.add_u64_counter(l_newstore_kv_lat_hist_first + i, lat_hist[i],
+		      "Kv commits with this latency");
+  }
+  logger = b.create_perf_counters();
+  cct->get_perfcounters_collection()->add(logger);
 }
 
 void NewStore::_shutdown_logger()
 {
-  // XXX
+  cct->get_perfcounters_collection()->remove(logger);
+  delete logger;
+  logger = NULL;
 }
 
 int NewStore::peek_journal_fsid(uuid_d *fsid)
@@ -818,6 +980,14 @@ int NewStore::_open_db()
     return -EIO;
   }
   db->init(g_conf->newstore_backend_options);
+  int r = db->set_column_families(g_conf->newstore_backend_cf_options);
+  if (r < 0) {
+    derr << __func__ << " bad newstore_backend_cf_options: "
+	 << cpp_strerror(r) << dendl;
+    delete db;
+    db = NULL;
+    return r;
+  }
   stringstream err;
   if (db->create_and_open(err)) {
     derr << __func__ << " erroring opening db: " << err.str() << dendl;
@@ -838,6 +1008,102 @@ void NewStore::_close_db()
   db = NULL;
 }
 
+int NewStore::_open_bdev(bool create)
+{
+  assert(bdev == NULL);
+  struct stat st;
+  int r = ::fstatat(path_fd, "block", &st, 0);
+  if (r < 0) {
+    r = -errno;
+    if (r == -ENOENT) {
+      dout(10) << __func__ << " no block device, storing data in fragments"
+	       << dendl;
+      return 0;
+    }
+    derr << __func__ << " cannot stat " << path << "/block: "
+	 << cpp_strerror(r) << dendl;
+    return r;
+  }
+
+  bdev = new BlockDevice(cct);
+  r = bdev->open(path + "/block");
+  if (r < 0) {
+    delete bdev;
+    bdev = NULL;
+    return r;
+  }
+
+  uint64_t min_alloc_size = MAX((uint64_t)g_conf->newstore_min_alloc_size,
+				bdev->get_block_size());
+  if ((min_alloc_size & (min_alloc_size - 1)) != 0) {
+    derr << __func__ << " min_alloc_size " << min_alloc_size
+	 << " is not a power of 2" << dendl;
+    r = -EINVAL;
+    goto out_bdev;
+  }
+
+  csum_order = 0;
+  if (g_conf->newstore_csum_block_size) {
+    uint32_t bs = g_conf->newstore_csum_block_size;
+    if (bs < 512 || (bs & (bs - 1)) != 0) {
+      derr << __func__ << " newstore_csum_block_size " << bs
+	   << " is not a power of 2 >= 512" << dendl;
+      r = -EINVAL;
+      goto out_bdev;
+    }
+    while ((1u << csum_order) < bs)
+      ++csum_order;
+  }
+
+  if (create) {
+    bufferlist bl;
+    db->get(PREFIX_SUPER, "bdev_size", &bl);
+    if (bl.length() == 0) {
+      KeyValueDB::Transaction t = db->get_transaction();
+      fm.create(bdev->get_size(), t);
+      fm.shutdown();
+      ::encode(bdev->get_size(), bl);
+      t->set(PREFIX_SUPER, "bdev_size", bl);
+      db->submit_transaction_sync(t);
+    } else {
+      dout(1) << __func__ << " freelist already initialized" << dendl;
+    }
+  }
+
+  r = fm.init(db, PREFIX_ALLOC);
+  if (r < 0)
+    goto out_bdev;
+
+  alloc = new ExtentAllocator(min_alloc_size);
+  for (map<uint64_t,uint64_t>::const_iterator p = fm.get_freelist().begin();
+       p != fm.get_freelist().end();
+       ++p) {
+    alloc->init_add_free(p->first, p->second);
+  }
+  dout(1) << __func__ << " " << path << "/block " << fm.get_total_free()
+	  << " of " << bdev->get_size() << " bytes free" << dendl;
+  return 0;
+
+ out_bdev:
+  bdev->close();
+  delete bdev;
+  bdev = NULL;
+  return r;
+}
+
+void NewStore::_close_bdev()
+{
+  if (!bdev)
+    return;
+  alloc->shutdown();
+  delete alloc;
+  alloc = NULL;
+  fm.shutdown();
+  bdev->close();
+  delete bdev;
+  bdev = NULL;
+}
+
 int NewStore::_aio_start()
 {
   if (g_conf->newstore_aio) {
@@ -861,6 +1127,66 @@ void NewStore::_aio_stop()
   }
 }
 
+int NewStore::_open_compression()
+{
+  compression_pools.clear();
+  list<string> ls;
+  get_str_list(g_conf->newstore_compression_pools, ls);
+  for (list<string>::iterator p = ls.begin(); p != ls.end(); ++p) {
+    string err;
+    int64_t pool = strict_strtoll(p->c_str(), 10, &err);
+    if (!err.empty()) {
+      derr << __func__ << " bad pool id '" << *p << "' in "
+	   << "newstore_compression_pools: " << err << dendl;
+      return -EINVAL;
+    }
+    compression_pools.insert(pool);
+  }
+  if (g_conf->newstore_compression.length() &&
+      !_get_compressor(g_conf->newstore_compression)) {
+    derr << __func__ << " unknown compressor '"
+	 << g_conf->newstore_compression << "'" << dendl;
+    return -EINVAL;
+  }
+  dout(10) << __func__ << " compression '" << g_conf->newstore_compression
+	   << "' pools " << compression_pools << dendl;
+  return 0;
+}
+
+void NewStore::_close_compression()
+{
+  Mutex::Locker l(compressor_lock);
+  for (map<string,Compressor*>::iterator p = compressors.begin();
+       p != compressors.end();
+       ++p)
+    delete p->second;
+  compressors.clear();
+}
+
+Compressor *NewStore::_get_compressor(const string& type)
+{
+  Mutex::Locker l(compressor_lock);
+  map<string,Compressor*>::iterator p = compressors.find(type);
+  if (p != compressors.end())
+    return p->second;
+  Compressor *c = Compressor::create(type);
+  if (c)
+    compressors[type] = c;
+  return c;
+}
+
+string NewStore::_choose_compression(coll_t cid)
+{
+  if (g_conf->newstore_compression.empty())
+    return string();
+  if (!compression_pools.empty()) {
+    spg_t pgid;
+    if (!cid.is_pg(&pgid) || !compression_pools.count(pgid.pool()))
+      return string();
+  }
+  return g_conf->newstore_compression;
+}
+
 int NewStore::_open_collections()
 {
   KeyValueDB::Iterator it = db->get_iterator(PREFIX_COLL);
@@ -932,14 +1258,37 @@ int NewStore::mkfs()
     if (r < 0)
       goto out_close_frag;
   }
+  if (g_conf->newstore_block_path.length()) {
+    r = symlinkat(g_conf->newstore_block_path.c_str(), path_fd, "block");
+    if (r < 0 && errno != EEXIST) {
+      r = -errno;
+      derr << __func__ << " failed to link " << path << "/block to "
+	   << g_conf->newstore_block_path << ": " << cpp_strerror(r) << dendl;
+      goto out_close_frag;
+    }
+    r = BlockDevice::create(g_conf->newstore_block_path,
+			    g_conf->newstore_block_size);
+    if (r < 0) {
+      derr << __func__ << " failed to create " << g_conf->newstore_block_path
+	   << ": " << cpp_strerror(r) << dendl;
+      goto out_close_frag;
+    }
+  }
   r = _open_db();
   if (r < 0)
     goto out_close_frag;
 
+  r = _open_bdev(true);
+  if (r < 0)
+    goto out_close_db;
+
   // FIXME: superblock
 
   dout(10) << __func__ << " success" << dendl;
   r = 0;
+  _close_bdev();
+
+ out_close_db:
   _close_db();
 
  out_close_frag:
@@ -980,21 +1329,32 @@ int NewStore::mount()
   if (r < 0)
     goto out_frag;
 
-  r = _recover_next_fid();
+  r = _open_bdev(false);
   if (r < 0)
     goto out_db;
 
+  r = _recover_next_fid();
+  if (r < 0)
+    goto out_bdev;
+
   r = _recover_next_nid();
   if (r < 0)
-    goto out_db;
+    goto out_bdev;
+
+  r = _open_compression();
+  if (r < 0)
+    goto out_bdev;
+
+  onode_cache.init(g_conf->newstore_onode_cache_shards,
+		   g_conf->newstore_onode_cache_size, logger);
 
   r = _open_collections();
   if (r < 0)
-    goto out_db;
+    goto out_compression;
 
   r = _aio_start();
   if (r < 0)
-    goto out_db;
+    goto out_compression;
 
   r = _wal_replay();
   if (r < 0)
@@ -1010,6 +1370,11 @@ int NewStore::mount()
 
  out_aio:
   _aio_stop();
+ out_compression:
+  onode_cache.shutdown();
+  _close_compression();
+ out_bdev:
+  _close_bdev();
  out_db:
   _close_db();
  out_frag:
@@ -1048,6 +1413,9 @@ int NewStore::umount()
   mounted = false;
   if (fset_fd >= 0)
     VOID_TEMP_FAILURE_RETRY(::close(fset_fd));
+  onode_cache.shutdown();
+  _close_compression();
+  _close_bdev();
   _close_db();
   _close_frag();
   _close_fsid();
@@ -1075,6 +1443,14 @@ void NewStore::_sync()
 
 int NewStore::statfs(struct statfs *buf)
 {
+  if (bdev) {
+    memset(buf, 0, sizeof(*buf));
+    buf->f_bsize = bdev->get_block_size();
+    buf->f_blocks = bdev->get_size() / buf->f_bsize;
+    buf->f_bfree = alloc->get_free() / buf->f_bsize;
+    buf->f_bavail = buf->f_bfree;
+    return 0;
+  }
   if (::statfs(path.c_str(), buf) < 0) {
     int r = -errno;
     assert(!g_conf->newstore_fail_eio || r != -EIO);
@@ -1116,17 +1492,18 @@ void NewStore::_reap_collections()
     CollectionRef c = *p;
     dout(10) << __func__ << " " << c->cid << dendl;
     {
-      pair<ghobject_t,OnodeRef> next;
-      while (c->onode_map.get_next(next.first, &next)) {
-	assert(!next.second->exists);
-	if (!next.second->flush_txns.empty()) {
-	  dout(10) << __func__ << " " << c->cid << " " << next.second->oid
-		   << " flush_txns " << next.second->flush_txns << dendl;
+      list<OnodeRef> ls;
+      onode_cache.get_collection(&*c, &ls);
+      for (list<OnodeRef>::iterator q = ls.begin(); q != ls.end(); ++q) {
+	assert(!(*q)->exists);
+	if (!(*q)->flush_txns.empty()) {
+	  dout(10) << __func__ << " " << c->cid << " " << (*q)->oid
+		   << " flush_txns " << (*q)->flush_txns << dendl;
 	  return;
 	}
       }
     }
-    c->onode_map.clear();
+    onode_cache.clear_collection(&*c);
     dout(10) << __func__ << " " << c->cid << " done" << dendl;
   }
 
@@ -1221,6 +1598,7 @@ int NewStore::_do_read(
   int r;
   int fd = -1;
   fid_t cur_fid;
+  bufferlist cdata;  ///< decompressed data for the current fragment
 
   dout(20) << __func__ << " " << offset << "~" << length << " size "
 	   << o->onode.size << dendl;
@@ -1290,6 +1668,44 @@ int NewStore::_do_read(
     }
 
     // frag?
+    if (fp != fend && fp->first <= offset && fp->second.is_compressed()) {
+      if (cdata.length() == 0) {
+	r = _decompress_fragment(NULL, fp->second, &cdata);
+	if (r < 0)
+	  goto out;
+      }
+      uint64_t x_off = offset - fp->first;
+      x_len = MIN(x_len, fp->second.length - x_off);
+      dout(30) << __func__ << " data " << fp->first << " " << fp->second
+	       << " use " << x_off << "~" << x_len << dendl;
+      bufferlist t;
+      t.substr_of(cdata, x_off, x_len);
+      bl.claim_append(t);
+      offset += x_len;
+      length -= x_len;
+      if (x_off + x_len == fp->second.length) {
+	cdata.clear();
+	++fp;
+      }
+      continue;
+    }
+    if (fp != fend && fp->first <= offset && fp->second.is_block()) {
+      uint64_t x_off = offset - fp->first;
+      x_len = MIN(x_len, fp->second.length - x_off);
+      dout(30) << __func__ << " data " << fp->first << " " << fp->second
+	       << " use " << x_off << "~" << x_len << dendl;
+      bufferlist t;
+      r = _block_read_verify(NULL, fp->second, x_off, x_len, &t);
+      if (r < 0)
+	goto out;
+      bl.claim_append(t);
+      offset += x_len;
+      length -= x_len;
+      if (x_off + x_len == fp->second.length) {
+	++fp;
+      }
+      continue;
+    }
     if (fp != fend && fp->first <= offset) {
       if (fp->second.fid != cur_fid) {
 	cur_fid = fp->second.fid;
@@ -1890,13 +2306,26 @@ int NewStore::omap_get_values(
   if (!o->onode.omap_head)
     goto out;
   o->flush();
-  for (set<string>::const_iterator p = keys.begin(); p != keys.end(); ++p) {
-    string key;
-    get_omap_key(o->onode.omap_head, *p, &key);
-    bufferlist val;
-    if (db->get(PREFIX_OMAP, key, &val) >= 0) {
-      dout(30) << __func__ << "  got " << key << " -> " << *p << dendl;
-      out->insert(make_pair(*p, val));
+  {
+    // one batched lookup; the encoded keys sort like the user keys
+    set<string> to_get;
+    for (set<string>::const_iterator p = keys.begin(); p != keys.end(); ++p) {
+      string key;
+      get_omap_key(o->onode.omap_head, *p, &key);
+      to_get.insert(to_get.end(), key);
+    }
+    map<string, bufferlist> got;
+    r = db->get(PREFIX_OMAP, to_get, &got);
+    if (r < 0)
+      goto out;
+    for (map<string, bufferlist>::iterator p = got.begin();
+	 p != got.end();
+	 ++p) {
+      string user_key;
+      decode_omap_key(p->first, &user_key);
+      dout(30) << __func__ << "  got " << p->first << " -> " << user_key
+	       << dendl;
+      (*out)[user_key].claim(p->second);
     }
   }
  out:
@@ -1925,15 +2354,25 @@ int NewStore::omap_check_keys(
   if (!o->onode.omap_head)
     goto out;
   o->flush();
-  for (set<string>::const_iterator p = keys.begin(); p != keys.end(); ++p) {
-    string key;
-    get_omap_key(o->onode.omap_head, *p, &key);
-    bufferlist val;
-    if (db->get(PREFIX_OMAP, key, &val) >= 0) {
-      dout(30) << __func__ << "  have " << key << " -> " << *p << dendl;
-      out->insert(*p);
-    } else {
-      dout(30) << __func__ << "  miss " << key << " -> " << *p << dendl;
+  {
+    set<string> to_get;
+    for (set<string>::const_iterator p = keys.begin(); p != keys.end(); ++p) {
+      string key;
+      get_omap_key(o->onode.omap_head, *p, &key);
+      to_get.insert(to_get.end(), key);
+    }
+    map<string, bufferlist> got;
+    r = db->get(PREFIX_OMAP, to_get, &got);
+    if (r < 0)
+      goto out;
+    for (map<string, bufferlist>::iterator p = got.begin();
+	 p != got.end();
+	 ++p) {
+      string user_key;
+      decode_omap_key(p->first, &user_key);
+      dout(30) << __func__ << "  have " << p->first << " -> " << user_key
+	       << dendl;
+      out->insert(user_key);
     }
   }
  out:
@@ -2182,13 +2621,20 @@ void NewStore::_txc_state_proc(TransContext *txc)
       if (!g_conf->newstore_sync_transaction) {
 	Mutex::Locker l(kv_lock);
 	if (g_conf->newstore_sync_submit_transaction) {
+	  _txc_update_fm(txc);
 	  db->submit_transaction(txc->t);
 	}
 	kv_queue.push_back(txc);
+	kv_queue_bytes += txc->bytes;
 	kv_cond.SignalOne();
 	return;
       }
-      db->submit_transaction_sync(txc->t);
+      {
+	// freelist updates must reach the kv store in the order we make them
+	Mutex::Locker l(kv_lock);
+	_txc_update_fm(txc);
+	db->submit_transaction_sync(txc->t);
+      }
       break;
 
     case TransContext::STATE_KV_QUEUED:
@@ -2300,6 +2746,7 @@ int NewStore::_txc_finalize(OpSequencer *osr, TransContext *txc)
     bufferlist bl;
     ::encode((*p)->onode, bl);
     txc->t->set(PREFIX_OBJ, (*p)->key, bl);
+    onode_cache.update(*p, bl.length());
 
     Mutex::Locker l((*p)->flush_lock);
     (*p)->flush_txns.insert(txc);
@@ -2347,6 +2794,26 @@ void NewStore::_txc_do_sync_fsync(TransContext *txc)
   }
 }
 
+void NewStore::_txc_update_fm(TransContext *txc)
+{
+  if (txc->allocated.empty() && txc->released.empty())
+    return;
+  dout(20) << __func__ << " txc " << txc << " allocated " << txc->allocated
+	   << " released " << txc->released << dendl;
+  for (interval_set<uint64_t>::iterator p = txc->allocated.begin();
+       p != txc->allocated.end();
+       ++p) {
+    int r = fm.allocate(p.get_start(), p.get_len(), txc->t);
+    assert(r == 0);
+  }
+  for (interval_set<uint64_t>::iterator p = txc->released.begin();
+       p != txc->released.end();
+       ++p) {
+    int r = fm.release(p.get_start(), p.get_len(), txc->t);
+    assert(r == 0);
+  }
+}
+
 void NewStore::_txc_finish_kv(TransContext *txc)
 {
   dout(20) << __func__ << " txc " << txc << dendl;
@@ -2421,8 +2888,12 @@ void NewStore::_osr_reap_done(OpSequencer *osr)
       break;
     }
 
-    if (txc->first_collection) {
-      txc->first_collection->onode_map.trim(g_conf->newstore_onode_map_size);
+    // released extents may be reused only now that this txc and all
+    // prior txcs in the sequencer (and their wal ops) are complete.
+    for (interval_set<uint64_t>::iterator p = txc->released.begin();
+	 p != txc->released.end();
+	 ++p) {
+      alloc->release(p.get_start(), p.get_len());
     }
 
     osr->q.pop_front();
@@ -2451,7 +2922,8 @@ void NewStore::_aio_thread()
 	dout(10) << __func__ << " finished aio " << aio[i] << " txc " << txc
 		 << " state " << txc->get_state_name() << ", "
 		 << left << " aios left" << dendl;
-	VOID_TEMP_FAILURE_RETRY(::close(aio[i]->fd));
+	if (!bdev || aio[i]->fd != bdev->get_fd_direct())
+	  VOID_TEMP_FAILURE_RETRY(::close(aio[i]->fd));
 	if (left == 0) {
 	  _txc_state_proc(txc);
 	}
@@ -2461,9 +2933,21 @@ void NewStore::_aio_thread()
   dout(10) << __func__ << " end" << dendl;
 }
 
+// bucket for v in a power-of-2 histogram: 0-1, 2-3, 4-7, ... (max+)
+static int pow2_bucket(uint64_t v, int max)
+{
+  int b = 0;
+  while (v > 1 && b < max) {
+    v >>= 1;
+    ++b;
+  }
+  return b;
+}
+
 void NewStore::_kv_sync_thread()
 {
   dout(10) << __func__ << " start" << dendl;
+  unsigned last_batch = 0;
   kv_lock.Lock();
   while (true) {
     assert(kv_committing.empty());
@@ -2476,10 +2960,31 @@ void NewStore::_kv_sync_thread()
       kv_cond.Wait(kv_lock);
       dout(20) << __func__ << " wake" << dendl;
     } else {
+      // group commit.  if the last commit was shared by several txcs
+      // there are concurrent writers, so give them a moment to join
+      // this one.  a lone writer never waits.
+      if (last_batch > 1 &&
+	  !kv_queue.empty() &&
+	  g_conf->newstore_kv_batch_max_us > 0) {
+	utime_t wait_start = ceph_clock_now(NULL);
+	utime_t until = wait_start;
+	until += (double)g_conf->newstore_kv_batch_max_us / 1000000.0;
+	while (!kv_stop &&
+	       kv_queue.size() < (unsigned)g_conf->newstore_kv_batch_max_txcs &&
+	       kv_queue_bytes < g_conf->newstore_kv_batch_max_bytes) {
+	  if (kv_cond.WaitUntil(kv_lock, until) == ETIMEDOUT)
+	    break;
+	}
+	logger->tinc(l_newstore_kv_batch_wait_lat,
+		     ceph_clock_now(NULL) - wait_start);
+      }
       dout(20) << __func__ << " committing " << kv_queue.size()
+	       << " (" << kv_queue_bytes << " bytes)"
 	       << " cleaning " << wal_cleanup_queue.size() << dendl;
       kv_committing.swap(kv_queue);
       wal_cleaning.swap(wal_cleanup_queue);
+      kv_queue_bytes = 0;
+      last_batch = kv_committing.size();
       utime_t start = ceph_clock_now(NULL);
       kv_lock.Unlock();
 
@@ -2487,6 +2992,7 @@ void NewStore::_kv_sync_thread()
 	for (std::deque<TransContext *>::iterator it = kv_committing.begin();
 	     it != kv_committing.end();
 	     ++it) {
+	  _txc_update_fm(*it);
 	  db->submit_transaction((*it)->t);
 	}
       }
@@ -2525,6 +3031,16 @@ void NewStore::_kv_sync_thread()
       dout(20) << __func__ << " committed " << kv_committing.size()
 	       << " cleaned " << wal_cleaning.size()
 	       << " in " << dur << dendl;
+      logger->inc(l_newstore_kv_commit);
+      logger->tinc(l_newstore_kv_commit_lat, dur);
+      if (!kv_committing.empty()) {
+	logger->inc(l_newstore_kv_batch, kv_committing.size());
+	logger->inc(l_newstore_kv_batch_hist_first +
+		    pow2_bucket(kv_committing.size(), 5));
+      }
+      uint64_t ms = dur.to_msec();
+      logger->inc(l_newstore_kv_lat_hist_first +
+		  (ms ? 1 + pow2_bucket(ms, 4) : 0));
       while (!kv_committing.empty()) {
 	TransContext *txc = kv_committing.front();
 	_txc_state_proc(txc);
@@ -2586,6 +3102,7 @@ int NewStore::_do_wal_transaction(wal_transaction_t& wt,
 {
   vector<int> sync_fds;
   sync_fds.reserve(wt.ops.size());
+  bool sync_bdev = false;
 
   // read all the overlay data first for apply
   _do_read_all_overlays(wt);
@@ -2609,9 +3126,15 @@ int NewStore::_do_wal_transaction(wal_transaction_t& wt,
 	    p->data.rebuild();
 	  }
 	}
-	int fd = _open_fid(p->fid, flags);
-	if (fd < 0)
-	  return fd;
+	bool block = (p->fid == fid_t());
+	int fd;
+	if (block) {
+	  fd = bdev->get_fd_direct();
+	} else {
+	  fd = _open_fid(p->fid, flags);
+	  if (fd < 0)
+	    return fd;
+	}
 #ifdef HAVE_LIBAIO
 	if (g_conf->newstore_aio && txc && (flags & O_DIRECT)) {
 	  txc->pending_aios.push_back(FS::aio_t(txc, fd));
@@ -2621,7 +3144,12 @@ int NewStore::_do_wal_transaction(wal_transaction_t& wt,
 	  dout(2) << __func__ << " prepared aio " << &aio << dendl;
 	} else
 #endif
-	{
+	if (block) {
+	  int r = bdev->write(p->offset, p->data);
+	  if (r < 0)
+	    return r;
+	  sync_bdev = true;
+	} else {
 	  int r = ::lseek64(fd, p->offset, SEEK_SET);
 	  if (r < 0) {
 	    r = -errno;
@@ -2646,6 +3174,13 @@ int NewStore::_do_wal_transaction(wal_transaction_t& wt,
       {
 	dout(20) << __func__ << " zero " << p->fid << " "
 		 << p->offset << "~" << p->length << dendl;
+	if (p->fid == fid_t()) {
+	  int r = bdev->zero(p->offset, p->length);
+	  if (r < 0)
+	    return r;
+	  sync_bdev = true;
+	  break;
+	}
 	int fd = _open_fid(p->fid, O_RDWR);
 	if (fd < 0)
 	  return fd;
@@ -2700,6 +3235,10 @@ int NewStore::_do_wal_transaction(wal_transaction_t& wt,
     assert(r == 0);
     VOID_TEMP_FAILURE_RETRY(::close(*p));
   }
+  if (sync_bdev) {
+    int r = bdev->flush();
+    assert(r == 0);
+  }
 
   return 0;
 }
@@ -2839,6 +3378,48 @@ void NewStore::_txc_aio_submit(TransContext *txc)
   }
 }
 
+/*
+ * Batch the onode lookups of the objects a transaction operates on,
+ * one kv read per collection, instead of one per object as each op
+ * gets to it.
+ */
+void NewStore::_txc_prefetch_onodes(Transaction::iterator i,
+				    vector<CollectionRef>& cvec)
+{
+  vector<vector<ghobject_t> > oids(cvec.size());
+  while (i.have_op()) {
+    Transaction::Op *op = i.decode_op();
+    switch (op->op) {
+    case Transaction::OP_CLONE:
+    case Transaction::OP_CLONERANGE:
+    case Transaction::OP_CLONERANGE2:
+      oids[op->cid].push_back(i.get_oid(op->dest_oid));
+      // fall through
+    case Transaction::OP_TOUCH:
+    case Transaction::OP_WRITE:
+    case Transaction::OP_ZERO:
+    case Transaction::OP_TRUNCATE:
+    case Transaction::OP_REMOVE:
+    case Transaction::OP_SETATTR:
+    case Transaction::OP_SETATTRS:
+    case Transaction::OP_RMATTR:
+    case Transaction::OP_RMATTRS:
+    case Transaction::OP_OMAP_CLEAR:
+    case Transaction::OP_OMAP_SETKEYS:
+    case Transaction::OP_OMAP_RMKEYS:
+    case Transaction::OP_OMAP_RMKEYRANGE:
+    case Transaction::OP_OMAP_SETHEADER:
+    case Transaction::OP_SETALLOCHINT:
+      oids[op->cid].push_back(i.get_oid(op->oid));
+      break;
+    }
+  }
+  for (unsigned j = 0; j < cvec.size(); ++j) {
+    if (cvec[j] && oids[j].size() > 1)
+      cvec[j]->prefetch_onodes(oids[j]);
+  }
+}
+
 int NewStore::_txc_add_transaction(TransContext *txc, Transaction *t)
 {
   Transaction::iterator i = t->begin();
@@ -2849,11 +3430,9 @@ int NewStore::_txc_add_transaction(TransContext *txc, Transaction *t)
   for (vector<coll_t>::iterator p = i.colls.begin(); p != i.colls.end();
        ++p, ++j) {
     cvec[j] = _get_collection(*p);
-
-    // note first collection we reference
-    if (!j && !txc->first_collection)
-      txc->first_collection = cvec[j];
   }
+  if (i.objects.size() > 1)
+    _txc_prefetch_onodes(i, cvec);
 
   while (i.have_op()) {
     Transaction::Op *op = i.decode_op();
@@ -3380,6 +3959,7 @@ void NewStore::_do_read_all_overlays(wal_transaction_t& wt)
 }
 
 int NewStore::_do_write(TransContext *txc,
+			CollectionRef& c,
 			OnodeRef o,
 			uint64_t offset, uint64_t length,
 			bufferlist& bl,
@@ -3388,6 +3968,7 @@ int NewStore::_do_write(TransContext *txc,
   int fd = -1;
   int r = 0;
   unsigned flags;
+  bool use_overlay;
 
   dout(20) << __func__ << " have " << o->onode.size
 	   << " bytes in " << o->onode.data_map.size()
@@ -3400,15 +3981,35 @@ int NewStore::_do_write(TransContext *txc,
     goto out;
   }
 
-  if ((int)o->onode.overlay_map.size() < g_conf->newstore_overlay_max &&
-      (int)length <= g_conf->newstore_overlay_max_length) {
+  use_overlay =
+    (int)o->onode.overlay_map.size() < g_conf->newstore_overlay_max &&
+    (int)length <= g_conf->newstore_overlay_max_length;
+
+  if (!o->onode.data_map.empty() &&
+      o->onode.data_map.begin()->second.is_compressed()) {
+    // compressed data cannot be modified in place, but it can be
+    // replaced entirely or covered by overlays within the object.
+    bool uncompress;
+    if (use_overlay)
+      uncompress = offset + length > o->onode.size;
+    else
+      uncompress = offset > 0 || length < o->onode.size;
+    if (uncompress) {
+      r = _do_uncompress(txc, o);
+      if (r < 0)
+	goto out;
+    }
+  }
+
+  if (use_overlay) {
     // write an overlay
     r = _do_overlay_write(txc, o, offset, length, bl);
     if (r < 0)
       goto out;
     if (offset + length > o->onode.size) {
-      // make sure the data fragment matches
-      if (!o->onode.data_map.empty()) {
+      // make sure the data fragment matches.  (block fragments do
+      // not need to extend to the end of the object.)
+      if (!o->onode.data_map.empty() && !bdev) {
 	assert(o->onode.data_map.size() == 1);
 	fragment_t& f = o->onode.data_map.begin()->second;
 	assert(f.offset == 0);
@@ -3426,6 +4027,11 @@ int NewStore::_do_write(TransContext *txc,
     goto out;
   }
 
+  if (bdev) {
+    r = _do_block_write(txc, c, o, offset, length, bl, fadvise_flags);
+    goto out;
+  }
+
   flags = O_RDWR;
   if (g_conf->newstore_o_direct &&
       (offset & ~CEPH_PAGE_MASK) == 0 &&
@@ -3448,6 +4054,8 @@ int NewStore::_do_write(TransContext *txc,
       fragment_t &f = o->onode.data_map[0];
       f.offset = 0;
       f.length = MAX(offset + length, o->onode.size);
+      if (offset == 0 && length >= o->onode.size && _compress(c, bl, &f))
+	flags = O_RDWR;  // compressed data is not page-aligned
       fd = _create_fid(txc, &f.fid, flags);
       if (fd < 0) {
 	r = fd;
@@ -3516,6 +4124,8 @@ int NewStore::_do_write(TransContext *txc,
 
     f.length = length;
     o->onode.size = length;
+    if (_compress(c, bl, &f))
+      flags = O_RDWR;  // compressed data is not page-aligned
     fd = _create_fid(txc, &f.fid, O_RDWR);
     if (fd < 0) {
       r = fd;
@@ -3624,6 +4234,611 @@ int NewStore::_clean_fid_tail(TransContext *txc, const fragment_t& f)
 }
 
 
+int NewStore::_block_allocate(TransContext *txc, uint64_t want, uint64_t hint,
+			      fragment_t *f)
+{
+  uint64_t offset, length;
+  int r = alloc->allocate(want, hint, &offset, &length);
+  if (r == -ENOSPC) {
+    // expected as the device fills up; callers may retry with less
+    dout(10) << __func__ << " no space for " << want << " bytes" << dendl;
+    return r;
+  }
+  if (r < 0) {
+    derr << __func__ << " failed to allocate " << want << " bytes: "
+	 << cpp_strerror(r) << dendl;
+    return r;
+  }
+  txc->allocated.insert(offset, length);
+  f->fid = fid_t();
+  f->offset = 0;
+  f->block_offset = offset;
+  f->block_length = length;
+  f->csum_order = csum_order;
+  f->csum.clear();
+  dout(20) << __func__ << " want " << want << " got " << offset << "~"
+	   << length << dendl;
+  return 0;
+}
+
+void NewStore::_block_release(TransContext *txc, const fragment_t& f)
+{
+  assert(f.is_block());
+  dout(20) << __func__ << " " << f << dendl;
+  txc->released.insert(f.block_offset, f.block_length);
+}
+
+void NewStore::_block_sync(TransContext *txc)
+{
+  if (txc->sync_bdev)
+    return;
+  int fd = ::dup(bdev->get_fd_buffered());
+  assert(fd >= 0);
+  txc->sync_fd(fd);
+  txc->sync_bdev = true;
+}
+
+/*
+ * Write into space that nothing else references yet (a new extent, or
+ * the unused tail of an allocated extent), so no wal is needed.
+ */
+int NewStore::_block_write(TransContext *txc, uint64_t offset, bufferlist& bl)
+{
+  dout(20) << __func__ << " " << offset << "~" << bl.length() << dendl;
+#ifdef HAVE_LIBAIO
+  if (g_conf->newstore_aio &&
+      g_conf->newstore_o_direct &&
+      (offset & ~CEPH_PAGE_MASK) == 0 &&
+      (bl.length() & ~CEPH_PAGE_MASK) == 0) {
+    if (!bl.is_page_aligned()) {
+      dout(20) << __func__ << " rebuilding buffer to be page-aligned" << dendl;
+      bl.rebuild();
+    }
+    txc->pending_aios.push_back(FS::aio_t(txc, bdev->get_fd_direct()));
+    FS::aio_t& aio = txc->pending_aios.back();
+    bl.prepare_iov(&aio.iov);
+    txc->aio_bl.append(bl);
+    aio.pwritev(offset);
+    txc->pending_block_writes[offset] = bl;
+    dout(2) << __func__ << " prepared aio " << &aio << dendl;
+    return 0;
+  }
+#endif
+  int r = bdev->write(offset, bl);
+  if (r < 0)
+    return r;
+  _block_sync(txc);
+  return 0;
+}
+
+/*
+ * Read from the block device, including any data this txc has written
+ * via aio that has not been submitted yet.
+ */
+int NewStore::_block_read(TransContext *txc, uint64_t offset, uint64_t length,
+			  bufferlist *bl)
+{
+  bufferlist t;
+  int r = bdev->read(offset, length, &t);
+  if (r < 0)
+    return r;
+  if (txc) {
+    uint64_t end = offset + length;
+    for (map<uint64_t,bufferlist>::iterator p =
+	   txc->pending_block_writes.begin();
+	 p != txc->pending_block_writes.end();
+	 ++p) {
+      uint64_t pend = p->first + p->second.length();
+      if (pend <= offset || p->first >= end)
+	continue;
+      uint64_t x_off = MAX(offset, p->first);
+      uint64_t x_len = MIN(end, pend) - x_off;
+      bufferlist data;
+      data.substr_of(p->second, x_off - p->first, x_len);
+      t.copy_in(x_off - offset, x_len, data);
+    }
+  }
+  bl->claim_append(t);
+  return 0;
+}
+
+// crc32c of bl[off, off+len) without flattening the bufferlist
+static uint32_t bl_crc32c(const bufferlist& bl, unsigned off, unsigned len)
+{
+  uint32_t crc = -1;
+  for (list<bufferptr>::const_iterator p = bl.buffers().begin();
+       p != bl.buffers().end() && len > 0;
+       ++p) {
+    if (off >= p->length()) {
+      off -= p->length();
+      continue;
+    }
+    unsigned l = MIN(len, p->length() - off);
+    crc = ceph_crc32c(crc, (unsigned char*)p->c_str() + off, l);
+    off = 0;
+    len -= l;
+  }
+  return crc;
+}
+
+/*
+ * Read part of a block fragment, verifying the checksums of every
+ * block the range touches.
+ */
+int NewStore::_block_read_verify(TransContext *txc, const fragment_t& f,
+				 uint64_t x_off, uint64_t x_len,
+				 bufferlist *bl)
+{
+  if (!f.has_csum())
+    return _block_read(txc, f.block_offset + x_off, x_len, bl);
+
+  uint64_t bs = f.get_csum_block_size();
+  uint64_t b_off = x_off & ~(bs - 1);
+  uint64_t b_end = MIN(ROUND_UP_TO(x_off + x_len, bs),
+		       (uint64_t)f.stored_length());
+  assert(x_off + x_len <= b_end);
+  bufferlist t;
+  int r = _block_read(txc, f.block_offset + b_off, b_end - b_off, &t);
+  if (r < 0)
+    return r;
+  for (uint64_t pos = b_off; pos < b_end; pos += bs) {
+    unsigned l = MIN(bs, b_end - pos);
+    uint32_t crc = bl_crc32c(t, pos - b_off, l);
+    uint32_t expected = f.csum[pos / bs];
+    if (crc != expected) {
+      derr << __func__ << " bad crc32c " << std::hex << crc
+	   << " expected " << expected << std::dec
+	   << " at " << f << " offset " << pos << "~" << l << dendl;
+      return -EIO;
+    }
+  }
+  bufferlist u;
+  u.substr_of(t, x_off - b_off, x_len);
+  bl->claim_append(u);
+  return 0;
+}
+
+/*
+ * Read what a block fragment will contain once this txc and everything
+ * before it are applied: wait for earlier txcs, then include the wal
+ * ops this txc has queued so far.
+ */
+int NewStore::_block_read_current(TransContext *txc, OnodeRef o,
+				  const fragment_t& f,
+				  uint64_t x_off, uint64_t x_len,
+				  bufferlist *bl)
+{
+  o->flush();
+  uint64_t start = f.block_offset + x_off;
+  uint64_t end = start + x_len;
+  bufferlist t;
+  int r = _block_read(txc, start, x_len, &t);
+  if (r < 0)
+    return r;
+  if (txc->wal_txn) {
+    for (list<wal_op_t>::iterator p = txc->wal_txn->ops.begin();
+	 p != txc->wal_txn->ops.end();
+	 ++p) {
+      if (p->fid != fid_t() ||
+	  p->offset >= end ||
+	  p->offset + p->length <= start)
+	continue;
+      uint64_t o_off = MAX(start, p->offset);
+      uint64_t o_len = MIN(end, p->offset + p->length) - o_off;
+      bufferlist data;
+      if (p->op == wal_op_t::OP_WRITE) {
+	data.substr_of(p->data, o_off - p->offset, o_len);
+      } else {
+	assert(p->op == wal_op_t::OP_ZERO);
+	bufferptr z(o_len);
+	z.zero();
+	data.append(z);
+      }
+      t.copy_in(o_off - start, o_len, data);
+    }
+  }
+  bl->claim_append(t);
+  return 0;
+}
+
+/// checksum stored data bl, which starts at block-aligned offset b_off
+void NewStore::_csum_calc(fragment_t *f, uint64_t b_off, const bufferlist& bl)
+{
+  if (!f->has_csum())
+    return;
+  uint64_t bs = f->get_csum_block_size();
+  assert((b_off & (bs - 1)) == 0);
+  uint64_t end = MIN(b_off + bl.length(), (uint64_t)f->stored_length());
+  f->csum.resize(DIV_ROUND_UP(f->stored_length(), bs));
+  for (uint64_t pos = b_off; pos < end; pos += bs) {
+    f->csum[pos / bs] = bl_crc32c(bl, pos - b_off, MIN(bs, end - pos));
+  }
+}
+
+/*
+ * Update checksums after bl is (or will be, via wal) written at x_off
+ * in f's stored data, and f.length already reflects the result.  The
+ * parts of partially covered blocks outside the write are read back.
+ */
+int NewStore::_csum_update(TransContext *txc, OnodeRef o, fragment_t& f,
+			   uint64_t x_off, const bufferlist& bl)
+{
+  if (!f.has_csum())
+    return 0;
+  uint64_t bs = f.get_csum_block_size();
+  uint64_t x_end = x_off + bl.length();
+  uint64_t b_off = x_off & ~(bs - 1);
+  uint64_t b_end = MIN(ROUND_UP_TO(x_end, bs), (uint64_t)f.stored_length());
+  assert(x_end <= f.stored_length());
+  bufferlist t;
+  if (b_off < x_off) {
+    int r = _block_read_current(txc, o, f, b_off, x_off - b_off, &t);
+    if (r < 0)
+      return r;
+  }
+  t.append(bl);
+  if (x_end < b_end) {
+    int r = _block_read_current(txc, o, f, x_end, b_end - x_end, &t);
+    if (r < 0)
+      return r;
+  }
+  dout(20) << __func__ << " " << f << " " << b_off << "~" << t.length()
+	   << dendl;
+  _csum_calc(&f, b_off, t);
+  return 0;
+}
+
+/// read the bytes stored for a fragment, compressed or not
+int NewStore::_read_fragment(TransContext *txc, const fragment_t& f,
+			     bufferlist *bl)
+{
+  uint32_t len = f.stored_length();
+  if (f.is_block())
+    return _block_read_verify(txc, f, 0, len, bl);
+
+  int fd = _open_fid(f.fid, O_RDONLY);
+  if (fd < 0)
+    return fd;
+  int r = ::lseek64(fd, f.offset, SEEK_SET);
+  if (r < 0) {
+    r = -errno;
+  } else {
+    r = bl->read_fd(fd, len);
+    if (r >= 0 && (uint32_t)r < len) {
+      derr << __func__ << " short read " << r << " < " << len
+	   << " from " << f.fid << dendl;
+      r = -EIO;
+    }
+  }
+  VOID_TEMP_FAILURE_RETRY(::close(fd));
+  return r < 0 ? r : 0;
+}
+
+int NewStore::_decompress_fragment(TransContext *txc, const fragment_t& f,
+				   bufferlist *bl)
+{
+  bufferlist raw;
+  int r = _read_fragment(txc, f, &raw);
+  if (r < 0)
+    return r;
+  Compressor *compressor = _get_compressor(f.compression);
+  if (!compressor) {
+    derr << __func__ << " " << f << " unknown compressor" << dendl;
+    return -EIO;
+  }
+  bufferlist t;
+  r = compressor->decompress(raw, t);
+  if (r < 0 || t.length() != f.length) {
+    derr << __func__ << " " << f << " failed to decompress (r = " << r
+	 << ", got " << t.length() << " bytes)" << dendl;
+    return -EIO;
+  }
+  bl->claim_append(t);
+  return 0;
+}
+
+/*
+ * Compress data that will make up an entire fragment if the collection
+ * asks for it and it is worth it.  On success bl is replaced by the
+ * compressed data; otherwise f is marked uncompressed and bl is left
+ * alone.
+ */
+bool NewStore::_compress(CollectionRef& c, bufferlist& bl, fragment_t *f)
+{
+  f->compression.clear();
+  f->compressed_length = 0;
+  if (!c->compressor ||
+      bl.length() < g_conf->newstore_compression_min_blob_size)
+    return false;
+  bufferlist out;
+  int r = c->compressor->compress(bl, out);
+  if (r < 0) {
+    dout(10) << __func__ << " " << c->compression << " failed: "
+	     << cpp_strerror(r) << dendl;
+    return false;
+  }
+  if (out.length() >
+      (double)bl.length() * g_conf->newstore_compression_max_ratio) {
+    dout(20) << __func__ << " " << bl.length() << " -> " << out.length()
+	     << " bytes, storing raw" << dendl;
+    return false;
+  }
+  dout(20) << __func__ << " " << bl.length() << " -> " << out.length()
+	   << " bytes with " << c->compression << dendl;
+  f->compression = c->compression;
+  f->compressed_length = out.length();
+  bl.swap(out);
+  return true;
+}
+
+/*
+ * Replace a compressed fragment with a raw copy so that it can be
+ * modified in place.
+ */
+int NewStore::_do_uncompress(TransContext *txc, OnodeRef o)
+{
+  assert(o->onode.data_map.size() == 1);
+  uint64_t fstart = o->onode.data_map.begin()->first;
+  fragment_t& f = o->onode.data_map.begin()->second;
+  assert(f.is_compressed());
+  dout(20) << __func__ << " " << fstart << " " << f << dendl;
+
+  o->flush();
+  bufferlist bl;
+  int r = _decompress_fragment(txc, f, &bl);
+  if (r < 0)
+    return r;
+
+  fragment_t nf;
+  if (f.is_block()) {
+    uint64_t want = f.length;
+    if (o->onode.expected_object_size > fstart + f.length)
+      want = o->onode.expected_object_size - fstart;
+    r = _block_allocate(txc, want, f.block_offset, &nf);
+    if (r < 0)
+      return r;
+    nf.length = f.length;
+    _csum_calc(&nf, 0, bl);
+    r = _block_write(txc, nf.block_offset, bl);
+    if (r < 0)
+      return r;
+    _block_release(txc, f);
+  } else {
+    int fd = _create_fid(txc, &nf.fid, O_RDWR);
+    if (fd < 0)
+      return fd;
+    r = bl.write_fd(fd);
+    if (r < 0) {
+      derr << __func__ << " bl.write_fd error: " << cpp_strerror(r) << dendl;
+      VOID_TEMP_FAILURE_RETRY(::close(fd));
+      return r;
+    }
+    txc->sync_fd(fd);
+    wal_op_t *op = _get_wal_op(txc);
+    op->op = wal_op_t::OP_REMOVE;
+    op->fid = f.fid;
+    nf.offset = 0;
+    nf.length = f.length;
+  }
+  f = nf;
+  txc->write_onode(o);
+  return 0;
+}
+
+// append [from, to) of the old fragment data (old_start~old.length())
+// to out, zero-filling whatever the old data does not cover
+static void append_old_or_zero(bufferlist& out, const bufferlist& old,
+			       uint64_t old_start, uint64_t from, uint64_t to)
+{
+  uint64_t old_end = old_start + old.length();
+  while (from < to) {
+    if (from >= old_start && from < old_end) {
+      uint64_t l = MIN(to, old_end) - from;
+      bufferlist t;
+      t.substr_of(old, from - old_start, l);
+      out.claim_append(t);
+      from += l;
+    } else {
+      uint64_t l = to - from;
+      if (from < old_start)
+	l = MIN(l, old_start - from);
+      bufferptr z(l);
+      z.zero();
+      out.append(z);
+      from += l;
+    }
+  }
+}
+
+int NewStore::_do_block_write(TransContext *txc,
+			      CollectionRef& c,
+			      OnodeRef o,
+			      uint64_t offset, uint64_t length,
+			      bufferlist& bl,
+			      uint32_t fadvise_flags)
+{
+  uint64_t end = offset + length;
+  int r;
+
+  // new data takes precedence over any overlays
+  _do_overlay_trim(txc, o, offset, length);
+
+  if (o->onode.data_map.empty() ||
+      (offset == 0 && length >= o->onode.size)) {
+    // write a fresh extent, replacing whatever was there
+    if (!o->onode.data_map.empty())
+      _do_overlay_clear(txc, o);
+    uint64_t hint = 0;
+    for (map<uint64_t,fragment_t>::iterator p = o->onode.data_map.begin();
+	 p != o->onode.data_map.end();
+	 ++p) {
+      hint = p->second.block_offset;
+      _block_release(txc, p->second);
+    }
+    o->onode.data_map.clear();
+    fragment_t &f = o->onode.data_map[offset];
+    uint64_t want = length;
+    if (offset == 0 && length >= o->onode.size && _compress(c, bl, &f))
+      want = bl.length();
+    else if (o->onode.expected_object_size > end)
+      want = o->onode.expected_object_size - offset;
+    r = _block_allocate(txc, want, hint, &f);
+    if (r < 0)
+      return r;
+    f.length = length;
+    _csum_calc(&f, 0, bl);
+    if (f.is_compressed()) {
+      // pad to a page so that we can still use aio
+      uint64_t padded = ROUND_UP_TO(bl.length(), CEPH_PAGE_SIZE);
+      if (padded > bl.length() && padded <= f.block_length) {
+	bufferptr z(padded - bl.length());
+	z.zero();
+	bl.append(z);
+      }
+    }
+    dout(20) << __func__ << " new " << f << " writing "
+	     << offset << "~" << length << dendl;
+    r = _block_write(txc, f.block_offset, bl);
+    if (r < 0)
+      return r;
+    if (end > o->onode.size)
+      o->onode.size = end;
+    return 0;
+  }
+
+  assert(o->onode.data_map.size() == 1);
+  uint64_t fstart = o->onode.data_map.begin()->first;
+  fragment_t& f = o->onode.data_map.begin()->second;
+  assert(f.is_block());
+  assert(!f.is_compressed());
+  uint64_t fend = fstart + f.length;
+
+  if (offset >= fstart && end <= fstart + f.block_length) {
+    // fits inside the allocated extent
+    if (offset >= fend) {
+      // unused tail of the extent: nobody reads it, so no wal.  zero
+      // the gap (if any) since the device may have stale data there.
+      bufferlist t;
+      if (offset > fend) {
+	bufferptr z(offset - fend);
+	z.zero();
+	t.append(z);
+      }
+      t.append(bl);
+      dout(20) << __func__ << " append " << f << " writing "
+	       << fend << "~" << t.length() << dendl;
+      r = _block_write(txc, f.block_offset + f.length, t);
+      if (r < 0)
+	return r;
+      f.length = end - fstart;
+      r = _csum_update(txc, o, f, fend - fstart, t);
+      if (r < 0)
+	return r;
+    } else {
+      wal_op_t *op = _get_wal_op(txc);
+      op->op = wal_op_t::OP_WRITE;
+      op->fid = fid_t();
+      op->offset = f.block_offset + offset - fstart;
+      op->length = length;
+      op->data = bl;
+      dout(20) << __func__ << " wal " << f << " write "
+	       << offset << "~" << length << dendl;
+      if (end > fend)
+	f.length = end - fstart;
+      r = _csum_update(txc, o, f, offset - fstart, bl);
+      if (r < 0)
+	return r;
+    }
+    if (end > o->onode.size)
+      o->onode.size = end;
+    return 0;
+  }
+
+  // does not fit; copy into a larger extent and release the old one
+  uint64_t nstart = MIN(fstart, offset);
+  uint64_t nend = MAX(fend, end);
+  dout(20) << __func__ << " cow " << f << " at " << fstart
+	   << " to " << nstart << "~" << (nend - nstart) << dendl;
+
+  bufferlist old;
+  r = _block_read_current(txc, o, f, 0, f.length, &old);
+  if (r < 0)
+    return r;
+
+  bufferlist nbl;
+  append_old_or_zero(nbl, old, fstart, nstart, offset);
+  nbl.append(bl);
+  append_old_or_zero(nbl, old, fstart, end, nend);
+  assert(nbl.length() == nend - nstart);
+
+  fragment_t nf;
+  uint64_t need = nend - nstart;
+  uint64_t want = need;
+  if (o->onode.expected_object_size > nend)
+    want = o->onode.expected_object_size - nstart;
+  else
+    // leave room to grow so that appends without an allocation hint
+    // do not copy the whole object each time
+    want += MIN(need, (uint64_t)g_conf->newstore_block_max_slack);
+  r = _block_allocate(txc, want, f.block_offset, &nf);
+  if (r == -ENOSPC && want > need)
+    r = _block_allocate(txc, need, f.block_offset, &nf);
+  if (r < 0)
+    return r;
+  nf.length = need;
+  _csum_calc(&nf, 0, nbl);
+  r = _block_write(txc, nf.block_offset, nbl);
+  if (r < 0)
+    return r;
+  _block_release(txc, f);
+  o->onode.data_map.clear();
+  o->onode.data_map[nstart] = nf;
+  if (nend > o->onode.size)
+    o->onode.size = nend;
+  return 0;
+}
+
+int NewStore::_do_block_zero(TransContext *txc,
+			     OnodeRef o,
+			     uint64_t offset, uint64_t length)
+{
+  uint64_t end = offset + length;
+  if (!o->onode.data_map.empty()) {
+    assert(o->onode.data_map.size() == 1);
+    uint64_t fstart = o->onode.data_map.begin()->first;
+    fragment_t& f = o->onode.data_map.begin()->second;
+    uint64_t fend = fstart + f.length;
+    if (offset <= fstart && end >= fend) {
+      dout(20) << __func__ << " release " << f << dendl;
+      _block_release(txc, f);
+      o->onode.data_map.clear();
+    } else if (offset < fend && end > fstart) {
+      uint64_t x_off = MAX(offset, fstart);
+      uint64_t x_end = MIN(end, fend);
+      wal_op_t *op = _get_wal_op(txc);
+      op->op = wal_op_t::OP_ZERO;
+      op->fid = fid_t();
+      op->offset = f.block_offset + x_off - fstart;
+      op->length = x_end - x_off;
+      dout(20) << __func__ << " wal " << f << " zero "
+	       << x_off << "~" << (x_end - x_off) << dendl;
+      if (f.has_csum()) {
+	bufferlist z;
+	bufferptr zp(op->length);
+	zp.zero();
+	z.append(zp);
+	int r = _csum_update(txc, o, f, x_off - fstart, z);
+	if (r < 0)
+	  return r;
+      }
+    }
+  }
+  if (end > o->onode.size)
+    o->onode.size = end;
+  txc->write_onode(o);
+  return 0;
+}
+
 int NewStore::_write(TransContext *txc,
 		     CollectionRef& c,
 		     const ghobject_t& oid,
@@ -3637,7 +4852,7 @@ int NewStore::_write(TransContext *txc,
   RWLock::WLocker l(c->lock);
   OnodeRef o = c->get_onode(oid, true);
   _assign_nid(txc, o);
-  int r = _do_write(txc, o, offset, length, bl, fadvise_flags);
+  int r = _do_write(txc, c, o, offset, length, bl, fadvise_flags);
   txc->write_onode(o);
 
   dout(10) << __func__ << " " << c->cid << " " << oid
@@ -3664,7 +4879,16 @@ int NewStore::_zero(TransContext *txc,
   if (_do_overlay_trim(txc, o, offset, length) > 0)
     txc->write_onode(o);
 
-  if (o->onode.data_map.empty()) {
+  if (!o->onode.data_map.empty() &&
+      o->onode.data_map.begin()->second.is_compressed()) {
+    r = _do_uncompress(txc, o);
+    if (r < 0)
+      goto out;
+  }
+
+  if (bdev) {
+    r = _do_block_zero(txc, o, offset, length);
+  } else if (o->onode.data_map.empty()) {
     // we're already a big hole
     if (offset + length > o->onode.size) {
       o->onode.size = offset + length;
@@ -3718,6 +4942,15 @@ int NewStore::_zero(TransContext *txc,
 
 int NewStore::_do_truncate(TransContext *txc, OnodeRef o, uint64_t offset)
 {
+  if (!o->onode.data_map.empty() &&
+      o->onode.data_map.begin()->second.is_compressed() &&
+      offset > 0 && offset != o->onode.size) {
+    // compressed data can only be removed whole
+    int r = _do_uncompress(txc, o);
+    if (r < 0)
+      return r;
+  }
+
   // trim down fragments
   map<uint64_t,fragment_t>::iterator fp = o->onode.data_map.end();
   if (fp != o->onode.data_map.begin())
@@ -3727,11 +4960,17 @@ int NewStore::_do_truncate(TransContext *txc, OnodeRef o, uint64_t offset)
       break;
     }
     if (fp->first >= offset) {
-      dout(20) << __func__ << " wal rm fragment " << fp->first << " "
-	       << fp->second << dendl;
-      wal_op_t *op = _get_wal_op(txc);
-      op->op = wal_op_t::OP_REMOVE;
-      op->fid = fp->second.fid;
+      if (fp->second.is_block()) {
+	dout(20) << __func__ << " release fragment " << fp->first << " "
+		 << fp->second << dendl;
+	_block_release(txc, fp->second);
+      } else {
+	dout(20) << __func__ << " wal rm fragment " << fp->first << " "
+		 << fp->second << dendl;
+	wal_op_t *op = _get_wal_op(txc);
+	op->op = wal_op_t::OP_REMOVE;
+	op->fid = fp->second.fid;
+      }
       if (fp != o->onode.data_map.begin()) {
 	o->onode.data_map.erase(fp--);
 	continue;
@@ -3747,6 +4986,14 @@ int NewStore::_do_truncate(TransContext *txc, OnodeRef o, uint64_t offset)
 	       << fp->second << " to " << newlen << dendl;
       fragment_t& f = fp->second;
       f.length = newlen;
+      if (f.is_block()) {
+	// stale data past the fragment end is never read; any later
+	// write into that space zero-fills the gap first.
+	int r = _csum_update(txc, o, f, newlen, bufferlist());
+	if (r < 0)
+	  return r;
+	break;
+      }
       wal_op_t *op = _get_wal_op(txc);
       op->op = wal_op_t::OP_TRUNCATE;
       op->offset = offset;
@@ -3756,7 +5003,7 @@ int NewStore::_do_truncate(TransContext *txc, OnodeRef o, uint64_t offset)
   }
 
   // truncate up trailing fragment?
-  if (!o->onode.data_map.empty() && offset > o->onode.size) {
+  if (!o->onode.data_map.empty() && offset > o->onode.size && !bdev) {
     // resize file up.  make sure we don't have trailing bytes
     assert(o->onode.data_map.size() == 1);
     fragment_t& f = o->onode.data_map.begin()->second;
@@ -3846,6 +5093,10 @@ int NewStore::_do_remove(TransContext *txc,
     for (map<uint64_t,fragment_t>::iterator p = o->onode.data_map.begin();
 	 p != o->onode.data_map.end();
 	 ++p) {
+      if (p->second.is_block()) {
+	_block_release(txc, p->second);
+	continue;
+      }
       dout(20) << __func__ << " will wal remove " << p->second.fid << dendl;
       wal_op_t *op = _get_wal_op(txc);
       op->op = wal_op_t::OP_REMOVE;
@@ -3989,20 +5240,11 @@ int NewStore::_rmattrs(TransContext *txc,
 
 void NewStore::_do_omap_clear(TransContext *txc, uint64_t id)
 {
-  KeyValueDB::Iterator it = db->get_iterator(PREFIX_OMAP);
   string prefix, tail;
   get_omap_header(id, &prefix);
   get_omap_tail(id, &tail);
-  it->lower_bound(prefix);
-  while (it->valid()) {
-    if (it->key() >= tail) {
-      dout(30) << __func__ << "  stop at " << tail << dendl;
-      break;
-    }
-    txc->t->rmkey(PREFIX_OMAP, it->key());
-    dout(30) << __func__ << "  rm " << it->key() << dendl;
-    it->next();
-  }
+  dout(30) << __func__ << "  rm " << prefix << " to " << tail << dendl;
+  txc->t->rm_range_keys(PREFIX_OMAP, prefix, tail);
 }
 
 int NewStore::_omap_clear(TransContext *txc,
@@ -4129,7 +5371,6 @@ int NewStore::_omap_rmkey_range(TransContext *txc,
 {
   dout(15) << __func__ << " " << c->cid << " " << oid << dendl;
   int r = 0;
-  KeyValueDB::Iterator it;
   string key_first, key_last;
 
   RWLock::WLocker l(c->lock);
@@ -4142,19 +5383,10 @@ int NewStore::_omap_rmkey_range(TransContext *txc,
     r = 0;
     goto out;
   }
-  it = db->get_iterator(PREFIX_OMAP);
   get_omap_key(o->onode.omap_head, first, &key_first);
   get_omap_key(o->onode.omap_head, last, &key_last);
-  it->lower_bound(key_first);
-  while (it->valid()) {
-    if (it->key() >= key_last) {
-      dout(30) << __func__ << "  stop at " << key_last << dendl;
-      break;
-    }
-    txc->t->rmkey(PREFIX_OMAP, it->key());
-    dout(30) << __func__ << "  rm " << it->key() << dendl;
-    it->next();
-  }
+  dout(30) << __func__ << "  rm " << key_first << " to " << key_last << dendl;
+  txc->t->rm_range_keys(PREFIX_OMAP, key_first, key_last);
   r = 0;
 
  out:
@@ -4220,13 +5452,18 @@ int NewStore::_clone(TransContext *txc,
 
   // truncate any old data
   while (!newo->onode.data_map.empty()) {
-    wal_op_t *op = _get_wal_op(txc);
-    op->op = wal_op_t::OP_REMOVE;
-    op->fid = newo->onode.data_map.rbegin()->second.fid;
+    const fragment_t& f = newo->onode.data_map.rbegin()->second;
+    if (f.is_block()) {
+      _block_release(txc, f);
+    } else {
+      wal_op_t *op = _get_wal_op(txc);
+      op->op = wal_op_t::OP_REMOVE;
+      op->fid = f.fid;
+    }
     newo->onode.data_map.erase(newo->onode.data_map.rbegin()->first);
   }
 
-  r = _do_write(txc, newo, 0, oldo->onode.size, bl, 0);
+  r = _do_write(txc, c, newo, 0, oldo->onode.size, bl, 0);
 
   newo->onode.attrs = oldo->onode.attrs;
 
@@ -4297,7 +5534,7 @@ int NewStore::_clone_range(TransContext *txc,
   if (r < 0)
     goto out;
 
-  r = _do_write(txc, newo, dstoff, bl.length(), bl, 0);
+  r = _do_write(txc, c, newo, dstoff, bl.length(), bl, 0);
 
   txc->write_onode(newo);
 
@@ -4341,7 +5578,7 @@ int NewStore::_rename(TransContext *txc,
   get_object_key(old_oid, &old_key);
   get_object_key(new_oid, &new_key);
 
-  c->onode_map.rename(old_oid, new_oid);
+  onode_cache.rename(oldo, old_oid, new_oid);
   oldo->oid = new_oid;
   oldo->key = new_key;
 
@@ -4399,9 +5636,10 @@ int NewStore::_remove_collection(TransContext *txc, coll_t cid,
       r = -ENOENT;
       goto out;
     }
-    pair<ghobject_t,OnodeRef> next;
-    while ((*c)->onode_map.get_next(next.first, &next)) {
-      if (next.second->exists) {
+    list<OnodeRef> ls;
+    onode_cache.get_collection(&**c, &ls);
+    for (list<OnodeRef>::iterator p = ls.begin(); p != ls.end(); ++p) {
+      if ((*p)->exists) {
 	r = -ENOTEMPTY;
 	goto out;
       }
@@ -4428,10 +5666,19 @@ int NewStore::_split_collection(TransContext *txc,
   int r;
   RWLock::WLocker l(c->lock);
   RWLock::WLocker l2(d->lock);
-  c->onode_map.clear();
-  d->onode_map.clear();
   c->cnode.bits = bits;
   assert(d->cnode.bits == bits);
+
+  // cached onodes that now belong to d move with it
+  spg_t pgid;
+  bool is_pg = d->cid.is_pg(&pgid);
+  assert(is_pg);
+  list<OnodeRef> ls;
+  onode_cache.get_collection(&*c, &ls);
+  for (list<OnodeRef>::iterator p = ls.begin(); p != ls.end(); ++p) {
+    if ((*p)->oid.match(bits, pgid.ps()))
+      onode_cache.set_collection(*p, &*d);
+  }
   r = 0;
 
   dout(10) << __func__ << " " << c->cid << " to " << d->cid << " "
@@ -20,25 +20,50 @@
 #include <unistd.h>
 
 #include "include/assert.h"
+#include "include/interval_set.h"
 #include "include/unordered_map.h"
 #include "include/memory.h"
 #include "common/Finisher.h"
+#include "common/perf_counters.h"
 #include "common/RWLock.h"
 #include "common/WorkQueue.h"
 #include "os/ObjectStore.h"
 #include "os/fs/FS.h"
 #include "os/KeyValueDB.h"
+#include "compressor/Compressor.h"
 
 #include "newstore_types.h"
+#include "BlockDevice.h"
+#include "ExtentAllocator.h"
+#include "FreelistManager.h"
 
 #include "boost/intrusive/list.hpp"
 
+enum {
+  l_newstore_first = 35000,
+  l_newstore_onode_hit,
+  l_newstore_onode_miss,
+  l_newstore_onode_evict,
+  l_newstore_onode_count,
+  l_newstore_onode_bytes,
+  l_newstore_kv_commit,
+  l_newstore_kv_batch,
+  l_newstore_kv_batch_wait_lat,
+  l_newstore_kv_commit_lat,
+  l_newstore_kv_batch_hist_first,   // txcs per commit: 1, 2-3, 4-7, ..., 32+
+  l_newstore_kv_batch_hist_last = l_newstore_kv_batch_hist_first + 5,
+  l_newstore_kv_lat_hist_first,     // commit ms: <1, 1-2, 2-4, ..., 16+
+  l_newstore_kv_lat_hist_last = l_newstore_kv_lat_hist_first + 5,
+  l_newstore_last
+};
+
 class NewStore : public ObjectStore {
   // -----------------------------------------------------
   // types
 public:
 
   class TransContext;
+  struct Collection;
 
   /// an in-memory object
   struct Onode {
@@ -47,6 +72,9 @@ public:
     ghobject_t oid;
     string key;     ///< key under PREFIX_OBJ where we are stored
     boost::intrusive::list_member_hook<> lru_item;
+    Collection *coll;      ///< collection we belong to, or NULL once it
+                           ///  is removed (protected by cache)
+    uint32_t cache_bytes;  ///< estimated memory use (protected by cache)
 
     onode_t onode;  ///< metadata stored as value in kv store
     bool dirty;     // ???
@@ -56,7 +84,7 @@ public:
     Cond flush_cond;   ///< wait here for unapplied txns, fsyncs
     set<TransContext*> flush_txns;   ///< fsyncing or committing or wal txns
 
-    Onode(const ghobject_t& o, const string& k);
+    Onode(Collection *c, const ghobject_t& o, const string& k);
 
     void flush() {
       Mutex::Locker l(flush_lock);
@@ -73,7 +101,15 @@ public:
   };
   typedef boost::intrusive_ptr<Onode> OnodeRef;
 
-  struct OnodeHashLRU {
+  /**
+   * onode cache shared by all collections
+   *
+   * Onodes are sharded by object hash, each shard with its own lock and
+   * lru, and the shards split a single memory budget.  Onodes that are
+   * referenced outside of the cache (e.g., by an in-flight txc) are
+   * never evicted.
+   */
+  class OnodeCache {
     typedef boost::intrusive::list<
       Onode,
       boost::intrusive::member_hook<
@@ -81,20 +117,49 @@ public:
 	boost::intrusive::list_member_hook<>,
 	&Onode::lru_item> > lru_list_t;
 
-    Mutex lock;
-    ceph::unordered_map<ghobject_t,OnodeRef> onode_map;  ///< forward lookups
-    lru_list_t lru;                                      ///< lru
-
-    OnodeHashLRU() : lock("NewStore::OnodeHashLRU::lock") {}
-
-    void add(const ghobject_t& oid, OnodeRef o);
-    void _touch(OnodeRef o);
-    OnodeRef lookup(const ghobject_t& o);
-    void remove(const ghobject_t& o);
-    void rename(const ghobject_t& old_oid, const ghobject_t& new_oid);
-    void clear();
-    bool get_next(const ghobject_t& after, pair<ghobject_t,OnodeRef> *next);
-    int trim(int max=-1);
+    struct Shard {
+      Mutex lock;
+      ceph::unordered_map<ghobject_t,OnodeRef> onode_map;  ///< forward lookups
+      lru_list_t lru;                                      ///< lru
+      uint64_t bytes;  ///< estimated memory use of onodes in this shard
+
+      Shard() : lock("NewStore::OnodeCache::Shard::lock"), bytes(0) {}
+    };
+
+    CephContext *cct;
+    vector<Shard*> shards;
+    uint64_t max_shard_bytes;
+    PerfCounters *logger;
+
+    Shard *_get_shard(const ghobject_t& oid) {
+      return shards[oid.hobj.get_bitwise_key_u32() % shards.size()];
+    }
+    void _set_bytes(Onode *o, uint32_t bytes);
+    void _remove(Shard *s, Onode *o);
+    void _trim(Shard *s);
+
+  public:
+    OnodeCache(CephContext *c)
+      : cct(c), max_shard_bytes(0), logger(NULL) {}
+    ~OnodeCache() {
+      assert(shards.empty());
+    }
+
+    void init(unsigned num_shards, uint64_t max_bytes, PerfCounters *l);
+    void shutdown();
+
+    OnodeRef lookup(Collection *c, const ghobject_t& oid);
+    /// whether oid is cached; unlike lookup(), no stats or lru update
+    bool contains(const ghobject_t& oid);
+    /// add a new onode; return it, or whichever was cached first
+    OnodeRef add(OnodeRef o, uint32_t encoded_len);
+    /// update memory estimate after the onode is reencoded
+    void update(OnodeRef o, uint32_t encoded_len);
+    void rename(OnodeRef o, const ghobject_t& old_oid,
+		const ghobject_t& new_oid);
+    void get_collection(Collection *c, list<OnodeRef> *ls);
+    void set_collection(OnodeRef o, Collection *c);
+    void clear_collection(Collection *c);
   };
 
   struct Collection {
@@ -103,11 +168,11 @@ public:
     cnode_t cnode;
     RWLock lock;
 
-    // cache onodes on a per-collection basis to avoid lock
-    // contention.
-    OnodeHashLRU onode_map;
+    string compression;      ///< compressor type for new data, if any
+    Compressor *compressor;  ///< (owned by NewStore)
 
     OnodeRef get_onode(const ghobject_t& oid, bool create);
+    void prefetch_onodes(const vector<ghobject_t>& oids);
 
     Collection(NewStore *ns, coll_t c);
   };
@@ -188,6 +253,7 @@ public:
     uint64_t ops, bytes;
 
     list<fsync_item> sync_items; ///< these fds need to be synced
+    bool sync_bdev;              ///< block device is in sync_items
     set<OnodeRef> onodes;     ///< these onodes need to be updated/written
     KeyValueDB::Transaction t; ///< then we will commit this
     Context *oncommit;         ///< signal on commit
@@ -205,16 +271,19 @@ public:
     bufferlist aio_bl;  // just a pile of refs
     atomic_t num_aio;
 
+    interval_set<uint64_t> allocated;  ///< block extents we allocated
+    interval_set<uint64_t> released;   ///< block extents we released
+    map<uint64_t,bufferlist> pending_block_writes;  ///< aio data, by offset
+
     Mutex lock;
     Cond cond;
 
-    CollectionRef first_collection;  ///< first referenced collection
-
     TransContext(OpSequencer *o)
       : state(STATE_PREPARE),
 	osr(o),
 	ops(0),
 	bytes(0),
+	sync_bdev(false),
 	oncommit(NULL),
 	onreadable(NULL),
 	onreadable_sync(NULL),
@@ -468,6 +537,15 @@ private:
   int fset_fd;  ///< open handle to $path/fragments/$cur_fid.fset
   bool mounted;
 
+  BlockDevice *bdev;      ///< $path/block, if present
+  FreelistManager fm;     ///< committed free block extents
+  ExtentAllocator *alloc; ///< free block extents available to allocate
+  uint8_t csum_order;     ///< checksum block size for new block fragments
+
+  Mutex compressor_lock;
+  map<string,Compressor*> compressors;  ///< by type
+  set<int64_t> compression_pools;  ///< compress only these (empty for all)
+
   RWLock coll_lock;    ///< rwlock to protect coll_map
   ceph::unordered_map<coll_t, CollectionRef> coll_map;
 
@@ -500,9 +578,12 @@ private:
   Cond kv_cond, kv_sync_cond;
   bool kv_stop;
   deque<TransContext*> kv_queue, kv_committing;
+  uint64_t kv_queue_bytes;  ///< bytes of data written by txcs in kv_queue
   deque<TransContext*> wal_cleanup_queue, wal_cleaning;
 
-  Logger *logger;
+  PerfCounters *logger;
+
+  OnodeCache onode_cache;
 
   Mutex reap_lock;
   Cond reap_cond;
@@ -527,6 +608,12 @@ private:
   void _close_frag();
   int _open_db();
   void _close_db();
+  int _open_bdev(bool create);
+  void _close_bdev();
+  int _open_compression();
+  void _close_compression();
+  Compressor *_get_compressor(const string& type);
+  string _choose_compression(coll_t cid);
   int _open_collections();
   void _close_collections();
 
@@ -545,7 +632,30 @@ private:
   int _clean_fid_tail_fd(const fragment_t& f, int fd);
   int _clean_fid_tail(TransContext *txc, const fragment_t& f);
 
+  int _block_allocate(TransContext *txc, uint64_t want, uint64_t hint,
+		      fragment_t *f);
+  void _block_release(TransContext *txc, const fragment_t& f);
+  int _block_write(TransContext *txc, uint64_t offset, bufferlist& bl);
+  void _block_sync(TransContext *txc);
+  int _block_read(TransContext *txc, uint64_t offset, uint64_t length,
+		  bufferlist *bl);
+  int _block_read_verify(TransContext *txc, const fragment_t& f,
+			 uint64_t x_off, uint64_t x_len, bufferlist *bl);
+  int _block_read_current(TransContext *txc, OnodeRef o, const fragment_t& f,
+			  uint64_t x_off, uint64_t x_len, bufferlist *bl);
+  void _csum_calc(fragment_t *f, uint64_t b_off, const bufferlist& bl);
+  int _csum_update(TransContext *txc, OnodeRef o, fragment_t& f,
+		   uint64_t x_off, const bufferlist& bl);
+
+  int _read_fragment(TransContext *txc, const fragment_t& f, bufferlist *bl);
+  int _decompress_fragment(TransContext *txc, const fragment_t& f,
+			   bufferlist *bl);
+  bool _compress(CollectionRef& c, bufferlist& bl, fragment_t *f);
+  int _do_uncompress(TransContext *txc, OnodeRef o);
+
   TransContext *_txc_create(OpSequencer *osr);
+  void _txc_prefetch_onodes(Transaction::iterator i,
+			    vector<CollectionRef>& cvec);
   int _txc_add_transaction(TransContext *txc, Transaction *t);
   int _txc_finalize(OpSequencer *osr, TransContext *txc);
   void _txc_state_proc(TransContext *txc);
@@ -554,6 +664,7 @@ private:
   void _txc_queue_fsync(TransContext *txc);
   void _txc_process_fsync(fsync_item *i);
   void _txc_finish_io(TransContext *txc);
+  void _txc_update_fm(TransContext *txc);
   void _txc_finish_kv(TransContext *txc);
   void _txc_finish(TransContext *txc);
 
@@ -742,10 +853,20 @@ private:
 			     OnodeRef o);
   void _do_read_all_overlays(wal_transaction_t& wt);
   int _do_write(TransContext *txc,
+		CollectionRef& c,
 		OnodeRef o,
 		uint64_t offset, uint64_t length,
 		bufferlist& bl,
 		uint32_t fadvise_flags);
+  int _do_block_write(TransContext *txc,
+		      CollectionRef& c,
+		      OnodeRef o,
+		      uint64_t offset, uint64_t length,
+		      bufferlist& bl,
+		      uint32_t fadvise_flags);
+  int _do_block_zero(TransContext *txc,
+		     OnodeRef o,
+		     uint64_t offset, uint64_t length);
   int _touch(TransContext *txc,
 	     CollectionRef& c,
 	     const ghobject_t& oid);
@@ -62,19 +62,46 @@ void fid_t::generate_test_instances(list<fid_t*>& o)
 
 void fragment_t::encode(bufferlist& bl) const
 {
-  ENCODE_START(1, 1, bl);
+  ENCODE_START(4, 1, bl);
   ::encode(offset, bl);
   ::encode(length, bl);
   ::encode(fid, bl);
+  ::encode(block_offset, bl);
+  ::encode(block_length, bl);
+  ::encode(compression, bl);
+  ::encode(compressed_length, bl);
+  ::encode(csum_order, bl);
+  ::encode(csum, bl);
   ENCODE_FINISH(bl);
 }
 
 void fragment_t::decode(bufferlist::iterator& p)
 {
-  DECODE_START(1, p);
+  DECODE_START(4, p);
   ::decode(offset, p);
   ::decode(length, p);
   ::decode(fid, p);
+  if (struct_v >= 2) {
+    ::decode(block_offset, p);
+    ::decode(block_length, p);
+  } else {
+    block_offset = 0;
+    block_length = 0;
+  }
+  if (struct_v >= 3) {
+    ::decode(compression, p);
+    ::decode(compressed_length, p);
+  } else {
+    compression.clear();
+    compressed_length = 0;
+  }
+  if (struct_v >= 4) {
+    ::decode(csum_order, p);
+    ::decode(csum, p);
+  } else {
+    csum_order = 0;
+    csum.clear();
+  }
   DECODE_FINISH(p);
 }
 
@@ -83,6 +110,15 @@ void fragment_t::dump(Formatter *f) const
   f->dump_unsigned("offset", offset);
   f->dump_unsigned("length", length);
   f->dump_object("fid", fid);
+  f->dump_unsigned("block_offset", block_offset);
+  f->dump_unsigned("block_length", block_length);
+  f->dump_string("compression", compression);
+  f->dump_unsigned("compressed_length", compressed_length);
+  f->dump_unsigned("csum_block_size", has_csum() ? get_csum_block_size() : 0);
+  f->open_array_section("csum");
+  for (vector<uint32_t>::const_iterator p = csum.begin(); p != csum.end(); ++p)
+    f->dump_unsigned("crc32c", *p);
+  f->close_section();
 }
 
 void fragment_t::generate_test_instances(list<fragment_t*>& o)
@@ -90,11 +126,32 @@ void fragment_t::generate_test_instances(list<fragment_t*>& o)
   o.push_back(new fragment_t());
   o.push_back(new fragment_t(123, 456));
   o.push_back(new fragment_t(789, 1024, fid_t(3, 400)));
+  o.push_back(new fragment_t(0, 1024));
+  o.back()->block_offset = 65536;
+  o.back()->block_length = 4096;
+  o.push_back(new fragment_t(0, 65536, fid_t(3, 401)));
+  o.back()->compression = "snappy";
+  o.back()->compressed_length = 1234;
+  o.push_back(new fragment_t(0, 8000));
+  o.back()->block_offset = 1048576;
+  o.back()->block_length = 8192;
+  o.back()->csum_order = 12;
+  o.back()->csum.push_back(0x12345678);
+  o.back()->csum.push_back(0x9abcdef0);
 }
 
 ostream& operator<<(ostream& out, const fragment_t& f)
 {
-  out << "fragment(" << f.offset << "~" << f.length << " " << f.fid << ")";
+  out << "fragment(" << f.offset << "~" << f.length;
+  if (f.is_block())
+    out << " block " << f.block_offset << "~" << f.block_length;
+  else
+    out << " " << f.fid;
+  if (f.is_compressed())
+    out << " " << f.compression << " " << f.compressed_length;
+  if (f.has_csum())
+    out << " csum " << f.get_csum_block_size() << "x" << f.csum.size();
+  out << ")";
   return out;
 }
 
@@ -71,15 +71,46 @@ static inline bool operator!=(const fid_t& a, const fid_t& b) {
   return !(a == b);
 }
 
-/// fragment: a byte extent backed by a file
+/// fragment: a byte extent backed by a file or a block device extent
 struct fragment_t {
   uint32_t offset;   ///< offset in file to first byte of this fragment
   uint32_t length;   ///< length of fragment/extent
-  fid_t fid;         ///< file backing this fragment
+  fid_t fid;         ///< file backing this fragment (null if on block device)
+  uint64_t block_offset;  ///< start of allocated extent on block device
+  uint32_t block_length;  ///< length of allocated extent (>= length)
+  string compression;     ///< compressor type, or empty if stored raw
+  uint32_t compressed_length;  ///< bytes actually stored, if compressed
+  uint8_t csum_order;     ///< log2 of checksum block size, or 0 for none
+  vector<uint32_t> csum;  ///< crc32c of each block of stored data
+
+  fragment_t()
+    : offset(0), length(0), block_offset(0), block_length(0),
+      compressed_length(0), csum_order(0) {}
+  fragment_t(uint32_t o, uint32_t l)
+    : offset(o), length(l), block_offset(0), block_length(0),
+      compressed_length(0), csum_order(0) {}
+  fragment_t(uint32_t o, uint32_t l, fid_t f)
+    : offset(o), length(l), fid(f), block_offset(0), block_length(0),
+      compressed_length(0), csum_order(0) {}
+
+  bool is_block() const {
+    return fid == fid_t();
+  }
+  /// if compressed, length is the logical (uncompressed) length
+  bool is_compressed() const {
+    return !compression.empty();
+  }
+  /// bytes of data actually stored
+  uint32_t stored_length() const {
+    return is_compressed() ? compressed_length : length;
+  }
 
-  fragment_t() : offset(0), length(0) {}
-  fragment_t(uint32_t o, uint32_t l) : offset(o), length(l) {}
-  fragment_t(uint32_t o, uint32_t l, fid_t f) : offset(o), length(l), fid(f) {}
+  bool has_csum() const {
+    return csum_order > 0;
+  }
+  uint32_t get_csum_block_size() const {
+    return 1u << csum_order;
+  }
 
   void encode(bufferlist& bl) const;
   void decode(bufferlist::iterator& p);
@@ -140,6 +171,9 @@ WRITE_CLASS_ENCODER(onode_t)
 
 
 /// writeahead-logged op
+///
+/// A null fid means the op targets the block device, and offset is
+/// the device offset.
 struct wal_op_t {
   typedef enum {
     OP_WRITE = 1,
@@ -1194,6 +1194,19 @@ OSDMapRef OSDService::_add_map(OSDMap *o)
   return l;
 }
 
+uint64_t OSDService::get_map_cache_footprint()
+{
+  // consecutive epochs share most of their structures; only count
+  // what each map does not share with the one before it
+  uint64_t total = 0;
+  pair<epoch_t, OSDMapRef> cur(0, OSDMapRef()), prev;
+  while (map_cache.get_next(cur.first, &cur)) {
+    total += cur.second->get_footprint(prev.second.get());
+    prev = cur;
+  }
+  return total;
+}
+
 OSDMapRef OSDService::try_get_map(epoch_t epoch)
 {
   Mutex::Locker l(map_cache_lock);
@@ -2189,6 +2202,7 @@ void OSD::create_logger()
   osd_plb.add_u64_counter(l_osd_map, "map_messages", "OSD map messages");           // osdmap messages
   osd_plb.add_u64_counter(l_osd_mape, "map_message_epochs", "OSD map epochs");         // osdmap epochs
   osd_plb.add_u64_counter(l_osd_mape_dup, "map_message_epoch_dups", "OSD map duplicates"); // dup osdmap epochs
+  osd_plb.add_u64(l_osd_map_cache_bytes, "map_cache_bytes", "Memory used by decoded OSD maps");
   osd_plb.add_u64_counter(l_osd_waiting_for_map, "messages_delayed_for_map", "Operations waiting for OSD map"); // dup osdmap epochs
 
   osd_plb.add_u64(l_osd_stat_bytes, "stat_bytes", "OSD size");
@@ -2223,6 +2237,8 @@ void OSD::create_logger()
   osd_plb.add_time_avg(l_osd_tier_promote_lat, "osd_tier_promote_lat", "Object promote latency");
   osd_plb.add_time_avg(l_osd_tier_r_lat, "osd_tier_r_lat", "Object proxy read latency");
 
+  osd_plb.add_u64_counter(l_osd_op_wq_steal, "op_wq_steal", "Ops dequeued from another op shard");
+
   logger = osd_plb.create_perf_counters();
   cct->get_perfcounters_collection()->add(logger);
 }
@@ -6287,6 +6303,8 @@ void OSD::handle_osd_map(MOSDMap *m)
       ghobject_t fulloid = get_osdmap_pobject_name(e);
       t.write(coll_t::meta(), fulloid, 0, bl.length(), bl);
       pin_map_bl(e, bl);
+      if (cct->_conf->osd_map_mapping_table)
+	o->update_mapping(cct->_conf->osd_map_mapping_threads);
       pinned_maps.push_back(add_map(o));
 
       got_full_map(e);
@@ -6303,9 +6321,10 @@ void OSD::handle_osd_map(MOSDMap *m)
 
       OSDMap *o = new OSDMap;
       if (e > 1) {
-	bufferlist obl;
-	get_map_bl(e - 1, obl);
-	o->decode(obl);
+	// start from the previous epoch instead of decoding it again, and
+	// share whatever the incremental does not change
+	OSDMapRef prev = get_map(e - 1);
+	o->shared_copy_from(*prev);
       }
 
       OSDMap::Incremental inc;
@@ -6344,6 +6363,8 @@ void OSD::handle_osd_map(MOSDMap *m)
       ghobject_t fulloid = get_osdmap_pobject_name(e);
       t.write(coll_t::meta(), fulloid, 0, fbl.length(), fbl);
       pin_map_bl(e, fbl);
+      if (cct->_conf->osd_map_mapping_table)
+	o->update_mapping(cct->_conf->osd_map_mapping_threads);
       pinned_maps.push_back(add_map(o));
       continue;
     }
@@ -6351,6 +6372,8 @@ void OSD::handle_osd_map(MOSDMap *m)
     assert(0 == "MOSDMap lied about what maps it had?");
   }
 
+  logger->set(l_osd_map_cache_bytes, service.get_map_cache_footprint());
+
   // even if this map isn't from a mon, we may have satisfied our subscription
   monc->sub_got("osdmap", last);
 
@@ -8246,6 +8269,155 @@ void OSD::enqueue_op(PG *pg, OpRequestRef& op)
   pg->queue_op(op);
 }
 
+op_queue_class_t PGQueueable::get_class(int64_t pool) const
+{
+  const OpRequestRef *op = boost::get<OpRequestRef>(&qvariant);
+  if (!op)
+    return op_queue_class_t(op_queue_class_t::SCRUB, pool, entity_inst_t());
+  switch ((*op)->get_req()->get_type()) {
+  case MSG_OSD_PG_PUSH:
+  case MSG_OSD_PG_PULL:
+  case MSG_OSD_PG_PUSH_REPLY:
+  case MSG_OSD_PG_SCAN:
+  case MSG_OSD_PG_BACKFILL:
+    return op_queue_class_t(op_queue_class_t::RECOVERY, pool,
+			    entity_inst_t());
+  case MSG_OSD_REP_SCRUB:
+    return op_queue_class_t(op_queue_class_t::SCRUB, pool, entity_inst_t());
+  }
+  if (owner.name.is_osd())
+    return op_queue_class_t(op_queue_class_t::PEER, pool, owner);
+  return op_queue_class_t(op_queue_class_t::CLIENT, pool, owner);
+}
+
+OSD::ShardedOpWQ::OpQueueType *OSD::ShardedOpWQ::create_queue()
+{
+  md_config_t *conf = osd->cct->_conf;
+  if (use_mclock)
+    return new MClockQueue< pair<PGRef, PGQueueable>, op_queue_class_t>(
+      std::bind(&ShardedOpWQ::get_mclock_info, this, std::placeholders::_1));
+  if (conf->osd_op_queue != "prio")
+    lgeneric_derr(osd->cct) << "unknown osd_op_queue " << conf->osd_op_queue
+			    << ", using prio" << dendl;
+  return new PrioritizedQueue< pair<PGRef, PGQueueable>, op_queue_class_t>(
+    conf->osd_op_pq_max_tokens_per_priority,
+    conf->osd_op_pq_min_cost);
+}
+
+op_queue_class_t OSD::ShardedOpWQ::get_class(
+  const pair<PGRef, PGQueueable> &item) const
+{
+  if (!use_mclock)
+    return op_queue_class_t(item.second.get_owner());
+  return item.second.get_class(item.first->get_pgid().pool());
+}
+
+mclock_info_t OSD::ShardedOpWQ::get_mclock_info(const op_queue_class_t &c)
+{
+  Mutex::Locker l(mclock_lock);
+  switch (c.type) {
+  case op_queue_class_t::CLIENT:
+    {
+      map<int64_t, mclock_info_t>::iterator p =
+	mclock_conf.pool_client.find(c.pool);
+      if (p != mclock_conf.pool_client.end())
+	return p->second;
+    }
+    return mclock_conf.client;
+  case op_queue_class_t::PEER:
+    return mclock_conf.peer;
+  case op_queue_class_t::RECOVERY:
+    return mclock_conf.recov;
+  case op_queue_class_t::SCRUB:
+    return mclock_conf.scrub;
+  }
+  return mclock_info_t();
+}
+
+void OSD::ShardedOpWQ::update_mclock_conf()
+{
+  if (!use_mclock)
+    return;
+  md_config_t *conf = osd->cct->_conf;
+  MClockConf c;
+  c.client = mclock_info_t(conf->osd_op_queue_mclock_client_res,
+			   conf->osd_op_queue_mclock_client_wgt,
+			   conf->osd_op_queue_mclock_client_lim);
+  c.peer = mclock_info_t(conf->osd_op_queue_mclock_peer_res,
+			 conf->osd_op_queue_mclock_peer_wgt,
+			 conf->osd_op_queue_mclock_peer_lim);
+  c.recov = mclock_info_t(conf->osd_op_queue_mclock_recov_res,
+			  conf->osd_op_queue_mclock_recov_wgt,
+			  conf->osd_op_queue_mclock_recov_lim);
+  c.scrub = mclock_info_t(conf->osd_op_queue_mclock_scrub_res,
+			  conf->osd_op_queue_mclock_scrub_wgt,
+			  conf->osd_op_queue_mclock_scrub_lim);
+  // per-pool overrides: "pool:res:wgt:lim ..."
+  list<string> pools;
+  get_str_list(conf->osd_op_queue_mclock_pool_client_qos, " \t", pools);
+  for (list<string>::iterator p = pools.begin(); p != pools.end(); ++p) {
+    long long pool;
+    double r, w, l;
+    if (sscanf(p->c_str(), "%lld:%lf:%lf:%lf", &pool, &r, &w, &l) != 4) {
+      lgeneric_derr(osd->cct)
+	<< "bad osd_op_queue_mclock_pool_client_qos entry " << *p << dendl;
+      continue;
+    }
+    c.pool_client[pool] = mclock_info_t(r, w, l);
+  }
+
+  // the rates are per osd and the pgs are spread over the shards
+  mclock_info_t *all[] = { &c.client, &c.peer, &c.recov, &c.scrub };
+  for (unsigned i = 0; i < sizeof(all) / sizeof(all[0]); ++i) {
+    all[i]->reservation /= num_shards;
+    all[i]->limit /= num_shards;
+  }
+  for (map<int64_t, mclock_info_t>::iterator p = c.pool_client.begin();
+       p != c.pool_client.end();
+       ++p) {
+    p->second.reservation /= num_shards;
+    p->second.limit /= num_shards;
+  }
+
+  {
+    Mutex::Locker l(mclock_lock);
+    mclock_conf = c;
+  }
+  for (vector<ShardData*>::iterator p = shard_list.begin();
+       p != shard_list.end();
+       ++p) {
+    Mutex::Locker l((*p)->sdata_op_ordering_lock);
+    (*p)->pqueue->update_class_info();
+  }
+}
+
+OSD::ShardedOpWQ::ShardData *OSD::ShardedOpWQ::steal_shard(
+  uint32_t shard_index)
+{
+  unsigned min_queue = osd->cct->_conf->osd_op_shard_steal_min_queue;
+  if (!min_queue)
+    return NULL;
+  ShardData *victim = NULL;
+  unsigned victim_len = 0;
+  for (uint32_t i = 1; i < num_shards; ++i) {
+    ShardData *s = shard_list[(shard_index + i) % num_shards];
+    // never wait on a busy shard; an idle thread has better things to do
+    if (!s->sdata_op_ordering_lock.TryLock())
+      continue;
+    unsigned len = s->pqueue->length();
+    if (len >= min_queue && len > victim_len &&
+	s->pqueue->get_wait() <= 0) {
+      if (victim)
+	victim->sdata_op_ordering_lock.Unlock();
+      victim = s;
+      victim_len = len;
+    } else {
+      s->sdata_op_ordering_lock.Unlock();
+    }
+  }
+  return victim;
+}
+
 void OSD::ShardedOpWQ::_process(uint32_t thread_index, heartbeat_handle_d *hb ) {
 
   uint32_t shard_index = thread_index % num_shards;
@@ -8253,25 +8425,57 @@ void OSD::ShardedOpWQ::_process(uint32_t thread_index, heartbeat_handle_d *hb )
   ShardData* sdata = shard_list[shard_index];
   assert(NULL != sdata);
   sdata->sdata_op_ordering_lock.Lock();
-  if (sdata->pqueue.empty()) {
+  boost::optional< pair<PGRef, PGQueueable> > stolen;
+  if (sdata->pqueue->empty()) {
+    sdata->sdata_op_ordering_lock.Unlock();
+    ShardData *victim = steal_shard(shard_index);
+    if (victim) {
+      stolen = steal_op(
+	victim->pqueue, victim->pg_for_processing,
+	std::bind(&ShardedOpWQ::get_class, this, std::placeholders::_1));
+      if (stolen) {
+	// from here on we work on the victim's ordering state, pg locked
+	victim->stolen.inc();
+	if (osd->logger)
+	  osd->logger->inc(l_osd_op_wq_steal);
+	sdata = victim;
+      } else {
+	victim->sdata_op_ordering_lock.Unlock();
+      }
+    }
+    if (!stolen) {
+      osd->cct->get_heartbeat_map()->reset_timeout(hb, 4, 0);
+      sdata->sdata_lock.Lock();
+      sdata->sdata_cond.WaitInterval(osd->cct, sdata->sdata_lock, utime_t(2, 0));
+      sdata->sdata_lock.Unlock();
+      sdata->sdata_op_ordering_lock.Lock();
+      if(sdata->pqueue->empty()) {
+	sdata->sdata_op_ordering_lock.Unlock();
+	return;
+      }
+    }
+  }
+  double wait = stolen ? 0 : sdata->pqueue->get_wait();
+  if (wait > 0) {
+    // everything queued is over its limit
     sdata->sdata_op_ordering_lock.Unlock();
     osd->cct->get_heartbeat_map()->reset_timeout(hb, 4, 0);
+    utime_t t;
+    t.set_from_double(MIN(wait, 2.0));
     sdata->sdata_lock.Lock();
-    sdata->sdata_cond.WaitInterval(osd->cct, sdata->sdata_lock, utime_t(2, 0));
+    sdata->sdata_cond.WaitInterval(osd->cct, sdata->sdata_lock, t);
     sdata->sdata_lock.Unlock();
-    sdata->sdata_op_ordering_lock.Lock();
-    if(sdata->pqueue.empty()) {
-      sdata->sdata_op_ordering_lock.Unlock();
-      return;
-    }
+    return;
   }
-  pair<PGRef, PGQueueable> item = sdata->pqueue.dequeue();
+  pair<PGRef, PGQueueable> item =
+    stolen ? *stolen : sdata->pqueue->dequeue();
   sdata->pg_for_processing[&*(item.first)].push_back(item.second);
   sdata->sdata_op_ordering_lock.Unlock();
   ThreadPool::TPHandle tp_handle(osd->cct, hb, timeout_interval, 
     suicide_interval);
 
-  (item.first)->lock_suspend_timeout(tp_handle);
+  if (!stolen)
+    (item.first)->lock_suspend_timeout(tp_handle);
 
   boost::optional<PGQueueable> op;
   {
@@ -8335,19 +8539,28 @@ void OSD::ShardedOpWQ::_enqueue(pair<PGRef, PGQueueable> item) {
   unsigned cost = item.second.get_cost();
   sdata->sdata_op_ordering_lock.Lock();
  
+  op_queue_class_t cl = get_class(item);
   if (priority >= CEPH_MSG_PRIO_LOW)
-    sdata->pqueue.enqueue_strict(
-      item.second.get_owner(), priority, item);
+    sdata->pqueue->enqueue_strict(cl, priority, item);
   else
-    sdata->pqueue.enqueue(
-      item.second.get_owner(),
-      priority, cost, item);
+    sdata->pqueue->enqueue(cl, priority, cost, item);
+  unsigned len = sdata->pqueue->length();
   sdata->sdata_op_ordering_lock.Unlock();
 
   sdata->sdata_lock.Lock();
   sdata->sdata_cond.SignalOne();
   sdata->sdata_lock.Unlock();
 
+  unsigned min_queue = osd->cct->_conf->osd_op_shard_steal_min_queue;
+  if (min_queue && len == min_queue && num_shards > 1) {
+    // just became backlogged: wake a thread of the next shard in case it
+    // is idle; once it is stealing it keeps checking on its own
+    ShardData *next = shard_list[(shard_index + 1) % num_shards];
+    next->sdata_lock.Lock();
+    next->sdata_cond.SignalOne();
+    next->sdata_lock.Unlock();
+  }
+
 }
 
 void OSD::ShardedOpWQ::_enqueue_front(pair<PGRef, PGQueueable> item) {
@@ -8364,14 +8577,11 @@ void OSD::ShardedOpWQ::_enqueue_front(pair<PGRef, PGQueueable> item) {
   }
   unsigned priority = item.second.get_priority();
   unsigned cost = item.second.get_cost();
+  op_queue_class_t cl = get_class(item);
   if (priority >= CEPH_MSG_PRIO_LOW)
-    sdata->pqueue.enqueue_strict_front(
-      item.second.get_owner(),
-      priority, item);
+    sdata->pqueue->enqueue_strict_front(cl, priority, item);
   else
-    sdata->pqueue.enqueue_front(
-      item.second.get_owner(),
-      priority, cost, item);
+    sdata->pqueue->enqueue_front(cl, priority, cost, item);
 
   sdata->sdata_op_ordering_lock.Unlock();
   sdata->sdata_lock.Lock();
@@ -8525,6 +8735,19 @@ const char** OSD::get_tracked_conf_keys() const
     "osd_pg_epoch_persisted_max_stale",
     "osd_disk_thread_ioprio_class",
     "osd_disk_thread_ioprio_priority",
+    "osd_op_queue_mclock_client_res",
+    "osd_op_queue_mclock_client_wgt",
+    "osd_op_queue_mclock_client_lim",
+    "osd_op_queue_mclock_peer_res",
+    "osd_op_queue_mclock_peer_wgt",
+    "osd_op_queue_mclock_peer_lim",
+    "osd_op_queue_mclock_recov_res",
+    "osd_op_queue_mclock_recov_wgt",
+    "osd_op_queue_mclock_recov_lim",
+    "osd_op_queue_mclock_scrub_res",
+    "osd_op_queue_mclock_scrub_wgt",
+    "osd_op_queue_mclock_scrub_lim",
+    "osd_op_queue_mclock_pool_client_qos",
     // clog & admin clog
     "clog_to_monitors",
     "clog_to_syslog",
@@ -8560,6 +8783,14 @@ void OSD::handle_conf_change(const struct md_config_t *conf,
       changed.count("osd_disk_thread_ioprio_priority")) {
     set_disk_tp_priority();
   }
+  for (set<string>::const_iterator p = changed.begin();
+       p != changed.end();
+       ++p) {
+    if (p->compare(0, 19, "osd_op_queue_mclock") == 0) {
+      op_shardedwq.update_mclock_conf();
+      break;
+    }
+  }
   if (changed.count("osd_map_cache_size")) {
     service.map_cache.set_size(cct->_conf->osd_map_cache_size);
     service.map_bl_cache.set_size(cct->_conf->osd_map_cache_size);
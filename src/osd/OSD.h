@@ -53,6 +53,8 @@ using namespace std;
 #include "common/simple_cache.hpp"
 #include "common/sharedptr_registry.hpp"
 #include "common/PrioritizedQueue.h"
+#include "common/MClockQueue.h"
+#include "OpShardSteal.h"
 #include "messages/MOSDOp.h"
 
 #define CEPH_OSD_PROTOCOL    10 /* cluster internal */
@@ -115,6 +117,7 @@ enum {
   l_osd_map,
   l_osd_mape,
   l_osd_mape_dup,
+  l_osd_map_cache_bytes,
 
   l_osd_waiting_for_map,
 
@@ -150,6 +153,8 @@ enum {
   l_osd_tier_promote_lat,
   l_osd_tier_r_lat,
 
+  l_osd_op_wq_steal,
+
   l_osd_last,
 };
 
@@ -332,6 +337,34 @@ struct PGSnapTrim {
   }
 };
 
+/// what the op queue shares service between
+struct op_queue_class_t {
+  enum {
+    CLIENT,    ///< ops of one client in one pool
+    PEER,      ///< replication traffic from one osd in one pool
+    RECOVERY,  ///< recovery and backfill in one pool
+    SCRUB,     ///< scrub and snap trimming in one pool
+    OWNER,     ///< all ops of one owner; what the prio queue is fair between
+  };
+  int type;
+  int64_t pool;
+  entity_inst_t owner;
+  op_queue_class_t(int t, int64_t p, const entity_inst_t &o)
+    : type(t), pool(p), owner(o) {}
+  explicit op_queue_class_t(const entity_inst_t &o)
+    : type(OWNER), pool(-1), owner(o) {}
+};
+inline bool operator==(const op_queue_class_t &l, const op_queue_class_t &r) {
+  return l.type == r.type && l.pool == r.pool && l.owner == r.owner;
+}
+inline bool operator<(const op_queue_class_t &l, const op_queue_class_t &r) {
+  if (l.type != r.type)
+    return l.type < r.type;
+  if (l.pool != r.pool)
+    return l.pool < r.pool;
+  return l.owner < r.owner;
+}
+
 class PGQueueable {
   typedef boost::variant<
     OpRequestRef,
@@ -382,6 +415,7 @@ public:
   int get_cost() const { return cost; }
   utime_t get_start_time() const { return start_time; }
   entity_inst_t get_owner() const { return owner; }
+  op_queue_class_t get_class(int64_t pool) const;
 };
 
 class OSDService {
@@ -875,6 +909,9 @@ public:
 
   void clear_map_bl_cache_pins(epoch_t e);
 
+  /// bytes held by the decoded maps we know of, shared parts counted once
+  uint64_t get_map_cache_footprint();
+
   void need_heartbeat_peer_update();
 
   void pg_stat_queue_enqueue(PG *pg);
@@ -1593,28 +1630,45 @@ private:
   friend class PGQueueable;
   class ShardedOpWQ: public ShardedThreadPool::ShardedWQ < pair <PGRef, PGQueueable> > {
 
+    typedef OpQueue< pair<PGRef, PGQueueable>, op_queue_class_t> OpQueueType;
+
     struct ShardData {
       Mutex sdata_lock;
       Cond sdata_cond;
       Mutex sdata_op_ordering_lock;
       map<PG*, list<PGQueueable> > pg_for_processing;
-      PrioritizedQueue< pair<PGRef, PGQueueable>, entity_inst_t> pqueue;
+      OpQueueType *pqueue;
+      atomic_t stolen;  ///< items dequeued by other shards' threads
       ShardData(
-	string lock_name, string ordering_lock,
-	uint64_t max_tok_per_prio, uint64_t min_cost)
+	string lock_name, string ordering_lock, OpQueueType *q)
 	: sdata_lock(lock_name.c_str()),
 	  sdata_op_ordering_lock(ordering_lock.c_str()),
-	  pqueue(max_tok_per_prio, min_cost) {}
+	  pqueue(q) {}
+      ~ShardData() {
+	delete pqueue;
+      }
     };
     
+    /// osd_op_queue_mclock_* as parsed by update_mclock_conf()
+    struct MClockConf {
+      mclock_info_t client, peer, recov, scrub;
+      map<int64_t, mclock_info_t> pool_client;  ///< per-pool client qos
+    };
+
     vector<ShardData*> shard_list;
     OSD *osd;
     uint32_t num_shards;
+    bool use_mclock;
+    Mutex mclock_lock;  ///< protects mclock_conf; taken under ordering locks
+    MClockConf mclock_conf;
 
   public:
     ShardedOpWQ(uint32_t pnum_shards, OSD *o, time_t ti, time_t si, ShardedThreadPool* tp):
       ShardedThreadPool::ShardedWQ < pair <PGRef, PGQueueable> >(ti, si, tp),
-      osd(o), num_shards(pnum_shards) {
+      osd(o), num_shards(pnum_shards),
+      use_mclock(o->cct->_conf->osd_op_queue == "mclock"),
+      mclock_lock("OSD::ShardedOpWQ::mclock_lock") {
+      update_mclock_conf();
       for(uint32_t i = 0; i < num_shards; i++) {
 	char lock_name[32] = {0};
 	snprintf(lock_name, sizeof(lock_name), "%s.%d", "OSD:ShardedOpWQ:", i);
@@ -1623,12 +1677,28 @@ private:
 	  order_lock, sizeof(order_lock), "%s.%d",
 	  "OSD:ShardedOpWQ:order:", i);
 	ShardData* one_shard = new ShardData(
-	  lock_name, order_lock,
-	  osd->cct->_conf->osd_op_pq_max_tokens_per_priority, 
-	  osd->cct->_conf->osd_op_pq_min_cost);
+	  lock_name, order_lock, create_queue());
 	shard_list.push_back(one_shard);
       }
     }
+
+    OpQueueType *create_queue();
+    op_queue_class_t get_class(const pair<PGRef, PGQueueable> &item) const;
+    mclock_info_t get_mclock_info(const op_queue_class_t &c);
+    /// parse the mclock settings and apply them to the classes already queued
+    void update_mclock_conf();
+
+    /**
+     * find a backlogged shard for an idle thread to help out
+     *
+     * Items are only stolen with steal_op(), which skips pgs that are in
+     * flight, and are then tracked through the victim's own
+     * pg_for_processing, exactly as the victim's threads would, so
+     * per-pg ordering is kept.
+     *
+     * @return the victim, with its sdata_op_ordering_lock held, or NULL
+     */
+    ShardData *steal_shard(uint32_t shard_index);
     
     ~ShardedOpWQ() {
       while(!shard_list.empty()) {
@@ -1659,7 +1729,9 @@ private:
 	assert (NULL != sdata);
 	sdata->sdata_op_ordering_lock.Lock();
 	f->open_object_section(lock_name);
-	sdata->pqueue.dump(f);
+	f->dump_unsigned("queue_length", sdata->pqueue->length());
+	f->dump_unsigned("stolen", sdata->stolen.read());
+	sdata->pqueue->dump(f);
 	f->close_section();
 	sdata->sdata_op_ordering_lock.Unlock();
       }
@@ -1680,7 +1752,7 @@ private:
       sdata = shard_list[shard_index];
       assert(sdata != NULL);
       sdata->sdata_op_ordering_lock.Lock();
-      sdata->pqueue.remove_by_filter(Pred(pg));
+      sdata->pqueue->remove_by_filter(Pred(pg));
       sdata->pg_for_processing.erase(pg);
       sdata->sdata_op_ordering_lock.Unlock();
     }
@@ -1694,7 +1766,7 @@ private:
       assert(dequeued);
       list<pair<PGRef, PGQueueable> > _dequeued;
       sdata->sdata_op_ordering_lock.Lock();
-      sdata->pqueue.remove_by_filter(Pred(pg), &_dequeued);
+      sdata->pqueue->remove_by_filter(Pred(pg), &_dequeued);
       for (list<pair<PGRef, PGQueueable> >::iterator i = _dequeued.begin();
 	   i != _dequeued.end(); ++i) {
 	boost::optional<OpRequestRef> mop = i->second.maybe_get_op();
@@ -1721,7 +1793,7 @@ private:
       ShardData* sdata = shard_list[shard_index];
       assert(NULL != sdata);
       Mutex::Locker l(sdata->sdata_op_ordering_lock);
-      return sdata->pqueue.empty();
+      return sdata->pqueue->empty();
     }
   } op_shardedwq;
 
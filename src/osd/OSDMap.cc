@@ -27,6 +27,8 @@
 #include "common/code_environment.h"
 
 #include "crush/CrushTreeDumper.h"
+#include "common/Thread.h"
+#include "include/atomic.h"
 
 #define dout_subsys ceph_subsys_osd
 
@@ -923,6 +925,9 @@ void OSDMap::set_max_osd(int m)
   }
   osd_info.resize(m);
   osd_xinfo.resize(m);
+  unshare(osd_addrs);
+  unshare(osd_uuid);
+  unshare(osd_primary_affinity);
   osd_addrs->client_addr.resize(m);
   osd_addrs->cluster_addr.resize(m);
   osd_addrs->hb_back_addr.resize(m);
@@ -1127,61 +1132,165 @@ void OSDMap::dedup(const OSDMap *o, OSDMap *n)
   int diff = 0;
 
   // do addrs match?
-  if (o->max_osd != n->max_osd)
-    diff++;
-  for (int i = 0; i < o->max_osd && i < n->max_osd; i++) {
-    if ( n->osd_addrs->client_addr[i] &&  o->osd_addrs->client_addr[i] &&
-	*n->osd_addrs->client_addr[i] == *o->osd_addrs->client_addr[i])
-      n->osd_addrs->client_addr[i] = o->osd_addrs->client_addr[i];
-    else
-      diff++;
-    if ( n->osd_addrs->cluster_addr[i] &&  o->osd_addrs->cluster_addr[i] &&
-	*n->osd_addrs->cluster_addr[i] == *o->osd_addrs->cluster_addr[i])
-      n->osd_addrs->cluster_addr[i] = o->osd_addrs->cluster_addr[i];
-    else
-      diff++;
-    if ( n->osd_addrs->hb_back_addr[i] &&  o->osd_addrs->hb_back_addr[i] &&
-	*n->osd_addrs->hb_back_addr[i] == *o->osd_addrs->hb_back_addr[i])
-      n->osd_addrs->hb_back_addr[i] = o->osd_addrs->hb_back_addr[i];
-    else
-      diff++;
-    if ( n->osd_addrs->hb_front_addr[i] &&  o->osd_addrs->hb_front_addr[i] &&
-	*n->osd_addrs->hb_front_addr[i] == *o->osd_addrs->hb_front_addr[i])
-      n->osd_addrs->hb_front_addr[i] = o->osd_addrs->hb_front_addr[i];
-    else
+  if (n->osd_addrs != o->osd_addrs) {
+    // n's addrs may be shared with the map it was copied from
+    unshare(n->osd_addrs);
+    if (o->max_osd != n->max_osd)
       diff++;
-  }
-  if (diff == 0) {
-    // zoinks, no differences at all!
-    n->osd_addrs = o->osd_addrs;
+    for (int i = 0; i < o->max_osd && i < n->max_osd; i++) {
+      if ( n->osd_addrs->client_addr[i] &&  o->osd_addrs->client_addr[i] &&
+	  *n->osd_addrs->client_addr[i] == *o->osd_addrs->client_addr[i])
+	n->osd_addrs->client_addr[i] = o->osd_addrs->client_addr[i];
+      else
+	diff++;
+      if ( n->osd_addrs->cluster_addr[i] &&  o->osd_addrs->cluster_addr[i] &&
+	  *n->osd_addrs->cluster_addr[i] == *o->osd_addrs->cluster_addr[i])
+	n->osd_addrs->cluster_addr[i] = o->osd_addrs->cluster_addr[i];
+      else
+	diff++;
+      if ( n->osd_addrs->hb_back_addr[i] &&  o->osd_addrs->hb_back_addr[i] &&
+	  *n->osd_addrs->hb_back_addr[i] == *o->osd_addrs->hb_back_addr[i])
+	n->osd_addrs->hb_back_addr[i] = o->osd_addrs->hb_back_addr[i];
+      else
+	diff++;
+      if ( n->osd_addrs->hb_front_addr[i] &&  o->osd_addrs->hb_front_addr[i] &&
+	  *n->osd_addrs->hb_front_addr[i] == *o->osd_addrs->hb_front_addr[i])
+	n->osd_addrs->hb_front_addr[i] = o->osd_addrs->hb_front_addr[i];
+      else
+	diff++;
+    }
+    if (diff == 0) {
+      // zoinks, no differences at all!
+      n->osd_addrs = o->osd_addrs;
+    }
   }
 
   // does crush match?
-  bufferlist oc, nc;
-  ::encode(*o->crush, oc);
-  ::encode(*n->crush, nc);
-  if (oc.contents_equal(nc)) {
-    n->crush = o->crush;
+  if (n->crush != o->crush) {
+    bufferlist oc, nc;
+    ::encode(*o->crush, oc);
+    ::encode(*n->crush, nc);
+    if (oc.contents_equal(nc)) {
+      n->crush = o->crush;
+    }
   }
 
   // does pg_temp match?
-  if (o->pg_temp->size() == n->pg_temp->size()) {
+  if (o->pg_temp != n->pg_temp &&
+      o->pg_temp->size() == n->pg_temp->size()) {
     if (*o->pg_temp == *n->pg_temp)
       n->pg_temp = o->pg_temp;
   }
 
   // does primary_temp match?
-  if (o->primary_temp->size() == n->primary_temp->size()) {
+  if (o->primary_temp != n->primary_temp &&
+      o->primary_temp->size() == n->primary_temp->size()) {
     if (*o->primary_temp == *n->primary_temp)
       n->primary_temp = o->primary_temp;
   }
 
   // do uuids match?
-  if (o->osd_uuid->size() == n->osd_uuid->size() &&
+  if (o->osd_uuid != n->osd_uuid &&
+      o->osd_uuid->size() == n->osd_uuid->size() &&
       *o->osd_uuid == *n->osd_uuid)
     n->osd_uuid = o->osd_uuid;
 }
 
+uint64_t OSDMap::get_footprint(const OSDMap *base) const
+{
+  // std::map/rb-tree node overhead, roughly
+  const uint64_t node = 4 * sizeof(void*);
+  uint64_t r = sizeof(*this);
+
+  r += osd_state.capacity() * sizeof(uint8_t) +
+    osd_weight.capacity() * sizeof(__u32) +
+    osd_info.capacity() * sizeof(osd_info_t) +
+    osd_xinfo.capacity() * sizeof(osd_xinfo_t);
+  r += pools.size() * (node + sizeof(int64_t) + sizeof(pg_pool_t));
+  for (map<int64_t,string>::const_iterator p = pool_name.begin();
+       p != pool_name.end();
+       ++p)
+    r += 2 * (node + sizeof(int64_t) + sizeof(string) + p->second.size());
+  r += blacklist.size() *
+    (node + sizeof(entity_addr_t) + sizeof(utime_t));
+
+  if (!base || osd_addrs != base->osd_addrs) {
+    r += sizeof(addrs_s);
+    const vector<ceph::shared_ptr<entity_addr_t> > *v[4] = {
+      &osd_addrs->client_addr, &osd_addrs->cluster_addr,
+      &osd_addrs->hb_back_addr, &osd_addrs->hb_front_addr };
+    const vector<ceph::shared_ptr<entity_addr_t> > *bv[4] = {
+      NULL, NULL, NULL, NULL };
+    if (base) {
+      bv[0] = &base->osd_addrs->client_addr;
+      bv[1] = &base->osd_addrs->cluster_addr;
+      bv[2] = &base->osd_addrs->hb_back_addr;
+      bv[3] = &base->osd_addrs->hb_front_addr;
+    }
+    for (int j = 0; j < 4; ++j) {
+      r += v[j]->capacity() * sizeof(ceph::shared_ptr<entity_addr_t>);
+      for (unsigned i = 0; i < v[j]->size(); ++i) {
+	if (!(*v[j])[i])
+	  continue;
+	if (bv[j] && i < bv[j]->size() && (*bv[j])[i] == (*v[j])[i])
+	  continue;
+	r += sizeof(entity_addr_t);
+      }
+    }
+  }
+  if (!base || pg_temp != base->pg_temp)
+    r += pg_temp->size() *
+      (node + sizeof(pg_t) + sizeof(vector<int32_t>) + 3 * sizeof(int32_t));
+  if (!base || primary_temp != base->primary_temp)
+    r += primary_temp->size() * (node + sizeof(pg_t) + sizeof(int32_t));
+  if (osd_primary_affinity &&
+      (!base || osd_primary_affinity != base->osd_primary_affinity))
+    r += osd_primary_affinity->capacity() * sizeof(__u32);
+  if (!base || osd_uuid != base->osd_uuid)
+    r += osd_uuid->capacity() * sizeof(uuid_d);
+
+  if (mapping && (!base || mapping != base->mapping)) {
+    r += sizeof(mapping_t) + mapping->osd_weight.capacity() * sizeof(__u32);
+    for (map<int64_t, ceph::shared_ptr<const pool_mapping_t> >::const_iterator p =
+	   mapping->pools.begin();
+	 p != mapping->pools.end();
+	 ++p) {
+      r += node + sizeof(*p);
+      if (base && base->mapping) {
+	map<int64_t, ceph::shared_ptr<const pool_mapping_t> >::const_iterator q =
+	  base->mapping->pools.find(p->first);
+	if (q != base->mapping->pools.end() && q->second == p->second)
+	  continue;
+      }
+      r += sizeof(pool_mapping_t) + p->second->osds.capacity() * sizeof(int32_t);
+    }
+  }
+
+  if (!base || crush != base->crush) {
+    int max_buckets = crush->get_max_buckets();
+    int max_rules = crush->get_max_rules();
+    if (max_buckets < 0 || max_rules < 0)
+      max_buckets = max_rules = 0;  // no crush_map at all
+    r += sizeof(CrushWrapper) + sizeof(crush_map);
+    r += max_buckets * sizeof(crush_bucket*) + max_rules * sizeof(crush_rule*);
+    for (int i = 0; i < max_buckets; ++i) {
+      int id = -1 - i;
+      if (!crush->bucket_exists(id))
+	continue;
+      // items, perm and per-item weights
+      r += sizeof(crush_bucket) +
+	crush->get_bucket_size(id) * 3 * sizeof(__u32);
+    }
+    for (int i = 0; i < max_rules; ++i) {
+      if (!crush->rule_exists(i))
+	continue;
+      r += sizeof(crush_rule) +
+	crush->get_rule_len(i) * sizeof(crush_rule_step);
+    }
+  }
+  return r;
+}
+
 void OSDMap::remove_redundant_temporaries(CephContext *cct, const OSDMap& osdmap,
 					  OSDMap::Incremental *pending_inc)
 {
@@ -1344,6 +1453,15 @@ int OSDMap::apply_incremental(const Incremental &inc)
     set_erasure_code_profile(i->first, i->second);
   }
   
+  if (!inc.new_state.empty() || !inc.new_uuid.empty())
+    unshare(osd_uuid);
+  if (!inc.new_up_client.empty() || !inc.new_up_cluster.empty())
+    unshare(osd_addrs);
+  if (!inc.new_pg_temp.empty())
+    unshare(pg_temp);
+  if (!inc.new_primary_temp.empty())
+    unshare(primary_temp);
+
   // up/down
   for (map<int32_t,uint8_t>::const_iterator i = inc.new_state.begin();
        i != inc.new_state.end();
@@ -1514,6 +1632,175 @@ void OSDMap::_remove_nonexistent_osds(const pg_pool_t& pool,
   }
 }
 
+OSDMap::pool_mapping_t::pool_mapping_t(const pg_pool_t& pool)
+  : pg_num(pool.get_pg_num()),
+    pgp_num(pool.get_pgp_num()),
+    size(pool.get_size()),
+    crush_ruleset(pool.get_crush_ruleset()),
+    type(pool.get_type()),
+    hashpspool(pool.has_flag(pg_pool_t::FLAG_HASHPSPOOL)),
+    osds(pg_num * (size + 1), 0)
+{
+}
+
+bool OSDMap::pool_mapping_t::same_placement(const pg_pool_t& pool) const
+{
+  return pg_num == pool.get_pg_num() &&
+    pgp_num == pool.get_pgp_num() &&
+    size == pool.get_size() &&
+    crush_ruleset == pool.get_crush_ruleset() &&
+    type == pool.get_type() &&
+    hashpspool == pool.has_flag(pg_pool_t::FLAG_HASHPSPOOL);
+}
+
+/// computes a range of pgs of one pool for update_mapping()
+class OSDMapMappingJob : public Thread {
+public:
+  struct range_t {
+    const pg_pool_t *pool;
+    int64_t poolid;
+    OSDMap::pool_mapping_t *pm;
+    unsigned begin, end;
+  };
+
+private:
+  const OSDMap *osdmap;
+  const vector<range_t> &ranges;
+  atomic_t &next;
+  bool need_lock;
+
+public:
+  OSDMapMappingJob(const OSDMap *m, const vector<range_t> &r, atomic_t &n,
+		   bool l)
+    : osdmap(m), ranges(r), next(n), need_lock(l) {}
+
+  void *entry() {
+    unsigned i;
+    while ((i = next.inc() - 1) < ranges.size())
+      run(ranges[i]);
+    return 0;
+  }
+
+  void run(const range_t &r) {
+    const CrushWrapper *crush = osdmap->crush.get();
+    unsigned size = r.pm->size;
+    int ruleno = crush->find_rule(r.pool->get_crush_ruleset(),
+				  r.pool->get_type(), size);
+    vector<int> osds;
+    for (unsigned ps = r.begin; ps < r.end; ++ps) {
+      osds.clear();
+      if (ruleno >= 0)
+	crush->do_rule(ruleno, r.pool->raw_pg_to_pps(pg_t(ps, r.poolid)),
+		       osds, size, osdmap->osd_weight, need_lock);
+      int32_t *e = &r.pm->osds[ps * (size + 1)];
+      e[0] = osds.size();
+      for (unsigned j = 0; j < osds.size(); ++j)
+	e[j + 1] = osds[j];
+    }
+  }
+};
+
+bool OSDMap::_rule_reaches(const pg_pool_t& pool, const set<int>& osds) const
+{
+  int ruleno = crush->find_rule(pool.get_crush_ruleset(), pool.get_type(),
+				pool.get_size());
+  if (ruleno < 0)
+    return false;
+  for (int s = 0; s < crush->get_rule_len(ruleno); ++s) {
+    if (crush->get_rule_op(ruleno, s) != CRUSH_RULE_TAKE)
+      continue;
+    int root = crush->get_rule_arg1(ruleno, s);
+    for (set<int>::const_iterator p = osds.begin(); p != osds.end(); ++p) {
+      if (crush->subtree_contains(root, *p))
+	return true;
+    }
+  }
+  return false;
+}
+
+void OSDMap::update_mapping(unsigned num_threads)
+{
+  const mapping_t *prev = mapping.get();
+  bool reuse = prev && prev->crush == crush &&
+    prev->osd_weight.size() == osd_weight.size();
+  set<int> reweighted;
+  for (unsigned i = 0; reuse && i < osd_weight.size(); ++i) {
+    if (osd_weight[i] != prev->osd_weight[i])
+      reweighted.insert(i);
+  }
+
+  ceph::shared_ptr<mapping_t> m(new mapping_t);
+  m->epoch = epoch;
+  m->crush = crush;
+  m->osd_weight = osd_weight;
+
+  const unsigned chunk = 1024;
+  vector<OSDMapMappingJob::range_t> ranges;
+  for (map<int64_t,pg_pool_t>::const_iterator p = pools.begin();
+       p != pools.end();
+       ++p) {
+    if (reuse) {
+      map<int64_t, ceph::shared_ptr<const pool_mapping_t> >::const_iterator q =
+	prev->pools.find(p->first);
+      if (q != prev->pools.end() &&
+	  q->second->same_placement(p->second) &&
+	  (reweighted.empty() || !_rule_reaches(p->second, reweighted))) {
+	m->pools[p->first] = q->second;
+	continue;
+      }
+    }
+    pool_mapping_t *pm = new pool_mapping_t(p->second);
+    m->pools[p->first].reset(pm);
+    for (unsigned b = 0; b < pm->pg_num; b += chunk) {
+      OSDMapMappingJob::range_t r;
+      r.pool = &p->second;
+      r.poolid = p->first;
+      r.pm = pm;
+      r.begin = b;
+      r.end = MIN(b + chunk, pm->pg_num);
+      ranges.push_back(r);
+    }
+  }
+
+  atomic_t next;
+  bool need_lock = !crush->is_mapper_reentrant();
+  unsigned n = need_lock ? 1 : MIN(num_threads, ranges.size());
+  if (n <= 1) {
+    OSDMapMappingJob job(this, ranges, next, need_lock);
+    job.entry();
+  } else {
+    vector<OSDMapMappingJob*> jobs;
+    for (unsigned i = 0; i < n; ++i) {
+      jobs.push_back(new OSDMapMappingJob(this, ranges, next, need_lock));
+      jobs.back()->create();
+    }
+    for (unsigned i = 0; i < n; ++i) {
+      jobs[i]->join();
+      delete jobs[i];
+    }
+  }
+  mapping = m;
+}
+
+bool OSDMap::_get_mapped_osds(const pg_pool_t& pool, pg_t pg,
+			      vector<int> *osds) const
+{
+  if (!have_mapping())
+    return false;
+  map<int64_t, ceph::shared_ptr<const pool_mapping_t> >::const_iterator p =
+    mapping->pools.find(pg.pool());
+  if (p == mapping->pools.end())
+    return false;
+  const pool_mapping_t& pm = *p->second;
+  // raw pgs (e.g. from object_locator_to_pg) map like their folded pg
+  unsigned ps = pool.raw_pg_to_pg(pg).ps();
+  if (ps >= pm.pg_num || pm.size != pool.get_size())
+    return false;
+  const int32_t *e = &pm.osds[ps * (pm.size + 1)];
+  osds->assign(e + 1, e + 1 + e[0]);
+  return true;
+}
+
 int OSDMap::_pg_to_osds(const pg_pool_t& pool, pg_t pg,
                         vector<int> *osds, int *primary,
 			ps_t *ppps) const
@@ -1522,10 +1809,12 @@ int OSDMap::_pg_to_osds(const pg_pool_t& pool, pg_t pg,
   ps_t pps = pool.raw_pg_to_pps(pg);  // placement ps
   unsigned size = pool.get_size();
 
-  // what crush rule?
-  int ruleno = crush->find_rule(pool.get_crush_ruleset(), pool.get_type(), size);
-  if (ruleno >= 0)
-    crush->do_rule(ruleno, pps, *osds, size, osd_weight);
+  if (!_get_mapped_osds(pool, pg, osds)) {
+    // what crush rule?
+    int ruleno = crush->find_rule(pool.get_crush_ruleset(), pool.get_type(), size);
+    if (ruleno >= 0)
+      crush->do_rule(ruleno, pps, *osds, size, osd_weight);
+  }
 
   _remove_nonexistent_osds(pool, *osds);
 
@@ -2088,8 +2377,22 @@ void OSDMap::decode_classic(bufferlist::iterator& p)
   post_decode();
 }
 
+void OSDMap::reset_shared()
+{
+  osd_addrs.reset(new addrs_s);
+  pg_temp.reset(new map<pg_t,vector<int32_t> >);
+  primary_temp.reset(new map<pg_t,int32_t>);
+  osd_primary_affinity.reset();
+  osd_uuid.reset(new vector<uuid_d>);
+  crush.reset(new CrushWrapper);
+  mapping.reset();
+}
+
 void OSDMap::decode(bufferlist::iterator& bl)
 {
+  // we may share these with other maps; decode into our own
+  reset_shared();
+
   /**
    * Older encodings of the OSDMap had a single struct_v which
    * covered the whole encoding, and was prior to our modern
@@ -250,8 +250,47 @@ private:
   mutable bool crc_defined;
   mutable uint32_t crc;
 
+  /// raw crush output for every pg of one pool
+  struct pool_mapping_t {
+    // the placement inputs it was computed from
+    unsigned pg_num, pgp_num, size;
+    int crush_ruleset;
+    unsigned type;
+    bool hashpspool;
+    vector<int32_t> osds;  ///< size + 1 per pg: the count, then the osds
+
+    explicit pool_mapping_t(const pg_pool_t& pool);
+    bool same_placement(const pg_pool_t& pool) const;
+  };
+  /// see update_mapping()
+  struct mapping_t {
+    epoch_t epoch;
+    ceph::shared_ptr<CrushWrapper> crush;
+    vector<__u32> osd_weight;
+    map<int64_t, ceph::shared_ptr<const pool_mapping_t> > pools;
+    mapping_t() : epoch(0) {}
+  };
+  ceph::shared_ptr<const mapping_t> mapping;
+  friend class OSDMapMappingJob;
+
   void _calc_up_osd_features();
 
+  /**
+   * make a structure shared with other maps private before changing it
+   *
+   * Maps copied with shared_copy_from() share osd_addrs, the temps,
+   * osd_uuid, osd_primary_affinity and crush with their source until
+   * one of them changes, so every in-place modification of those must
+   * go through here first.
+   */
+  template <typename T>
+  static void unshare(ceph::shared_ptr<T>& p) {
+    if (p && !p.unique())
+      p.reset(new T(*p));
+  }
+  /// replace the shared structures with new, empty ones (before decode)
+  void reset_shared();
+
  public:
   bool have_crc() const { return crc_defined; }
   uint32_t get_crc() const { return crc; }
@@ -299,6 +338,39 @@ public:
     // allocate a new CrushWrapper, though.
   }
 
+  /**
+   * copy o, sharing its addrs, temps, uuids, primary affinity and crush
+   *
+   * They are copied on write, so apply_incremental() on the result only
+   * duplicates what the incremental actually changes.
+   */
+  void shared_copy_from(const OSDMap& o) {
+    *this = o;
+  }
+
+  /**
+   * approximate bytes held by this map
+   *
+   * @param base if non-NULL, leave out structures shared with base
+   */
+  uint64_t get_footprint(const OSDMap *base = NULL) const;
+
+  /**
+   * precompute the crush placement of every pg for this epoch
+   *
+   * Later lookups at this epoch use the table instead of running crush.
+   * Pools whose placement inputs did not change since the table of the
+   * previous epoch (kept across apply_incremental()) reuse its entries;
+   * so do pools whose rules do not reach any osd whose weight changed.
+   * The rest is computed by up to num_threads threads.
+   *
+   * The map must not be changed at the same epoch afterwards.
+   */
+  void update_mapping(unsigned num_threads = 1);
+  bool have_mapping() const {
+    return mapping && mapping->epoch == epoch;
+  }
+
   // map info
   const uuid_d& get_fsid() const { return fsid; }
   void set_fsid(uuid_d& f) { fsid = f; }
@@ -383,6 +455,7 @@ public:
     if (!osd_primary_affinity)
       osd_primary_affinity.reset(new vector<__u32>(max_osd,
 						   CEPH_OSD_DEFAULT_PRIMARY_AFFINITY));
+    unshare(osd_primary_affinity);
     (*osd_primary_affinity)[o] = w;
   }
   unsigned get_primary_affinity(int o) const {
@@ -618,6 +691,12 @@ public:
   }
 
 private:
+  /// look pg up in the mapping table; false if it is not covered
+  bool _get_mapped_osds(const pg_pool_t& pool, pg_t pg,
+			vector<int> *osds) const;
+  /// true if pool's crush rule can choose any of osds
+  bool _rule_reaches(const pg_pool_t& pool, const set<int>& osds) const;
+
   /// pg -> (raw osd list)
   int _pg_to_osds(const pg_pool_t& pool, pg_t pg,
                   vector<int> *osds, int *primary,
@@ -834,6 +913,8 @@ public:
   bool crush_ruleset_in_use(int ruleset) const;
 
   void clear_temp() {
+    unshare(pg_temp);
+    unshare(primary_temp);
     pg_temp->clear();
     primary_temp->clear();
   }
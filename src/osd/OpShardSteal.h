@@ -0,0 +1,50 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef CEPH_OSD_OPSHARDSTEAL_H
+#define CEPH_OSD_OPSHARDSTEAL_H
+
+#include <boost/optional.hpp>
+
+#include "include/msgr.h"
+#include "common/OpQueue.h"
+
+/**
+ * Dequeue the next item of another op shard for an idle thread
+ *
+ * The thief must never wait on a pg lock: the pg is likely the hot one
+ * that backlogged the shard, and its own threads are already queued on
+ * it.  So the item is only taken if no other item of its pg is in
+ * flight on the shard (in_flight is the shard's pg_for_processing) and
+ * the pg can be try_lock()ed; it is then returned with the pg locked.
+ * Otherwise it goes back to the front of its class and nothing is
+ * returned.
+ *
+ * The caller holds the shard's ordering lock and has checked that the
+ * queue is not empty.
+ */
+template <typename T, typename K, typename InFlight, typename ClassFunc>
+boost::optional<T> steal_op(OpQueue<T, K> *q, const InFlight &in_flight,
+			    ClassFunc get_class)
+{
+  T item = q->dequeue();
+  if (!in_flight.count(&*item.first) && item.first->try_lock())
+    return item;
+  unsigned priority = item.second.get_priority();
+  if (priority >= CEPH_MSG_PRIO_LOW)
+    q->enqueue_strict_front(get_class(item), priority, item);
+  else
+    q->enqueue_front(get_class(item), priority, item.second.get_cost(), item);
+  return boost::optional<T>();
+}
+
+#endif
@@ -253,6 +253,17 @@ void PG::lock(bool no_lockdep) const
   dout(30) << "lock" << dendl;
 }
 
+bool PG::try_lock() const
+{
+  if (!_lock.TryLock())
+    return false;
+  assert(!dirty_info);
+  assert(!dirty_big_info);
+
+  dout(30) << "try_lock" << dendl;
+  return true;
+}
+
 std::string PG::gen_prefix() const
 {
   stringstream out;
@@ -56,6 +56,12 @@ public:
     const string &prefix
     );
 
+  int rm_range_keys(
+    const string &prefix,
+    const string &start,
+    const string &end
+    );
+
   class TransactionImpl_ : public TransactionImpl {
   public:
     list<Context *> on_commit;
@@ -110,6 +116,18 @@ public:
       on_commit.push_back(new RmKeysByPrefixOp(db, prefix));
     }
 
+    // match the real backends: only committed keys are removed
+    void rm_range_keys(const string &prefix, const string &start,
+		       const string &end) {
+      map<std::pair<string,string>,bufferlist>::iterator i =
+	db->db.lower_bound(make_pair(prefix, start));
+      for (; i != db->db.end(); ++i) {
+	if (i->first.first != prefix || i->first.second >= end)
+	  break;
+	on_commit.push_back(new RmKeysOp(db, i->first));
+      }
+    }
+
     int complete() {
       for (list<Context *>::iterator i = on_commit.begin();
 	   i != on_commit.end();
@@ -79,6 +79,8 @@
      --show-mappings       show mappings
      --show-bad-mappings   show bad mappings
      --show-choose-tries   show choose tries histogram
+     --show-time           show how long the mapping took
+     --no-simd             hash straw2 items without simd
      --output-name name
                            prepend the data file(s) generated during the
                            testing routine with name
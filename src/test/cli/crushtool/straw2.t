@@ -1,4 +1,7 @@
   $ crushtool -c $TESTDIR/straw2.txt -o straw2
   $ crushtool -d straw2 -o straw2.txt.new
   $ diff -b $TESTDIR/straw2.txt straw2.txt.new
-  $ rm straw2 straw2.txt.new
+  $ crushtool -i straw2 --test --show-mappings --min-x 0 --max-x 1023 --num-rep 3 > simd.out
+  $ crushtool -i straw2 --test --show-mappings --min-x 0 --max-x 1023 --num-rep 3 --no-simd > scalar.out
+  $ diff simd.out scalar.out
+  $ rm straw2 straw2.txt.new simd.out scalar.out
@@ -0,0 +1,177 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include "gtest/gtest.h"
+#include "common/MClockQueue.h"
+
+#include <map>
+
+class MClockQueueTest : public testing::Test
+{
+protected:
+  typedef int Klass;
+  typedef unsigned Item;
+  typedef MClockQueue<Item, Klass> Q;
+
+  double now;
+  std::map<Klass, mclock_info_t> info;
+
+  MClockQueueTest() : now(100) {}
+
+  Q *create() {
+    return new Q(std::bind(&MClockQueueTest::get_info, this,
+			   std::placeholders::_1),
+		 std::bind(&MClockQueueTest::get_now, this));
+  }
+  mclock_info_t get_info(const Klass& k) {
+    return info[k];
+  }
+  double get_now() {
+    return now;
+  }
+};
+
+TEST_F(MClockQueueTest, strict_first) {
+  std::unique_ptr<Q> q(create());
+  q->enqueue(1, 0, 0, 1);
+  q->enqueue_strict(2, 10, 2);
+  q->enqueue_strict(2, 20, 3);
+  q->enqueue_strict_front(2, 20, 4);
+  ASSERT_EQ(4u, q->length());
+  EXPECT_EQ(4u, q->dequeue());
+  EXPECT_EQ(3u, q->dequeue());
+  EXPECT_EQ(2u, q->dequeue());
+  EXPECT_EQ(1u, q->dequeue());
+  EXPECT_TRUE(q->empty());
+}
+
+TEST_F(MClockQueueTest, fifo_within_class) {
+  std::unique_ptr<Q> q(create());
+  for (unsigned i = 0; i < 10; ++i)
+    q->enqueue(1, 0, 0, i);
+  q->enqueue_front(1, 0, 0, 100);
+  EXPECT_EQ(100u, q->dequeue());
+  for (unsigned i = 0; i < 10; ++i)
+    EXPECT_EQ(i, q->dequeue());
+  EXPECT_TRUE(q->empty());
+}
+
+TEST_F(MClockQueueTest, weight) {
+  info[1] = mclock_info_t(0, 1, 0);
+  info[2] = mclock_info_t(0, 3, 0);
+  std::unique_ptr<Q> q(create());
+  for (unsigned i = 0; i < 400; ++i) {
+    q->enqueue(1, 0, 0, 1);
+    q->enqueue(2, 0, 0, 2);
+  }
+  // both are backlogged: service follows the weights
+  unsigned got[3] = {0, 0, 0};
+  for (unsigned i = 0; i < 400; ++i)
+    ++got[q->dequeue()];
+  EXPECT_NEAR(100u, got[1], 2);
+  EXPECT_NEAR(300u, got[2], 2);
+}
+
+TEST_F(MClockQueueTest, late_arrival) {
+  info[1] = mclock_info_t(0, 1, 0);
+  info[2] = mclock_info_t(0, 1, 0);
+  std::unique_ptr<Q> q(create());
+  for (unsigned i = 0; i < 1000; ++i)
+    q->enqueue(1, 0, 0, 1);
+  // class 1 has been backlogged for a while: its tags are ahead of now
+  for (unsigned i = 0; i < 100; ++i)
+    EXPECT_EQ(1u, q->dequeue());
+
+  for (unsigned i = 0; i < 100; ++i)
+    q->enqueue(2, 0, 0, 2);
+  // the newcomer shares by weight instead of taking over
+  unsigned got[3] = {0, 0, 0};
+  for (unsigned i = 0; i < 100; ++i)
+    ++got[q->dequeue()];
+  EXPECT_NEAR(50u, got[1], 1);
+  EXPECT_NEAR(50u, got[2], 1);
+}
+
+TEST_F(MClockQueueTest, reservation) {
+  info[1] = mclock_info_t(10, 1, 0);
+  info[2] = mclock_info_t(0, 1000, 0);
+  std::unique_ptr<Q> q(create());
+  for (unsigned i = 0; i < 1000; ++i) {
+    q->enqueue(1, 0, 0, 1);
+    q->enqueue(2, 0, 0, 2);
+  }
+  // serve 100 ops/s for one second: weights alone would give class 1
+  // a tenth of an op, its reservation guarantees 10
+  unsigned got[3] = {0, 0, 0};
+  for (unsigned i = 0; i < 100; ++i) {
+    now += 0.01;
+    ++got[q->dequeue()];
+  }
+  EXPECT_GE(got[1], 10u);
+  EXPECT_LE(got[1], 12u);
+}
+
+TEST_F(MClockQueueTest, limit) {
+  info[1] = mclock_info_t(0, 1, 10);
+  std::unique_ptr<Q> q(create());
+  for (unsigned i = 0; i < 5; ++i)
+    q->enqueue(1, 0, 0, i);
+  EXPECT_EQ(0, q->get_wait());
+  EXPECT_EQ(0u, q->dequeue());
+  EXPECT_NEAR(0.1, q->get_wait(), 0.0001);
+  now += 0.1;
+  EXPECT_EQ(0, q->get_wait());
+  EXPECT_EQ(1u, q->dequeue());
+
+  // an unlimited class is not held back by the limited one
+  q->enqueue(2, 0, 0, 100);
+  EXPECT_EQ(0, q->get_wait());
+  EXPECT_EQ(100u, q->dequeue());
+  EXPECT_LT(0, q->get_wait());
+}
+
+TEST_F(MClockQueueTest, remove) {
+  std::unique_ptr<Q> q(create());
+  for (unsigned i = 0; i < 10; ++i)
+    q->enqueue(i % 2, 0, 0, i);
+  q->enqueue_strict(1, 10, 11);
+
+  std::list<Item> removed;
+  q->remove_by_class(1, &removed);
+  EXPECT_EQ(6u, removed.size());
+  EXPECT_EQ(5u, q->length());
+
+  removed.clear();
+  q->remove_by_filter([](Item i) { return i < 4; }, &removed);
+  EXPECT_EQ(2u, removed.size());
+  EXPECT_EQ(3u, q->length());
+  EXPECT_EQ(4u, q->dequeue());
+  EXPECT_EQ(6u, q->dequeue());
+  EXPECT_EQ(8u, q->dequeue());
+  EXPECT_TRUE(q->empty());
+}
+
+TEST_F(MClockQueueTest, update_class_info) {
+  info[1] = mclock_info_t(0, 1, 10);
+  std::unique_ptr<Q> q(create());
+  q->enqueue(1, 0, 0, 1);
+  EXPECT_EQ(1u, q->dequeue());
+  q->enqueue(1, 0, 0, 2);
+  EXPECT_NEAR(0.1, q->get_wait(), 0.0001);
+  now += 0.1;
+  EXPECT_EQ(2u, q->dequeue());
+
+  // a known class keeps its old limit until told otherwise
+  info[1] = mclock_info_t(0, 1, 100);
+  q->enqueue(1, 0, 0, 3);
+  EXPECT_NEAR(0.1, q->get_wait(), 0.0001);
+  now += 0.1;
+  EXPECT_EQ(3u, q->dequeue());
+
+  q->update_class_info();
+  q->enqueue(1, 0, 0, 4);
+  EXPECT_NEAR(0.01, q->get_wait(), 0.0001);
+  now += 0.01;
+  EXPECT_EQ(4u, q->dequeue());
+  EXPECT_TRUE(q->empty());
+}
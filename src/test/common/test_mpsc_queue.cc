@@ -0,0 +1,58 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include "gtest/gtest.h"
+#include "common/MPSCQueue.h"
+
+#include <list>
+#include <thread>
+#include <vector>
+
+TEST(MPSCQueue, Order)
+{
+  MPSCQueue<int> q;
+  ASSERT_TRUE(q.empty());
+  ASSERT_TRUE(q.push(1));
+  ASSERT_FALSE(q.push(2));
+  ASSERT_FALSE(q.push(3));
+  ASSERT_FALSE(q.empty());
+
+  std::list<int> out;
+  q.drain(&out);
+  ASSERT_TRUE(q.empty());
+  ASSERT_EQ(3u, out.size());
+  ASSERT_EQ(1, out.front());
+  ASSERT_EQ(3, out.back());
+
+  // empty again, so the next push must report it
+  ASSERT_TRUE(q.push(4));
+}
+
+TEST(MPSCQueue, Producers)
+{
+  const int nthreads = 4, per_thread = 100000;
+  MPSCQueue<std::pair<int,int> > q;
+  std::vector<std::thread> producers;
+  for (int t = 0; t < nthreads; ++t)
+    producers.push_back(std::thread([&q, t]() {
+	  for (int i = 0; i < per_thread; ++i)
+	    q.push(std::make_pair(t, i));
+	}));
+
+  // each producer's items must come out in the order it pushed them
+  std::vector<int> next(nthreads, 0);
+  int total = 0;
+  while (total < nthreads * per_thread) {
+    std::list<std::pair<int,int> > out;
+    q.drain(&out);
+    for (std::list<std::pair<int,int> >::iterator p = out.begin();
+	 p != out.end(); ++p) {
+      ASSERT_EQ(next[p->first], p->second);
+      ++next[p->first];
+      ++total;
+    }
+  }
+  for (int t = 0; t < nthreads; ++t)
+    producers[t].join();
+  ASSERT_TRUE(q.empty());
+}
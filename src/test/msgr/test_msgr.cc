@@ -18,6 +18,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <time.h>
+#include <sys/stat.h>
 #include "common/Mutex.h"
 #include "common/Cond.h"
 #include "common/ceph_argparse.h"
@@ -29,6 +30,7 @@
 #include "msg/Connection.h"
 #include "messages/MPing.h"
 #include "messages/MCommand.h"
+#include "compressor/Compressor.h"
 
 #include <boost/random/mersenne_twister.hpp>
 #include <boost/random/uniform_int.hpp>
@@ -694,6 +696,120 @@ TEST_P(MessengerTest, MessageTest) {
   client_msgr->wait();
 }
 
+TEST_P(MessengerTest, CompressTest) {
+  FakeDispatcher cli_dispatcher(false), srv_dispatcher(true);
+  entity_addr_t bind_addr;
+  bind_addr.parse("127.0.0.1");
+  ceph::shared_ptr<Compressor> compressor(Compressor::create("snappy"));
+  ASSERT_TRUE(compressor);
+  ASSERT_EQ(0, server_msgr->set_compressor(compressor));
+  ASSERT_EQ(0, client_msgr->set_compressor(compressor));
+  Messenger::Policy p = Messenger::Policy::stateful_server(0, 0);
+  server_msgr->set_policy(entity_name_t::TYPE_CLIENT, p);
+  p = Messenger::Policy::lossless_peer(0, 0);
+  client_msgr->set_policy(entity_name_t::TYPE_OSD, p);
+
+  server_msgr->bind(bind_addr);
+  server_msgr->add_dispatcher_head(&srv_dispatcher);
+  server_msgr->start();
+  client_msgr->add_dispatcher_head(&cli_dispatcher);
+  client_msgr->start();
+
+  // a compressible "data"; the crcs cover the uncompressed bytes, so a
+  // reply means the server inflated it correctly
+  ConnectionRef conn = client_msgr->get_connection(server_msgr->get_myinst());
+  for (int n = 0; n < 3; n++) {
+    bufferlist bl;
+    string s("abcdefghijklmnopqrstuvwxyz");
+    for (int i = 0; i < 1024*30; i++)
+      bl.append(s);
+    MPing *m = new MPing();
+    m->set_data(bl);
+    conn->send_message(m);
+    utime_t t;
+    t += 1000*1000*500;
+    Mutex::Locker l(cli_dispatcher.lock);
+    while (!cli_dispatcher.got_new)
+      cli_dispatcher.cond.WaitInterval(g_ceph_context, cli_dispatcher.lock, t);
+    ASSERT_TRUE(cli_dispatcher.got_new);
+    cli_dispatcher.got_new = false;
+  }
+  ASSERT_TRUE(conn->has_feature(CEPH_FEATURE_MSG_COMPRESS));
+  server_msgr->shutdown();
+  client_msgr->shutdown();
+  server_msgr->wait();
+  client_msgr->wait();
+}
+
+class LocalSocketMessengerTest : public ::testing::Test {
+ public:
+  char dir[32];
+  Messenger *server_msgr;
+  Messenger *client_msgr;
+
+  LocalSocketMessengerTest(): server_msgr(NULL), client_msgr(NULL) {
+    strcpy(dir, "/tmp/test_msgr_local.XXXXXX");
+  }
+  virtual void SetUp() {
+    ASSERT_TRUE(mkdtemp(dir) != NULL);
+    // host addresses and the socket dir are read at construction
+    g_ceph_context->_conf->set_val("ms_async_local_socket_dir", dir);
+    g_ceph_context->_conf->apply_changes(NULL);
+    server_msgr = Messenger::create(g_ceph_context, "async", entity_name_t::OSD(0), "server", getpid());
+    client_msgr = Messenger::create(g_ceph_context, "async", entity_name_t::CLIENT(-1), "client", getpid());
+    server_msgr->set_default_policy(Messenger::Policy::stateless_server(0, 0));
+    client_msgr->set_default_policy(Messenger::Policy::lossy_client(0, 0));
+  }
+  virtual void TearDown() {
+    delete server_msgr;
+    delete client_msgr;
+    g_ceph_context->_conf->set_val("ms_async_local_socket_dir", "");
+    g_ceph_context->_conf->apply_changes(NULL);
+    ::rmdir(dir);
+  }
+};
+
+TEST_F(LocalSocketMessengerTest, PingTest) {
+  FakeDispatcher cli_dispatcher(false), srv_dispatcher(true);
+  entity_addr_t bind_addr;
+  bind_addr.parse("127.0.0.1");
+  server_msgr->bind(bind_addr);
+  server_msgr->add_dispatcher_head(&srv_dispatcher);
+  server_msgr->start();
+  client_msgr->add_dispatcher_head(&cli_dispatcher);
+  client_msgr->start();
+
+  ostringstream path;
+  path << dir << "/ms." << server_msgr->get_myaddr().get_port() << "."
+       << server_msgr->get_myaddr().get_nonce();
+  struct stat st;
+  ASSERT_EQ(0, ::stat(path.str().c_str(), &st));
+  ASSERT_TRUE(S_ISSOCK(st.st_mode));
+
+  ConnectionRef conn = client_msgr->get_connection(server_msgr->get_myinst());
+  {
+    MPing *m = new MPing();
+    ASSERT_EQ(conn->send_message(m), 0);
+    Mutex::Locker l(cli_dispatcher.lock);
+    while (!cli_dispatcher.got_new)
+      cli_dispatcher.cond.Wait(cli_dispatcher.lock);
+    cli_dispatcher.got_new = false;
+  }
+  ASSERT_TRUE(conn->is_connected());
+
+  // the server knows the client by the address from its banner
+  ASSERT_FALSE(client_msgr->get_myaddr().is_blank_ip());
+  ConnectionRef sconn = server_msgr->get_connection(client_msgr->get_myinst());
+  ASSERT_TRUE(sconn->is_connected());
+  ASSERT_EQ(client_msgr->get_myaddr(), sconn->get_peer_addr());
+
+  server_msgr->shutdown();
+  client_msgr->shutdown();
+  server_msgr->wait();
+  client_msgr->wait();
+  ASSERT_NE(0, ::stat(path.str().c_str(), &st));
+}
+
 
 class SyntheticWorkload;
 
@@ -1129,6 +1245,42 @@ TEST_P(MessengerTest, SyntheticInjectTest) {
   g_ceph_context->_conf->set_val("ms_inject_internal_delays", "0");
 }
 
+TEST_P(MessengerTest, SyntheticZeroCopyTest) {
+  // small batches and a low zerocopy threshold exercise both send paths
+  g_ceph_context->_conf->set_val("ms_async_send_batch_bytes", "4096");
+  g_ceph_context->_conf->set_val("ms_async_zerocopy_min_size", "4096");
+  g_ceph_context->_conf->set_val("ms_inject_socket_failures", "30");
+  SyntheticWorkload test_msg(8, 32, GetParam(), 100,
+                             Messenger::Policy::stateful_server(0, 0),
+                             Messenger::Policy::lossless_client(0, 0));
+  for (int i = 0; i < 100; ++i) {
+    if (!(i % 10)) cerr << "seeding connection " << i << std::endl;
+    test_msg.generate_connection();
+  }
+  gen_type rng(time(NULL));
+  for (int i = 0; i < 1000; ++i) {
+    if (!(i % 10)) {
+      cerr << "Op " << i << ": ";
+      test_msg.print_internal_state();
+    }
+    boost::uniform_int<> true_false(0, 99);
+    int val = true_false(rng);
+    if (val > 90) {
+      test_msg.generate_connection();
+    } else if (val > 80) {
+      test_msg.drop_connection();
+    } else if (val > 10) {
+      test_msg.send_message();
+    } else {
+      usleep(rand() % 500 + 100);
+    }
+  }
+  test_msg.wait_for_done();
+  g_ceph_context->_conf->set_val("ms_async_send_batch_bytes", "65536");
+  g_ceph_context->_conf->set_val("ms_async_zerocopy_min_size", "0");
+  g_ceph_context->_conf->set_val("ms_inject_socket_failures", "0");
+}
+
 TEST_P(MessengerTest, SyntheticInjectTest2) {
   g_ceph_context->_conf->set_val("ms_inject_socket_failures", "30");
   g_ceph_context->_conf->set_val("ms_inject_internal_delays", "0.1");
@@ -68,6 +68,37 @@ public:
     if (store)
       store->umount();
   }
+
+  /// remake the store as a newstore keeping object data on a block file
+  int mkfs_newstore_block(string *block) {
+    store->umount();
+    char cwd[PATH_MAX];
+    if (!::getcwd(cwd, sizeof(cwd)))
+      return -errno;
+    *block = string(cwd) + "/store_test_temp_block";
+    ::unlink(block->c_str());
+    g_ceph_context->_conf->set_val("newstore_block_path", *block);
+    g_ceph_context->_conf->set_val("newstore_block_size", "67108864");
+    // every write goes to the block device
+    g_ceph_context->_conf->set_val("newstore_overlay_max", "0");
+    g_ceph_context->_conf->apply_changes(NULL);
+    if (::system("rm -rf store_test_temp_dir_block") != 0 ||
+	::mkdir("store_test_temp_dir_block", 0777) < 0)
+      return -EIO;
+    store.reset(ObjectStore::create(g_ceph_context, "newstore",
+				    "store_test_temp_dir_block",
+				    "store_test_temp_journal"));
+    int r = store->mkfs();
+    if (r < 0)
+      return r;
+    return store->mount();
+  }
+  void unset_newstore_block() {
+    g_ceph_context->_conf->set_val("newstore_block_path", "");
+    g_ceph_context->_conf->set_val("newstore_block_size", "10737418240");
+    g_ceph_context->_conf->set_val("newstore_overlay_max", "32");
+    g_ceph_context->_conf->apply_changes(NULL);
+  }
 };
 
 bool sorted(const vector<ghobject_t> &in, bool bitwise) {
@@ -139,6 +170,80 @@ TEST_P(StoreTest, SimpleRemount) {
   }
 }
 
+TEST_P(StoreTest, MultiCollectionRemount) {
+  // remount repeatedly, touching a different subset of collections each
+  // time, so that incremental checkpoints (memstore) are exercised
+  ObjectStore::Sequencer osr("test");
+  coll_t a(spg_t(pg_t(1, 1), shard_id_t::NO_SHARD));
+  coll_t b(spg_t(pg_t(2, 1), shard_id_t::NO_SHARD));
+  coll_t c(spg_t(pg_t(3, 1), shard_id_t::NO_SHARD));
+  ghobject_t hoid(hobject_t(sobject_t("Object 1", CEPH_NOSNAP)));
+  bufferlist one, two;
+  one.append("1111111111");
+  two.append("2222222222");
+  int r;
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(a, 0);
+    t.create_collection(b, 0);
+    t.write(a, hoid, 0, one.length(), one);
+    t.write(b, hoid, 0, one.length(), one);
+    r = store->apply_transaction(&osr, t);
+    ASSERT_EQ(r, 0);
+  }
+  store->umount();
+  r = store->mount();
+  ASSERT_EQ(0, r);
+  {
+    ObjectStore::Transaction t;
+    t.write(b, hoid, 0, two.length(), two);
+    t.create_collection(c, 0);
+    t.write(c, hoid, 0, two.length(), two);
+    r = store->apply_transaction(&osr, t);
+    ASSERT_EQ(r, 0);
+  }
+  store->umount();
+  r = store->mount();
+  ASSERT_EQ(0, r);
+  {
+    bufferlist in;
+    ASSERT_EQ((int)one.length(), store->read(a, hoid, 0, one.length(), in));
+    ASSERT_TRUE(in.contents_equal(one));
+    in.clear();
+    ASSERT_EQ((int)two.length(), store->read(b, hoid, 0, two.length(), in));
+    ASSERT_TRUE(in.contents_equal(two));
+    in.clear();
+    ASSERT_EQ((int)two.length(), store->read(c, hoid, 0, two.length(), in));
+    ASSERT_TRUE(in.contents_equal(two));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(b, hoid);
+    t.remove_collection(b);
+    r = store->apply_transaction(&osr, t);
+    ASSERT_EQ(r, 0);
+  }
+  store->umount();
+  r = store->mount();
+  ASSERT_EQ(0, r);
+  {
+    vector<coll_t> ls;
+    store->list_collections(ls);
+    ASSERT_EQ(0, count(ls.begin(), ls.end(), b));
+    ASSERT_EQ(1, count(ls.begin(), ls.end(), a));
+    ASSERT_EQ(1, count(ls.begin(), ls.end(), c));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(a, hoid);
+    t.remove(c, hoid);
+    t.remove_collection(a);
+    t.remove_collection(c);
+    r = store->apply_transaction(&osr, t);
+    ASSERT_EQ(r, 0);
+  }
+}
+
 TEST_P(StoreTest, IORemount) {
   ObjectStore::Sequencer osr("test");
   coll_t cid;
@@ -182,6 +287,471 @@ TEST_P(StoreTest, IORemount) {
   }
 }
 
+TEST_P(StoreTest, CompressionTest) {
+  if (string(GetParam()) != "newstore")
+    return;
+  g_ceph_context->_conf->set_val("newstore_compression", "snappy");
+  g_ceph_context->_conf->apply_changes(NULL);
+  store->umount();
+  int r = store->mount();
+  ASSERT_EQ(0, r);
+
+  ObjectStore::Sequencer osr("test");
+  coll_t cid;
+  ghobject_t hoid(hobject_t(sobject_t("Object 1", CEPH_NOSNAP)));
+  bufferlist bl, expected;
+  for (unsigned i = 0; i < 128*1024 / 16; ++i)
+    bl.append("abcdefghabcdefgh");
+  expected = bl;
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    t.write(cid, hoid, 0, bl.length(), bl);
+    r = store->apply_transaction(&osr, t);
+    ASSERT_EQ(r, 0);
+  }
+  {
+    bufferlist in;
+    r = store->read(cid, hoid, 0, expected.length(), in);
+    ASSERT_EQ((int)expected.length(), r);
+    ASSERT_TRUE(in.contents_equal(expected));
+  }
+  {
+    // partial overwrite too big for an overlay
+    bufferlist bl2;
+    for (unsigned i = 0; i < 80*1024 / 16; ++i)
+      bl2.append("0123456701234567");
+    ObjectStore::Transaction t;
+    t.write(cid, hoid, 4096, bl2.length(), bl2);
+    r = store->apply_transaction(&osr, t);
+    ASSERT_EQ(r, 0);
+    bufferlist e;
+    e.substr_of(expected, 0, 4096);
+    e.append(bl2);
+    bufferlist tail;
+    tail.substr_of(expected, 4096 + bl2.length(),
+		   expected.length() - 4096 - bl2.length());
+    e.append(tail);
+    expected.swap(e);
+  }
+  {
+    ObjectStore::Transaction t;
+    t.truncate(cid, hoid, 100000);
+    r = store->apply_transaction(&osr, t);
+    ASSERT_EQ(r, 0);
+    bufferlist e;
+    e.substr_of(expected, 0, 100000);
+    expected.swap(e);
+  }
+  store->umount();
+  r = store->mount();
+  ASSERT_EQ(0, r);
+  {
+    bufferlist in;
+    r = store->read(cid, hoid, 0, 200000, in);
+    ASSERT_EQ((int)expected.length(), r);
+    ASSERT_TRUE(in.contents_equal(expected));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove_collection(cid);
+    r = store->apply_transaction(&osr, t);
+    ASSERT_EQ(r, 0);
+  }
+  g_ceph_context->_conf->set_val("newstore_compression", "");
+  g_ceph_context->_conf->apply_changes(NULL);
+}
+
+TEST_P(StoreTest, BlockChecksumCorruptTest) {
+  if (string(GetParam()) != "newstore")
+    return;
+  string block;
+  int r = mkfs_newstore_block(&block);
+  ASSERT_EQ(0, r);
+
+  ObjectStore::Sequencer osr("test");
+  coll_t cid;
+  ghobject_t hoid(hobject_t(sobject_t("Object 1", CEPH_NOSNAP)));
+  {
+    bufferlist bl;
+    bl.append(string(65536, 'Q'));
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    t.write(cid, hoid, 0, bl.length(), bl);
+    r = store->apply_transaction(&osr, t);
+    ASSERT_EQ(r, 0);
+  }
+  store->umount();
+
+  // flip a byte of the object's first block underneath the store
+  {
+    int fd = ::open(block.c_str(), O_RDWR);
+    ASSERT_LE(0, fd);
+    string all(4096, 'Q');
+    char buf[4096];
+    off_t pos = 0;
+    bool found = false;
+    while (::pread(fd, buf, sizeof(buf), pos) == (ssize_t)sizeof(buf)) {
+      if (memcmp(buf, all.c_str(), sizeof(buf)) == 0) {
+	found = true;
+	break;
+      }
+      pos += sizeof(buf);
+    }
+    ASSERT_TRUE(found);
+    ASSERT_EQ(1, ::pwrite(fd, "R", 1, pos + 100));
+    ASSERT_EQ(0, ::fsync(fd));
+    ::close(fd);
+  }
+
+  r = store->mount();
+  ASSERT_EQ(0, r);
+  {
+    bufferlist in;
+    r = store->read(cid, hoid, 0, 65536, in);
+    ASSERT_EQ(-EIO, r);
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove_collection(cid);
+    r = store->apply_transaction(&osr, t);
+    ASSERT_EQ(r, 0);
+  }
+  unset_newstore_block();
+}
+
+TEST_P(StoreTest, BlockChecksumPartialTest) {
+  if (string(GetParam()) != "newstore")
+    return;
+  string block;
+  int r = mkfs_newstore_block(&block);
+  ASSERT_EQ(0, r);
+
+  ObjectStore::Sequencer osr("test");
+  coll_t cid;
+  ghobject_t hoid(hobject_t(sobject_t("Object 1", CEPH_NOSNAP)));
+  string expected;
+  for (unsigned i = 0; i < 65536; ++i)
+    expected.push_back('a' + i % 26);
+  {
+    bufferlist bl;
+    bl.append(expected);
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    t.write(cid, hoid, 0, bl.length(), bl);
+    r = store->apply_transaction(&osr, t);
+    ASSERT_EQ(r, 0);
+  }
+  {
+    // neither end of any of these is block aligned
+    bufferlist bl;
+    bl.append(string(3000, 'X'));
+    ObjectStore::Transaction t;
+    t.write(cid, hoid, 5000, bl.length(), bl);
+    r = store->apply_transaction(&osr, t);
+    ASSERT_EQ(r, 0);
+    expected.replace(5000, 3000, string(3000, 'X'));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.zero(cid, hoid, 10000, 7000);
+    r = store->apply_transaction(&osr, t);
+    ASSERT_EQ(r, 0);
+    expected.replace(10000, 7000, string(7000, '\0'));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.truncate(cid, hoid, 30001);
+    r = store->apply_transaction(&osr, t);
+    ASSERT_EQ(r, 0);
+    expected.resize(30001);
+  }
+  for (int pass = 0; pass < 2; ++pass) {
+    // a checksum mismatch would fail the read with -EIO
+    bufferlist in;
+    r = store->read(cid, hoid, 0, 65536, in);
+    ASSERT_EQ((int)expected.length(), r);
+    ASSERT_EQ(expected, string(in.c_str(), in.length()));
+    in.clear();
+    r = store->read(cid, hoid, 4999, 3002, in);
+    ASSERT_EQ(3002, r);
+    ASSERT_EQ(expected.substr(4999, 3002), string(in.c_str(), in.length()));
+    store->umount();
+    r = store->mount();
+    ASSERT_EQ(0, r);
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove_collection(cid);
+    r = store->apply_transaction(&osr, t);
+    ASSERT_EQ(r, 0);
+  }
+  unset_newstore_block();
+}
+
+TEST_P(StoreTest, AioApplyTest) {
+  if (string(GetParam()) != "filestore")
+    return;
+  g_ceph_context->_conf->set_val("filestore_aio_apply", "true");
+  g_ceph_context->_conf->set_val("filestore_aio_apply_min_size", "4096");
+  g_ceph_context->_conf->apply_changes(NULL);
+  store->umount();
+  int r = store->mount();
+  ASSERT_EQ(0, r);
+
+  ObjectStore::Sequencer osr("test");
+  coll_t cid;
+  ghobject_t hoid(hobject_t(sobject_t("Object 1", CEPH_NOSNAP)));
+  ghobject_t hoid2(hobject_t(sobject_t("Object 2", CEPH_NOSNAP)));
+  bufferlist expected;
+  {
+    // aligned writes go via aio; the unaligned one overlaps them and
+    // must see them on disk first.
+    bufferlist a, b, c;
+    a.append(string(65536, 'a'));
+    b.append(string(8192, 'b'));
+    c.append(string(100, 'c'));
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    t.write(cid, hoid, 0, a.length(), a);
+    t.write(cid, hoid, 8192, b.length(), b);
+    t.write(cid, hoid, 10000, c.length(), c);
+    t.setattr(cid, hoid, "attr", c);
+    r = store->apply_transaction(&osr, t);
+    ASSERT_EQ(r, 0);
+    expected.append(string(8192, 'a'));
+    expected.append(string(10000 - 8192, 'b'));
+    expected.append(c);
+    expected.append(string(16384 - 10100, 'b'));
+    expected.append(string(65536 - 16384, 'a'));
+  }
+  {
+    // clone must see the writes queued ahead of it
+    bufferlist d;
+    d.append(string(4096, 'd'));
+    ObjectStore::Transaction t;
+    t.write(cid, hoid, 65536, d.length(), d);
+    t.clone(cid, hoid, hoid2);
+    r = store->apply_transaction(&osr, t);
+    ASSERT_EQ(r, 0);
+    expected.append(d);
+  }
+  for (unsigned i = 0; i < 16; ++i) {
+    // queue several ops on one sequencer without waiting in between
+    bufferlist e;
+    e.append(string(4096, 'e' + i));
+    ObjectStore::Transaction *t = new ObjectStore::Transaction;
+    t->write(cid, hoid, i * 4096, e.length(), e);
+    store->queue_transaction(&osr, t, new ObjectStore::C_DeleteTransaction(t));
+    bufferlist n;
+    n.substr_of(expected, 0, i * 4096);
+    n.append(e);
+    bufferlist rest;
+    rest.substr_of(expected, (i + 1) * 4096, expected.length() - (i + 1) * 4096);
+    n.append(rest);
+    expected.swap(n);
+  }
+  osr.flush();
+  {
+    bufferlist in;
+    r = store->read(cid, hoid, 0, expected.length(), in);
+    ASSERT_EQ((int)expected.length(), r);
+    ASSERT_TRUE(in.contents_equal(expected));
+  }
+  {
+    bufferlist in;
+    r = store->read(cid, hoid2, 65536, 4096, in);
+    ASSERT_EQ(4096, r);
+    ASSERT_EQ(string(4096, 'd'), string(in.c_str(), in.length()));
+  }
+  ghobject_t hoid3(hobject_t(sobject_t("Object 3", CEPH_NOSNAP)));
+  for (unsigned i = 0; i < 16; ++i) {
+    // overlapping aligned writes in one transaction must land in order
+    bufferlist x, y;
+    x.append(string(16384, 'x'));
+    y.append(string(8192, 'y'));
+    ObjectStore::Transaction t;
+    t.write(cid, hoid3, 0, x.length(), x);
+    t.write(cid, hoid3, 4096, y.length(), y);
+    r = store->apply_transaction(&osr, t);
+    ASSERT_EQ(r, 0);
+    bufferlist in;
+    r = store->read(cid, hoid3, 0, 16384, in);
+    ASSERT_EQ(16384, r);
+    ASSERT_EQ(string(4096, 'x') + string(8192, 'y') + string(4096, 'x'),
+	      string(in.c_str(), in.length()));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove(cid, hoid2);
+    t.remove(cid, hoid3);
+    t.remove_collection(cid);
+    r = store->apply_transaction(&osr, t);
+    ASSERT_EQ(r, 0);
+  }
+  g_ceph_context->_conf->set_val("filestore_aio_apply", "false");
+  g_ceph_context->_conf->set_val("filestore_aio_apply_min_size", "65536");
+  g_ceph_context->_conf->apply_changes(NULL);
+}
+
+TEST_P(StoreTest, AioApplyQueueDepthTest) {
+  if (string(GetParam()) != "filestore")
+    return;
+  // transactions with more writes than the aio context has slots, from
+  // several sequencers at once
+  g_ceph_context->_conf->set_val("filestore_aio_apply", "true");
+  g_ceph_context->_conf->set_val("filestore_aio_apply_min_size", "4096");
+  g_ceph_context->_conf->set_val("filestore_aio_apply_queue_depth", "2");
+  g_ceph_context->_conf->apply_changes(NULL);
+  store->umount();
+  int r = store->mount();
+  ASSERT_EQ(0, r);
+
+  const unsigned num_osr = 4, num_txn = 8, num_writes = 7;
+  coll_t cid;
+  {
+    ObjectStore::Sequencer osr("test");
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = store->apply_transaction(&osr, t);
+    ASSERT_EQ(r, 0);
+  }
+  vector<ObjectStore::Sequencer*> osrs;
+  for (unsigned s = 0; s < num_osr; ++s) {
+    osrs.push_back(new ObjectStore::Sequencer("test"));
+    ghobject_t hoid(hobject_t(sobject_t("Object " + stringify(s),
+					CEPH_NOSNAP)));
+    for (unsigned i = 0; i < num_txn; ++i) {
+      ObjectStore::Transaction *t = new ObjectStore::Transaction;
+      for (unsigned w = 0; w < num_writes; ++w) {
+	bufferlist bl;
+	bl.append(string(4096, 'a' + i));
+	t->write(cid, hoid, w * 4096, bl.length(), bl);
+      }
+      store->queue_transaction(osrs[s], t,
+			       new ObjectStore::C_DeleteTransaction(t));
+    }
+  }
+  for (unsigned s = 0; s < num_osr; ++s) {
+    osrs[s]->flush();
+    delete osrs[s];
+    ghobject_t hoid(hobject_t(sobject_t("Object " + stringify(s),
+					CEPH_NOSNAP)));
+    bufferlist in;
+    r = store->read(cid, hoid, 0, num_writes * 4096, in);
+    ASSERT_EQ((int)(num_writes * 4096), r);
+    ASSERT_EQ(string(num_writes * 4096, 'a' + num_txn - 1),
+	      string(in.c_str(), in.length()));
+  }
+  {
+    ObjectStore::Sequencer osr("test");
+    ObjectStore::Transaction t;
+    for (unsigned s = 0; s < num_osr; ++s)
+      t.remove(cid, ghobject_t(hobject_t(sobject_t("Object " + stringify(s),
+						   CEPH_NOSNAP))));
+    t.remove_collection(cid);
+    r = store->apply_transaction(&osr, t);
+    ASSERT_EQ(r, 0);
+  }
+  g_ceph_context->_conf->set_val("filestore_aio_apply", "false");
+  g_ceph_context->_conf->set_val("filestore_aio_apply_min_size", "65536");
+  g_ceph_context->_conf->set_val("filestore_aio_apply_queue_depth", "128");
+  g_ceph_context->_conf->apply_changes(NULL);
+}
+
+TEST_P(StoreTest, KVGroupCommitTest) {
+  if (string(GetParam()) != "newstore")
+    return;
+  // wait long enough for batches to fill, and cap them by count and by
+  // bytes well below the number of transactions in flight
+  g_ceph_context->_conf->set_val("newstore_kv_batch_max_us", "10000");
+  g_ceph_context->_conf->set_val("newstore_kv_batch_max_txcs", "8");
+  g_ceph_context->_conf->set_val("newstore_kv_batch_max_bytes", "65536");
+  g_ceph_context->_conf->apply_changes(NULL);
+  int r;
+
+  const unsigned num_osr = 8, num_txn = 16;
+  coll_t cid;
+  {
+    ObjectStore::Sequencer osr("test");
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = store->apply_transaction(&osr, t);
+    ASSERT_EQ(r, 0);
+  }
+  vector<ObjectStore::Sequencer*> osrs;
+  vector<C_SaferCond*> commits;
+  for (unsigned s = 0; s < num_osr; ++s)
+    osrs.push_back(new ObjectStore::Sequencer("test"));
+  for (unsigned i = 0; i < num_txn; ++i) {
+    for (unsigned s = 0; s < num_osr; ++s) {
+      ghobject_t hoid(hobject_t(sobject_t(
+        "Object " + stringify(s) + "." + stringify(i), CEPH_NOSNAP)));
+      ObjectStore::Transaction *t = new ObjectStore::Transaction;
+      bufferlist bl;
+      bl.append(string(4096 * (1 + i % 4), 'a' + s));
+      t->write(cid, hoid, 0, bl.length(), bl);
+      map<string, bufferlist> km;
+      km["key"].append(stringify(i));
+      t->omap_setkeys(cid, hoid, km);
+      C_SaferCond *c = new C_SaferCond;
+      commits.push_back(c);
+      store->queue_transaction(osrs[s], t,
+			       new ObjectStore::C_DeleteTransaction(t), c);
+    }
+  }
+  for (unsigned j = 0; j < commits.size(); ++j) {
+    ASSERT_EQ(0, commits[j]->wait());
+    delete commits[j];
+  }
+  for (unsigned s = 0; s < num_osr; ++s) {
+    osrs[s]->flush();
+    delete osrs[s];
+  }
+
+  // everything that was acked as committed survives a remount
+  store->umount();
+  r = store->mount();
+  ASSERT_EQ(0, r);
+  for (unsigned s = 0; s < num_osr; ++s) {
+    for (unsigned i = 0; i < num_txn; ++i) {
+      ghobject_t hoid(hobject_t(sobject_t(
+        "Object " + stringify(s) + "." + stringify(i), CEPH_NOSNAP)));
+      unsigned len = 4096 * (1 + i % 4);
+      bufferlist in;
+      r = store->read(cid, hoid, 0, len, in);
+      ASSERT_EQ((int)len, r);
+      ASSERT_EQ(string(len, 'a' + s), string(in.c_str(), in.length()));
+      set<string> keys;
+      keys.insert("key");
+      map<string, bufferlist> got;
+      r = store->omap_get_values(cid, hoid, keys, &got);
+      ASSERT_EQ(0, r);
+      ASSERT_EQ(1u, got.size());
+      ASSERT_EQ(stringify(i), string(got["key"].c_str(), got["key"].length()));
+    }
+  }
+  {
+    ObjectStore::Sequencer osr("test");
+    ObjectStore::Transaction t;
+    for (unsigned s = 0; s < num_osr; ++s)
+      for (unsigned i = 0; i < num_txn; ++i)
+	t.remove(cid, ghobject_t(hobject_t(sobject_t(
+	  "Object " + stringify(s) + "." + stringify(i), CEPH_NOSNAP))));
+    t.remove_collection(cid);
+    r = store->apply_transaction(&osr, t);
+    ASSERT_EQ(r, 0);
+  }
+  g_ceph_context->_conf->set_val("newstore_kv_batch_max_us", "250");
+  g_ceph_context->_conf->set_val("newstore_kv_batch_max_txcs", "64");
+  g_ceph_context->_conf->set_val("newstore_kv_batch_max_bytes", "4194304");
+  g_ceph_context->_conf->apply_changes(NULL);
+}
+
 TEST_P(StoreTest, SimpleMetaColTest) {
   ObjectStore::Sequencer osr("test");
   coll_t cid;
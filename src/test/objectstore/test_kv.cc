@@ -113,6 +113,172 @@ TEST_P(KVTest, PutReopen) {
   fini();
 }
 
+TEST_P(KVTest, GetBatch) {
+  ASSERT_EQ(0, db->create_and_open(cout));
+  {
+    KeyValueDB::Transaction t = db->get_transaction();
+    bufferlist value;
+    value.append("value");
+    t->set("a", "key1", value);
+    t->set("a", "key3", value);
+    t->set("b", "key1", value);
+    t->set("b", "key2", value);
+    db->submit_transaction_sync(t);
+  }
+  {
+    set<string> keys;
+    keys.insert("key1");
+    keys.insert("key2");
+    keys.insert("key3");
+    keys.insert("key4");
+    map<string, bufferlist> out;
+    ASSERT_EQ(0, db->get("a", keys, &out));
+    ASSERT_EQ(2u, out.size());
+    ASSERT_TRUE(out.count("key1"));
+    ASSERT_TRUE(out.count("key3"));
+    ASSERT_EQ(5u, out["key3"].length());
+  }
+  {
+    map<string, set<string> > keys;
+    keys["a"].insert("key2");
+    keys["a"].insert("key3");
+    keys["b"].insert("key1");
+    keys["b"].insert("key2");
+    keys["c"].insert("key1");
+    map<string, map<string, bufferlist> > out;
+    ASSERT_EQ(0, db->get_batch(keys, &out));
+    ASSERT_EQ(1u, out["a"].size());
+    ASSERT_TRUE(out["a"].count("key3"));
+    ASSERT_EQ(2u, out["b"].size());
+    ASSERT_EQ(5u, out["b"]["key2"].length());
+    ASSERT_TRUE(out["c"].empty());
+  }
+  fini();
+}
+
+TEST_P(KVTest, RmRangeKeys) {
+  ASSERT_EQ(0, db->create_and_open(cout));
+  {
+    KeyValueDB::Transaction t = db->get_transaction();
+    bufferlist value;
+    value.append("value");
+    for (int i = 0; i < 10; ++i) {
+      t->set("range", stringify(i), value);
+      t->set("rangf", stringify(i), value);
+    }
+    db->submit_transaction_sync(t);
+  }
+  {
+    KeyValueDB::Transaction t = db->get_transaction();
+    t->rm_range_keys("range", "3", "7");
+    db->submit_transaction_sync(t);
+  }
+  {
+    KeyValueDB::Iterator it = db->get_iterator("range");
+    const char *left[] = { "0", "1", "2", "7", "8", "9" };
+    it->seek_to_first();
+    for (unsigned i = 0; i < 6; ++i) {
+      ASSERT_TRUE(it->valid());
+      ASSERT_EQ(string(left[i]), it->key());
+      it->next();
+    }
+    ASSERT_FALSE(it->valid());
+    // neighbouring prefix untouched
+    bufferlist v;
+    ASSERT_EQ(0, db->get("rangf", "5", &v));
+  }
+  {
+    // keys set earlier in the same transaction are not removed
+    KeyValueDB::Transaction t = db->get_transaction();
+    bufferlist value;
+    value.append("value");
+    t->set("range", "4", value);
+    t->rm_range_keys("range", "0", "9");
+    db->submit_transaction_sync(t);
+    bufferlist v;
+    ASSERT_EQ(0, db->get("range", "4", &v));
+    ASSERT_EQ(-ENOENT, db->get("range", "8", &v));
+    ASSERT_EQ(0, db->get("range", "9", &v));
+  }
+  {
+    KeyValueDB::Transaction t = db->get_transaction();
+    t->rmkeys_by_prefix("range");
+    db->submit_transaction_sync(t);
+    KeyValueDB::Iterator it = db->get_iterator("range");
+    it->seek_to_first();
+    ASSERT_FALSE(it->valid());
+    bufferlist v;
+    ASSERT_EQ(0, db->get("rangf", "0", &v));
+  }
+  fini();
+}
+
+TEST_P(KVTest, ColumnFamilies) {
+  // families are only created with a new store
+  fini();
+  ASSERT_EQ(0, ::system("rm -rf kv_test_temp_dir && mkdir kv_test_temp_dir"));
+  init();
+  ASSERT_EQ(0, db->set_column_families("b c:write_buffer_size=1048576;bloom_bits=10"));
+  ASSERT_EQ(0, db->create_and_open(cout));
+  {
+    KeyValueDB::Transaction t = db->get_transaction();
+    bufferlist value;
+    value.append("value");
+    t->set("a", "1", value);
+    t->set("b", "1", value);
+    t->set("b", "2", value);
+    t->set("c", "1", value);
+    t->set("d", "1", value);
+    db->submit_transaction_sync(t);
+  }
+  fini();
+
+  // existing families are found again without being configured
+  init();
+  ASSERT_EQ(0, db->open(cout));
+  {
+    const char *expect[][2] = {
+      {"a", "1"}, {"b", "1"}, {"b", "2"}, {"c", "1"}, {"d", "1"}
+    };
+    KeyValueDB::WholeSpaceIterator it = db->get_iterator();
+    it->seek_to_first();
+    for (unsigned i = 0; i < 5; ++i) {
+      ASSERT_TRUE(it->valid());
+      ASSERT_EQ(make_pair(string(expect[i][0]), string(expect[i][1])),
+		it->raw_key());
+      it->next();
+    }
+    ASSERT_FALSE(it->valid());
+    // and backwards, turning around in the middle
+    it->seek_to_last();
+    ASSERT_EQ(make_pair(string("d"), string("1")), it->raw_key());
+    it->prev();
+    it->prev();
+    ASSERT_EQ(make_pair(string("b"), string("2")), it->raw_key());
+    it->next();
+    ASSERT_EQ(make_pair(string("c"), string("1")), it->raw_key());
+  }
+  {
+    KeyValueDB::Transaction t = db->get_transaction();
+    t->rmkeys_by_prefix("b");
+    db->submit_transaction_sync(t);
+    bufferlist v;
+    ASSERT_EQ(-ENOENT, db->get("b", "1", &v));
+    ASSERT_EQ(0, db->get("c", "1", &v));
+    ASSERT_EQ(0, db->get("a", "1", &v));
+  }
+  fini();
+
+  if (string(GetParam()) == "rocksdb") {
+    // a store whose families cannot be listed is an error, not a new store
+    ASSERT_EQ(0, ::system("echo MANIFEST-999999 > kv_test_temp_dir/CURRENT"));
+    init();
+    ASSERT_EQ(0, db->set_column_families("b c"));
+    ASSERT_EQ(-EIO, db->open(cout));
+    fini();
+  }
+}
+
 TEST_P(KVTest, BenchCommit) {
   int n = 1024;
   ASSERT_EQ(0, db->create_and_open(cout));
@@ -0,0 +1,73 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2015 Red Hat
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include <errno.h>
+#include "os/newstore/ExtentAllocator.h"
+#include "gtest/gtest.h"
+#include "test/unit.h"
+
+TEST(ExtentAllocator, RoundUp) {
+  ExtentAllocator a(4096);
+  a.init_add_free(0, 1048576);
+  uint64_t off, len;
+  ASSERT_EQ(0, a.allocate(1, 0, &off, &len));
+  ASSERT_EQ(0u, off);
+  ASSERT_EQ(4096u, len);
+  ASSERT_EQ(0, a.allocate(4097, 0, &off, &len));
+  ASSERT_EQ(4096u, off);
+  ASSERT_EQ(8192u, len);
+  ASSERT_EQ(1048576u - 12288u, a.get_free());
+}
+
+TEST(ExtentAllocator, Hint) {
+  ExtentAllocator a(4096);
+  a.init_add_free(0, 65536);
+  uint64_t off, len;
+  ASSERT_EQ(0, a.allocate(4096, 32768, &off, &len));
+  ASSERT_EQ(32768u, off);
+  // wraps around when nothing fits past the hint
+  ASSERT_EQ(0, a.allocate(32768, 40960, &off, &len));
+  ASSERT_EQ(0u, off);
+}
+
+TEST(ExtentAllocator, ENOSPC) {
+  ExtentAllocator a(4096);
+  a.init_add_free(0, 8192);
+  a.init_add_free(16384, 8192);
+  uint64_t off, len;
+  ASSERT_EQ(-ENOSPC, a.allocate(12288, 0, &off, &len));
+  ASSERT_EQ(16384u, a.get_free());
+}
+
+TEST(ExtentAllocator, ReleaseMerges) {
+  ExtentAllocator a(4096);
+  a.init_add_free(0, 16384);
+  uint64_t o1, o2, o3, len;
+  ASSERT_EQ(0, a.allocate(4096, 0, &o1, &len));
+  ASSERT_EQ(0, a.allocate(4096, 0, &o2, &len));
+  ASSERT_EQ(0, a.allocate(8192, 0, &o3, &len));
+  ASSERT_EQ(0u, a.get_free());
+  a.release(o1, 4096);
+  a.release(o3, 8192);
+  ASSERT_EQ(-ENOSPC, a.allocate(16384, 0, &o1, &len));
+  a.release(o2, 4096);
+  // neighbours coalesce back into a single extent
+  ASSERT_EQ(0, a.allocate(16384, 0, &o1, &len));
+  ASSERT_EQ(0u, o1);
+  ASSERT_EQ(16384u, len);
+}
+
+// Local Variables:
+// compile-command: "cd ../.. ; make unittest_newstore_alloc ; ./unittest_newstore_alloc"
+// End:
@@ -0,0 +1,167 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2015 Red Hat
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include <stdio.h>
+#include "os/newstore/NewStore.h"
+#include "common/perf_counters.h"
+#include "global/global_context.h"
+#include "gtest/gtest.h"
+#include "test/unit.h"
+
+class OnodeCacheTest : public ::testing::Test {
+protected:
+  typedef NewStore::Onode Onode;
+  typedef NewStore::OnodeRef OnodeRef;
+  typedef NewStore::Collection Collection;
+
+  // every onode is charged sizeof(Onode) plus its (empty) key and this
+  static const uint32_t ENCODED_LEN = 1000;
+
+  NewStore store;
+  PerfCounters *logger;
+  NewStore::OnodeCache cache;
+
+  OnodeCacheTest()
+    : store(g_ceph_context, "/nonexistent"),
+      logger(NULL),
+      cache(g_ceph_context) {}
+
+  virtual void SetUp() {
+    PerfCountersBuilder b(g_ceph_context, "onode_cache_test",
+			  l_newstore_first, l_newstore_last);
+    b.add_u64_counter(l_newstore_onode_hit, "onode_hit", "");
+    b.add_u64_counter(l_newstore_onode_miss, "onode_miss", "");
+    b.add_u64_counter(l_newstore_onode_evict, "onode_evict", "");
+    b.add_u64(l_newstore_onode_count, "onode_count", "");
+    logger = b.create_perf_counters();
+  }
+  virtual void TearDown() {
+    cache.shutdown();
+    delete logger;
+  }
+
+  /// room for n onodes in a single shard
+  void init(unsigned n) {
+    cache.init(1, n * (sizeof(Onode) + ENCODED_LEN), logger);
+  }
+  static ghobject_t make_oid(unsigned i, uint32_t hash) {
+    char name[16];
+    snprintf(name, sizeof(name), "obj%u", i);
+    return ghobject_t(hobject_t(sobject_t(name, CEPH_NOSNAP), "", hash, 0,
+				""));
+  }
+  OnodeRef add(Collection *c, const ghobject_t& oid) {
+    return cache.add(new Onode(c, oid, ""), ENCODED_LEN);
+  }
+  bool cached(Collection *c, const ghobject_t& oid) {
+    return cache.lookup(c, oid) != OnodeRef();
+  }
+};
+
+TEST_F(OnodeCacheTest, TrimToBudget) {
+  Collection c(&store, coll_t());
+  init(3);
+  for (unsigned i = 0; i < 5; ++i)
+    add(&c, make_oid(i, i));
+  ASSERT_EQ(3u, logger->get(l_newstore_onode_count));
+  ASSERT_EQ(2u, logger->get(l_newstore_onode_evict));
+  // least recently used go first
+  ASSERT_FALSE(cached(&c, make_oid(0, 0)));
+  ASSERT_FALSE(cached(&c, make_oid(1, 1)));
+  for (unsigned i = 2; i < 5; ++i)
+    ASSERT_TRUE(cached(&c, make_oid(i, i)));
+
+  // a hit moves the onode to the front of the lru
+  ASSERT_TRUE(cached(&c, make_oid(2, 2)));
+  add(&c, make_oid(5, 5));
+  ASSERT_TRUE(cached(&c, make_oid(2, 2)));
+  ASSERT_FALSE(cached(&c, make_oid(3, 3)));
+}
+
+TEST_F(OnodeCacheTest, SkipInUse) {
+  Collection c(&store, coll_t());
+  init(2);
+  OnodeRef held = add(&c, make_oid(0, 0));
+  for (unsigned i = 1; i < 4; ++i)
+    add(&c, make_oid(i, i));
+  // the oldest onode is referenced, so the ones after it are evicted
+  ASSERT_TRUE(cached(&c, make_oid(0, 0)));
+  ASSERT_FALSE(cached(&c, make_oid(1, 1)));
+  ASSERT_FALSE(cached(&c, make_oid(2, 2)));
+  ASSERT_TRUE(cached(&c, make_oid(3, 3)));
+
+  // once released it is trimmed like any other
+  held.reset();
+  add(&c, make_oid(4, 4));
+  add(&c, make_oid(5, 5));
+  ASSERT_FALSE(cached(&c, make_oid(0, 0)));
+  ASSERT_EQ(2u, logger->get(l_newstore_onode_count));
+}
+
+TEST_F(OnodeCacheTest, SplitByMatch) {
+  Collection c(&store, coll_t(spg_t(pg_t(0, 1), shard_id_t::NO_SHARD)));
+  Collection d(&store, coll_t(spg_t(pg_t(2, 1), shard_id_t::NO_SHARD)));
+  init(16);
+  for (unsigned i = 0; i < 8; ++i)
+    add(&c, make_oid(i, i));
+
+  // what _split_collection does with 2 bits, moving pg 2's objects to d
+  const unsigned bits = 2;
+  list<OnodeRef> ls;
+  cache.get_collection(&c, &ls);
+  ASSERT_EQ(8u, ls.size());
+  for (list<OnodeRef>::iterator p = ls.begin(); p != ls.end(); ++p) {
+    if ((*p)->oid.match(bits, 2))
+      cache.set_collection(*p, &d);
+  }
+
+  list<OnodeRef> in_c, in_d;
+  cache.get_collection(&c, &in_c);
+  cache.get_collection(&d, &in_d);
+  ASSERT_EQ(6u, in_c.size());
+  ASSERT_EQ(2u, in_d.size());
+  for (list<OnodeRef>::iterator p = in_d.begin(); p != in_d.end(); ++p)
+    ASSERT_EQ(2u, (*p)->oid.hobj.get_hash() & 3);
+  for (list<OnodeRef>::iterator p = in_c.begin(); p != in_c.end(); ++p)
+    ASSERT_NE(2u, (*p)->oid.hobj.get_hash() & 3);
+}
+
+TEST_F(OnodeCacheTest, ClearCollection) {
+  Collection c(&store, coll_t());
+  init(16);
+  OnodeRef held = add(&c, make_oid(0, 0));
+  add(&c, make_oid(1, 1));
+  cache.clear_collection(&c);
+  ASSERT_FALSE(cached(NULL, make_oid(1, 1)));
+  // the referenced onode stays, but no longer points at c
+  ASSERT_EQ(1u, logger->get(l_newstore_onode_count));
+  ASSERT_TRUE(held->coll == NULL);
+  list<OnodeRef> ls;
+  cache.get_collection(&c, &ls);
+  ASSERT_TRUE(ls.empty());
+}
+
+TEST_F(OnodeCacheTest, Contains) {
+  Collection c(&store, coll_t());
+  init(3);
+  for (unsigned i = 0; i < 3; ++i)
+    add(&c, make_oid(i, i));
+  ASSERT_TRUE(cache.contains(make_oid(0, 0)));
+  ASSERT_FALSE(cache.contains(make_oid(3, 3)));
+  ASSERT_EQ(0u, logger->get(l_newstore_onode_hit));
+  ASSERT_EQ(0u, logger->get(l_newstore_onode_miss));
+  // nor does it move the onode up the lru
+  add(&c, make_oid(3, 3));
+  ASSERT_FALSE(cache.contains(make_oid(0, 0)));
+}
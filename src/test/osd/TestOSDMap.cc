@@ -400,3 +400,145 @@ TEST_F(OSDMapTest, PrimaryAffinity) {
     osdmap.set_primary_affinity(1, 0x10000);
   }
 }
+
+TEST_F(OSDMapTest, SharedCopyOnWrite) {
+  set_up_map();
+
+  pg_t rawpg(0, 0, -1);
+  pg_t pgid = osdmap.raw_pg_to_pg(rawpg);
+  vector<int> up_osds, acting_osds;
+  int up_primary, acting_primary;
+  osdmap.pg_to_up_acting_osds(pgid, &up_osds, &up_primary,
+                              &acting_osds, &acting_primary);
+
+  OSDMap next;
+  next.shared_copy_from(osdmap);
+  uint64_t shared = next.get_footprint(&osdmap);
+  EXPECT_LT(shared, osdmap.get_footprint());
+
+  // changing the copy must leave the original alone
+  vector<int> new_acting_osds(acting_osds.rbegin(), acting_osds.rend());
+  OSDMap::Incremental inc(next.get_epoch() + 1);
+  inc.fsid = next.get_fsid();
+  inc.new_pg_temp[pgid] = new_acting_osds;
+  inc.new_state[0] = CEPH_OSD_UP;
+  ASSERT_EQ(0, next.apply_incremental(inc));
+  EXPECT_GT(next.get_footprint(&osdmap), shared);
+
+  next.pg_to_up_acting_osds(pgid, &up_osds, &up_primary,
+			    &acting_osds, &acting_primary);
+  EXPECT_EQ(new_acting_osds, acting_osds);
+  EXPECT_TRUE(next.is_down(0));
+  EXPECT_EQ(0u, osdmap.get_num_pg_temp());
+  EXPECT_TRUE(osdmap.is_up(0));
+
+  // ...and an identical map decodes and dedups back to sharing
+  bufferlist bl;
+  osdmap.encode(bl, CEPH_FEATURES_SUPPORTED_DEFAULT | CEPH_FEATURE_RESERVED);
+  OSDMap *copy = new OSDMap;
+  copy->decode(bl);
+  copy->inc_epoch();
+  OSDMap::dedup(&osdmap, copy);
+  EXPECT_LT(copy->get_footprint(&osdmap), copy->get_footprint());
+  delete copy;
+}
+
+TEST_F(OSDMapTest, MappingTable) {
+  set_up_map();
+
+  for (int round = 0; round < 3; ++round) {
+    osdmap.update_mapping(4);
+    ASSERT_TRUE(osdmap.have_mapping());
+
+    // a decoded copy has no table and runs crush for every lookup
+    bufferlist bl;
+    osdmap.encode(bl, CEPH_FEATURES_SUPPORTED_DEFAULT | CEPH_FEATURE_RESERVED);
+    OSDMap plain;
+    plain.decode(bl);
+    ASSERT_FALSE(plain.have_mapping());
+
+    const map<int64_t,pg_pool_t>& pools = osdmap.get_pools();
+    for (map<int64_t,pg_pool_t>::const_iterator p = pools.begin();
+	 p != pools.end();
+	 ++p) {
+      for (unsigned ps = 0; ps < p->second.get_pg_num() * 2; ++ps) {
+	pg_t pgid(ps, p->first);
+	vector<int> up, acting, plain_up, plain_acting;
+	int up_primary, acting_primary, plain_up_primary, plain_acting_primary;
+	osdmap.pg_to_up_acting_osds(pgid, &up, &up_primary,
+				    &acting, &acting_primary);
+	plain.pg_to_up_acting_osds(pgid, &plain_up, &plain_up_primary,
+				   &plain_acting, &plain_acting_primary);
+	ASSERT_EQ(plain_up, up);
+	ASSERT_EQ(plain_up_primary, up_primary);
+	ASSERT_EQ(plain_acting, acting);
+	ASSERT_EQ(plain_acting_primary, acting_primary);
+      }
+    }
+
+    // reweight an osd, then mark one down: the next table is built from
+    // this one and must still match
+    OSDMap::Incremental inc(osdmap.get_epoch() + 1);
+    inc.fsid = osdmap.get_fsid();
+    if (round == 0)
+      inc.new_weight[1] = CEPH_OSD_IN / 2;
+    else
+      inc.new_state[2] = CEPH_OSD_UP;
+    ASSERT_EQ(0, osdmap.apply_incremental(inc));
+    ASSERT_FALSE(osdmap.have_mapping());
+  }
+}
+
+TEST_F(OSDMapTest, MappingTablePgpNum) {
+  set_up_map();
+
+  // a pool being split: pgs past pgp_num are placed like their parents
+  OSDMap::Incremental pool_inc(osdmap.get_epoch() + 1);
+  pool_inc.fsid = osdmap.get_fsid();
+  pool_inc.new_pool_max = osdmap.get_pool_max();
+  pg_pool_t empty;
+  int64_t pool_id = ++pool_inc.new_pool_max;
+  pg_pool_t *p = pool_inc.get_new_pool(pool_id, &empty);
+  p->size = 3;
+  p->set_pg_num(64);
+  p->set_pgp_num(12);
+  p->type = pg_pool_t::TYPE_REPLICATED;
+  p->crush_ruleset = osdmap.get_pg_pool(0)->get_crush_ruleset();
+  pool_inc.new_pool_names[pool_id] = "splitting";
+  ASSERT_EQ(0, osdmap.apply_incremental(pool_inc));
+
+  for (unsigned pgp_num = 12; pgp_num <= 64; pgp_num += 26) {
+    osdmap.update_mapping(4);
+    ASSERT_TRUE(osdmap.have_mapping());
+
+    bufferlist bl;
+    osdmap.encode(bl, CEPH_FEATURES_SUPPORTED_DEFAULT | CEPH_FEATURE_RESERVED);
+    OSDMap plain;
+    plain.decode(bl);
+    ASSERT_EQ(pgp_num, plain.get_pg_pool(pool_id)->get_pgp_num());
+
+    for (unsigned ps = 0; ps < 64 * 2; ++ps) {
+      pg_t pgid(ps, pool_id);
+      vector<int> up, acting, plain_up, plain_acting;
+      int up_primary, acting_primary, plain_up_primary, plain_acting_primary;
+      osdmap.pg_to_up_acting_osds(pgid, &up, &up_primary,
+				  &acting, &acting_primary);
+      plain.pg_to_up_acting_osds(pgid, &plain_up, &plain_up_primary,
+				 &plain_acting, &plain_acting_primary);
+      ASSERT_EQ(plain_up, up);
+      ASSERT_EQ(plain_up_primary, up_primary);
+      ASSERT_EQ(plain_acting, acting);
+      ASSERT_EQ(plain_acting_primary, acting_primary);
+    }
+
+    if (pgp_num == 64)
+      break;
+    // raise pgp_num: the pool's table must not be reused
+    OSDMap::Incremental inc(osdmap.get_epoch() + 1);
+    inc.fsid = osdmap.get_fsid();
+    inc.get_new_pool(pool_id, osdmap.get_pg_pool(pool_id))->set_pgp_num(
+      pgp_num + 26);
+    ASSERT_EQ(0, osdmap.apply_incremental(inc));
+    ASSERT_FALSE(osdmap.have_mapping());
+  }
+}
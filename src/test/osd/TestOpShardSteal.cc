@@ -0,0 +1,98 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include "gtest/gtest.h"
+#include "common/PrioritizedQueue.h"
+#include "osd/OpShardSteal.h"
+
+#include <list>
+#include <map>
+
+class OpShardStealTest : public testing::Test
+{
+protected:
+  struct FakePG {
+    bool locked;
+    FakePG() : locked(false) {}
+    bool try_lock() {
+      if (locked)
+	return false;
+      locked = true;
+      return true;
+    }
+  };
+  struct FakeOp {
+    unsigned id, priority;
+    FakeOp(unsigned i, unsigned p = 63) : id(i), priority(p) {}
+    unsigned get_priority() const { return priority; }
+    int get_cost() const { return 1; }
+  };
+  typedef std::pair<FakePG*, FakeOp> Item;
+  typedef PrioritizedQueue<Item, int> Q;
+
+  FakePG pg[3];
+  std::map<FakePG*, std::list<FakeOp> > in_flight;
+  Q q;
+
+  OpShardStealTest() : q(4194304, 65536) {}
+
+  static int get_class(const Item &i) {
+    return 0;
+  }
+  boost::optional<Item> steal() {
+    return steal_op(&q, in_flight, &OpShardStealTest::get_class);
+  }
+  void enqueue(unsigned pgn, unsigned id) {
+    q.enqueue(0, 63, 1, Item(&pg[pgn], FakeOp(id)));
+  }
+};
+
+TEST_F(OpShardStealTest, idle_pg) {
+  enqueue(0, 1);
+  enqueue(1, 2);
+  boost::optional<Item> i = steal();
+  ASSERT_TRUE(i);
+  EXPECT_EQ(1u, i->second.id);
+  // handed over with the pg lock held
+  EXPECT_TRUE(pg[0].locked);
+  EXPECT_EQ(1u, q.length());
+}
+
+TEST_F(OpShardStealTest, locked_pg) {
+  enqueue(0, 1);
+  enqueue(0, 2);
+  pg[0].locked = true;
+  EXPECT_FALSE(steal());
+  // put back where it was
+  ASSERT_EQ(2u, q.length());
+  EXPECT_EQ(1u, q.dequeue().second.id);
+  EXPECT_EQ(2u, q.dequeue().second.id);
+}
+
+TEST_F(OpShardStealTest, pg_in_flight) {
+  enqueue(0, 1);
+  enqueue(1, 2);
+  // an earlier op of pg 0 was dequeued and waits for the pg lock
+  in_flight[&pg[0]].push_back(FakeOp(0));
+  EXPECT_FALSE(steal());
+  EXPECT_FALSE(pg[0].locked);
+  EXPECT_EQ(2u, q.length());
+
+  // the queue moves on to the next pg
+  in_flight.clear();
+  boost::optional<Item> i = steal();
+  ASSERT_TRUE(i);
+  EXPECT_EQ(1u, i->second.id);
+}
+
+TEST_F(OpShardStealTest, strict) {
+  enqueue(1, 1);
+  q.enqueue_strict(0, CEPH_MSG_PRIO_HIGH,
+		   Item(&pg[0], FakeOp(2, CEPH_MSG_PRIO_HIGH)));
+  pg[0].locked = true;
+  EXPECT_FALSE(steal());
+  // still strict, still first
+  EXPECT_EQ(2u, q.dequeue().second.id);
+  EXPECT_EQ(1u, q.dequeue().second.id);
+  EXPECT_TRUE(q.empty());
+}
@@ -61,6 +61,9 @@ TEST(Arch, all)
 #endif
 #if (__x86_64__)
 
+  expected = strstr(flags, " avx2 ") ? 1 : 0;
+  EXPECT_EQ(expected, ceph_arch_intel_avx2);
+
   expected = strstr(flags, " pclmulqdq ") ? 1 : 0;
   EXPECT_EQ(expected, ceph_arch_intel_pclmul);
 
@@ -9,6 +9,8 @@
 #include "common/config.h"
 #include "common/Finisher.h"
 #include "os/FileJournal.h"
+#include "os/StripedJournal.h"
+#include "include/stringify.h"
 #include "include/Context.h"
 #include "common/Mutex.h"
 #include "common/safe_io.h"
@@ -248,6 +250,53 @@ TEST(TestFileJournal, WriteManyVecs) {
   }
 }
 
+TEST(TestFileJournal, WriteAlignedTail) {
+  g_ceph_context->_conf->set_val("journal_ignore_corruption", "false");
+  g_ceph_context->_conf->set_val("journal_write_header_frequency", "0");
+  g_ceph_context->_conf->set_val("journal_batch_adaptive", "true");
+  g_ceph_context->_conf->apply_changes(NULL);
+
+  for (unsigned i = 0 ; i < 3; ++i) {
+    SCOPED_TRACE(subtests[i].description);
+    fsid.generate_random();
+    FileJournal j(fsid, finisher, &sync_cond, path, subtests[i].directio,
+		  subtests[i].aio, subtests[i].faio);
+    ASSERT_EQ(0, j.create());
+    j.make_writeable();
+
+    // aligned payloads with a ragged tail; only the tail needs a copy
+    C_GatherBuilder gb(g_ceph_context, new C_SafeCond(&wait_lock, &cond, &done));
+    list<bufferlist> written;
+    for (unsigned seq = 1; seq <= 20; ++seq) {
+      bufferptr bp = buffer::create_page_aligned(3 * 4096 + 100 * seq);
+      memset(bp.c_str(), (char)seq, bp.length());
+      bufferlist bl;
+      bl.append(bp);
+      written.push_back(bl);
+      j.submit_entry(seq, bl, 0, gb.new_sub());
+    }
+    gb.activate();
+    wait();
+
+    j.close();
+
+    j.open(0);
+    uint64_t seq = 0;
+    for (list<bufferlist>::iterator p = written.begin();
+	 p != written.end();
+	 ++p) {
+      bufferlist inbl;
+      ASSERT_EQ(true, j.read_entry(inbl, seq));
+      ASSERT_TRUE(inbl.contents_equal(*p));
+    }
+    ASSERT_EQ(20ull, seq);
+    j.make_writeable();
+    j.close();
+  }
+  g_ceph_context->_conf->set_val("journal_batch_adaptive", "false");
+  g_ceph_context->_conf->apply_changes(NULL);
+}
+
 TEST(TestFileJournal, ReplaySmall) {
   g_ceph_context->_conf->set_val("journal_ignore_corruption", "false");
   g_ceph_context->_conf->set_val("journal_write_header_frequency", "0");
@@ -634,3 +683,185 @@ TEST(TestFileJournal, ReplayDetectCorruptHeader) {
     ::close(fd);
   }
 }
+
+TEST(TestFileJournal, StripedReplayGap) {
+  g_ceph_context->_conf->set_val("journal_ignore_corruption", "false");
+  g_ceph_context->_conf->set_val("journal_write_header_frequency", "0");
+  g_ceph_context->_conf->apply_changes(NULL);
+
+  vector<string> paths;
+  paths.push_back(path);
+  paths.push_back(string(path) + ".1");
+
+  for (unsigned i = 0 ; i < 3; ++i) {
+    SCOPED_TRACE(subtests[i].description);
+    fsid.generate_random();
+    StripedJournal j(fsid, finisher, &sync_cond, paths, subtests[i].directio,
+		     subtests[i].aio, subtests[i].faio);
+    ASSERT_EQ(0, j.create());
+    j.make_writeable();
+
+    {
+      C_Sync s;
+      C_GatherBuilder gb(g_ceph_context, s.c);
+      for (uint64_t seq = 1; seq <= 6; ++seq) {
+	bufferlist bl;
+	bl.append(stringify(seq));
+	j.submit_entry(seq, bl, 0, gb.new_sub());
+      }
+      gb.activate();
+    }
+    j.close();
+
+    // lose seq 3, which lives on the second stripe
+    {
+      FileJournal s(fsid, finisher, &sync_cond, paths[1].c_str(),
+		    subtests[i].directio, subtests[i].aio, subtests[i].faio);
+      s.set_allow_seq_gaps(true);
+      ASSERT_EQ(0, s.open(0));
+      int fd = open(paths[1].c_str(), O_WRONLY);
+      s.corrupt_header_magic(fd, 3);
+      ::close(fd);
+      s.close();
+    }
+
+    ASSERT_EQ(0, j.open(0));
+    bufferlist inbl;
+    uint64_t seq;
+    for (uint64_t want = 1; want <= 2; ++want) {
+      seq = want;
+      ASSERT_TRUE(j.read_entry(inbl, seq));
+      ASSERT_EQ(want, seq);
+      ASSERT_EQ(stringify(want), string(inbl.c_str(), inbl.length()));
+    }
+    seq = 3;
+    ASSERT_FALSE(j.read_entry(inbl, seq));
+
+    // 4..6 were never acked; the new 3 must not be followed by the old 4
+    j.make_writeable();
+    {
+      C_Sync s;
+      bufferlist bl;
+      bl.append("three");
+      j.submit_entry(3, bl, 0, s.c);
+    }
+    j.close();
+
+    ASSERT_EQ(0, j.open(2));
+    seq = 3;
+    ASSERT_TRUE(j.read_entry(inbl, seq));
+    ASSERT_EQ(3u, seq);
+    ASSERT_EQ(string("three"), string(inbl.c_str(), inbl.length()));
+    seq = 4;
+    ASSERT_FALSE(j.read_entry(inbl, seq));
+    j.make_writeable();
+    j.close();
+  }
+  unlink(paths[1].c_str());
+}
+
+TEST(TestFileJournal, StripedReplayGapTornTail) {
+  g_ceph_context->_conf->set_val("journal_ignore_corruption", "false");
+  g_ceph_context->_conf->set_val("journal_write_header_frequency", "0");
+  g_ceph_context->_conf->apply_changes(NULL);
+
+  vector<string> paths;
+  paths.push_back(path);
+  paths.push_back(string(path) + ".1");
+
+  for (unsigned i = 0 ; i < 3; ++i) {
+    SCOPED_TRACE(subtests[i].description);
+    fsid.generate_random();
+    StripedJournal j(fsid, finisher, &sync_cond, paths, subtests[i].directio,
+		     subtests[i].aio, subtests[i].faio);
+    ASSERT_EQ(0, j.create());
+    j.make_writeable();
+
+    {
+      C_Sync s;
+      C_GatherBuilder gb(g_ceph_context, s.c);
+      for (uint64_t seq = 1; seq <= 6; ++seq) {
+	bufferlist bl;
+	bl.append(stringify(seq));
+	j.submit_entry(seq, bl, 0, gb.new_sub());
+      }
+      gb.activate();
+    }
+    j.close();
+
+    // lose seq 3, so that 4 and 6 on the first stripe go unread
+    {
+      FileJournal s(fsid, finisher, &sync_cond, paths[1].c_str(),
+		    subtests[i].directio, subtests[i].aio, subtests[i].faio);
+      s.set_allow_seq_gaps(true);
+      ASSERT_EQ(0, s.open(0));
+      int fd = open(paths[1].c_str(), O_WRONLY);
+      s.corrupt_header_magic(fd, 3);
+      ::close(fd);
+      s.close();
+    }
+
+    ASSERT_EQ(0, j.open(0));
+    bufferlist inbl;
+    uint64_t seq;
+    for (uint64_t want = 1; want <= 2; ++want) {
+      seq = want;
+      ASSERT_TRUE(j.read_entry(inbl, seq));
+    }
+    seq = 3;
+    ASSERT_FALSE(j.read_entry(inbl, seq));
+    j.make_writeable();
+
+    // the first stripe's header as the invalidation left it
+    char hdr[4096];
+    {
+      int fd = open(paths[0].c_str(), O_RDONLY);
+      ASSERT_EQ(0, safe_pread_exact(fd, hdr, sizeof(hdr), 0));
+      ::close(fd);
+    }
+
+    {
+      C_Sync s;
+      C_GatherBuilder gb(g_ceph_context, s.c);
+      for (uint64_t seq = 3; seq <= 4; ++seq) {
+	bufferlist bl;
+	bl.append("new " + stringify(seq));
+	j.submit_entry(seq, bl, 0, gb.new_sub());
+      }
+      gb.activate();
+    }
+    j.close();
+
+    // crash with the new 4 torn, before the header was written again
+    {
+      FileJournal s(fsid, finisher, &sync_cond, paths[0].c_str(),
+		    subtests[i].directio, subtests[i].aio, subtests[i].faio);
+      s.set_allow_seq_gaps(true);
+      ASSERT_EQ(0, s.open(0));
+      int fd = open(paths[0].c_str(), O_WRONLY);
+      s.corrupt_payload(fd, 4);
+      ::close(fd);
+      s.close();
+    }
+    {
+      int fd = open(paths[0].c_str(), O_WRONLY);
+      ASSERT_EQ(0, safe_pwrite(fd, hdr, sizeof(hdr), 0));
+      ::close(fd);
+    }
+
+    // the torn entry just ends the journal; before the header was
+    // lowered, this asserted that the journal is corrupt
+    ASSERT_EQ(0, j.open(0));
+    for (uint64_t want = 1; want <= 3; ++want) {
+      seq = want;
+      ASSERT_TRUE(j.read_entry(inbl, seq));
+      ASSERT_EQ(want, seq);
+    }
+    ASSERT_EQ(string("new 3"), string(inbl.c_str(), inbl.length()));
+    seq = 4;
+    ASSERT_FALSE(j.read_entry(inbl, seq));
+    j.make_writeable();
+    j.close();
+  }
+  unlink(paths[1].c_str());
+}
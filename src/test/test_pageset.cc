@@ -1,5 +1,7 @@
 // -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
 // vim: ts=8 sw=2 smarttab
+#include <thread>
+
 #include "gtest/gtest.h"
 
 #include "os/PageSet.h"
@@ -269,3 +271,37 @@ TEST(PageSet, FreeHoles)
   pages.get_range(0, 8, range);
   ASSERT_EQ(0u, range.size());
 }
+
+TEST(PageSet, ConcurrentReads)
+{
+  // readers walk the tree without a lock while a writer allocates and
+  // frees pages underneath them
+  PageSet pages(4096);
+  std::atomic<bool> stop(false);
+  std::vector<std::thread> readers;
+  for (int i = 0; i < 4; i++) {
+    readers.emplace_back([&pages, &stop] {
+      PageSet::page_vector range;
+      while (!stop) {
+        pages.get_range(0, 1 << 24, range);
+        for (size_t j = 1; j < range.size(); j++)
+          ASSERT_LT(range[j-1]->offset, range[j]->offset);
+        range.clear();
+      }
+    });
+  }
+
+  PageSet::page_vector range;
+  for (int i = 0; i < 1000; i++) {
+    pages.alloc_range((i % 64) << 16, 3 << 12, range);
+    range.clear();
+    if (i % 10 == 9)
+      pages.free_pages_after((i % 7) << 18);
+  }
+  stop = true;
+  for (auto &t : readers)
+    t.join();
+
+  pages.free_pages_after(0);
+  ASSERT_TRUE(pages.empty());
+}
@@ -25,6 +25,7 @@
 #include "common/debug.h"
 #include "common/errno.h"
 #include "common/config.h"
+#include "common/Clock.h"
 
 #include "common/ceph_argparse.h"
 #include "include/stringify.h"
@@ -185,6 +186,8 @@ void usage()
   cout << "   --show-mappings       show mappings\n";
   cout << "   --show-bad-mappings   show bad mappings\n";
   cout << "   --show-choose-tries   show choose tries histogram\n";
+  cout << "   --show-time           show how long the mapping took\n";
+  cout << "   --no-simd             hash straw2 items without simd\n";
   cout << "   --output-name name\n";
   cout << "                         prepend the data file(s) generated during the\n";
   cout << "                         testing routine with name\n";
@@ -236,6 +239,7 @@ int main(int argc, const char **argv)
   bool write_to_file = false;
   int verbose = 0;
   bool unsafe_tunables = false;
+  bool show_time = false;
 
   bool reweight = false;
   int add_item = -1;
@@ -311,6 +315,10 @@ int main(int argc, const char **argv)
     } else if (ceph_argparse_flag(args, i, "--show_choose_tries", (char*)NULL)) {
       display = true;
       tester.set_output_choose_tries(true);
+    } else if (ceph_argparse_flag(args, i, "--show_time", (char*)NULL)) {
+      show_time = true;
+    } else if (ceph_argparse_flag(args, i, "--no_simd", (char*)NULL)) {
+      crush_hash_batch_enable(0);
     } else if (ceph_argparse_witharg(args, i, &val, "-c", "--compile", (char*)NULL)) {
       srcfn = val;
       compile = true;
@@ -845,9 +853,14 @@ int main(int argc, const char **argv)
 	tester.get_output_utilization())
       tester.set_output_statistics(true);
 
+    utime_t start = ceph_clock_now(g_ceph_context);
     int r = tester.test();
     if (r < 0)
       exit(1);
+    if (show_time)
+      cerr << "mapping took " << (ceph_clock_now(g_ceph_context) - start)
+	   << " seconds (straw2 hash: " << crush_hash_batch_impl() << ")"
+	   << std::endl;
   }
 
   // output ---
@@ -330,6 +330,8 @@ int main(int argc, const char **argv)
     vector<int> size(30, 0);
     if (test_random)
       srand(getpid());
+    else if (g_conf->osd_map_mapping_table)
+      osdmap.update_mapping(g_conf->osd_map_mapping_threads);
     const map<int64_t,pg_pool_t>& pools = osdmap.get_pools();
     for (map<int64_t,pg_pool_t>::const_iterator p = pools.begin();
 	 p != pools.end(); ++p) {